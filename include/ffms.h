@@ -22,7 +22,7 @@
 #define FFMS_H
 
 // Version format: major - minor - micro - bump
-#define FFMS_VERSION ((2 << 24) | (30 << 16) | (0 << 8) | 0)
+#define FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0)
 
 #include <stdint.h>
 #include <stddef.h>
@@ -98,6 +98,8 @@ typedef struct FFMS_AudioSource FFMS_AudioSource;
 typedef struct FFMS_Indexer FFMS_Indexer;
 typedef struct FFMS_Index FFMS_Index;
 typedef struct FFMS_Track FFMS_Track;
+typedef struct FFMS_IndexWriter FFMS_IndexWriter;
+typedef struct FFMS_SegmentedIndex FFMS_SegmentedIndex;
 
 typedef enum FFMS_Errors {
     // No error
@@ -146,6 +148,12 @@ typedef enum FFMS_IndexErrorHandling {
     FFMS_IEH_IGNORE = 3
 } FFMS_IndexErrorHandling;
 
+typedef enum FFMS_IndexingFlags {
+    FFMS_INDEX_FLAG_CONTAINER_INDEX = 0x01,
+    FFMS_INDEX_FLAG_KEYFRAMES_ONLY = 0x02,
+    FFMS_INDEX_FLAG_WAVEFORM = 0x04
+} FFMS_IndexingFlags;
+
 typedef enum FFMS_TrackType {
     FFMS_TYPE_UNKNOWN = -1,
     FFMS_TYPE_VIDEO,
@@ -279,6 +287,21 @@ typedef enum FFMS_LogLevels {
     FFMS_LOG_TRACE = 56
 } FFMS_LogLevels;
 
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef enum FFMS_ExportFormat {
+    FFMS_EXPORT_TIMECODES_V2 = 0,
+    FFMS_EXPORT_TIMECODES_V1 = 1,
+    FFMS_EXPORT_KEYFRAMES = 2,
+    FFMS_EXPORT_FRAMES_CSV = 3,
+    FFMS_EXPORT_FRAMES_JSON = 4
+} FFMS_ExportFormat;
+
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef enum FFMS_AudioFileFormat {
+    FFMS_AUDIO_FILE_WAV = 0,
+    FFMS_AUDIO_FILE_W64 = 1
+} FFMS_AudioFileFormat;
+
 typedef struct FFMS_ResampleOptions {
     int64_t ChannelLayout;
     FFMS_SampleFormat SampleFormat;
@@ -395,8 +418,59 @@ typedef struct FFMS_AudioProperties {
     double LastEndTime;
 } FFMS_AudioProperties;
 
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef struct FFMS_WaveformProperties {
+    int Channels;
+    int SampleRate;
+    int64_t NumSamples;
+    int PointSamples; /* samples summarized by each stored point */
+} FFMS_WaveformProperties;
+
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef struct FFMS_WaveformPoint {
+    float Min;
+    float Max;
+    float RMS;
+} FFMS_WaveformPoint;
+
 typedef int (FFMS_CC *TIndexCallback)(int64_t Current, int64_t Total, void *ICPrivate);
 
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef struct FFMS_IndexProgress {
+    int64_t Current;
+    int64_t Total;
+    int64_t BytesRead;
+    double ReadBandwidth; /* bytes per second */
+} FFMS_IndexProgress;
+
+typedef int (FFMS_CC *TIndexProgressCallback)(const FFMS_IndexProgress *Progress, void *ICPrivate);
+
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef struct FFMS_IndexingStats {
+    double TotalTime; /* all times in seconds */
+    double DemuxTime;
+    double ParseTime;
+    double DecodeTime;
+    double FinalizeTime;
+    double WriteTime;
+    int64_t BytesRead;
+    int64_t BytesWritten;
+    int64_t Packets;
+    int64_t ParserCalls;
+    int64_t DecodeCalls;
+    int FromContainer; /* non-0 if the tracks were taken from the container's own index */
+} FFMS_IndexingStats;
+
+/* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+typedef struct FFMS_IOCallbacks {
+    /* Reads up to Size bytes at Offset and returns the number read, 0 at the end and negative on errors. May be called from several threads at once. */
+    int64_t (FFMS_CC *Read)(void *Private, int64_t Offset, uint8_t *Buffer, int64_t Size);
+    int64_t (FFMS_CC *Size)(void *Private);
+    /* Optional, called once nothing uses the input anymore */
+    void (FFMS_CC *Close)(void *Private);
+    void *Private;
+} FFMS_IOCallbacks;
+
 /* Most functions return 0 on success */
 /* Functions without error message output can be assumed to never fail in a graceful way */
 FFMS_API(void) FFMS_Init(int, int); /* Pass 0 to both arguments, kept to partially preserve abi */
@@ -413,6 +487,11 @@ FFMS_API(const FFMS_AudioProperties *) FFMS_GetAudioProperties(FFMS_AudioSource
 FFMS_API(const FFMS_Frame *) FFMS_GetFrame(FFMS_VideoSource *V, int n, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(const FFMS_Frame *) FFMS_GetFrameByTime(FFMS_VideoSource *V, double Time, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(int) FFMS_GetAudio(FFMS_AudioSource *A, void *Buf, int64_t Start, int64_t Count, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(int) FFMS_GetAudioPlanar(FFMS_AudioSource *A, void **Planes, int64_t Start, int64_t Count, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetAudioCacheSize(FFMS_AudioSource *A, int64_t Bytes); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_SetAudioPrefetch(FFMS_AudioSource *A, int64_t Bytes, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_ExtractAudio(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, int Threads, void *Buf, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_ExtractAudioToFile(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, int Threads, const char *OutputFile, int Format, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(int) FFMS_SetOutputFormatV2(FFMS_VideoSource *V, const int *TargetFormats, int Width, int Height, int Resizer, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (15 << 16) | (3 << 8) | 0) */
 FFMS_API(void) FFMS_ResetOutputFormatV(FFMS_VideoSource *V);
 FFMS_API(int) FFMS_SetInputFormatV(FFMS_VideoSource *V, int ColorSpace, int ColorRange, int Format, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (17 << 16) | (1 << 8) | 0) */
@@ -428,6 +507,7 @@ FFMS_API(int) FFMS_GetNumTracksI(FFMS_Indexer *Indexer);
 FFMS_API(int) FFMS_GetTrackType(FFMS_Track *T);
 FFMS_API(int) FFMS_GetTrackTypeI(FFMS_Indexer *Indexer, int Track);
 FFMS_API(FFMS_IndexErrorHandling) FFMS_GetErrorHandling(FFMS_Index *Index);
+FFMS_API(int) FFMS_GetIndexingStats(FFMS_Index *Index, int Track, FFMS_IndexingStats *Stats, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(const char *) FFMS_GetCodecNameI(FFMS_Indexer *Indexer, int Track);
 FFMS_API(const char *) FFMS_GetFormatNameI(FFMS_Indexer *Indexer);
 FFMS_API(int) FFMS_GetNumFrames(FFMS_Track *T);
@@ -437,17 +517,39 @@ FFMS_API(FFMS_Track *) FFMS_GetTrackFromVideo(FFMS_VideoSource *V);
 FFMS_API(FFMS_Track *) FFMS_GetTrackFromAudio(FFMS_AudioSource *A);
 FFMS_API(const FFMS_TrackTimeBase *) FFMS_GetTimeBase(FFMS_Track *T);
 FFMS_API(int) FFMS_WriteTimecodes(FFMS_Track *T, const char *TimecodeFile, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(int) FFMS_ExportTrack(FFMS_Track *T, const char *File, int Format, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(const FFMS_WaveformProperties *) FFMS_GetWaveformProperties(FFMS_Track *T); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_GetWaveform(FFMS_Track *T, int64_t Start, int64_t Count, int Points, FFMS_WaveformPoint *Dst, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(FFMS_Indexer *) FFMS_CreateIndexer(const char *SourceFile, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(void) FFMS_TrackIndexSettings(FFMS_Indexer *Indexer, int Track, int Index, int); /* Pass 0 to last argument, kapt to preserve abi. Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
 FFMS_API(void) FFMS_TrackTypeIndexSettings(FFMS_Indexer *Indexer, int TrackType, int Index, int); /* Pass 0 to last argument, kapt to preserve abi. Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
 FFMS_API(void) FFMS_SetProgressCallback(FFMS_Indexer *Indexer, TIndexCallback IC, void *ICPrivate); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexingThreads(FFMS_Indexer *Indexer, int Threads); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexingFlags(FFMS_Indexer *Indexer, int Flags); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetProgressCallback2(FFMS_Indexer *Indexer, TIndexProgressCallback IC, void *ICPrivate); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexingReadAhead(FFMS_Indexer *Indexer, int64_t BufferSize); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_RegisterInput(const char *Name, const FFMS_IOCallbacks *Callbacks, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_RegisterMemoryInput(const char *Name, const uint8_t *Buffer, int64_t Size, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_UnregisterInput(const char *Name); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexServer(const char *SocketPath); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(FFMS_Index *) FFMS_DoIndexing2(FFMS_Indexer *Indexer, int ErrorHandling, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
 FFMS_API(void) FFMS_CancelIndexing(FFMS_Indexer *Indexer);
 FFMS_API(FFMS_Index *) FFMS_ReadIndex(const char *IndexFile, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(FFMS_Index *) FFMS_ReadIndexFromBuffer(const uint8_t *Buffer, size_t Size, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(FFMS_Index *) FFMS_ReadIndexCompat(const char *IndexFile, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(int) FFMS_GetFileSignature(const char *SourceFile, int64_t *Filesize, uint8_t *Digest, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_UpgradeIndex(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_IndexAdditionalTracks(FFMS_Index *Index, const char *SourceFile, const int *Tracks, int NumTracks, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(FFMS_IndexWriter *) FFMS_WriteIndexAsync(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(int) FFMS_FinishIndexWrite(FFMS_IndexWriter *Writer, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 FFMS_API(int) FFMS_WriteIndexToBuffer(uint8_t **BufferPtr, size_t *Size, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(void) FFMS_FreeIndexBuffer(uint8_t **BufferPtr);
 FFMS_API(int) FFMS_GetPixFmt(const char *Name);
+FFMS_API(FFMS_SegmentedIndex *) FFMS_CreateSegmentedIndex(const char **SourceFiles, FFMS_Index **Indexes, int NumSegments, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_DestroySegmentedIndex(FFMS_SegmentedIndex *Index); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(FFMS_Track *) FFMS_GetTrackFromSegmentedIndex(FFMS_SegmentedIndex *Index, int Track); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(FFMS_VideoSource *) FFMS_CreateSegmentedVideoSource(FFMS_SegmentedIndex *Index, int Track, int Threads, int SeekMode, int MaxOpenSegments, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
+FFMS_API(FFMS_AudioSource *) FFMS_CreateSegmentedAudioSource(FFMS_SegmentedIndex *Index, int Track, int DelayMode, int MaxOpenSegments, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (31 << 16) | (0 << 8) | 0) */
 #endif
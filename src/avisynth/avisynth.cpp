@@ -19,6 +19,7 @@
 //  THE SOFTWARE.
 
 #include <string>
+#include <vector>
 #include "ffms.h"
 #include "avssources.h"
 #include "../core/utils.h"
@@ -116,6 +117,7 @@ static AVSValue __cdecl CreateFFVideoSource(AVSValue Args, void* UserData, IScri
         Env->ThrowError("FFVideoSource: Timecodes will overwrite the source");
 
     ErrorInfo E;
+    FFMS_IndexWriter *Writer = nullptr;
     FFMS_Index *Index = nullptr;
     std::string DefaultCache;
     if (Cache) {
@@ -146,21 +148,28 @@ static AVSValue __cdecl CreateFFVideoSource(AVSValue Args, void* UserData, IScri
         if (!Index)
             Env->ThrowError("FFVideoSource: %s", E.Buffer);
 
-        if (Cache)
-            if (FFMS_WriteIndex(CacheFile, Index, &E)) {
+        // The index is written in the background while frames are already
+        // being served from the copy in memory
+        if (Cache) {
+            Writer = FFMS_WriteIndexAsync(CacheFile, Index, &E);
+            if (!Writer) {
                 FFMS_DestroyIndex(Index);
                 Env->ThrowError("FFVideoSource: %s", E.Buffer);
             }
+        }
     }
 
     if (Track == -1)
         Track = FFMS_GetFirstIndexedTrackOfType(Index, FFMS_TYPE_VIDEO, &E);
-    if (Track < 0)
+    if (Track < 0) {
+        FinishIndexWrite(Writer);
         Env->ThrowError("FFVideoSource: No video track found");
+    }
 
     if (strcmp(Timecodes, "")) {
         if (FFMS_WriteTimecodes(FFMS_GetTrackFromIndex(Index, Track), Timecodes, &E)) {
             FFMS_DestroyIndex(Index);
+            FinishIndexWrite(Writer);
             Env->ThrowError("FFVideoSource: %s", E.Buffer);
         }
     }
@@ -171,9 +180,11 @@ static AVSValue __cdecl CreateFFVideoSource(AVSValue Args, void* UserData, IScri
         Filter = new AvisynthVideoSource(Source, Track, Index, FPSNum, FPSDen, Threads, SeekMode, RFFMode, Width, Height, Resizer, ColorSpace, VarPrefix, Env);
     } catch (...) {
         FFMS_DestroyIndex(Index);
+        FinishIndexWrite(Writer);
         throw;
     }
 
+    Filter->SetIndexWriter(Writer);
     FFMS_DestroyIndex(Index);
     return Filter;
 }
@@ -216,22 +227,28 @@ static AVSValue __cdecl CreateFFAudioSource(AVSValue Args, void* UserData, IScri
         }
     }
 
-    // Index needs to be remade if it is an unindexed audio track
-    if (Index && Track >= 0 && Track < FFMS_GetNumTracks(Index)
-        && FFMS_GetTrackType(FFMS_GetTrackFromIndex(Index, Track)) == FFMS_TYPE_AUDIO
-        && FFMS_GetNumFrames(FFMS_GetTrackFromIndex(Index, Track)) == 0) {
-        FFMS_DestroyIndex(Index);
-        Index = nullptr;
-    }
+    // Unindexed audio tracks are added to the index, which only costs
+    // indexing the audio. For finding a default track all audio tracks are
+    // added if none of them are indexed.
+    if (Index) {
+        std::vector<int> Missing;
+        if (Track >= 0 && Track < FFMS_GetNumTracks(Index)
+            && FFMS_GetTrackType(FFMS_GetTrackFromIndex(Index, Track)) == FFMS_TYPE_AUDIO
+            && FFMS_GetNumFrames(FFMS_GetTrackFromIndex(Index, Track)) == 0) {
+            Missing.push_back(Track);
+        } else if (Track == -1 && FFMS_GetFirstIndexedTrackOfType(Index, FFMS_TYPE_AUDIO, &E) < 0) {
+            for (int i = 0; i < FFMS_GetNumTracks(Index); i++)
+                if (FFMS_GetTrackType(FFMS_GetTrackFromIndex(Index, i)) == FFMS_TYPE_AUDIO)
+                    Missing.push_back(i);
+        }
 
-    // More complicated for finding a default track, reindex the file if at least one audio track exists
-    if (Index && FFMS_GetFirstTrackOfType(Index, FFMS_TYPE_AUDIO, &E) >= 0
-        && FFMS_GetFirstIndexedTrackOfType(Index, FFMS_TYPE_AUDIO, &E) < 0) {
-        for (int i = 0; i < FFMS_GetNumTracks(Index); i++) {
-            if (FFMS_GetTrackType(FFMS_GetTrackFromIndex(Index, i)) == FFMS_TYPE_AUDIO) {
+        if (!Missing.empty()) {
+            if (FFMS_IndexAdditionalTracks(Index, Source, Missing.data(), static_cast<int>(Missing.size()), &E)) {
                 FFMS_DestroyIndex(Index);
                 Index = nullptr;
-                break;
+            } else if (Cache && FFMS_WriteIndex(CacheFile, Index, &E)) {
+                FFMS_DestroyIndex(Index);
+                Env->ThrowError("FFAudioSource: %s", E.Buffer);
             }
         }
     }
@@ -24,6 +24,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <string>
 
 static AVPixelFormat CSNameToPIXFMT(const char *CSName, AVPixelFormat Default, bool HighBitDepth) {
     if (!CSName)
@@ -257,8 +258,21 @@ AvisynthVideoSource::AvisynthVideoSource(const char *SourceFile, int Track, FFMS
     Env->SetGlobalVar("FFVAR_PREFIX", this->VarPrefix);
 }
 
+void FinishIndexWrite(FFMS_IndexWriter *Writer) {
+    if (!Writer)
+        return;
+    ErrorInfo E;
+    if (FFMS_FinishIndexWrite(Writer, &E)) {
+        std::string Message = "FFVideoSource: ";
+        Message += E.Buffer;
+        Message += "\n";
+        OutputDebugStringA(Message.c_str());
+    }
+}
+
 AvisynthVideoSource::~AvisynthVideoSource() {
     FFMS_DestroyVideoSource(V);
+    FinishIndexWrite(IndexWriter);
 }
 
 static int GetSubSamplingH(const VideoInfo &vi) {
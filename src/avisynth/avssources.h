@@ -34,6 +34,11 @@ struct ErrorInfo : FFMS_ErrorInfo {
     }
 };
 
+// Waits for an index being written in the background and reports it to the
+// debugger if writing it failed, since clips are destroyed where no error
+// can be thrown
+void FinishIndexWrite(FFMS_IndexWriter *Writer);
+
 class AvisynthVideoSource : public IClip {
     struct FrameFields {
         int Top;
@@ -48,6 +53,7 @@ class AvisynthVideoSource : public IClip {
     int RFFMode;
     std::vector<FrameFields> FieldList;
     const char *VarPrefix;
+    FFMS_IndexWriter *IndexWriter = nullptr;
 
     void InitOutputFormat(int ResizeToWidth, int ResizeToHeight,
         const char *ResizerName, const char *ConvertToFormatName, IScriptEnvironment *Env);
@@ -59,6 +65,8 @@ public:
         int ResizeToWidth, int ResizeToHeight, const char *ResizerName,
         const char *ConvertToFormatName, const char *VarPrefix, IScriptEnvironment* Env);
     ~AvisynthVideoSource();
+    // Waits for the index to be written when the clip is destroyed
+    void SetIndexWriter(FFMS_IndexWriter *Writer) { IndexWriter = Writer; }
     bool __stdcall GetParity(int n);
     int __stdcall SetCacheHints(int cachehints, int frame_range) { return 0; }
     const VideoInfo& __stdcall GetVideoInfo() { return VI; }
@@ -0,0 +1,233 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "audiocache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+
+namespace {
+// Slabs hold this many chunks of one size, or as many as fit in SlabSize if
+// that's fewer, but at least one. Each size in use has a slab with room left
+// over, so they're kept small enough for that not to matter much.
+const size_t SlabChunks = 16;
+const size_t SlabSize = 1024 * 1024;
+const size_t MinChunkSize = 256;
+}
+
+size_t SampleArena::SizeClass(size_t Size) {
+    if (Size <= MinChunkSize)
+        return 0;
+    // The classes from 2^n up to 2^(n+1) are 2^n, 1.25 * 2^n, 1.5 * 2^n
+    // and 1.75 * 2^n
+    size_t Value = Size - 1;
+    size_t Log2 = 0;
+    while (Value >> (Log2 + 1))
+        Log2++;
+    size_t Step = ((Value >> (Log2 - 2)) & 3) + 1;
+    return (Log2 - 8) * 4 + Step;
+}
+
+size_t SampleArena::ClassSize(size_t Class) {
+    return (4 + Class % 4) << (Class / 4 + 6);
+}
+
+uint8_t *SampleArena::Allocate(size_t Size) {
+    size_t Class = SizeClass(Size);
+    size_t ChunkSize = ClassSize(Class);
+    if (Class >= Open.size())
+        Open.resize(Class + 1);
+
+    if (Open[Class].empty()) {
+        size_t Chunks = std::max<size_t>(std::min(SlabChunks, SlabSize / ChunkSize), 1);
+        std::unique_ptr<uint8_t[]> Memory(new uint8_t[Chunks * ChunkSize]);
+        Slab &NewSlab = Slabs[Memory.get()];
+        NewSlab.Memory = std::move(Memory);
+        NewSlab.Class = Class;
+        NewSlab.Size = Chunks * ChunkSize;
+        // So that releasing chunks never allocates
+        NewSlab.FreeChunks.reserve(Chunks);
+        Open[Class].push_back(&NewSlab);
+        Bytes += NewSlab.Size;
+        EmptySlabs++;
+    }
+
+    Slab &S = *Open[Class].back();
+    uint8_t *Chunk;
+    if (!S.FreeChunks.empty()) {
+        Chunk = S.FreeChunks.back();
+        S.FreeChunks.pop_back();
+    } else {
+        Chunk = S.Memory.get() + S.Carved++ * ChunkSize;
+    }
+    if (S.Used++ == 0)
+        EmptySlabs--;
+    if (S.Full(ChunkSize))
+        Open[Class].pop_back();
+    return Chunk;
+}
+
+void SampleArena::Release(uint8_t *Chunk) {
+    Slab &S = Slabs.lower_bound(Chunk)->second;
+    if (S.Full(ClassSize(S.Class)))
+        Open[S.Class].push_back(&S);
+    S.FreeChunks.push_back(Chunk);
+    if (--S.Used == 0)
+        EmptySlabs++;
+}
+
+bool SampleArena::ReleaseEmptySlab() {
+    if (!EmptySlabs)
+        return false;
+    for (auto it = Slabs.begin(); it != Slabs.end(); ++it) {
+        Slab &S = it->second;
+        if (S.Used)
+            continue;
+        // Empty slabs always have room
+        std::vector<Slab *> &ClassOpen = Open[S.Class];
+        ClassOpen.erase(std::find(ClassOpen.begin(), ClassOpen.end(), &S));
+        Bytes -= S.Size;
+        EmptySlabs--;
+        Slabs.erase(it);
+        return true;
+    }
+    return false;
+}
+
+void SampleArena::Clear() {
+    Slabs.clear();
+    Open.clear();
+    Bytes = 0;
+    EmptySlabs = 0;
+}
+
+AudioCache::AudioCache(size_t MaxBytes)
+    : MaxBytes(MaxBytes) {
+}
+
+void AudioCache::SetMaxBytes(size_t NewMaxBytes) {
+    MaxBytes = NewMaxBytes;
+    Evict();
+    // Enough spare nodes to replace every block once is plenty for a cache
+    // which stays full, and the rest would never be given back otherwise
+    Blocks.get_allocator().Trim(Blocks.size());
+    LRU.get_allocator().Trim(LRU.size());
+}
+
+void AudioCache::Clear() {
+    Blocks.clear();
+    LRU.clear();
+    Arena.Clear();
+    PinnedBytes = 0;
+    Newest = nullptr;
+}
+
+void AudioCache::Erase(BlockMap::iterator it) {
+    Block &B = it->second;
+    if (B.Pinned)
+        PinnedBytes -= B.Capacity;
+    else
+        LRU.erase(B.LRUPos);
+    if (Newest == &B)
+        Newest = nullptr;
+    if (B.Data)
+        Arena.Release(B.Data);
+    Blocks.erase(it);
+}
+
+void AudioCache::Evict() {
+    // Slabs nothing is using go before any cached audio does
+    auto it = LRU.begin();
+    while (Arena.MemoryUsage() > MaxBytes + PinnedBytes) {
+        if (Arena.ReleaseEmptySlab())
+            continue;
+        if (it != LRU.end() && *it == Newest)
+            ++it;
+        if (it == LRU.end())
+            break;
+        Block *B = *it++;
+        Erase(Blocks.find(B->Start));
+    }
+}
+
+AudioCache::Block *AudioCache::Find(int64_t Sample) {
+    auto it = Blocks.upper_bound(Sample);
+    if (it == Blocks.begin())
+        return nullptr;
+    Block &B = (--it)->second;
+    if (B.Start + B.Samples <= Sample)
+        return nullptr;
+    if (!B.Pinned)
+        LRU.splice(LRU.end(), LRU, B.LRUPos);
+    return &B;
+}
+
+AudioCache::Block *AudioCache::Insert(int64_t Start, size_t ExpectedSize) {
+    if (Newest && Newest->Start == Start)
+        return Newest;
+
+    auto it = Blocks.lower_bound(Start);
+    if (it != Blocks.end() && it->first == Start)
+        return nullptr;
+
+    it = Blocks.emplace_hint(it, std::piecewise_construct, std::forward_as_tuple(Start), std::forward_as_tuple(Start));
+    Newest = &it->second;
+    Newest->LRUPos = LRU.insert(LRU.end(), Newest);
+    if (ExpectedSize) {
+        Newest->Data = Arena.Allocate(ExpectedSize);
+        Newest->Capacity = SampleArena::ClassSize(SampleArena::SizeClass(ExpectedSize));
+        Evict();
+    }
+    return Newest;
+}
+
+uint8_t *AudioCache::Grow(Block *B, size_t Size) {
+    // Only happens if the packet decoded to more samples than the index
+    // says it has
+    if (B->DataSize + Size > B->Capacity) {
+        size_t NewSize = B->DataSize + Size;
+        uint8_t *NewData = Arena.Allocate(NewSize);
+        size_t NewCapacity = SampleArena::ClassSize(SampleArena::SizeClass(NewSize));
+        if (B->Data) {
+            memcpy(NewData, B->Data, B->DataSize);
+            Arena.Release(B->Data);
+        }
+        if (B->Pinned)
+            PinnedBytes += NewCapacity - B->Capacity;
+        B->Data = NewData;
+        B->Capacity = NewCapacity;
+        Evict();
+    }
+
+    uint8_t *ptr = B->Data + B->DataSize;
+    B->DataSize += Size;
+    return ptr;
+}
+
+void AudioCache::PinAll() {
+    for (auto &B : Blocks) {
+        if (!B.second.Pinned)
+            PinnedBytes += B.second.Capacity;
+        B.second.Pinned = true;
+    }
+    LRU.clear();
+}
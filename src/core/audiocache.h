@@ -0,0 +1,214 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <vector>
+
+// About 45 seconds of 48 kHz stereo float audio
+const size_t DefaultAudioCacheBytes = 16 * 1024 * 1024;
+
+// The nodes a RecyclingAllocator and its copies keep for reuse
+struct RecyclingPool {
+    size_t NodeSize = 0;
+    std::vector<void *> Nodes;
+
+    ~RecyclingPool() {
+        for (void *Node : Nodes)
+            ::operator delete(Node);
+    }
+};
+
+// Allocator for node based containers which keeps the nodes freed by the
+// container for reuse, so that a container which stays about the same size
+// stops allocating. Copies share their free nodes, including copies for
+// another type, which is how the container's own copy is reached.
+template<typename T>
+class RecyclingAllocator {
+    template<typename U> friend class RecyclingAllocator;
+
+    std::shared_ptr<RecyclingPool> Free;
+
+public:
+    typedef T value_type;
+
+    RecyclingAllocator() : Free(std::make_shared<RecyclingPool>()) {}
+    template<typename U>
+    RecyclingAllocator(RecyclingAllocator<U> const& Other) : Free(Other.Free) {}
+
+    T *allocate(size_t n) {
+        // Only single nodes of one size are recycled
+        if (n == 1 && Free->NodeSize == sizeof(T) && !Free->Nodes.empty()) {
+            void *Node = Free->Nodes.back();
+            Free->Nodes.pop_back();
+            return static_cast<T *>(Node);
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n == 1 && (Free->NodeSize == 0 || Free->NodeSize == sizeof(T))) {
+            Free->NodeSize = sizeof(T);
+            Free->Nodes.push_back(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    // Frees the nodes kept for reuse beyond the first Keep
+    void Trim(size_t Keep) {
+        if (Free->Nodes.size() <= Keep)
+            return;
+        for (size_t i = Keep; i < Free->Nodes.size(); i++)
+            ::operator delete(Free->Nodes[i]);
+        Free->Nodes.resize(Keep);
+        Free->Nodes.shrink_to_fit();
+    }
+
+    size_t FreeNodes() const { return Free->Nodes.size(); }
+
+    template<typename U>
+    bool operator==(RecyclingAllocator<U> const& Other) const { return Free == Other.Free; }
+    template<typename U>
+    bool operator!=(RecyclingAllocator<U> const& Other) const { return Free != Other.Free; }
+};
+
+// Memory for the samples of cached blocks. Chunks are rounded up to one of
+// four sizes per power of two and carved out of slabs which only hold chunks
+// of one size, and which keep their freed chunks for the next block that
+// needs that much. A slab is only freed by ReleaseEmptySlab once none of its
+// chunks are in use, so a cache which stays full doesn't allocate.
+class SampleArena {
+    struct Slab {
+        std::unique_ptr<uint8_t[]> Memory;
+        size_t Class = 0;
+        size_t Size = 0;
+        // Chunks handed out and not released yet
+        size_t Used = 0;
+        // Chunks carved from the start of the slab so far
+        size_t Carved = 0;
+        std::vector<uint8_t *> FreeChunks;
+
+        bool Full(size_t ChunkSize) const {
+            return FreeChunks.empty() && Carved * ChunkSize == Size;
+        }
+    };
+    // By address, highest first, to find the slab a released chunk is in
+    std::map<uint8_t *, Slab, std::greater<uint8_t *>> Slabs;
+    // Slabs with room for another chunk, by size class
+    std::vector<std::vector<Slab *>> Open;
+    size_t Bytes = 0;
+    size_t EmptySlabs = 0;
+
+public:
+    static size_t SizeClass(size_t Size);
+    static size_t ClassSize(size_t Class);
+
+    // Returns a chunk of ClassSize(SizeClass(Size)) bytes
+    uint8_t *Allocate(size_t Size);
+    void Release(uint8_t *Chunk);
+    // Frees a slab none of whose chunks are in use, or returns false if
+    // there is none
+    bool ReleaseEmptySlab();
+    // Frees all memory, which invalidates every chunk handed out
+    void Clear();
+    // Size of all slabs, used or not
+    size_t MemoryUsage() const { return Bytes; }
+};
+
+// Decoded audio blocks, looked up by the samples they hold and evicted least
+// recently used first once the memory they're kept in takes up more than a
+// byte budget. Pinned blocks are kept regardless of the budget, so it only
+// limits what the rest of the cache takes up.
+class AudioCache {
+public:
+    struct Block {
+        int64_t Start;
+        int64_t Samples = 0;
+        size_t DataSize = 0;
+        uint8_t *Data = nullptr;
+
+        explicit Block(int64_t Start) : Start(Start) {}
+
+    private:
+        friend class AudioCache;
+        size_t Capacity = 0;
+        // Pinned blocks are never evicted and aren't in the LRU list
+        bool Pinned = false;
+        std::list<Block *, RecyclingAllocator<Block *>>::iterator LRUPos;
+    };
+
+private:
+    typedef std::map<int64_t, Block, std::less<int64_t>, RecyclingAllocator<std::pair<const int64_t, Block>>> BlockMap;
+
+    SampleArena Arena;
+    BlockMap Blocks;
+    // Least recently used first
+    std::list<Block *, RecyclingAllocator<Block *>> LRU;
+    size_t MaxBytes;
+    // Size of the chunks held by pinned blocks
+    size_t PinnedBytes = 0;
+    // The block which was written to last is kept even if it's over budget
+    // on its own, as the caller is still using it
+    Block *Newest = nullptr;
+
+    void Evict();
+    void Erase(BlockMap::iterator it);
+
+public:
+    explicit AudioCache(size_t MaxBytes = DefaultAudioCacheBytes);
+
+    bool empty() const { return Blocks.empty(); }
+    size_t size() const { return Blocks.size(); }
+    size_t MemoryUsage() const { return Arena.MemoryUsage(); }
+    // Nodes of the block map and LRU list kept for reuse
+    size_t SpareNodes() const { return Blocks.get_allocator().FreeNodes() + LRU.get_allocator().FreeNodes(); }
+
+    size_t GetMaxBytes() const { return MaxBytes; }
+    // Evicts blocks and frees memory until the cache fits in the new budget
+    void SetMaxBytes(size_t NewMaxBytes);
+    void Clear();
+
+    // The block holding Sample, or null if it isn't cached. Marks the block
+    // as used.
+    Block *Find(int64_t Sample);
+
+    // Returns the block to write the samples starting at Start to, with
+    // room for ExpectedSize bytes. More samples decoded from the packet
+    // which was written last are appended to its block. Returns null if
+    // another block starting there is already cached, since there's no need
+    // to keep the samples twice.
+    Block *Insert(int64_t Start, size_t ExpectedSize);
+
+    // Makes room for Size more bytes at the end of B, which must be the
+    // block returned by the last Insert, and returns a pointer to them
+    uint8_t *Grow(Block *B, size_t Size);
+
+    // Keeps everything currently cached for as long as the cache exists
+    void PinAll();
+};
@@ -0,0 +1,302 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "audioextract.h"
+
+#include "audiosource.h"
+#include "filehandle.h"
+#include "indexing.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace {
+// Rough amount of output each decoder is given at a time
+size_t PartBytes = 4 * 1024 * 1024;
+bool DistrustOverlaps = false;
+// Samples before each part which the decoder of the part decodes as well,
+// to compare them with what the decoder of the previous part got
+const int64_t OverlapSamples = 8192;
+
+// The track is split into parts starting at keyframes, and each batch of
+// parts is decoded by all the decoders at once. Every decoder but the first
+// starts decoding a part right after seeking, which is only the same as
+// decoding on from the previous part once the decoder has converged. That
+// is checked by also decoding the samples right before the part and
+// comparing them to the end of the previous part. Parts for which they
+// differ are decoded again by the decoder of the previous part, which just
+// goes on from where it stopped, as does the decoder of the first part of
+// every batch. Codecs without dependencies between packets always match,
+// so nothing is decoded twice for them.
+class ParallelAudioExtractor {
+    std::vector<std::unique_ptr<FFMS_AudioSource>> Sources;
+    // First sample of each part, followed by the total number of samples
+    std::vector<int64_t> Parts;
+    // Decoder which decoded up to the start of the next batch
+    FFMS_AudioSource *Last = nullptr;
+    AudioExtractStats Stats;
+
+    void DecodeBatch(size_t First, size_t End, uint8_t *Dst);
+
+public:
+    FFMS_AudioProperties AP;
+    size_t BytesPerSample;
+
+    ParallelAudioExtractor(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads);
+
+    // Decodes the whole track into Buf if given, and otherwise into File
+    void Extract(uint8_t *Buf, FileHandle *File);
+    AudioExtractStats const& GetStats() const { return Stats; }
+};
+
+ParallelAudioExtractor::ParallelAudioExtractor(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads) {
+    Sources.push_back(make_unique<FFMS_AudioSource>(SourceFile, Index, Track, DelayMode));
+    FFMS_AudioSource &First = *Sources.front();
+    AP = First.GetAudioProperties();
+    BytesPerSample = First.BytesPerSample;
+
+    FrameColumns const& Frames = First.GetTrack()->Columns();
+    const int64_t PartSamples = std::max<int64_t>(PartBytes / BytesPerSample, 1);
+    Parts.push_back(0);
+    for (size_t i = 0; i < First.GetTrack()->size(); i++) {
+        int64_t Start = Frames.SampleStart(i) + First.Delay;
+        if (Frames.KeyFrame(i) && Start - Parts.back() >= PartSamples && Start < AP.NumSamples)
+            Parts.push_back(Start);
+    }
+    Parts.push_back(AP.NumSamples);
+
+    // Sources which can't seek can only decode from the start
+    if (Threads <= 0)
+        Threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    if (First.SeekOffset < 0)
+        Threads = 1;
+    Threads = static_cast<int>(std::min<size_t>(Threads, Parts.size() - 1));
+    for (int i = 1; i < Threads; i++)
+        Sources.push_back(make_unique<FFMS_AudioSource>(SourceFile, Index, Track, DelayMode));
+
+    Stats.Parts = Parts.size() - 1;
+    Stats.Decoders = Threads;
+}
+
+void ParallelAudioExtractor::DecodeBatch(size_t First, size_t End, uint8_t *Dst) {
+    const size_t Count = End - First;
+    std::vector<FFMS_AudioSource *> Decoders;
+    if (Last)
+        Decoders.push_back(Last);
+    for (auto &Source : Sources) {
+        if (Source.get() != Last)
+            Decoders.push_back(Source.get());
+    }
+
+    auto PartDst = [&](size_t Part) {
+        return Dst + (Parts[Part] - Parts[First]) * BytesPerSample;
+    };
+
+    std::vector<std::vector<uint8_t>> Overlaps(Count);
+    std::vector<std::exception_ptr> Errors(Count);
+    auto Decode = [&](size_t i) {
+        try {
+            const size_t Part = First + i;
+            if (i > 0) {
+                int64_t Overlap = std::min(OverlapSamples, Parts[Part] - Parts[Part - 1]);
+                Overlaps[i].resize(static_cast<size_t>(Overlap * BytesPerSample));
+                Decoders[i]->GetAudio(Overlaps[i].data(), Parts[Part] - Overlap, Overlap);
+            }
+            Decoders[i]->GetAudio(PartDst(Part), Parts[Part], Parts[Part + 1] - Parts[Part]);
+        } catch (...) {
+            Errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> Threads;
+    try {
+        for (size_t i = 1; i < Count; i++)
+            Threads.emplace_back(Decode, i);
+    } catch (std::system_error const&) {
+        for (auto &Thread : Threads)
+            Thread.join();
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
+            "Could not start the audio decoding threads");
+    }
+    Decode(0);
+    for (auto &Thread : Threads)
+        Thread.join();
+    for (auto &Error : Errors) {
+        if (Error)
+            std::rethrow_exception(Error);
+    }
+
+    FFMS_AudioSource *Serial = Decoders[0];
+    for (size_t i = 1; i < Count; i++) {
+        const size_t Part = First + i;
+        uint8_t *Start = PartDst(Part);
+        Stats.Compared++;
+        if (DistrustOverlaps || memcmp(Overlaps[i].data(), Start - Overlaps[i].size(), Overlaps[i].size())) {
+            Serial->GetAudio(Start, Parts[Part], Parts[Part + 1] - Parts[Part]);
+            Stats.Redecoded++;
+        } else {
+            Serial = Decoders[i];
+        }
+    }
+    Last = Serial;
+}
+
+void ParallelAudioExtractor::Extract(uint8_t *Buf, FileHandle *File) {
+    std::vector<uint8_t> Buffer;
+    const size_t NumParts = Parts.size() - 1;
+    for (size_t First = 0; First < NumParts; First += Sources.size()) {
+        const size_t End = std::min(First + Sources.size(), NumParts);
+        const size_t Bytes = static_cast<size_t>((Parts[End] - Parts[First]) * BytesPerSample);
+        if (Buf) {
+            DecodeBatch(First, End, Buf + Parts[First] * BytesPerSample);
+        } else {
+            Buffer.resize(Bytes);
+            DecodeBatch(First, End, Buffer.data());
+            File->Write(reinterpret_cast<const char *>(Buffer.data()), Bytes);
+        }
+    }
+}
+
+class HeaderWriter {
+    std::vector<uint8_t> Data;
+
+public:
+    void Bytes(const char *Value, size_t Size) {
+        Data.insert(Data.end(), Value, Value + Size);
+    }
+    void LE(uint64_t Value, int Size) {
+        for (int i = 0; i < Size; i++)
+            Data.push_back(static_cast<uint8_t>(Value >> (8 * i)));
+    }
+    void Align(size_t Alignment) {
+        while (Data.size() % Alignment)
+            Data.push_back(0);
+    }
+    void Append(HeaderWriter const& Other) {
+        Data.insert(Data.end(), Other.Data.begin(), Other.Data.end());
+    }
+    const uint8_t *data() const { return Data.data(); }
+    size_t size() const { return Data.size(); }
+};
+
+// The WAVEFORMATEX or WAVEFORMATEXTENSIBLE structure describing the audio
+void WaveFormat(HeaderWriter &Out, FFMS_AudioProperties const& AP) {
+    const bool Float = AP.SampleFormat == FFMS_FMT_FLT || AP.SampleFormat == FFMS_FMT_DBL;
+    const unsigned Tag = Float ? 3 : 1;
+    const unsigned BlockAlign = AP.BitsPerSample / 8 * AP.Channels;
+    const bool Extensible = AP.Channels > 2 || AP.BitsPerSample > 16;
+
+    Out.LE(Extensible ? 0xFFFE : Tag, 2);
+    Out.LE(AP.Channels, 2);
+    Out.LE(AP.SampleRate, 4);
+    Out.LE(static_cast<uint64_t>(AP.SampleRate) * BlockAlign, 4);
+    Out.LE(BlockAlign, 2);
+    Out.LE(AP.BitsPerSample, 2);
+    if (Extensible) {
+        Out.LE(22, 2);
+        Out.LE(AP.BitsPerSample, 2);
+        // The first 18 channel layout bits are the speaker positions of the
+        // channel mask
+        Out.LE(AP.ChannelLayout & 0x3FFFF, 4);
+        Out.LE(Tag, 4);
+        Out.Bytes("\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 12);
+    }
+}
+
+void WriteWaveHeader(FileHandle &File, FFMS_AudioProperties const& AP, uint64_t DataBytes, int Format) {
+    HeaderWriter Fmt;
+    WaveFormat(Fmt, AP);
+
+    HeaderWriter Out;
+    if (Format == FFMS_AUDIO_FILE_WAV) {
+        const uint64_t RIFFSize = 4 + 8 + Fmt.size() + 8 + DataBytes + (DataBytes & 1);
+        if (RIFFSize > UINT32_MAX)
+            throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_FILE_WRITE,
+                "The audio is too long for a WAV file, use W64 instead");
+        Out.Bytes("RIFF", 4);
+        Out.LE(RIFFSize, 4);
+        Out.Bytes("WAVEfmt ", 8);
+        Out.LE(Fmt.size(), 4);
+        Out.Append(Fmt);
+        Out.Bytes("data", 4);
+        Out.LE(DataBytes, 4);
+    } else {
+        // Wave64 uses GUIDs instead of the four character codes, which for
+        // everything other than riff share the same suffix, and sizes which
+        // include the chunk headers
+        const char *Suffix = "\xF3\xAC\xD3\x11\x8C\xD1\x00\xC0\x4F\x8E\xDB\x8A";
+        Fmt.Align(8);
+        Out.Bytes("riff\x2E\x91\xCF\x11\xA5\xD6\x28\xDB\x04\xC1\x00\x00", 16);
+        Out.LE(24 + 16 + 24 + Fmt.size() + 24 + ((DataBytes + 7) & ~UINT64_C(7)), 8);
+        Out.Bytes("wave", 4);
+        Out.Bytes(Suffix, 12);
+        Out.Bytes("fmt ", 4);
+        Out.Bytes(Suffix, 12);
+        Out.LE(24 + Fmt.size(), 8);
+        Out.Append(Fmt);
+        Out.Bytes("data", 4);
+        Out.Bytes(Suffix, 12);
+        Out.LE(24 + DataBytes, 8);
+    }
+    File.Write(reinterpret_cast<const char *>(Out.data()), Out.size());
+}
+}
+
+void ExtractAudio(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads, void *Buf,
+    AudioExtractStats *Stats) {
+    ParallelAudioExtractor Extractor(SourceFile, Index, Track, DelayMode, Threads);
+    Extractor.Extract(static_cast<uint8_t *>(Buf), nullptr);
+    if (Stats)
+        *Stats = Extractor.GetStats();
+}
+
+void ExtractAudioToFile(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads,
+    const char *OutputFile, int Format, AudioExtractStats *Stats) {
+    if (Format != FFMS_AUDIO_FILE_WAV && Format != FFMS_AUDIO_FILE_W64)
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
+            "Invalid audio file format");
+
+    ParallelAudioExtractor Extractor(SourceFile, Index, Track, DelayMode, Threads);
+    const uint64_t DataBytes = static_cast<uint64_t>(Extractor.AP.NumSamples) * Extractor.BytesPerSample;
+
+    FileHandle File(OutputFile, "wb", FFMS_ERROR_DECODING, FFMS_ERROR_FILE_WRITE);
+    WriteWaveHeader(File, Extractor.AP, DataBytes, Format);
+    Extractor.Extract(nullptr, &File);
+    // Chunks are padded to an even size
+    if (Format == FFMS_AUDIO_FILE_WAV && (DataBytes & 1))
+        File.Write("", 1);
+    else if (Format == FFMS_AUDIO_FILE_W64 && (DataBytes & 7))
+        File.Write("\0\0\0\0\0\0\0", 8 - (DataBytes & 7));
+    if (Stats)
+        *Stats = Extractor.GetStats();
+}
+
+void SetAudioExtractPartBytes(size_t Bytes) {
+    PartBytes = std::max<size_t>(Bytes, 1);
+}
+
+void SetAudioExtractDistrustOverlaps(bool Distrust) {
+    DistrustOverlaps = Distrust;
+}
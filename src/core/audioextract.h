@@ -0,0 +1,54 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct FFMS_Index;
+
+// How an extraction went, for the tests
+struct AudioExtractStats {
+    size_t Parts = 0;
+    int Decoders = 0;
+    // Parts whose start was compared with the end of the part before
+    size_t Compared = 0;
+    // Parts decoded again because their start didn't match
+    size_t Redecoded = 0;
+};
+
+// Decodes a whole audio track with Threads decoders working on different
+// parts of it at once, into Buf or into a WAV or W64 file. The audio is
+// exactly what a single FFMS_AudioSource created with the same arguments
+// would return when reading the track from start to end.
+void ExtractAudio(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads, void *Buf,
+    AudioExtractStats *Stats = nullptr);
+void ExtractAudioToFile(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode, int Threads,
+    const char *OutputFile, int Format, AudioExtractStats *Stats = nullptr);
+
+// Only meant for the tests, which need short tracks split into many parts.
+// Defaults to 4 MiB of output per part.
+void SetAudioExtractPartBytes(size_t Bytes);
+// Only meant for the tests: has every part which doesn't start a batch
+// decoded again by the decoder of the part before, as if their starts
+// never matched
+void SetAudioExtractDistrustOverlaps(bool Distrust);
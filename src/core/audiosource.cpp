@@ -21,12 +21,15 @@
 #include "audiosource.h"
 
 #include "indexing.h"
+#include "segments.h"
 
 #include <algorithm>
 #include <cassert>
+#include <system_error>
 
 extern "C" {
 #include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
 }
 
 namespace {
@@ -51,6 +54,17 @@ namespace {
         MAPPER(DitherMethod,           "dither_method")
     };
 #undef MAPPER
+
+    // Requests, or runs of back to back requests, at least this large are
+    // decoded straight into the caller's buffer rather than through the cache
+    const int64_t DirectDecodeBytes = 256 * 1024;
+
+    // Input samples the sample rate conversion is started before the
+    // requested position after a seek, which is more than the resampling
+    // filter spans even for large rate ratios
+    const int64_t RatePreroll = 8192;
+    // Samples fed to and taken from the sample rate conversion at a time
+    const int64_t RateChunk = 4096;
 }
 
 FFMS_AudioSource::FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode)
@@ -92,12 +106,19 @@ FFMS_AudioSource::FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, in
     }
 }
 
+FFMS_AudioSource::FFMS_AudioSource(FFMS_SegmentedIndex &Index, int Track, int DelayMode, int MaxOpenSegments)
+    : LastValidTS(AV_NOPTS_VALUE)
+    , TrackNumber(Track)
+    , Segments(make_unique<SegmentedAudio>(Index, Track, DelayMode, MaxOpenSegments)) {
+    Frames = Segments->Frames;
+    AP = Segments->AP;
+}
 
 #define EXCESSIVE_CACHE_SIZE 400
 
 void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
     // Decode the first packet to ensure all properties are initialized
-    // Don't cache it since it might be in the wrong format
+    // Don't cache it since the cache format isn't known before
     for (size_t i = 0; i < Frames.size(); i++) {
         if (DecodeNextBlock())
             break;
@@ -110,6 +131,17 @@ void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
     if (AP.SampleRate <= 0 || AP.BitsPerSample <= 0)
         throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_CODEC,
             "Codec returned zero size audio");
+    SourceSampleRate = AP.SampleRate;
+    SourceSamples = AP.NumSamples;
+
+    CacheFormat = CodecContext->sample_fmt;
+    CachePlanar = !!av_sample_fmt_is_planar(CacheFormat);
+    CacheBytesPerSample = av_get_bytes_per_sample(CacheFormat) * AP.Channels;
+
+    // Go back to the start for the first request
+    PacketNumber = 0;
+    OpenFile();
+    avcodec_flush_buffers(CodecContext);
 
     auto opt = CreateResampleOptions();
     SetOutputFormat(*opt);
@@ -150,7 +182,8 @@ void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
             Delay -= Frames[i].SampleCount;
     }
 
-    AP.NumSamples += Delay;
+    SourceSamples += Delay;
+    AP.NumSamples = SourceSamples;
 }
 
 void FFMS_AudioSource::CacheBeginning() {
@@ -169,121 +202,202 @@ void FFMS_AudioSource::CacheBeginning() {
     // file (ts and?), so cache a few blocks even if PTSes are unique
     // Packet 7 is the last packet I've had be unseekable to, so cache up to
     // 10 for a bit of an extra buffer
-    auto end = Cache.end();
+    const int64_t FirstPTS = Frames.Columns().PTS(0);
     while (PacketNumber < Frames.size() &&
-        ((Frames[0].PTS != AV_NOPTS_VALUE && Frames[PacketNumber].PTS == Frames[0].PTS) ||
+        ((FirstPTS != AV_NOPTS_VALUE && Frames.Columns().PTS(PacketNumber) == FirstPTS) ||
             Cache.size() < 10)) {
 
         // Vorbis in particular seems to like having 60+ packets at the start
-        // of the file with a PTS of 0, so we might need to expand the search
-        // range to account for that.
-        // Expanding slightly before it's strictly needed to ensure there's a
-        // bit of space for an actual cache
-        if (Cache.size() >= MaxCacheBlocks - 5) {
-            if (MaxCacheBlocks >= EXCESSIVE_CACHE_SIZE)
-                throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
-                    "Exceeded the search range for an initial valid audio PTS");
-            MaxCacheBlocks *= 2;
-        }
+        // of the file with a PTS of 0, so we might need to cache quite a
+        // few blocks, but not without limit
+        if (Cache.size() >= EXCESSIVE_CACHE_SIZE)
+            throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
+                "Exceeded the search range for an initial valid audio PTS");
 
-        DecodeNextBlock(&end);
+        DecodeNextBlock(true);
     }
-    // Store the iterator to the last element of the cache which is used for
-    // correctness rather than speed, so that when looking for one to delete
-    // we know how much to skip
-    CacheNoDelete = Cache.end();
-    --CacheNoDelete;
+    // These blocks are needed for correctness rather than speed, so they
+    // are never evicted
+    Cache.PinAll();
 }
 
 void FFMS_AudioSource::SetOutputFormat(FFMS_ResampleOptions const& opt) {
-    if (opt.SampleRate != AP.SampleRate)
-        throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNSUPPORTED,
-            "Sample rate changes are currently unsupported.");
+    if (Segments) {
+        Segments->SetOutputFormat(opt);
+        return;
+    }
 
-    // Cache stores audio in the output format, so clear it and reopen the file
-    Cache.clear();
-    PacketNumber = 0;
-    OpenFile();
-    avcodec_flush_buffers(CodecContext);
+    if (opt.SampleRate <= 0)
+        throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_INVALID_ARGUMENT,
+            "Invalid output sample rate");
+
+    DecoderLock Lock(*this);
+
+    // The cache is in its own format, so it stays as it is, and only the
+    // conversion on the way out changes
+    OutputOptions = make_unique<FFMS_ResampleOptions>(opt);
+    OutputFormat = static_cast<AVSampleFormat>(opt.SampleFormat);
+    OutputChannels = av_get_channel_layout_nb_channels(opt.ChannelLayout);
+    BytesPerSample = av_get_bytes_per_sample(OutputFormat) * OutputChannels;
+
+    // The cache holds audio at the source's sample rate, since the rate
+    // can't be converted one packet at a time, and a second context takes
+    // it to the output rate when it's requested. Forced resampling goes
+    // through the same context, since the resampler's filter delay needs
+    // the same handling even when the rate stays the same.
+    RateContext.reset();
+    RateOutputPos = -1;
+    AP.SampleRate = opt.SampleRate;
+    AP.NumSamples = SourceSamples;
+    if (opt.SampleRate != SourceSampleRate || opt.ForceResample) {
+        const AVSampleFormat PlanarFormat = av_get_planar_sample_fmt(OutputFormat);
+        FFResampleContext newContext{ swr_alloc() };
+        SetOptions(opt, newContext.get(), resample_options);
+        av_opt_set_int(newContext.get(), "in_sample_rate", SourceSampleRate, 0);
+        av_opt_set_channel_layout(newContext.get(), "in_channel_layout", opt.ChannelLayout, 0);
+        av_opt_set_sample_fmt(newContext.get(), "in_sample_fmt", PlanarFormat, 0);
+
+        av_opt_set_int(newContext.get(), "out_sample_rate", opt.SampleRate, 0);
+        av_opt_set_channel_layout(newContext.get(), "out_channel_layout", opt.ChannelLayout, 0);
+        av_opt_set_sample_fmt(newContext.get(), "out_sample_fmt", RatePlanar ? PlanarFormat : OutputFormat, 0);
+
+        if (swr_init(newContext.get()))
+            throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNKNOWN,
+                "Could not open avresample context");
+        newContext.swap(RateContext);
+        AP.NumSamples = av_rescale(SourceSamples, opt.SampleRate, SourceSampleRate);
+    }
 
-    BytesPerSample = av_get_bytes_per_sample(static_cast<AVSampleFormat>(opt.SampleFormat)) * av_get_channel_layout_nb_channels(opt.ChannelLayout);
-    NeedsResample =
-        opt.SampleFormat != (int)CodecContext->sample_fmt ||
-        opt.SampleRate != AP.SampleRate ||
-        opt.ChannelLayout != AP.ChannelLayout ||
-        opt.ForceResample;
+    SetupConversion(opt, OutputFormat, ResampleContext, Converter);
+    SetupConversion(opt, av_get_planar_sample_fmt(OutputFormat), PlanarContext, PlanarConverter);
+}
 
-    if (!NeedsResample) return;
+void FFMS_AudioSource::SetupConversion(FFMS_ResampleOptions const& opt, AVSampleFormat Format, FFResampleContext &Context, std::unique_ptr<SampleConverter> &Conv) {
+    Context.reset();
+    Conv.reset();
+    if (opt.ChannelLayout == AP.ChannelLayout) {
+        if (Format == CacheFormat)
+            return;
+        // Without any mixing, the common format conversions don't need
+        // swresample
+        Conv = SampleConverter::Create(CacheFormat, Format, AP.Channels, opt.DitherMethod);
+        if (Conv)
+            return;
+    }
 
     FFResampleContext newContext{ swr_alloc() };
     SetOptions(opt, newContext.get(), resample_options);
-    av_opt_set_int(newContext.get(), "in_sample_rate", AP.SampleRate, 0);
-    av_opt_set_int(newContext.get(), "in_sample_fmt", CodecContext->sample_fmt, 0);
+    av_opt_set_int(newContext.get(), "in_sample_rate", SourceSampleRate, 0);
+    av_opt_set_int(newContext.get(), "in_sample_fmt", CacheFormat, 0);
     av_opt_set_int(newContext.get(), "in_channel_layout", AP.ChannelLayout, 0);
+    // Cached audio is converted in whatever order it's requested in, which
+    // a resampler with its filter delay can't do even at the same rate, so
+    // ForceResample is left to the rate conversion context
+    av_opt_set_int(newContext.get(), "force_resampling", 0, 0);
 
-    av_opt_set_int(newContext.get(), "out_sample_rate", opt.SampleRate, 0);
+    av_opt_set_int(newContext.get(), "out_sample_rate", SourceSampleRate, 0);
     av_opt_set_channel_layout(newContext.get(), "out_channel_layout", opt.ChannelLayout, 0);
-    av_opt_set_sample_fmt(newContext.get(), "out_sample_fmt", (AVSampleFormat)opt.SampleFormat, 0);
+    av_opt_set_sample_fmt(newContext.get(), "out_sample_fmt", Format, 0);
 
     if (swr_init(newContext.get()))
         throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNKNOWN,
             "Could not open avresample context");
-    newContext.swap(ResampleContext);
+    newContext.swap(Context);
 }
 
 std::unique_ptr<FFMS_ResampleOptions> FFMS_AudioSource::CreateResampleOptions() const {
-    auto ret = ReadOptions(ResampleContext.get(), resample_options);
-    ret->SampleRate = AP.SampleRate;
+    if (Segments)
+        return Segments->CreateResampleOptions();
+
+    auto ret = OutputOptions ? make_unique<FFMS_ResampleOptions>(*OutputOptions) : ReadOptions(ResampleContext.get(), resample_options);
+    ret->SampleRate = SourceSampleRate;
     ret->SampleFormat = static_cast<FFMS_SampleFormat>(AP.SampleFormat);
     ret->ChannelLayout = AP.ChannelLayout;
     return ret;
 }
 
-void FFMS_AudioSource::ResampleAndCache(CacheIterator pos) {
-    AudioBlock& block = *pos;
-
-    size_t size = DecodeFrame->nb_samples * BytesPerSample;
-    auto dst = block.Grow(size);
-
-    uint8_t *OutPlanes[1] = { dst };
+void FFMS_AudioSource::AudioOutput::Skip(int64_t Samples) {
+    for (auto &Plane : Planes)
+        Plane += Samples * SampleBytes;
+}
 
-    swr_convert(ResampleContext.get(), OutPlanes, DecodeFrame->nb_samples, (const uint8_t **)DecodeFrame->extended_data, DecodeFrame->nb_samples);
+FFMS_AudioSource::AudioOutput FFMS_AudioSource::OutputTo(void *const *Planes, bool Planar) const {
+    AudioOutput Out;
+    Out.Planar = Planar;
+    Out.SampleBytes = Planar ? BytesPerSample / OutputChannels : BytesPerSample;
+    for (int i = 0; i < (Planar ? OutputChannels : 1); i++)
+        Out.Planes.push_back(static_cast<uint8_t *>(Planes[i]));
+    return Out;
 }
 
-FFMS_AudioSource::AudioBlock *FFMS_AudioSource::CacheBlock(CacheIterator &pos) {
-    // If the previous block has the same Start sample as this one, then
-    // we got multiple frames of audio out of a single packet and should
-    // combine them
-    auto block = pos;
-    if (pos == Cache.begin() || (--block)->Start != CurrentSample)
-        block = Cache.emplace(pos, CurrentSample);
+FFMS_AudioSource::AudioOutput FFMS_AudioSource::ScratchOutput(std::vector<uint8_t> &Buffer, bool Planar, int64_t Samples) const {
+    Buffer.resize(static_cast<size_t>(Samples * BytesPerSample));
+    std::vector<void *> Planes;
+    const size_t PlaneBytes = static_cast<size_t>(Samples * BytesPerSample / OutputChannels);
+    for (int i = 0; i < (Planar ? OutputChannels : 1); i++)
+        Planes.push_back(Buffer.data() + i * PlaneBytes);
+    return OutputTo(Planes.data(), Planar);
+}
 
-    block->Samples += DecodeFrame->nb_samples;
+const uint8_t **FFMS_AudioSource::BlockPlanes(AudioCache::Block const& Block, int64_t Offset) {
+    if (!CachePlanar) {
+        SourcePlanes.assign(1, Block.Data + Offset * CacheBytesPerSample);
+    } else {
+        const size_t SampleBytes = CacheBytesPerSample / AP.Channels;
+        SourcePlanes.resize(AP.Channels);
+        for (int i = 0; i < AP.Channels; i++)
+            SourcePlanes[i] = Block.Data + (i * Block.Samples + Offset) * SampleBytes;
+    }
+    return SourcePlanes.data();
+}
 
-    if (NeedsResample)
-        ResampleAndCache(block);
-    else {
-        const uint8_t *data = DecodeFrame->extended_data[0];
-        auto dst = block->Grow(DecodeFrame->nb_samples * BytesPerSample);
-        memcpy(dst, data, DecodeFrame->nb_samples * BytesPerSample);
+void FFMS_AudioSource::ConvertOutput(AudioOutput const& Dst, const uint8_t **Src, int64_t Count) {
+    if (SampleConverter *Conv = Dst.Planar ? PlanarConverter.get() : Converter.get()) {
+        Conv->Convert(Dst.Planes.data(), Src, static_cast<int>(Count));
+    } else if (SwrContext *Context = Dst.Planar ? PlanarContext.get() : ResampleContext.get()) {
+        uint8_t **OutPlanes = const_cast<uint8_t **>(Dst.Planes.data());
+        swr_convert(Context, OutPlanes, static_cast<int>(Count), Src, static_cast<int>(Count));
+    } else {
+        // The cache is in the output format, with the same planes
+        for (size_t i = 0; i < Dst.Planes.size(); i++)
+            memcpy(Dst.Planes[i], Src[i], static_cast<size_t>(Count * Dst.SampleBytes));
     }
+}
+
+void FFMS_AudioSource::FillPadding(uint8_t *Pad, int64_t Missing, int64_t Available, size_t SampleBytes) {
+    const size_t MissingBytes = static_cast<size_t>(Missing * SampleBytes);
+    if (Missing > 200 || Missing > Available)
+        memset(Pad, 0, MissingBytes);
+    else
+        memcpy(Pad, Pad - MissingBytes, MissingBytes);
+}
 
-    if (Cache.size() >= MaxCacheBlocks) {
-        // Kill the oldest one
-        auto min = CacheNoDelete;
-        // Never drop the first one as the first packet decoded after a seek
-        // is often decoded incorrectly and we can't seek to before the first one
-        ++min;
-        for (auto it = min; it != Cache.end(); ++it)
-            if (it->Age < min->Age) min = it;
-        if (min == pos) ++pos;
-        Cache.erase(min);
+AudioCache::Block *FFMS_AudioSource::CacheBlock() {
+    // Packets which decode to fewer samples than the index says they hold
+    // are padded up to that, so that the block's size is known before
+    // writing each plane of it
+    const int64_t Decoded = DecodeFrame->nb_samples;
+    const int64_t Samples = std::max<int64_t>(Decoded, CurrentFrame.SampleCount);
+    auto block = Cache.Insert(CurrentSample, static_cast<size_t>(Samples * CacheBytesPerSample));
+    // The same packet decoded twice in a row is already in its block
+    if (!block || block->Samples)
+        return block;
+
+    uint8_t *Data = Cache.Grow(block, static_cast<size_t>(Samples * CacheBytesPerSample));
+    block->Samples = Samples;
+    const int Planes = CachePlanar ? AP.Channels : 1;
+    const size_t SampleBytes = CacheBytesPerSample / Planes;
+    for (int i = 0; i < Planes; i++) {
+        uint8_t *Plane = Data + i * Samples * SampleBytes;
+        memcpy(Plane, DecodeFrame->extended_data[i], static_cast<size_t>(Decoded * SampleBytes));
+        if (Samples > Decoded)
+            FillPadding(Plane + Decoded * SampleBytes, Samples - Decoded, Decoded, SampleBytes);
     }
-    return &*block;
+    return block;
 }
 
-int FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
-    CurrentFrame = &Frames[PacketNumber];
+int FFMS_AudioSource::DecodeNextBlock(bool UseCache, DirectOutput *Direct) {
+    CurrentFrame = Frames[PacketNumber];
 
     AVPacket Packet;
     if (!ReadPacket(&Packet))
@@ -291,11 +405,11 @@ int FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
             "ReadPacket unexpectedly failed to read a packet");
 
     // ReadPacket may have changed the packet number
-    CurrentFrame = &Frames[PacketNumber];
-    CurrentSample = CurrentFrame->SampleStart;
+    CurrentFrame = Frames[PacketNumber];
+    CurrentSample = CurrentFrame.SampleStart;
 
     int NumberOfSamples = 0;
-    AudioBlock *CachedBlock = nullptr;
+    bool WroteDirect = false;
     
     int Ret = avcodec_send_packet(CodecContext, &Packet);
     av_packet_unref(&Packet);
@@ -306,8 +420,15 @@ int FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
         //FIXME, is DecodeFrame->nb_samples > 0 always true for decoded frames? I can't be bothered to find out
         NumberOfSamples += DecodeFrame->nb_samples;
         if (DecodeFrame->nb_samples > 0) {
-            if (pos)
-                CachedBlock = CacheBlock(*pos);
+            // Packets which the caller wants all of skip the cache, unless
+            // they decode to more samples than the index says they hold
+            if (Direct && CurrentSample == Direct->Start &&
+                static_cast<int64_t>(CurrentFrame.SampleCount) <= Direct->Count &&
+                DecodeFrame->nb_samples <= static_cast<int64_t>(CurrentFrame.SampleCount)) {
+                ConvertOutput(Direct->Dst, const_cast<const uint8_t **>(DecodeFrame->extended_data), DecodeFrame->nb_samples);
+                WroteDirect = true;
+            } else if (UseCache)
+                CacheBlock();
         }
     }
 
@@ -317,20 +438,13 @@ int FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
     ++PacketNumber;
 
     // Add padding after the packet, if needed
-    if (!CachedBlock || CachedBlock->Samples == CurrentFrame->SampleCount)
-        return NumberOfSamples;
-
-    const int64_t MissingSamples = static_cast<int64_t>(CurrentFrame->SampleCount - CachedBlock->Samples);
-    // This can apparently happen in some rare circumstances, caused by inaccurate seeking?
-    if (MissingSamples <= 0)
-        return NumberOfSamples;
-    CachedBlock->Samples += MissingSamples;
-    const int64_t MissingBytes = MissingSamples * BytesPerSample;
-    if (MissingSamples > 200 || MissingSamples > CachedBlock->Samples - MissingSamples)
-        memset(CachedBlock->Grow(MissingBytes), 0, MissingBytes);
-    else {
-        auto ptr = CachedBlock->Grow(MissingBytes);
-        memcpy(ptr, ptr - MissingBytes, MissingBytes);
+    if (WroteDirect) {
+        const int64_t MissingSamples = static_cast<int64_t>(CurrentFrame.SampleCount) - NumberOfSamples;
+        if (MissingSamples > 0) {
+            for (uint8_t *Plane : Direct->Dst.Planes)
+                FillPadding(Plane + NumberOfSamples * Direct->Dst.SampleBytes, MissingSamples, NumberOfSamples, Direct->Dst.SampleBytes);
+        }
+        Direct->Written = CurrentFrame.SampleCount;
     }
     return NumberOfSamples;
 }
@@ -339,88 +453,306 @@ static bool SampleStartComp(const FrameInfo &a, const FrameInfo &b) {
     return a.SampleStart < b.SampleStart;
 }
 
+void FFMS_AudioSource::SeekTowards(int64_t Start) {
+    if (Start < CurrentSample && SeekOffset == -1)
+        throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Audio stream is not seekable");
+
+    if (SeekOffset >= 0 && (Start < CurrentSample || Start > CurrentSample + DecodeFrame->nb_samples * 5)) {
+        FrameInfo f;
+        f.SampleStart = Start;
+        size_t NewPacketNumber = std::distance(
+            Frames.begin(),
+            std::lower_bound(Frames.begin(), Frames.end(), f, SampleStartComp));
+        NewPacketNumber = NewPacketNumber > static_cast<size_t>(SeekOffset + 15)
+            ? NewPacketNumber - SeekOffset - 15
+            : 0;
+        while (NewPacketNumber > 0 && !Frames[NewPacketNumber].KeyFrame) --NewPacketNumber;
+
+        // Only seek forward if it'll actually result in moving forward
+        if (Start < CurrentSample || static_cast<size_t>(NewPacketNumber) > PacketNumber) {
+            PacketNumber = NewPacketNumber;
+            CurrentSample = -1;
+            av_frame_unref(DecodeFrame);
+            avcodec_flush_buffers(CodecContext);
+            Seek();
+        }
+    }
+
+    if (PacketNumber >= Frames.size())
+        throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Seeking is severely broken");
+}
+
 void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
+    if (Segments) {
+        Segments->GetAudio(Buf, Start, Count);
+        return;
+    }
+
+    GetOutputAudio(OutputTo(&Buf, false), Start, Count);
+}
+
+void FFMS_AudioSource::GetAudioPlanar(void **Planes, int64_t Start, int64_t Count) {
+    if (Segments) {
+        Segments->GetAudioPlanar(Planes, Start, Count);
+        return;
+    }
+
+    GetOutputAudio(OutputTo(Planes, true), Start, Count);
+}
+
+void FFMS_AudioSource::GetOutputAudio(AudioOutput const& Dst, int64_t Start, int64_t Count) {
     if (Start < 0 || Start + Count > AP.NumSamples || Count < 0)
         throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
             "Out of bounds audio samples requested");
 
+    DecoderLock Lock(*this);
+    if (RateContext)
+        GetResampledAudio(Dst, Start, Count);
+    else
+        GetSourceAudio(Dst, Start, Count);
+}
+
+void FFMS_AudioSource::GetResampledAudio(AudioOutput Dst, int64_t Start, int64_t Count) {
+    // Switching between interleaved and planar requests changes the
+    // resampler's output format, which needs a restart
+    if (Dst.Planar != RatePlanar) {
+        av_opt_set_sample_fmt(RateContext.get(), "out_sample_fmt", Dst.Planar ? av_get_planar_sample_fmt(OutputFormat) : OutputFormat, 0);
+        RatePlanar = Dst.Planar;
+        RateOutputPos = -1;
+    }
+
+    // Anything but reading on or skipping a little ahead restarts the
+    // conversion shortly before Start. It restarts at an input sample which
+    // falls exactly on an output sample, so that the filter phases are the
+    // same as when converting everything from the start, and early enough
+    // for the filter to only hold real input once Start is reached.
+    const int64_t OutRate = AP.SampleRate;
+    const int64_t InRate = SourceSampleRate;
+    if (Start < RateOutputPos || RateOutputPos < 0 || Start > RateOutputPos + av_rescale(RatePreroll, OutRate, InRate)) {
+        const int64_t GCD = av_gcd(InRate, OutRate);
+        const int64_t InStep = InRate / GCD;
+        const int64_t OutStep = OutRate / GCD;
+        const int64_t InStart = std::max<int64_t>(av_rescale(Start, InRate, OutRate) - RatePreroll, 0) / InStep;
+
+        if (swr_init(RateContext.get()))
+            throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNKNOWN,
+                "Could not reset avresample context");
+        RateInputPos = InStart * InStep;
+        RateOutputPos = InStart * OutStep;
+    }
+
+    // Output up to Start is only needed to fill the filter
+    while (RateOutputPos < Start)
+        ConvertRate(ScratchOutput(RateDiscard, Dst.Planar, RateChunk), std::min(Start - RateOutputPos, RateChunk));
+    ConvertRate(Dst, Count);
+}
+
+void FFMS_AudioSource::ConvertRate(AudioOutput Dst, int64_t Count) {
+    while (Count > 0) {
+        const int Want = static_cast<int>(std::min(Count, RateChunk));
+
+        // Output which the resampler still holds comes first
+        const uint8_t *NoInput[1] = { nullptr };
+        int Got = swr_convert(RateContext.get(), Dst.Planes.data(), Want, NoInput, 0);
+        if (Got == 0) {
+            // Silence after the end keeps the filter going for the last
+            // output samples
+            AudioOutput In = ScratchOutput(RateInput, true, RateChunk);
+            const int64_t Available = std::min(std::max<int64_t>(SourceSamples - RateInputPos, 0), RateChunk);
+            if (Available > 0)
+                GetSourceAudio(In, RateInputPos, Available);
+            for (uint8_t *Plane : In.Planes)
+                memset(Plane + Available * In.SampleBytes, 0, static_cast<size_t>((RateChunk - Available) * In.SampleBytes));
+
+            Got = swr_convert(RateContext.get(), Dst.Planes.data(), Want, const_cast<const uint8_t **>(In.Planes.data()), static_cast<int>(RateChunk));
+            RateInputPos += RateChunk;
+        }
+        if (Got < 0)
+            throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNKNOWN,
+                "Sample rate conversion failed");
+
+        Dst.Skip(Got);
+        Count -= Got;
+        RateOutputPos += Got;
+    }
+}
+
+void FFMS_AudioSource::GetSourceAudio(AudioOutput Dst, int64_t Start, int64_t Count) {
+    ReadEnd = Start - Delay + Count;
+
     CacheBeginning();
 
-    uint8_t *Dst = static_cast<uint8_t*>(Buf);
+    // Large reads and long runs of back to back reads, as in playback or
+    // encoding, would only churn the cache, so the packets which lie entirely
+    // within them are decoded straight into Buf. The partial packets at
+    // either end are still cached for the next request.
+    SequentialBytes = (Start == SequentialEnd ? SequentialBytes : 0) + Count * BytesPerSample;
+    SequentialEnd = Start + Count;
+    const bool DecodeDirect = SequentialBytes >= DirectDecodeBytes;
 
     // Apply audio delay (if any) and fill any samples before the start time with zero
     Start -= Delay;
     if (Start < 0) {
-        size_t Bytes = static_cast<size_t>(BytesPerSample * FFMIN(-Start, Count));
-        memset(Dst, 0, Bytes);
+        const int64_t Silence = FFMIN(-Start, Count);
+        for (uint8_t *Plane : Dst.Planes)
+            memset(Plane, 0, static_cast<size_t>(Silence * Dst.SampleBytes));
 
         Count += Start;
         // Entire request was before the start of the audio
         if (Count <= 0) return;
 
         Start = 0;
-        Dst += Bytes;
+        Dst.Skip(Silence);
     }
 
-    auto it = Cache.begin();
-
     while (Count > 0) {
-        // Find first useful cache block
-        while (it != Cache.end() && it->Start + it->Samples <= Start) ++it;
-
         // Cache has the next block we want
-        if (it != Cache.end() && it->Start <= Start) {
-            int64_t SrcOffset = FFMAX(0, Start - it->Start);
-            int64_t DstOffset = FFMAX(0, it->Start - Start);
-            int64_t CopySamples = FFMIN(it->Samples - SrcOffset, Count - DstOffset);
-            size_t Bytes = static_cast<size_t>(CopySamples * BytesPerSample);
+        if (auto block = Cache.Find(Start)) {
+            int64_t SrcOffset = Start - block->Start;
+            int64_t CopySamples = FFMIN(block->Samples - SrcOffset, Count);
 
-            memcpy(Dst + DstOffset * BytesPerSample, it->Data.get() + SrcOffset * BytesPerSample, Bytes);
+            ConvertOutput(Dst, BlockPlanes(*block, SrcOffset), CopySamples);
             Start += CopySamples;
             Count -= CopySamples;
-            Dst += Bytes;
-            ++it;
+            Dst.Skip(CopySamples);
         }
         // Decode another block
         else {
-            if (Start < CurrentSample && SeekOffset == -1)
-                throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Audio stream is not seekable");
-
-            if (SeekOffset >= 0 && (Start < CurrentSample || Start > CurrentSample + DecodeFrame->nb_samples * 5)) {
-                FrameInfo f;
-                f.SampleStart = Start;
-                size_t NewPacketNumber = std::distance(
-                    Frames.begin(),
-                    std::lower_bound(Frames.begin(), Frames.end(), f, SampleStartComp));
-                NewPacketNumber = NewPacketNumber > static_cast<size_t>(SeekOffset + 15)
-                    ? NewPacketNumber - SeekOffset - 15
-                    : 0;
-                while (NewPacketNumber > 0 && !Frames[NewPacketNumber].KeyFrame) --NewPacketNumber;
-
-                // Only seek forward if it'll actually result in moving forward
-                if (Start < CurrentSample || static_cast<size_t>(NewPacketNumber) > PacketNumber) {
-                    PacketNumber = NewPacketNumber;
-                    CurrentSample = -1;
-                    av_frame_unref(DecodeFrame);
-                    avcodec_flush_buffers(CodecContext);
-                    Seek();
-                }
+            SeekTowards(Start);
+
+            // Once the decoder is right before Start, whole packets can go
+            // to the caller until one only partially fits or doesn't start
+            // where expected, which then goes to the cache as usual
+            while (DecodeDirect && Count > 0 && PacketNumber < Frames.size() &&
+                CurrentSample >= 0 && CurrentSample + CurrentFrame.SampleCount == Start) {
+                DirectOutput Out = { Dst, Start, Count, 0 };
+                DecodeNextBlock(true, &Out);
+                if (!Out.Written)
+                    break;
+                Start += Out.Written;
+                Count -= Out.Written;
+                Dst.Skip(Out.Written);
+            }
+            if (Count <= 0)
+                break;
+
+            while (PacketNumber < Frames.size() &&
+                (CurrentSample + CurrentFrame.SampleCount <= Start || !Cache.Find(Start))) {
+                DecodeNextBlock(true);
+                if (CurrentSample > Start)
+                    throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Seeking is severely broken");
             }
+        }
+    }
+}
+
+void FFMS_AudioSource::SetCacheSize(size_t Bytes) {
+    if (Segments) {
+        Segments->SetCacheSize(Bytes);
+        return;
+    }
 
-            // Decode until we hit the block we want
-            if (PacketNumber >= Frames.size())
-                throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Seeking is severely broken");
-            while (CurrentSample + CurrentFrame->SampleCount <= Start && PacketNumber < Frames.size())
-                DecodeNextBlock(&it);
-            if (CurrentSample > Start)
-                throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Seeking is severely broken");
+    DecoderLock Lock(*this);
+    Cache.SetMaxBytes(Bytes);
+}
+
+void FFMS_AudioSource::SetPrefetch(size_t Bytes) {
+    if (Segments) {
+        Segments->SetPrefetch(Bytes);
+        return;
+    }
 
-            // The block we want is now in the cache immediately before it
-            --it;
+    if (!Bytes) {
+        StopPrefetchThread();
+        return;
+    }
+
+    {
+        DecoderLock Lock(*this);
+        PrefetchBytes = Bytes;
+        PrefetchFailedAt = -1;
+    }
+    if (!PrefetchThread.joinable()) {
+        try {
+            PrefetchThread = std::thread(&FFMS_AudioSource::PrefetchLoop, this);
+        } catch (std::system_error const&) {
+            throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
+                "Could not start the audio prefetch thread");
         }
     }
 }
 
+void FFMS_AudioSource::StopPrefetchThread() {
+    {
+        std::lock_guard<std::mutex> Lock(DecodeLock);
+        PrefetchBytes = 0;
+        StopPrefetch = true;
+    }
+    PrefetchWake.notify_one();
+    if (PrefetchThread.joinable())
+        PrefetchThread.join();
+    StopPrefetch = false;
+}
+
+int64_t FFMS_AudioSource::NextPrefetchSample() {
+    // Nothing is decoded ahead of the first request, which has to cache the
+    // beginning first anyway
+    if (!PrefetchBytes || ReadEnd == PrefetchFailedAt || Cache.empty() || !BytesPerSample)
+        return -1;
+
+    // Prefetching more than half of the cache would evict what was just
+    // prefetched before it's read
+    const size_t WindowSamples = std::min(PrefetchBytes / BytesPerSample, Cache.GetMaxBytes() / 2 / CacheBytesPerSample);
+    const int64_t End = std::min(SourceSamples - Delay, ReadEnd + static_cast<int64_t>(WindowSamples));
+    int64_t Sample = std::max<int64_t>(ReadEnd, 0);
+    while (Sample < End) {
+        auto block = Cache.Find(Sample);
+        if (!block)
+            return Sample;
+        Sample = block->Start + block->Samples;
+    }
+    return -1;
+}
+
+void FFMS_AudioSource::PrefetchLoop() {
+    std::unique_lock<std::mutex> Lock(DecodeLock);
+    while (!StopPrefetch) {
+        const int64_t Sample = WaitingCallers ? -1 : NextPrefetchSample();
+        if (Sample < 0) {
+            PrefetchWake.wait(Lock);
+            continue;
+        }
+
+        // Only a single packet is decoded at a time so that callers never
+        // wait long for the lock. Seeking is the exception, as Seek may have
+        // to decode packets to find out where it landed, and stopping half
+        // way would leave the decoder at an unknown position. A request
+        // elsewhere moves ReadEnd, which cancels decoding towards the old
+        // position and seeks if needed.
+        try {
+            SeekTowards(Sample);
+            DecodeNextBlock(true);
+            if (CurrentSample > Sample && !Cache.Find(Sample))
+                PrefetchFailedAt = ReadEnd;
+        } catch (...) {
+            // The next request runs into the same error and reports it
+            PrefetchFailedAt = ReadEnd;
+        }
+    }
+}
+
+FFMS_AudioSource::DecoderLock::DecoderLock(FFMS_AudioSource &Source)
+    : Source(Source) {
+    ++Source.WaitingCallers;
+    Lock = std::unique_lock<std::mutex>(Source.DecodeLock);
+    --Source.WaitingCallers;
+}
+
+FFMS_AudioSource::DecoderLock::~DecoderLock() {
+    Lock.unlock();
+    Source.PrefetchWake.notify_one();
+}
+
 size_t FFMS_AudioSource::GetSeekablePacketNumber(FFMS_Track const& Frames, size_t PacketNumber) {
     // Packets don't always have unique PTSes, so we may not be able to
     // uniquely identify the packet we want. This function attempts to find
@@ -459,7 +791,7 @@ size_t FFMS_AudioSource::GetSeekablePacketNumber(FFMS_Track const& Frames, size_
 
 void FFMS_AudioSource::OpenFile() {
     avcodec_free_context(&CodecContext);
-    avformat_close_input(&FormatContext);
+    LAVFCloseFile(FormatContext);
 
     LAVFOpenFile(SourceFile.c_str(), FormatContext, TrackNumber);
 
@@ -485,10 +817,11 @@ void FFMS_AudioSource::OpenFile() {
 void FFMS_AudioSource::Free() {
     av_frame_free(&DecodeFrame);
     avcodec_free_context(&CodecContext);
-    avformat_close_input(&FormatContext);
+    LAVFCloseFile(FormatContext);
 }
 
 FFMS_AudioSource::~FFMS_AudioSource() {
+    StopPrefetchThread();
     Free();
 }
 
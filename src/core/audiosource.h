@@ -21,62 +21,41 @@
 #ifndef FFAUDIOSOURCE_H
 #define FFAUDIOSOURCE_H
 
+#include "audiocache.h"
+#include "sampleconvert.h"
 #include "utils.h"
 #include "track.h"
 
-#include <list>
-#include <vector>
 #include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-struct FFMS_AudioSource {
-    struct AudioBlock {
-        struct Free {
-            void operator()(uint8_t *ptr) const {
-                free(ptr);
-            }
-        };
-
-        int64_t Age;
-        int64_t Start;
-        int64_t Samples = 0;
-        size_t DataSize = 0;
-        std::unique_ptr<uint8_t, Free> Data;
-
-        AudioBlock(int64_t Start)
-            : Start(Start) {
-            static std::atomic<int64_t> Now{ 0 };
-            Age = Now++;
-        }
-
-        uint8_t *Grow(size_t size) {
-            auto ptr = static_cast<uint8_t *>(realloc(Data.get(), DataSize + size));
-            if (!ptr)
-                throw std::bad_alloc();
-            Data.release();
-            Data.reset(ptr);
-            ptr += DataSize;
-            DataSize += size;
-            return ptr;
-        }
-    };
-    typedef std::list<AudioBlock>::iterator CacheIterator;
+struct FFMS_SegmentedIndex;
+class SegmentedAudio;
 
+struct FFMS_AudioSource {
     AVFormatContext *FormatContext = nullptr;
     int64_t LastValidTS;
     std::string SourceFile;
 
     // delay in samples to apply to the audio
     int64_t Delay = 0;
-    // cache of decoded audio blocks
-    std::list<AudioBlock> Cache;
-    // max size of the cache in blocks
-    size_t MaxCacheBlocks = 50;
-    // pointer to last element of the cache which should never be deleted
-    CacheIterator CacheNoDelete;
+    // cache of decoded audio blocks, which are in the decoder's format and
+    // only converted to the output format on the way out, so that changing
+    // the output format keeps them. Blocks of planar audio hold each
+    // channel's samples one after another.
+    AudioCache Cache;
+    AVSampleFormat CacheFormat = AV_SAMPLE_FMT_NONE;
+    bool CachePlanar = false;
+    // Bytes per sample * number of channels in the cache
+    size_t CacheBytesPerSample = 0;
     // bytes per sample * number of channels, *after* resampling if applicable
     size_t BytesPerSample = 0;
-
-    bool NeedsResample = false;
+    int OutputChannels = 0;
+    AVSampleFormat OutputFormat = AV_SAMPLE_FMT_NONE;
 
     struct SwrFreeWrapper {
         void operator()(SwrContext *c) const {
@@ -85,17 +64,119 @@ struct FFMS_AudioSource {
     };
 
     typedef std::unique_ptr<SwrContext, SwrFreeWrapper> FFResampleContext;
+    // Convert from the cache format to the interleaved and to the planar
+    // output format, either with swresample or, for the simple cases, with
+    // a SampleConverter. Both are unset if the formats are the same.
     FFResampleContext ResampleContext;
+    FFResampleContext PlanarContext;
+    std::unique_ptr<SampleConverter> Converter;
+    std::unique_ptr<SampleConverter> PlanarConverter;
+    // The options last passed to SetOutputFormat, since there may not be
+    // any context to read them back from
+    std::unique_ptr<FFMS_ResampleOptions> OutputOptions;
+    // Set up the conversion from the cache format to Format
+    void SetupConversion(FFMS_ResampleOptions const& opt, AVSampleFormat Format, FFResampleContext &Context, std::unique_ptr<SampleConverter> &Conv);
+
+    // Where audio is written to, either one interleaved buffer or one buffer
+    // per channel
+    struct AudioOutput {
+        std::vector<uint8_t *> Planes;
+        // Bytes per sample in each plane
+        size_t SampleBytes;
+        bool Planar;
+
+        void Skip(int64_t Samples);
+    };
+    AudioOutput OutputTo(void *const *Planes, bool Planar) const;
+    // Output to Buffer, resized to hold Samples samples
+    AudioOutput ScratchOutput(std::vector<uint8_t> &Buffer, bool Planar, int64_t Samples) const;
+
+    // Sample rate conversion, which happens on the way out of the cache
+    // since it can't be done one packet at a time. Unset if the output has
+    // the same rate as the source. It's fed planar audio, and its output is
+    // planar if the last request was.
+    FFResampleContext RateContext;
+    bool RatePlanar = false;
+    // Rate and number of samples, including the delay, of the source
+    int SourceSampleRate = 0;
+    int64_t SourceSamples = 0;
+    // Next sample RateContext outputs and next source sample it is fed
+    int64_t RateOutputPos = -1;
+    int64_t RateInputPos = 0;
+    std::vector<uint8_t> RateInput;
+    std::vector<uint8_t> RateDiscard;
+
+    // Range check and dispatch of both GetAudio and GetAudioPlanar
+    void GetOutputAudio(AudioOutput const& Dst, int64_t Start, int64_t Count);
+    // Samples at the source rate, in the output format
+    void GetSourceAudio(AudioOutput Dst, int64_t Start, int64_t Count);
+    // Samples at the output rate
+    void GetResampledAudio(AudioOutput Dst, int64_t Start, int64_t Count);
+    // Take the next Count samples from RateContext
+    void ConvertRate(AudioOutput Dst, int64_t Count);
 
     // Insert the current audio frame into the cache
-    AudioBlock *CacheBlock(CacheIterator &pos);
+    AudioCache::Block *CacheBlock();
+
+    // Pointers to each plane of the cached audio in Block from sample Offset
+    const uint8_t **BlockPlanes(AudioCache::Block const& Block, int64_t Offset);
+    std::vector<const uint8_t *> SourcePlanes;
+    // Convert Count samples in the cache format to the output format
+    void ConvertOutput(AudioOutput const& Dst, const uint8_t **Src, int64_t Count);
+    // Write Missing samples of SampleBytes each of padding to Pad, which
+    // follows Available samples of decoded audio
+    void FillPadding(uint8_t *Pad, int64_t Missing, int64_t Available, size_t SampleBytes);
+
+    // Where DecodeNextBlock writes a packet instead of caching it, if the
+    // packet starts at Start and fits within Count samples
+    struct DirectOutput {
+        AudioOutput const& Dst;
+        int64_t Start;
+        int64_t Count;
+        // Samples written to Dst, including padding
+        int64_t Written;
+    };
 
-    // Interleave the current audio frame and insert it into the cache
-    void ResampleAndCache(CacheIterator pos);
+    // End of the previous request and how many bytes have been requested
+    // back to back up to it, used to recognize sequential reads
+    int64_t SequentialEnd = -1;
+    int64_t SequentialBytes = 0;
 
     // Cache the unseekable beginning of the file once the output format is set
     void CacheBeginning();
 
+    // Seek if Start is behind the decoder or far ahead of it, so that
+    // decoding on reaches Start
+    void SeekTowards(int64_t Start);
+
+    // Held by whoever uses the decoder or the cache, which is either a
+    // caller of the public functions or the prefetch thread
+    std::mutex DecodeLock;
+    // Callers waiting for DecodeLock, which the prefetch thread yields to
+    std::atomic<int> WaitingCallers{0};
+    // Holds DecodeLock and wakes the prefetch thread once released
+    class DecoderLock {
+        FFMS_AudioSource &Source;
+        std::unique_lock<std::mutex> Lock;
+    public:
+        explicit DecoderLock(FFMS_AudioSource &Source);
+        ~DecoderLock();
+    };
+
+    // The prefetch thread decodes up to PrefetchBytes of audio following
+    // ReadEnd, the end of the last request, into the cache
+    std::thread PrefetchThread;
+    std::condition_variable PrefetchWake;
+    size_t PrefetchBytes = 0;
+    bool StopPrefetch = false;
+    int64_t ReadEnd = 0;
+    // Prefetching stops after an error until the next request moves ReadEnd
+    int64_t PrefetchFailedAt = -1;
+    void PrefetchLoop();
+    void StopPrefetchThread();
+    // The first sample in the prefetch window which isn't cached, or -1
+    int64_t NextPrefetchSample();
+
     // Called after seeking
     void Seek();
     // Read the next packet from the file
@@ -112,7 +193,7 @@ struct FFMS_AudioSource {
     // Next packet to be read
     size_t PacketNumber = 0;
     // Current audio frame
-    const FrameInfo *CurrentFrame = nullptr;
+    FrameInfo CurrentFrame{};
     // Track which this corresponds to
     int TrackNumber;
     // Number of packets which the demuxer requires to know where it is
@@ -124,8 +205,10 @@ struct FFMS_AudioSource {
     FFMS_Track Frames;
     AVCodecContext *CodecContext = nullptr;
     FFMS_AudioProperties AP = {};
+    // Set if the audio comes from the sources of a segmented index instead
+    std::unique_ptr<SegmentedAudio> Segments;
 
-    int DecodeNextBlock(CacheIterator *cachePos = 0);
+    int DecodeNextBlock(bool UseCache = false, DirectOutput *Direct = nullptr);
     // Initialization which has to be done after the codec is opened
     void Init(const FFMS_Index &Index, int DelayMode);
 
@@ -134,10 +217,14 @@ struct FFMS_AudioSource {
     void Free();
 public:
     FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, int Track, int DelayMode);
+    FFMS_AudioSource(FFMS_SegmentedIndex &Index, int Track, int DelayMode, int MaxOpenSegments);
     ~FFMS_AudioSource();
     FFMS_Track *GetTrack() { return &Frames; }
     const FFMS_AudioProperties& GetAudioProperties() const { return AP; }
     void GetAudio(void *Buf, int64_t Start, int64_t Count);
+    void GetAudioPlanar(void **Planes, int64_t Start, int64_t Count);
+    void SetCacheSize(size_t Bytes);
+    void SetPrefetch(size_t Bytes);
 
     std::unique_ptr<FFMS_ResampleOptions> CreateResampleOptions() const;
     void SetOutputFormat(FFMS_ResampleOptions const& opt);
@@ -20,10 +20,16 @@
 
 #include "ffms.h"
 
+#include "audioextract.h"
 #include "audiosource.h"
 #include "indexing.h"
+#include "indexserver.h"
+#include "input.h"
+#include "segments.h"
+#include "trackexport.h"
 #include "videosource.h"
 #include "videoutils.h"
+#include "waveform.h"
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -31,8 +37,10 @@ extern "C" {
 }
 
 #include <mutex>
+#include <new>
 #include <sstream>
 #include <iomanip>
+#include <system_error>
 
 #ifdef FFMS_WIN_DEBUG
 #	include <windows.h>
@@ -135,6 +143,26 @@ FFMS_API(FFMS_AudioSource *) FFMS_CreateAudioSource(const char *SourceFile, int
     }
 }
 
+FFMS_API(FFMS_VideoSource *) FFMS_CreateSegmentedVideoSource(FFMS_SegmentedIndex *Index, int Track, int Threads, int SeekMode, int MaxOpenSegments, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        return new FFMS_VideoSource(*Index, Track, Threads, SeekMode, MaxOpenSegments);
+    } catch (FFMS_Exception &e) {
+        e.CopyOut(ErrorInfo);
+        return nullptr;
+    }
+}
+
+FFMS_API(FFMS_AudioSource *) FFMS_CreateSegmentedAudioSource(FFMS_SegmentedIndex *Index, int Track, int DelayMode, int MaxOpenSegments, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        return new FFMS_AudioSource(*Index, Track, DelayMode, MaxOpenSegments);
+    } catch (FFMS_Exception &e) {
+        e.CopyOut(ErrorInfo);
+        return nullptr;
+    }
+}
+
 FFMS_API(void) FFMS_DestroyVideoSource(FFMS_VideoSource *V) {
     delete V;
 }
@@ -181,6 +209,54 @@ FFMS_API(int) FFMS_GetAudio(FFMS_AudioSource *A, void *Buf, int64_t Start, int64
     return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(int) FFMS_GetAudioPlanar(FFMS_AudioSource *A, void **Planes, int64_t Start, int64_t Count, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        A->GetAudioPlanar(Planes, Start, Count);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(void) FFMS_SetAudioCacheSize(FFMS_AudioSource *A, int64_t Bytes) {
+    if (Bytes < 0)
+        Bytes = 0;
+    A->SetCacheSize(static_cast<uint64_t>(Bytes) > SIZE_MAX ? SIZE_MAX : static_cast<size_t>(Bytes));
+}
+
+FFMS_API(int) FFMS_SetAudioPrefetch(FFMS_AudioSource *A, int64_t Bytes, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    if (Bytes < 0)
+        Bytes = 0;
+    try {
+        A->SetPrefetch(static_cast<uint64_t>(Bytes) > SIZE_MAX ? SIZE_MAX : static_cast<size_t>(Bytes));
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_ExtractAudio(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, int Threads, void *Buf, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        ExtractAudio(SourceFile, *Index, Track, DelayMode, Threads, Buf);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_ExtractAudioToFile(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, int Threads, const char *OutputFile, int Format, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        ExtractAudioToFile(SourceFile, *Index, Track, DelayMode, Threads, OutputFile, Format);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(int) FFMS_SetOutputFormatV2(FFMS_VideoSource *V, const int *TargetFormats, int Width, int Height, int Resizer, FFMS_ErrorInfo *ErrorInfo) {
     ClearErrorInfo(ErrorInfo);
     try {
@@ -268,6 +344,41 @@ FFMS_API(int) FFMS_GetNumTracks(FFMS_Index *Index) {
     return static_cast<int>(Index->size());
 }
 
+FFMS_API(int) FFMS_GetIndexingStats(FFMS_Index *Index, int Track, FFMS_IndexingStats *Stats, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        if (Track < -1 || Track >= static_cast<int>(Index->size()))
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "Invalid track number");
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+
+    IndexingStats const& S = Index->Stats;
+    *Stats = {};
+    std::vector<TrackIndexingStats> Tracks = S.Tracks;
+    Tracks.resize(Index->size());
+    for (int i = 0; i < static_cast<int>(Tracks.size()); i++) {
+        if (Track != -1 && Track != i)
+            continue;
+        Stats->Packets += Tracks[i].Packets;
+        Stats->ParserCalls += Tracks[i].ParserCalls;
+        Stats->DecodeCalls += Tracks[i].DecodeCalls;
+        Stats->ParseTime += Tracks[i].ParseTime;
+        Stats->DecodeTime += Tracks[i].DecodeTime;
+    }
+    if (Track == -1) {
+        Stats->TotalTime = S.TotalTime;
+        Stats->DemuxTime = S.DemuxTime;
+        Stats->FinalizeTime = S.FinalizeTime;
+        Stats->WriteTime = S.WriteTime;
+        Stats->BytesRead = S.BytesRead;
+        Stats->BytesWritten = S.BytesWritten;
+        Stats->FromContainer = S.FromContainer;
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(int) FFMS_GetNumTracksI(FFMS_Indexer *Indexer) {
     return Indexer->GetNumberOfTracks();
 }
@@ -318,6 +429,33 @@ FFMS_API(int) FFMS_WriteTimecodes(FFMS_Track *T, const char *TimecodeFile, FFMS_
     return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(int) FFMS_ExportTrack(FFMS_Track *T, const char *File, int Format, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        ExportTrack(*T, File, Format);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(const FFMS_WaveformProperties *) FFMS_GetWaveformProperties(FFMS_Track *T) {
+    return T->Waveform ? &T->Waveform->GetProperties() : nullptr;
+}
+
+FFMS_API(int) FFMS_GetWaveform(FFMS_Track *T, int64_t Start, int64_t Count, int Points, FFMS_WaveformPoint *Dst, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        if (!T->Waveform)
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "The track has no waveform summary");
+        T->Waveform->GetWaveform(Start, Count, Points, Dst);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(FFMS_Indexer *) FFMS_CreateIndexer(const char *SourceFile, FFMS_ErrorInfo *ErrorInfo) {
     ClearErrorInfo(ErrorInfo);
     try {
@@ -355,6 +493,56 @@ FFMS_API(void) FFMS_SetProgressCallback(FFMS_Indexer *Indexer, TIndexCallback IC
     Indexer->SetProgressCallback(IC, ICPrivate);
 }
 
+FFMS_API(void) FFMS_SetIndexingThreads(FFMS_Indexer *Indexer, int Threads) {
+    Indexer->SetThreads(Threads);
+}
+
+FFMS_API(void) FFMS_SetIndexingFlags(FFMS_Indexer *Indexer, int Flags) {
+    Indexer->SetFlags(Flags);
+}
+
+FFMS_API(void) FFMS_SetProgressCallback2(FFMS_Indexer *Indexer, TIndexProgressCallback IC, void *ICPrivate) {
+    Indexer->SetProgressCallback2(IC, ICPrivate);
+}
+
+FFMS_API(void) FFMS_SetIndexingReadAhead(FFMS_Indexer *Indexer, int64_t BufferSize) {
+    Indexer->SetReadAheadSize(BufferSize);
+}
+
+FFMS_API(int) FFMS_RegisterInput(const char *Name, const FFMS_IOCallbacks *Callbacks, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        if (!Callbacks || !Callbacks->Read || !Callbacks->Size)
+            throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_INVALID_ARGUMENT,
+                "The read and size callbacks are required");
+        RegisterCallbackInput(Name, *Callbacks);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_RegisterMemoryInput(const char *Name, const uint8_t *Buffer, int64_t Size, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        if (!Buffer || Size < 0)
+            throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_INVALID_ARGUMENT,
+                "Invalid buffer");
+        RegisterMemoryInput(Name, Buffer, Size);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(void) FFMS_UnregisterInput(const char *Name) {
+    UnregisterInput(Name);
+}
+
+FFMS_API(void) FFMS_SetIndexServer(const char *SocketPath) {
+    SetIndexServer(SocketPath);
+}
+
 FFMS_API(void) FFMS_CancelIndexing(FFMS_Indexer *Indexer) {
     delete Indexer;
 }
@@ -379,6 +567,18 @@ FFMS_API(FFMS_Index *) FFMS_ReadIndexFromBuffer(const uint8_t *Buffer, size_t Si
     }
 }
 
+FFMS_API(FFMS_Index *) FFMS_ReadIndexCompat(const char *IndexFile, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        std::unique_ptr<FFMS_Index> Index(new FFMS_Index(IndexFile, true));
+        Index->RevalidateTracks(SourceFile);
+        return Index.release();
+    } catch (FFMS_Exception &e) {
+        e.CopyOut(ErrorInfo);
+        return nullptr;
+    }
+}
+
 FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo) {
     ClearErrorInfo(ErrorInfo);
     try {
@@ -391,6 +591,54 @@ FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile,
     return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(int) FFMS_GetFileSignature(const char *SourceFile, int64_t *Filesize, uint8_t *Digest, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        FFMS_Index::CalculateFileSignature(SourceFile, Filesize, Digest);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(FFMS_SegmentedIndex *) FFMS_CreateSegmentedIndex(const char **SourceFiles, FFMS_Index **Indexes, int NumSegments, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        return new FFMS_SegmentedIndex(SourceFiles, Indexes, NumSegments);
+    } catch (FFMS_Exception &e) {
+        e.CopyOut(ErrorInfo);
+        return nullptr;
+    }
+}
+
+FFMS_API(void) FFMS_DestroySegmentedIndex(FFMS_SegmentedIndex *Index) {
+    delete Index;
+}
+
+FFMS_API(FFMS_Track *) FFMS_GetTrackFromSegmentedIndex(FFMS_SegmentedIndex *Index, int Track) {
+    return &Index->Tracks[Track];
+}
+
+FFMS_API(int) FFMS_UpgradeIndex(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        Index->UpgradeKeyFrameTracks(SourceFile);
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_IndexAdditionalTracks(FFMS_Index *Index, const char *SourceFile, const int *Tracks, int NumTracks, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        Index->AddTracks(SourceFile, std::set<int>(Tracks, NumTracks > 0 ? Tracks + NumTracks : Tracks));
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo) {
     ClearErrorInfo(ErrorInfo);
     try {
@@ -401,6 +649,36 @@ FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_Err
     return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(FFMS_IndexWriter *) FFMS_WriteIndexAsync(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    try {
+        return new FFMS_IndexWriter(*Index, IndexFile);
+    } catch (FFMS_Exception &e) {
+        e.CopyOut(ErrorInfo);
+    } catch (std::bad_alloc const&) {
+        FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+            "Could not copy the index for writing").CopyOut(ErrorInfo);
+    } catch (std::system_error const&) {
+        FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+            "Could not start the index writing thread").CopyOut(ErrorInfo);
+    }
+    return nullptr;
+}
+
+FFMS_API(int) FFMS_FinishIndexWrite(FFMS_IndexWriter *Writer, FFMS_ErrorInfo *ErrorInfo) {
+    ClearErrorInfo(ErrorInfo);
+    std::unique_ptr<FFMS_IndexWriter> Owner(Writer);
+    try {
+        if (!Writer)
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "No index write to finish");
+        Writer->Finish();
+    } catch (FFMS_Exception &e) {
+        return e.CopyOut(ErrorInfo);
+    }
+    return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(int) FFMS_WriteIndexToBuffer(uint8_t **BufferPtr, size_t *Size, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo) {
     ClearErrorInfo(ErrorInfo);
     uint8_t *buf;
@@ -88,6 +88,13 @@ size_t FileHandle::Write(const char *buffer, size_t size) {
     return size;
 }
 
+void FileHandle::Flush() {
+    avio_flush(avio);
+    if (avio->error < 0)
+        throw FFMS_Exception(error_source, FFMS_ERROR_FILE_WRITE,
+            "Failed to write to '" + filename + "'");
+}
+
 int64_t FileHandle::Size() {
     int64_t size = avio_size(avio);
     if (size < 0)
@@ -112,7 +119,6 @@ int FileHandle::Printf(const char *fmt, ...) {
     va_end(args);
 
     avio_write(avio, reinterpret_cast<const unsigned char *>(OutBuffer.data()), ret);
-    avio_flush(avio);
 
     return avio->error < 0 ? avio->error : ret;
 }
@@ -42,6 +42,8 @@ public:
 
     size_t Read(char *buffer, size_t size);
     size_t Write(const char *buffer, size_t size);
+    // Output is buffered, so write errors may only show up here
+    void Flush();
     int Printf(const char *fmt, ...)
 #ifdef __GNUC__
     __attribute__((format(printf, 2, 3)))
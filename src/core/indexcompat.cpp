@@ -0,0 +1,176 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// Reuse of indexes made with other FFmpeg versions.
+//
+// What an index holds only changes with the FFmpeg version if libavformat
+// starts demuxing the file differently: other stream parameters, made up
+// timestamps, split or merged packets, or other keyframe flags. So instead of
+// throwing the whole index away, each track is compared against what the
+// running libraries produce at its start, at its end and at a handful of
+// keyframes spread over the file. Only the tracks which differ anywhere get
+// indexed again.
+
+#include "indexing.h"
+
+#include "track.h"
+
+#include <algorithm>
+
+namespace {
+// Frames compared at the start and at the end of every track
+const size_t EdgeFrames = 8;
+// Keyframes in between which are seeked to and compared
+const size_t SpotKeyFrames = 8;
+// Packets which may be read after a seek before reaching the expected one,
+// and audio packets which may be skipped since packets without samples
+// aren't indexed
+const int MaxSkippedPackets = 1024;
+
+FrameInfo DecodeOrderFrame(FFMS_Track const& Track, size_t N) {
+    return Track.TT == FFMS_TYPE_VIDEO ? Track[Track[N].OriginalPos] : Track[N];
+}
+
+int64_t IndexedTS(FFMS_Track const& Track, FrameInfo const& Frame) {
+    // The video frame timestamps may have been reordered and audio ones
+    // shifted past discontinuities after reading them
+    if (Track.TT == FFMS_TYPE_VIDEO || Track.HasDiscontTS)
+        return Frame.OriginalPTS;
+    return Frame.PTS;
+}
+
+bool SamePacket(FFMS_Track const& Track, FrameInfo const& Frame, AVPacket const& Packet) {
+    if (Packet.pos != Frame.FilePos)
+        return false;
+    if (!!(Packet.flags & AV_PKT_FLAG_KEY) != Frame.KeyFrame)
+        return false;
+    int64_t TS = Track.UseDTS ? Packet.dts : Packet.pts;
+    return TS == AV_NOPTS_VALUE || TS == IndexedTS(Track, Frame);
+}
+
+// Reads on from the current position (or from Frame First when Seek is set)
+// and checks that frames First to First + Count - 1 show up as indexed
+bool CheckFrames(AVFormatContext *FormatContext, FFMS_Track const& Track, int TrackNumber, size_t First, size_t Count, bool Seek) {
+    if (Seek) {
+        int64_t TS = IndexedTS(Track, DecodeOrderFrame(Track, First));
+        if (av_seek_frame(FormatContext, TrackNumber, TS, AVSEEK_FLAG_BACKWARD) < 0)
+            return false;
+    }
+
+    AVPacket Packet;
+    InitNullPacket(Packet);
+    size_t Next = First;
+    int Skipped = 0;
+    while (Next < First + Count && av_read_frame(FormatContext, &Packet) >= 0) {
+        bool Match = Packet.stream_index == TrackNumber && SamePacket(Track, DecodeOrderFrame(Track, Next), Packet);
+        // Keyframe-only tracks don't know where the other frames are
+        bool Other = Packet.stream_index != TrackNumber || (Track.KeyFramesOnly && !(Packet.flags & AV_PKT_FLAG_KEY));
+        av_packet_unref(&Packet);
+        if (Other)
+            continue;
+        if (Match) {
+            ++Next;
+            continue;
+        }
+        // Once in sync every video packet has to match
+        if ((Next > First && Track.TT == FFMS_TYPE_VIDEO) || ++Skipped > MaxSkippedPackets)
+            return false;
+    }
+    return Next == First + Count;
+}
+
+// Rewind seeks to the start of the track first, when the file has already
+// been read from
+bool CheckTrack(AVFormatContext *FormatContext, FFMS_Track const& Track, int TrackNumber, bool Rewind) {
+    AVCodecParameters *Params = FormatContext->streams[TrackNumber]->codecpar;
+    if (Track.TT != static_cast<FFMS_TrackType>(Params->codec_type) ||
+        Track.CodecName != avcodec_get_name(Params->codec_id) ||
+        Track.CodecWidth != Params->width ||
+        Track.CodecHeight != Params->height ||
+        Track.CodecSampleRate != Params->sample_rate ||
+        Track.CodecChannels != Params->channels)
+        return false;
+
+    const size_t Size = Track.size();
+    if (!CheckFrames(FormatContext, Track, TrackNumber, 0, std::min(EdgeFrames, Size), Rewind))
+        return false;
+
+    // Decoding the end of the track has to start at a keyframe
+    size_t Tail = Size - std::min(EdgeFrames, Size);
+    while (Tail > 0 && !DecodeOrderFrame(Track, Tail).KeyFrame)
+        --Tail;
+    if (Tail > 0 && !CheckFrames(FormatContext, Track, TrackNumber, Tail, Size - Tail, true))
+        return false;
+
+    std::vector<size_t> KeyFrames;
+    for (size_t i = 0; i < Size; i++) {
+        if (DecodeOrderFrame(Track, i).KeyFrame)
+            KeyFrames.push_back(i);
+    }
+    const size_t Spots = std::min(SpotKeyFrames, KeyFrames.size());
+    for (size_t i = 1; i + 1 < Spots; i++) {
+        size_t First = KeyFrames[i * (KeyFrames.size() - 1) / (Spots - 1)];
+        if (!CheckFrames(FormatContext, Track, TrackNumber, First, std::min<size_t>(2, Size - First), true))
+            return false;
+    }
+    return true;
+}
+}
+
+void FFMS_Index::RevalidateTracks(const char *SourceFile) {
+    if (!OtherLibraryVersions)
+        return;
+
+    if (!CompareFileSignature(SourceFile))
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+            "The index does not belong to the file");
+
+    // One opened file serves all tracks, with only the one being checked
+    // read and a seek back to its start for all but the first
+    AVFormatContext *FormatContext = nullptr;
+    LAVFOpenFile(SourceFile, FormatContext, -1);
+    std::set<int> Failed;
+    try {
+        if (FormatContext->nb_streams != size())
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+                "The file has a different number of tracks than the index");
+        const bool SameFormat = FormatName == FormatContext->iformat->name;
+
+        bool Rewind = false;
+        for (int i = 0; i < static_cast<int>(size()); i++) {
+            // Tracks which weren't indexed stay that way
+            if ((*this)[i].empty())
+                continue;
+
+            for (int j = 0; j < static_cast<int>(size()); j++)
+                FormatContext->streams[j]->discard = j == i ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+            if (!SameFormat || !CheckTrack(FormatContext, (*this)[i], i, Rewind))
+                Failed.insert(i);
+            Rewind = true;
+        }
+    } catch (...) {
+        LAVFCloseFile(FormatContext);
+        throw;
+    }
+    LAVFCloseFile(FormatContext);
+
+    ReindexTracks(SourceFile, Failed);
+    OtherLibraryVersions = false;
+}
@@ -20,14 +20,19 @@
 
 #include "indexing.h"
 
+#include "indexserver.h"
+#include "input.h"
+#include "readahead.h"
 #include "track.h"
 #include "videoutils.h"
+#include "waveform.h"
 #include "zipfile.h"
 
 #include <algorithm>
 #include <limits>
 #include <numeric>
 #include <sstream>
+#include <thread>
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -35,7 +40,7 @@ extern "C" {
 }
 
 #define INDEXID 0x53920873
-#define INDEX_VERSION 5
+#define INDEX_VERSION 8
 
 SharedAVContext::~SharedAVContext() {
     avcodec_free_context(&CodecContext);
@@ -43,22 +48,78 @@ SharedAVContext::~SharedAVContext() {
         av_parser_close(Parser);
 }
 
+IndexingPass::IndexingPass(AVFormatContext *FormatContext, bool Partial)
+    : FormatContext(FormatContext)
+    , AVContexts(FormatContext->nb_streams)
+    , LastValidTS(FormatContext->nb_streams, AV_NOPTS_VALUE)
+    , Partial(Partial)
+    , TrackStats(FormatContext->nb_streams) {
+    DecodeFrame = av_frame_alloc();
+    if (!DecodeFrame)
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
+            "Couldn't allocate frame");
+}
+
+IndexingPass::~IndexingPass() {
+    av_frame_free(&DecodeFrame);
+}
+
+bool IndexingPass::ReadPacket(AVPacket &Packet) {
+    ScopedTimer Timer(DemuxTime);
+    return av_read_frame(FormatContext, &Packet) >= 0;
+}
+
+void IndexingStats::Add(IndexingPass const& Pass) {
+    Tracks.resize(std::max(Tracks.size(), Pass.TrackStats.size()));
+    for (size_t i = 0; i < Pass.TrackStats.size(); i++) {
+        TrackIndexingStats &Track = Tracks[i];
+        TrackIndexingStats const& PassTrack = Pass.TrackStats[i];
+        Track.Packets += PassTrack.Packets;
+        Track.ParserCalls += PassTrack.ParserCalls;
+        Track.DecodeCalls += PassTrack.DecodeCalls;
+        Track.ParseTime += PassTrack.ParseTime;
+        Track.DecodeTime += PassTrack.DecodeTime;
+    }
+    DemuxTime += Pass.DemuxTime;
+    // FormatContext->pb can apparently be NULL when opening images
+    if (Pass.FormatContext->pb)
+        BytesRead += Pass.FormatContext->pb->bytes_read;
+}
+
+void IndexingStats::Add(IndexingStats const& Other) {
+    Tracks.resize(std::max(Tracks.size(), Other.Tracks.size()));
+    for (size_t i = 0; i < Other.Tracks.size(); i++) {
+        Tracks[i].Packets += Other.Tracks[i].Packets;
+        Tracks[i].ParserCalls += Other.Tracks[i].ParserCalls;
+        Tracks[i].DecodeCalls += Other.Tracks[i].DecodeCalls;
+        Tracks[i].ParseTime += Other.Tracks[i].ParseTime;
+        Tracks[i].DecodeTime += Other.Tracks[i].DecodeTime;
+    }
+    TotalTime += Other.TotalTime;
+    DemuxTime += Other.DemuxTime;
+    FinalizeTime += Other.FinalizeTime;
+    WriteTime += Other.WriteTime;
+    BytesRead += Other.BytesRead;
+    BytesWritten += Other.BytesWritten;
+}
+
 void FFMS_Index::CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20]) {
-    FileHandle file(Filename, "rb", FFMS_ERROR_INDEX, FFMS_ERROR_FILE_READ);
+    std::shared_ptr<InputSource> Input = FindRegisteredInput(Filename);
+    if (!Input)
+        Input = OpenFileInput(Filename, FFMS_ERROR_INDEX);
 
     std::unique_ptr<AVSHA, decltype(&av_free)> ctx{ av_sha_alloc(), av_free };
     av_sha_init(ctx.get(), 160);
 
     try {
-        *Filesize = file.Size();
-        std::vector<char> FileBuffer(static_cast<size_t>(std::min<int64_t>(1024 * 1024, *Filesize)));
-        size_t BytesRead = file.Read(FileBuffer.data(), FileBuffer.size());
-        av_sha_update(ctx.get(), reinterpret_cast<const uint8_t*>(FileBuffer.data()), BytesRead);
+        *Filesize = Input->Size();
+        std::vector<uint8_t> FileBuffer(static_cast<size_t>(std::min<int64_t>(1024 * 1024, *Filesize)));
+        size_t BytesRead = Input->Read(0, FileBuffer.data(), FileBuffer.size());
+        av_sha_update(ctx.get(), FileBuffer.data(), BytesRead);
 
         if (*Filesize > static_cast<int64_t>(FileBuffer.size())) {
-            file.Seek(*Filesize - static_cast<int64_t>(FileBuffer.size()), SEEK_SET);
-            BytesRead = file.Read(FileBuffer.data(), FileBuffer.size());
-            av_sha_update(ctx.get(), reinterpret_cast<const uint8_t*>(FileBuffer.data()), BytesRead);
+            BytesRead = Input->Read(*Filesize - static_cast<int64_t>(FileBuffer.size()), FileBuffer.data(), FileBuffer.size());
+            av_sha_update(ctx.get(), FileBuffer.data(), BytesRead);
         }
     } catch (...) {
         av_sha_final(ctx.get(), Digest);
@@ -67,9 +128,19 @@ void FFMS_Index::CalculateFileSignature(const char *Filename, int64_t *Filesize,
     av_sha_final(ctx.get(), Digest);
 }
 
-void FFMS_Index::Finalize(std::vector<SharedAVContext> const& video_contexts, const char *Format) {
+void FFMS_Index::Finalize(std::vector<SharedAVContext> const& video_contexts, AVFormatContext *FormatContext) {
+    ScopedTimer Timer(Stats.FinalizeTime);
+    const char *Format = FormatContext->iformat->name;
+    FormatName = Format;
     for (size_t i = 0, end = size(); i != end; ++i) {
         FFMS_Track& track = (*this)[i];
+        AVCodecParameters *Params = FormatContext->streams[i]->codecpar;
+        track.CodecName = avcodec_get_name(Params->codec_id);
+        track.CodecWidth = Params->width;
+        track.CodecHeight = Params->height;
+        track.CodecSampleRate = Params->sample_rate;
+        track.CodecChannels = Params->channels;
+
         // H.264 PAFF needs to have some frames hidden
         //
         // Don't send any WMV/ASF files, since they (as far as we know) cannot contain PAFF,
@@ -77,6 +148,8 @@ void FFMS_Index::Finalize(std::vector<SharedAVContext> const& video_contexts, co
         if (video_contexts[i].CodecContext && video_contexts[i].CodecContext->codec_id == AV_CODEC_ID_H264 && !!strcmp(Format, "asf"))
             track.MaybeHideFrames();
         track.FinalizeTrack();
+        if (track.Waveform)
+            track.Waveform->Finish();
 
         if (track.TT != FFMS_TYPE_VIDEO) continue;
 
@@ -97,6 +170,64 @@ void FFMS_Index::Finalize(std::vector<SharedAVContext> const& video_contexts, co
     }
 }
 
+void FFMS_Index::ReindexTracks(const char *SourceFile, std::set<int> const& Tracks) {
+    if (Tracks.empty())
+        return;
+
+    FFMS_Indexer Indexer(SourceFile);
+    for (int i = 0; i < Indexer.GetNumberOfTracks(); i++)
+        Indexer.SetIndexTrack(i, !!Tracks.count(i));
+    Indexer.SetErrorHandling(ErrorHandling);
+    // Keep making waveform summaries if the index has them
+    for (FFMS_Track const& Track : *this) {
+        if (Track.Waveform)
+            Indexer.SetFlags(FFMS_INDEX_FLAG_WAVEFORM);
+    }
+    std::unique_ptr<FFMS_Index> New(Indexer.DoIndexing());
+    if (New->size() != size())
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+            "The file has a different number of tracks than the index");
+
+    for (int Track : Tracks)
+        (*this)[Track] = (*New)[Track];
+    FormatName = New->FormatName;
+}
+
+void FFMS_Index::UpgradeKeyFrameTracks(const char *SourceFile) {
+    std::set<int> Tracks;
+    for (size_t i = 0; i < size(); i++) {
+        if ((*this)[i].KeyFramesOnly)
+            Tracks.insert(static_cast<int>(i));
+    }
+    if (Tracks.empty())
+        return;
+
+    if (!CompareFileSignature(SourceFile))
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+            "The index does not belong to the file");
+
+    ReindexTracks(SourceFile, Tracks);
+}
+
+void FFMS_Index::AddTracks(const char *SourceFile, std::set<int> const& Tracks) {
+    std::set<int> Missing;
+    for (int Track : Tracks) {
+        if (Track < 0 || Track >= static_cast<int>(size()))
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "Invalid track number");
+        if ((*this)[Track].empty())
+            Missing.insert(Track);
+    }
+    if (Missing.empty())
+        return;
+
+    if (!CompareFileSignature(SourceFile))
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+            "The index does not belong to the file");
+
+    ReindexTracks(SourceFile, Missing);
+}
+
 bool FFMS_Index::CompareFileSignature(const char *Filename) {
     int64_t CFilesize;
     uint8_t CDigest[20];
@@ -105,6 +236,9 @@ bool FFMS_Index::CompareFileSignature(const char *Filename) {
 }
 
 void FFMS_Index::WriteIndex(ZipFile &zf) {
+    Stats.WriteTime = 0;
+    ScopedTimer Timer(Stats.WriteTime);
+
     // Write the index file header
     zf.Write<uint32_t>(INDEXID);
     zf.Write<uint32_t>(FFMS_VERSION);
@@ -117,17 +251,62 @@ void FFMS_Index::WriteIndex(ZipFile &zf) {
     zf.Write<uint32_t>(swscale_version());
     zf.Write<int64_t>(Filesize);
     zf.Write(Digest);
+    zf.WriteString(FormatName);
 
     for (size_t i = 0; i < size(); ++i)
         at(i).Write(zf);
 
     zf.Finish();
+    Stats.BytesWritten = zf.GetBytesWritten();
 }
 
 void FFMS_Index::WriteIndexFile(const char *IndexFile) {
-    ZipFile zf(IndexFile, "wb");
+    // Write to a temporary file which is then renamed over the index, so
+    // that a crash never leaves a truncated index behind
+    std::string TempFile = TemporaryFileName(IndexFile);
+    try {
+        {
+            ZipFile zf(TempFile.c_str(), "wb");
+            WriteIndex(zf);
+        }
+        RenameOver(TempFile.c_str(), IndexFile);
+    } catch (...) {
+        RemoveFile(TempFile.c_str());
+        throw;
+    }
+}
 
-    WriteIndex(zf);
+std::unique_ptr<FFMS_Index> FFMS_Index::Snapshot() const {
+    auto Copy = make_unique<FFMS_Index>(Filesize, Digest, ErrorHandling);
+    Copy->FormatName = FormatName;
+    Copy->assign(begin(), end());
+    return Copy;
+}
+
+FFMS_IndexWriter::FFMS_IndexWriter(FFMS_Index const& Index, const char *IndexFile)
+    : Index(Index.Snapshot())
+    , IndexFile(IndexFile) {
+    Thread = std::thread([this] {
+        try {
+            this->Index->WriteIndexFile(this->IndexFile.c_str());
+        } catch (FFMS_Exception const&) {
+            Error = std::current_exception();
+        } catch (...) {
+            Error = std::make_exception_ptr(FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_WRITE,
+                "Unknown error while writing '" + this->IndexFile + "'"));
+        }
+    });
+}
+
+FFMS_IndexWriter::~FFMS_IndexWriter() {
+    if (Thread.joinable())
+        Thread.join();
+}
+
+void FFMS_IndexWriter::Finish() {
+    Thread.join();
+    if (Error)
+        std::rethrow_exception(Error);
 }
 
 uint8_t *FFMS_Index::WriteIndexBuffer(size_t *Size) {
@@ -138,7 +317,7 @@ uint8_t *FFMS_Index::WriteIndexBuffer(size_t *Size) {
     return zf.GetBuffer(Size);
 }
 
-void FFMS_Index::ReadIndex(ZipFile &zf, const char *IndexFile) {
+void FFMS_Index::ReadIndex(ZipFile &zf, const char *IndexFile, bool AnyLibraryVersion) {
     // Read the index file header
     if (zf.Read<uint32_t>() != INDEXID)
         throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
@@ -155,15 +334,19 @@ void FFMS_Index::ReadIndex(ZipFile &zf, const char *IndexFile) {
     uint32_t Tracks = zf.Read<uint32_t>();
     ErrorHandling = zf.Read<uint32_t>();
 
-    if (zf.Read<uint32_t>() != avutil_version() ||
-        zf.Read<uint32_t>() != avformat_version() ||
-        zf.Read<uint32_t>() != avcodec_version() ||
-        zf.Read<uint32_t>() != swscale_version())
+    uint32_t Versions[4];
+    zf.Read(Versions, sizeof(Versions));
+    OtherLibraryVersions = Versions[0] != avutil_version() ||
+        Versions[1] != avformat_version() ||
+        Versions[2] != avcodec_version() ||
+        Versions[3] != swscale_version();
+    if (OtherLibraryVersions && !AnyLibraryVersion)
         throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
             std::string("A different FFmpeg build was used to create '") + IndexFile + "'");
 
     Filesize = zf.Read<int64_t>();
     zf.Read(Digest, sizeof(Digest));
+    FormatName = zf.ReadString();
 
     reserve(Tracks);
     try {
@@ -177,19 +360,19 @@ void FFMS_Index::ReadIndex(ZipFile &zf, const char *IndexFile) {
     }
 }
 
-FFMS_Index::FFMS_Index(const char *IndexFile) {
+FFMS_Index::FFMS_Index(const char *IndexFile, bool AnyLibraryVersion) {
     ZipFile zf(IndexFile, "rb");
 
-    ReadIndex(zf, IndexFile);
+    ReadIndex(zf, IndexFile, AnyLibraryVersion);
 }
 
 FFMS_Index::FFMS_Index(const uint8_t *Buffer, size_t Size) {
     ZipFile zf(Buffer, Size);
 
-    ReadIndex(zf, "User supplied buffer");
+    ReadIndex(zf, "User supplied buffer", false);
 }
 
-FFMS_Index::FFMS_Index(int64_t Filesize, uint8_t Digest[20], int ErrorHandling)
+FFMS_Index::FFMS_Index(int64_t Filesize, const uint8_t Digest[20], int ErrorHandling)
     : ErrorHandling(ErrorHandling)
     , Filesize(Filesize) {
     memcpy(this->Digest, Digest, sizeof(this->Digest));
@@ -225,9 +408,47 @@ void FFMS_Indexer::SetErrorHandling(int ErrorHandling_) {
 
 void FFMS_Indexer::SetProgressCallback(TIndexCallback IC_, void *ICPrivate_) {
     IC = IC_;
+    IC2 = nullptr;
     ICPrivate = ICPrivate_;
 }
 
+void FFMS_Indexer::SetProgressCallback2(TIndexProgressCallback IC_, void *ICPrivate_) {
+    IC = nullptr;
+    IC2 = IC_;
+    ICPrivate = ICPrivate_;
+}
+
+void FFMS_Indexer::SetReadAheadSize(int64_t Size) {
+    ReadAheadSize = Size;
+    if (Reader)
+        Reader->SetBlockSize(Size > 0 ? static_cast<size_t>(Size) : ReadAheadReader::DefaultBlockSize);
+}
+
+bool FFMS_Indexer::ReportProgress(int64_t Current, int64_t Total, int64_t BytesRead, double Bandwidth) {
+    if (IC2) {
+        if (Bandwidth < 0) {
+            std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - IndexingStart;
+            Bandwidth = Elapsed.count() > 0 ? BytesRead / Elapsed.count() : 0;
+        }
+        FFMS_IndexProgress Progress = { Current, Total, BytesRead, Bandwidth };
+        return !!(*IC2)(&Progress, ICPrivate);
+    }
+    return IC && (*IC)(Current, Total, ICPrivate);
+}
+
+void FFMS_Indexer::SetThreads(int Threads_) {
+    Threads = Threads_ > 0 ? Threads_ : std::max<int>(std::thread::hardware_concurrency(), 1);
+}
+
+void FFMS_Indexer::SetFlags(int Flags_) {
+    Flags = Flags_;
+}
+
+void FFMS_Indexer::SetParallelLimits(int64_t MinRangeSize_, int MaxSpliceCandidates_) {
+    MinRangeSize = std::max<int64_t>(MinRangeSize_, 1);
+    MaxSpliceCandidates = MaxSpliceCandidates_;
+}
+
 FFMS_Indexer *CreateIndexer(const char *Filename) {
     return new FFMS_Indexer(Filename);
 }
@@ -235,6 +456,22 @@ FFMS_Indexer *CreateIndexer(const char *Filename) {
 FFMS_Indexer::FFMS_Indexer(const char *Filename)
     : SourceFile(Filename) {
     try {
+        // Only regular files and registered inputs benefit from reading ahead;
+        // pipes, devices and network protocols are left to libavformat
+        std::shared_ptr<InputSource> Input = FindRegisteredInput(Filename);
+        if (!Input && IsRegularFile(Filename))
+            Input = OpenFileInput(Filename, FFMS_ERROR_PARSER);
+
+        if (Input) {
+            Reader = make_unique<ReadAheadReader>(Input, ReadAheadReader::DefaultBlockSize);
+            FormatContext = avformat_alloc_context();
+            if (!FormatContext)
+                throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+                    "Could not allocate format context");
+            FormatContext->pb = Reader->GetAVIOContext();
+            FormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
+
         if (avformat_open_input(&FormatContext, Filename, nullptr, nullptr) != 0)
             throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
                 std::string("Can't open '") + Filename + "'");
@@ -250,59 +487,55 @@ FFMS_Indexer::FFMS_Indexer(const char *Filename)
         for (unsigned int i = 0; i < FormatContext->nb_streams; i++)
             if (FormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
                 IndexMask.insert(i);
-
-        DecodeFrame = av_frame_alloc();
-        if (!DecodeFrame)
-            throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
-                "Couldn't allocate frame");
     } catch (...) {
         Free();
         throw;
     }
 }
 
-uint32_t FFMS_Indexer::IndexAudioPacket(int Track, AVPacket *Packet, SharedAVContext &Context, FFMS_Index &TrackIndices) {
+void FFMS_Indexer::HandleAudioError(IndexingPass &Pass, int Track, FFMS_Index &TrackIndices) {
+    if (ErrorHandling == FFMS_IEH_ABORT || (Pass.Partial && ErrorHandling != FFMS_IEH_IGNORE)) {
+        throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING, "Audio decoding error");
+    } else if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
+        TrackIndices[Track].clear();
+        IndexMask.erase(Track);
+    } else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
+        IndexMask.erase(Track);
+    }
+}
+
+uint32_t FFMS_Indexer::IndexAudioPacket(IndexingPass &Pass, int Track, AVPacket *Packet, FFMS_Index &TrackIndices) {
+    SharedAVContext &Context = Pass.AVContexts[Track];
     AVCodecContext *CodecContext = Context.CodecContext;
     int64_t StartSample = Context.CurrentSample;
+    ScopedTimer Timer(Pass.TrackStats[Track].DecodeTime);
+    Pass.TrackStats[Track].DecodeCalls++;
     int Ret = avcodec_send_packet(CodecContext, Packet);
-    if (Ret != 0) {
-        if (ErrorHandling == FFMS_IEH_ABORT) {
-            throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING, "Audio decoding error");
-        } else if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
-            TrackIndices[Track].clear();
-            IndexMask.erase(Track);
-        } else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
-            IndexMask.erase(Track);
-        }
-    }
+    if (Ret != 0)
+        HandleAudioError(Pass, Track, TrackIndices);
 
     while (true) {
-        av_frame_unref(DecodeFrame);
-        Ret = avcodec_receive_frame(CodecContext, DecodeFrame);
+        av_frame_unref(Pass.DecodeFrame);
+        Ret = avcodec_receive_frame(CodecContext, Pass.DecodeFrame);
         if (Ret == 0) {
-            CheckAudioProperties(Track, CodecContext);
-            Context.CurrentSample += DecodeFrame->nb_samples;
+            CheckAudioProperties(Pass, Track, CodecContext);
+            if (AudioWaveform *Waveform = TrackIndices[Track].Waveform.get())
+                Waveform->AddFrame(Pass.DecodeFrame);
+            Context.CurrentSample += Pass.DecodeFrame->nb_samples;
         } else if (Ret == AVERROR_EOF || Ret == AVERROR(EAGAIN)) {
             break;
         } else {
-            if (ErrorHandling == FFMS_IEH_ABORT) {
-                throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING, "Audio decoding error");
-            } else if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
-                TrackIndices[Track].clear();
-                IndexMask.erase(Track);
-            } else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
-                IndexMask.erase(Track);
-            }
+            HandleAudioError(Pass, Track, TrackIndices);
         }
     }
 
     return static_cast<uint32_t>(Context.CurrentSample - StartSample);
 }
 
-void FFMS_Indexer::CheckAudioProperties(int Track, AVCodecContext *Context) {
-    auto it = LastAudioProperties.find(Track);
-    if (it == LastAudioProperties.end()) {
-        FFMS_AudioProperties &AP = LastAudioProperties[Track];
+void FFMS_Indexer::CheckAudioProperties(IndexingPass &Pass, int Track, AVCodecContext *Context) {
+    auto it = Pass.LastAudioProperties.find(Track);
+    if (it == Pass.LastAudioProperties.end()) {
+        FFMS_AudioProperties &AP = Pass.LastAudioProperties[Track];
         AP.SampleRate = Context->sample_rate;
         AP.SampleFormat = Context->sample_fmt;
         AP.Channels = Context->channels;
@@ -363,8 +596,8 @@ void FFMS_Indexer::ParseVideoPacket(SharedAVContext &VideoContext, AVPacket &pkt
 }
 
 void FFMS_Indexer::Free() {
-    av_frame_free(&DecodeFrame);
     avformat_close_input(&FormatContext);
+    Reader.reset();
 }
 
 FFMS_Indexer::~FFMS_Indexer() {
@@ -388,8 +621,237 @@ const char *FFMS_Indexer::GetTrackCodec(int Track) {
     return codec ? codec->name : nullptr;
 }
 
+namespace {
+// Packets at the start of every track which are read to check that they are
+// the ones the container's index describes
+const size_t ContainerCheckPackets = 32;
+// Packets which may be read after seeking to the last entry of a track
+const int MaxSeekPackets = 1024;
+
+typedef std::map<int, std::vector<AVIndexEntry>> EntryMap;
+
+std::vector<AVIndexEntry> GetIndexEntries(AVStream *Stream) {
+    std::vector<AVIndexEntry> Entries;
+    // The entries were never part of the public API, and newer versions of
+    // libavformat only make them available through these
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    const int Count = avformat_index_get_entries_count(Stream);
+    Entries.reserve(std::max(Count, 0));
+    for (int i = 0; i < Count; ++i)
+        Entries.push_back(*avformat_index_get_entry(Stream, i));
+#else
+    if (Stream->nb_index_entries > 0)
+        Entries.assign(Stream->index_entries, Stream->index_entries + Stream->nb_index_entries);
+#endif
+    return Entries;
+}
+
+// The entries only have decoding timestamps, which are used as presentation
+// timestamps, so the first packets of every track are read to check that
+// they're the ones the entries describe and have no composition offsets
+bool CheckFirstPackets(AVFormatContext *Context, EntryMap const& Entries) {
+    std::map<int, size_t> Checked;
+    size_t Pending = Entries.size();
+    AVPacket Packet;
+    InitNullPacket(Packet);
+    while (Pending > 0 && av_read_frame(Context, &Packet) >= 0) {
+        auto it = Entries.find(Packet.stream_index);
+        bool Match = true;
+        if (it != Entries.end()) {
+            const size_t Count = std::min(ContainerCheckPackets, it->second.size());
+            size_t &n = Checked[Packet.stream_index];
+            if (n < Count) {
+                AVIndexEntry const& Entry = it->second[n];
+                Match = Packet.pos == Entry.pos && Packet.dts == Entry.timestamp && Packet.pts == Entry.timestamp &&
+                    !!(Packet.flags & AV_PKT_FLAG_KEY) == !!(Entry.flags & AVINDEX_KEYFRAME);
+                if (++n == Count)
+                    --Pending;
+            }
+        }
+        av_packet_unref(&Packet);
+        if (!Match)
+            return false;
+    }
+    return Pending == 0;
+}
+
+// The duration of the packet Entry describes, which is what a serial pass
+// takes the last duration of a track from, or -1 if it can't be read
+int64_t PacketDuration(AVFormatContext *Context, int Track, AVIndexEntry const& Entry) {
+    if (av_seek_frame(Context, Track, Entry.timestamp, AVSEEK_FLAG_ANY) < 0)
+        return -1;
+    AVPacket Packet;
+    InitNullPacket(Packet);
+    for (int i = 0; i < MaxSeekPackets && av_read_frame(Context, &Packet) >= 0; ++i) {
+        bool Found = Packet.stream_index == Track && Packet.pos == Entry.pos;
+        int64_t Duration = Packet.duration;
+        av_packet_unref(&Packet);
+        if (Found)
+            return Duration;
+    }
+    return -1;
+}
+}
+
+bool FFMS_Indexer::IndexFromContainer(FFMS_Index &TrackIndices, std::vector<SharedAVContext> &AVContexts) {
+    // Only trust index entries which cover every packet of a track. MP4 sample
+    // tables do, while Matroska cues only point at clusters and keyframes, so
+    // those (and fragmented MP4) end up being read in full.
+    EntryMap Entries;
+    for (int Track : IndexMask) {
+        AVStream *Stream = FormatContext->streams[Track];
+        AVCodecParameters *Params = Stream->codecpar;
+        std::vector<AVIndexEntry> &TrackEntries = Entries[Track] = GetIndexEntries(Stream);
+        if (TrackEntries.empty())
+            return false;
+
+        if (Params->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (Stream->nb_frames != static_cast<int64_t>(TrackEntries.size()))
+                return false;
+            // The index only has decoding timestamps
+            if (Params->video_delay > 0 || AVContexts[Track].CodecContext->has_b_frames > 0)
+                return false;
+            // Frame types, repeated fields, field pictures and invisible
+            // frames are found by parsing every packet, which means reading
+            // them all anyway. Keyframe-only tracks and codecs without a
+            // parser need nothing but the packets' flags.
+            if (AVContexts[Track].Parser)
+                return false;
+        } else {
+            // Waveform summaries need the decoded audio
+            if (TrackIndices[Track].Waveform)
+                return false;
+            // Only the sample count of PCM can be known without decoding
+            if (Params->codec_id < AV_CODEC_ID_PCM_S16LE || Params->codec_id >= AV_CODEC_ID_ADPCM_IMA_QT)
+                return false;
+            if (av_get_bits_per_sample(Params->codec_id) <= 0 || Params->channels <= 0)
+                return false;
+        }
+
+        for (size_t i = 0; i < TrackEntries.size(); ++i) {
+            if (TrackEntries[i].pos < 0 || TrackEntries[i].timestamp == AV_NOPTS_VALUE)
+                return false;
+            if (i > 0 && TrackEntries[i].timestamp < TrackEntries[i - 1].timestamp)
+                return false;
+        }
+    }
+
+    // Packets are read with a demuxer of its own, so that the serial pass
+    // can still start from the beginning if anything doesn't match
+    AVFormatContext *CheckContext = nullptr;
+    LAVFOpenInput(SourceFile.c_str(), CheckContext, FormatContext->iformat);
+    std::map<int, int64_t> LastDurations;
+    bool Usable;
+    try {
+        Usable = CheckFirstPackets(CheckContext, Entries);
+        for (int Track : IndexMask) {
+            if (!Usable)
+                break;
+            // A serial pass skips discarded packets, except in keyframe-only
+            // tracks
+            std::vector<AVIndexEntry> const& TrackEntries = Entries[Track];
+            auto Last = TrackEntries.rbegin();
+            if (!TrackIndices[Track].KeyFramesOnly) {
+                while (Last != TrackEntries.rend() && (Last->flags & AVINDEX_DISCARD_FRAME))
+                    ++Last;
+            }
+            int64_t Duration = 0;
+            if (Last != TrackEntries.rend())
+                Duration = PacketDuration(CheckContext, Track, *Last);
+            Usable = Duration >= 0;
+            LastDurations[Track] = Duration;
+        }
+    } catch (...) {
+        LAVFCloseFile(CheckContext);
+        throw;
+    }
+    LAVFCloseFile(CheckContext);
+    if (!Usable)
+        return false;
+
+    std::vector<FFMS_Track> Tracks(TrackIndices.size());
+    for (int Track : IndexMask) {
+        AVStream *Stream = FormatContext->streams[Track];
+        AVCodecParameters *Params = Stream->codecpar;
+        std::vector<AVIndexEntry> const& TrackEntries = Entries[Track];
+        FFMS_Track const& Header = TrackIndices[Track];
+        FFMS_Track &TrackInfo = Tracks[Track] = FFMS_Track(Header.TB.Num, Header.TB.Den, Header.TT, Header.HasDiscontTS, Header.UseDTS, Header.HasTS);
+        TrackInfo.KeyFramesOnly = Header.KeyFramesOnly;
+
+        if (Params->codec_type == AVMEDIA_TYPE_VIDEO) {
+            // This is what IndexPacket reports without a parser
+            for (AVIndexEntry const& Entry : TrackEntries) {
+                bool KeyFrame = !!(Entry.flags & AVINDEX_KEYFRAME);
+                if (TrackInfo.KeyFramesOnly)
+                    TrackInfo.CountVideoFrame(Entry.timestamp, KeyFrame, Entry.pos);
+                else
+                    TrackInfo.AddVideoFrame(Entry.timestamp, -1, KeyFrame, 0, Entry.pos, !!(Entry.flags & AVINDEX_DISCARD_FRAME));
+            }
+        } else {
+            const int64_t BytesPerSample = av_get_bits_per_sample(Params->codec_id) / 8 * Params->channels;
+            if (BytesPerSample <= 0)
+                return false;
+
+            int64_t SampleStart = 0;
+            for (size_t i = 0; i < TrackEntries.size(); ++i) {
+                AVIndexEntry const& Entry = TrackEntries[i];
+                int64_t SampleCount = Entry.size / BytesPerSample;
+                if (SampleCount <= 0 || Entry.size % BytesPerSample)
+                    return false;
+                // Every entry has to start right where the previous one ended
+                if (i > 0 && av_rescale_q(Entry.timestamp - TrackEntries[i - 1].timestamp, Stream->time_base, AVRational{ 1, Params->sample_rate }) != TrackInfo.back().SampleCount)
+                    return false;
+                TrackInfo.AddAudioFrame(Entry.timestamp, SampleStart, static_cast<uint32_t>(SampleCount),
+                    !!(Entry.flags & AVINDEX_KEYFRAME), Entry.pos, !!(Entry.flags & AVINDEX_DISCARD_FRAME));
+                SampleStart += SampleCount;
+            }
+            TrackInfo.HasTS = true;
+            TrackInfo.SampleRate = Params->sample_rate;
+        }
+
+        TrackInfo.LastDuration = LastDurations[Track];
+    }
+
+    for (int Track : IndexMask)
+        TrackIndices[Track] = Tracks[Track];
+    return true;
+}
+
+void FFMS_Indexer::PruneIndexMask() {
+    for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
+        AVStream *Stream = FormatContext->streams[i];
+        AVMediaType Type = Stream->codecpar->codec_type;
+        bool Index = IndexMask.count(i) && (Type == AVMEDIA_TYPE_AUDIO ||
+            (Type == AVMEDIA_TYPE_VIDEO && avcodec_find_decoder(Stream->codecpar->codec_id) &&
+             !(Stream->disposition & AV_DISPOSITION_ATTACHED_PIC)));
+        if (!Index) {
+            Stream->discard = AVDISCARD_ALL;
+            IndexMask.erase(i);
+        }
+    }
+}
+
 FFMS_Index *FFMS_Indexer::DoIndexing() {
-    std::vector<SharedAVContext> AVContexts(FormatContext->nb_streams);
+    PruneIndexMask();
+
+    IndexingStart = std::chrono::steady_clock::now();
+
+    // Another process may already have indexed the file for us
+    if (!FindRegisteredInput(SourceFile.c_str()) && IsRegularFile(SourceFile.c_str())) {
+        IndexServerRequest Request = { IndexMask, ErrorHandling, Flags, Threads, ReadAheadSize };
+        auto Progress = [&](int64_t Current, int64_t Total) {
+            return ReportProgress(Current, Total, Current, -1);
+        };
+        if (std::unique_ptr<FFMS_Index> Index = FetchIndexFromServer(SourceFile.c_str(), Request, Filesize, Digest, Progress))
+            return Index.release();
+        IndexingStart = std::chrono::steady_clock::now();
+    }
+
+    if (Reader)
+        Reader->ResetStats();
+
+    IndexingPass Pass(FormatContext, false);
+    std::vector<SharedAVContext> &AVContexts = Pass.AVContexts;
 
     auto TrackIndices = make_unique<FFMS_Index>(Filesize, Digest, ErrorHandling);
     bool UseDTS = !strcmp(FormatContext->iformat->name, "mpeg") || !strcmp(FormatContext->iformat->name, "mpegts") || !strcmp(FormatContext->iformat->name, "mpegtsraw") || !strcmp(FormatContext->iformat->name, "nuv");
@@ -403,11 +865,6 @@ FFMS_Index *FFMS_Indexer::DoIndexing() {
 
         if (IndexMask.count(i) && FormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
             AVCodec *VideoCodec = avcodec_find_decoder(FormatContext->streams[i]->codecpar->codec_id);
-            if (!VideoCodec) {
-                FormatContext->streams[i]->discard = AVDISCARD_ALL;
-                IndexMask.erase(i);
-                continue;
-            }
 
             AVContexts[i].CodecContext = avcodec_alloc_context3(VideoCodec);
             if (AVContexts[i].CodecContext == nullptr)
@@ -422,15 +879,15 @@ FFMS_Index *FFMS_Indexer::DoIndexing() {
                 throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
                     "Could not open video codec");
 
-            AVContexts[i].Parser = av_parser_init(FormatContext->streams[i]->codecpar->codec_id);
-            if (AVContexts[i].Parser)
-                AVContexts[i].Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
-
-            if (FormatContext->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC) {
-                FormatContext->streams[i]->discard = AVDISCARD_ALL;
-                IndexMask.erase(i);
+            // VPx alt-refs can only be told apart from real frames by parsing
+            // them, so those tracks always get a full index
+            AVCodecID CodecID = FormatContext->streams[i]->codecpar->codec_id;
+            if ((Flags & FFMS_INDEX_FLAG_KEYFRAMES_ONLY) && CodecID != AV_CODEC_ID_VP8 && CodecID != AV_CODEC_ID_VP9) {
+                (*TrackIndices)[i].KeyFramesOnly = true;
             } else {
-                IndexMask.insert(i);
+                AVContexts[i].Parser = av_parser_init(CodecID);
+                if (AVContexts[i].Parser)
+                    AVContexts[i].Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
             }
         } else if (IndexMask.count(i) && FormatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
             AVCodec *AudioCodec = avcodec_find_decoder(FormatContext->streams[i]->codecpar->codec_id);
@@ -452,91 +909,118 @@ FFMS_Index *FFMS_Indexer::DoIndexing() {
                     "Could not open audio codec");
 
             (*TrackIndices)[i].HasTS = false;
-        } else {
-            FormatContext->streams[i]->discard = AVDISCARD_ALL;
-            IndexMask.erase(i);
+            if (Flags & FFMS_INDEX_FLAG_WAVEFORM)
+                (*TrackIndices)[i].Waveform = std::make_shared<AudioWaveform>();
         }
     }
 
+    auto Finish = [&] {
+        TrackIndices->Finalize(AVContexts, FormatContext);
+        TrackIndices->Stats.Add(Pass);
+        TrackIndices->Stats.TotalTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - IndexingStart).count();
+        return TrackIndices.release();
+    };
+
+    if ((Flags & FFMS_INDEX_FLAG_CONTAINER_INDEX) && IndexFromContainer(*TrackIndices, AVContexts)) {
+        TrackIndices->Stats.FromContainer = true;
+        return Finish();
+    }
+
+    if (Threads > 1 && CanIndexInParallel() && DoParallelIndexing(*TrackIndices, AVContexts))
+        return Finish();
+
     AVPacket Packet;
     InitNullPacket(Packet);
-    std::vector<int64_t> LastValidTS(FormatContext->nb_streams, AV_NOPTS_VALUE);
 
     int64_t filesize = avio_size(FormatContext->pb);
-    enum AVPictureStructure LastPicStruct = AV_PICTURE_STRUCTURE_UNKNOWN;
-    while (av_read_frame(FormatContext, &Packet) >= 0) {
+    while (Pass.ReadPacket(Packet)) {
         // Update progress
         // FormatContext->pb can apparently be NULL when opening images.
-        if (IC && FormatContext->pb) {
-            if ((*IC)(FormatContext->pb->pos, filesize, ICPrivate))
+        if ((IC || IC2) && FormatContext->pb) {
+            int64_t BytesRead = Reader ? Reader->GetBytesRead() : FormatContext->pb->pos;
+            double Bandwidth = Reader ? Reader->GetBandwidth() : -1;
+            if (ReportProgress(FormatContext->pb->pos, filesize, BytesRead, Bandwidth))
                 throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER,
                     "Cancelled by user");
         }
-        if (!IndexMask.count(Packet.stream_index)) {
-            av_packet_unref(&Packet);
-            continue;
-        }
+        if (IndexMask.count(Packet.stream_index))
+            IndexPacket(Pass, Packet, *TrackIndices);
+        av_packet_unref(&Packet);
+    }
 
-        int Track = Packet.stream_index;
-        FFMS_Track &TrackInfo = (*TrackIndices)[Track];
-        bool KeyFrame = !!(Packet.flags & AV_PKT_FLAG_KEY);
-        ReadTS(Packet, LastValidTS[Track], (*TrackIndices)[Track].UseDTS);
-
-        if (FormatContext->streams[Track]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            int64_t PTS = TrackInfo.UseDTS ? Packet.dts : Packet.pts;
-            if (PTS == AV_NOPTS_VALUE) {
-                // VPx alt-refs are output as packets which lack timestmps or durations, since
-                // they are invisible. Currently, the timestamp mangling code in libavformat
-                // will sometimes add a bogus timestamp and duration, if the webm in question
-                // has the block duration set (which is a hack, and not really a frame duration
-                // at all). In the future, libav* will only output packets without timestamps
-                // or duration, so we need to handle it here, regardless. This does not handle
-                // NVOPs. We set the duration based on the last PTS, for these packets, because
-                // FFMS2 currently sorts packets by PTS, which will break decoding, otherwise.
-                bool HasAltRefs = (FormatContext->streams[Track]->codecpar->codec_id == AV_CODEC_ID_VP8 ||
-                                   FormatContext->streams[Track]->codecpar->codec_id == AV_CODEC_ID_VP9);
-                if (Packet.duration == 0 && !HasAltRefs)
-                    throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_PARSER,
-                        "Invalid packet pts, dts, and duration");
-
-                if (TrackInfo.empty())
-                    PTS = 0;
-                else
-                    PTS = TrackInfo.back().PTS + TrackInfo.LastDuration;
+    return Finish();
+}
 
-                TrackInfo.HasTS = false;
-            }
+void FFMS_Indexer::IndexPacket(IndexingPass &Pass, AVPacket &Packet, FFMS_Index &TrackIndices) {
+    AVFormatContext *FormatContext = Pass.FormatContext;
+    int Track = Packet.stream_index;
+    FFMS_Track &TrackInfo = TrackIndices[Track];
+    bool KeyFrame = !!(Packet.flags & AV_PKT_FLAG_KEY);
+    ReadTS(Packet, Pass.LastValidTS[Track], TrackInfo.UseDTS);
+    Pass.TrackStats[Track].Packets++;
+
+    if (FormatContext->streams[Track]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        int64_t PTS = TrackInfo.UseDTS ? Packet.dts : Packet.pts;
+        if (PTS == AV_NOPTS_VALUE) {
+            // VPx alt-refs are output as packets which lack timestmps or durations, since
+            // they are invisible. Currently, the timestamp mangling code in libavformat
+            // will sometimes add a bogus timestamp and duration, if the webm in question
+            // has the block duration set (which is a hack, and not really a frame duration
+            // at all). In the future, libav* will only output packets without timestamps
+            // or duration, so we need to handle it here, regardless. This does not handle
+            // NVOPs. We set the duration based on the last PTS, for these packets, because
+            // FFMS2 currently sorts packets by PTS, which will break decoding, otherwise.
+            bool HasAltRefs = (FormatContext->streams[Track]->codecpar->codec_id == AV_CODEC_ID_VP8 ||
+                               FormatContext->streams[Track]->codecpar->codec_id == AV_CODEC_ID_VP9);
+            if (Packet.duration == 0 && !HasAltRefs)
+                throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_PARSER,
+                    "Invalid packet pts, dts, and duration");
+
+            if (TrackInfo.KeyFramesOnly)
+                PTS = TrackInfo.FrameCount ? TrackInfo.LastPTS + TrackInfo.LastDuration : 0;
+            else if (TrackInfo.empty())
+                PTS = 0;
+            else
+                PTS = TrackInfo.back().PTS + TrackInfo.LastDuration;
 
-            int RepeatPict = -1;
-            int FrameType = 0;
-            bool Invisible = false;
-            ParseVideoPacket(AVContexts[Track], Packet, &RepeatPict, &FrameType, &Invisible, &LastPicStruct);
-
-            TrackInfo.AddVideoFrame(PTS, RepeatPict, KeyFrame,
-                FrameType, Packet.pos, Invisible);
-        } else if (FormatContext->streams[Track]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            // For video seeking timestamps are used only if all packets have
-            // timestamps, while for audio they're used if any have timestamps,
-            // as it's pretty common for only some packets to have timestamps
-            if (LastValidTS[Track] != AV_NOPTS_VALUE)
-                TrackInfo.HasTS = true;
-
-            int64_t StartSample = AVContexts[Track].CurrentSample;
-            uint32_t SampleCount = IndexAudioPacket(Track, &Packet, AVContexts[Track], *TrackIndices);
-            TrackInfo.SampleRate = AVContexts[Track].CodecContext->sample_rate;
-
-            TrackInfo.AddAudioFrame(LastValidTS[Track],
-                StartSample, SampleCount, KeyFrame, Packet.pos, Packet.flags & AV_PKT_FLAG_DISCARD);
+            TrackInfo.HasTS = false;
         }
 
-        if (!(Packet.flags & AV_PKT_FLAG_DISCARD))
+        if (TrackInfo.KeyFramesOnly) {
+            TrackInfo.CountVideoFrame(PTS, KeyFrame, Packet.pos);
             TrackInfo.LastDuration = Packet.duration;
+            return;
+        }
 
-        av_packet_unref(&Packet);
+        int RepeatPict = -1;
+        int FrameType = 0;
+        bool Invisible = false;
+        {
+            ScopedTimer Timer(Pass.TrackStats[Track].ParseTime);
+            if (Pass.AVContexts[Track].Parser)
+                Pass.TrackStats[Track].ParserCalls++;
+            ParseVideoPacket(Pass.AVContexts[Track], Packet, &RepeatPict, &FrameType, &Invisible, &Pass.LastPicStruct);
+        }
+
+        TrackInfo.AddVideoFrame(PTS, RepeatPict, KeyFrame,
+            FrameType, Packet.pos, Invisible);
+    } else if (FormatContext->streams[Track]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        // For video seeking timestamps are used only if all packets have
+        // timestamps, while for audio they're used if any have timestamps,
+        // as it's pretty common for only some packets to have timestamps
+        if (Pass.LastValidTS[Track] != AV_NOPTS_VALUE)
+            TrackInfo.HasTS = true;
+
+        int64_t StartSample = Pass.AVContexts[Track].CurrentSample;
+        uint32_t SampleCount = IndexAudioPacket(Pass, Track, &Packet, TrackIndices);
+        TrackInfo.SampleRate = Pass.AVContexts[Track].CodecContext->sample_rate;
+
+        TrackInfo.AddAudioFrame(Pass.LastValidTS[Track],
+            StartSample, SampleCount, KeyFrame, Packet.pos, Packet.flags & AV_PKT_FLAG_DISCARD);
     }
 
-    TrackIndices->Finalize(AVContexts, FormatContext->iformat->name);
-    return TrackIndices.release();
+    if (!(Packet.flags & AV_PKT_FLAG_DISCARD))
+        TrackInfo.LastDuration = Packet.duration;
 }
 
 void FFMS_Indexer::ReadTS(const AVPacket &Packet, int64_t &TS, bool &UseDTS) {
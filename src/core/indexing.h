@@ -27,6 +27,9 @@
 #include <map>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <exception>
+#include <thread>
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -42,10 +45,72 @@ struct SharedAVContext {
     ~SharedAVContext();
 };
 
+// Adds the time from construction to destruction to Total
+class ScopedTimer {
+    double &Total;
+    std::chrono::steady_clock::time_point Start;
+public:
+    explicit ScopedTimer(double &Total) : Total(Total), Start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        Total += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    }
+};
+
+struct TrackIndexingStats {
+    int64_t Packets = 0;
+    int64_t ParserCalls = 0;
+    int64_t DecodeCalls = 0;
+    double ParseTime = 0;
+    double DecodeTime = 0;
+};
+
+// Demuxing and decoding state for one pass over the file, or over a byte
+// range of it when indexing in parallel
+struct IndexingPass {
+    AVFormatContext *FormatContext = nullptr;
+    std::vector<SharedAVContext> AVContexts;
+    std::vector<int64_t> LastValidTS;
+    std::map<int, FFMS_AudioProperties> LastAudioProperties;
+    enum AVPictureStructure LastPicStruct = AV_PICTURE_STRUCTURE_UNKNOWN;
+    AVFrame *DecodeFrame = nullptr;
+    // Partial passes give up on errors instead of applying the error handling
+    // mode, since only a serial pass can apply it at the right packet
+    bool Partial = false;
+    std::vector<TrackIndexingStats> TrackStats;
+    double DemuxTime = 0;
+
+    IndexingPass(AVFormatContext *FormatContext, bool Partial);
+    ~IndexingPass();
+    // av_read_frame, timed
+    bool ReadPacket(AVPacket &Packet);
+};
+
+// Where the time went while making and writing an index. Times of passes
+// run in parallel are summed, so they can add up to more than TotalTime.
+struct IndexingStats {
+    std::vector<TrackIndexingStats> Tracks;
+    double TotalTime = 0;
+    double DemuxTime = 0;
+    double FinalizeTime = 0;
+    double WriteTime = 0;
+    // Number of byte ranges the file was indexed in at once, or 0 if it
+    // wasn't split
+    int ParallelRanges = 0;
+    // Set if the tracks were taken from the container's own index
+    bool FromContainer = false;
+    int64_t BytesRead = 0;
+    int64_t BytesWritten = 0;
+
+    void Add(IndexingPass const& Pass);
+    void Add(IndexingStats const& Other);
+};
+
 struct FFMS_Index : public std::vector<FFMS_Track> {
     FFMS_Index(FFMS_Index const&) = delete;
     FFMS_Index& operator=(FFMS_Index const&) = delete;
-    void ReadIndex(ZipFile &zf, const char* IndexFile);
+    void ReadIndex(ZipFile &zf, const char* IndexFile, bool AnyLibraryVersion);
+    // Replaces the given tracks with a new index of them made from SourceFile
+    void ReindexTracks(const char *SourceFile, std::set<int> const& Tracks);
     void WriteIndex(ZipFile &zf);
 public:
     static void CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20]);
@@ -53,37 +118,88 @@ public:
     int ErrorHandling;
     int64_t Filesize;
     uint8_t Digest[20];
+    std::string FormatName;
+    // Set when the index was read from a file made with other FFmpeg versions
+    bool OtherLibraryVersions = false;
+    // Not stored in index files
+    IndexingStats Stats;
 
-    void Finalize(std::vector<SharedAVContext> const& video_contexts, const char *Format);
+    void Finalize(std::vector<SharedAVContext> const& video_contexts, AVFormatContext *FormatContext);
     bool CompareFileSignature(const char *Filename);
+    // Replaces every keyframe-only track with a full index of it
+    void UpgradeKeyFrameTracks(const char *SourceFile);
+    // Indexes those of the given tracks which haven't been indexed yet
+    void AddTracks(const char *SourceFile, std::set<int> const& Tracks);
+    // Checks an index made with other FFmpeg versions against the file and
+    // reindexes the tracks which no longer match
+    void RevalidateTracks(const char *SourceFile);
     void WriteIndexFile(const char *IndexFile);
     uint8_t *WriteIndexBuffer(size_t *Size);
+    // A copy sharing the frame data, which is never modified once indexed
+    std::unique_ptr<FFMS_Index> Snapshot() const;
 
-    FFMS_Index(const char *IndexFile);
+    FFMS_Index(const char *IndexFile, bool AnyLibraryVersion = false);
     FFMS_Index(const uint8_t *Buffer, size_t Size);
-    FFMS_Index(int64_t Filesize, uint8_t Digest[20], int ErrorHandling);
+    FFMS_Index(int64_t Filesize, const uint8_t Digest[20], int ErrorHandling);
 };
 
+// Writes a copy of an index on a background thread
+struct FFMS_IndexWriter {
+private:
+    FFMS_IndexWriter(FFMS_IndexWriter const&) = delete;
+    FFMS_IndexWriter& operator=(FFMS_IndexWriter const&) = delete;
+    std::unique_ptr<FFMS_Index> Index;
+    std::string IndexFile;
+    std::exception_ptr Error;
+    std::thread Thread;
+public:
+    FFMS_IndexWriter(FFMS_Index const& Index, const char *IndexFile);
+    ~FFMS_IndexWriter();
+    // Waits for the write to finish and throws if it failed
+    void Finish();
+};
+
+class ReadAheadReader;
+
 struct FFMS_Indexer {
 private:
-    std::map<int, FFMS_AudioProperties> LastAudioProperties;
     FFMS_Indexer(FFMS_Indexer const&) = delete;
     FFMS_Indexer& operator=(FFMS_Indexer const&) = delete;
     AVFormatContext *FormatContext = nullptr;
     std::set<int> IndexMask;
     int ErrorHandling = FFMS_IEH_CLEAR_TRACK;
     TIndexCallback IC = nullptr;
+    TIndexProgressCallback IC2 = nullptr;
     void *ICPrivate = nullptr;
     std::string SourceFile;
-    AVFrame *DecodeFrame = nullptr;
+    int Threads = 1;
+    int Flags = 0;
+    int64_t ReadAheadSize = 0;
+    // Ranges smaller than this aren't worth an extra demuxer and the overlap
+    // needed to resynchronize it
+    int64_t MinRangeSize = 64 * 1024 * 1024;
+    // Number of possible splice points to try before giving up
+    int MaxSpliceCandidates = 64;
+    std::unique_ptr<ReadAheadReader> Reader;
+    std::chrono::steady_clock::time_point IndexingStart;
 
     int64_t Filesize;
     uint8_t Digest[20];
 
     void ReadTS(const AVPacket &Packet, int64_t &TS, bool &UseDTS);
-    void CheckAudioProperties(int Track, AVCodecContext *Context);
-    uint32_t IndexAudioPacket(int Track, AVPacket *Packet, SharedAVContext &Context, FFMS_Index &TrackIndices);
+    void CheckAudioProperties(IndexingPass &Pass, int Track, AVCodecContext *Context);
+    void HandleAudioError(IndexingPass &Pass, int Track, FFMS_Index &TrackIndices);
+    uint32_t IndexAudioPacket(IndexingPass &Pass, int Track, AVPacket *Packet, FFMS_Index &TrackIndices);
+    // Drops the tracks which can't be indexed, so that an index server is
+    // asked for exactly the tracks this indexer would index
+    void PruneIndexMask();
     void ParseVideoPacket(SharedAVContext &VideoContext, AVPacket &pkt, int *RepeatPict, int *FrameType, bool *Invisible, enum AVPictureStructure *LastPicStruct);
+    bool ReportProgress(int64_t Current, int64_t Total, int64_t BytesRead, double Bandwidth);
+    void IndexPacket(IndexingPass &Pass, AVPacket &Packet, FFMS_Index &TrackIndices);
+    void OpenCodecs(IndexingPass &Pass);
+    bool IndexFromContainer(FFMS_Index &TrackIndices, std::vector<SharedAVContext> &AVContexts);
+    bool CanIndexInParallel();
+    bool DoParallelIndexing(FFMS_Index &TrackIndices, std::vector<SharedAVContext> &AVContexts);
     void Free();
 public:
     FFMS_Indexer(const char *Filename);
@@ -93,6 +209,13 @@ public:
     void SetIndexTrackType(int TrackType, bool Index);
     void SetErrorHandling(int ErrorHandling_);
     void SetProgressCallback(TIndexCallback IC_, void *ICPrivate_);
+    void SetProgressCallback2(TIndexProgressCallback IC_, void *ICPrivate_);
+    void SetReadAheadSize(int64_t Size);
+    void SetThreads(int Threads_);
+    void SetFlags(int Flags_);
+    // Only meant for the tests, which split small files and force the
+    // fallback to a serial pass
+    void SetParallelLimits(int64_t MinRangeSize_, int MaxSpliceCandidates_);
 
     FFMS_Index *DoIndexing();
     int GetNumberOfTracks();
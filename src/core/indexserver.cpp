@@ -0,0 +1,217 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "indexserver.h"
+
+#include "indexing.h"
+#include "track.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#	include <climits>
+#	include <sys/socket.h>
+#	include <sys/time.h>
+#	include <sys/un.h>
+#	include <unistd.h>
+#endif
+
+namespace {
+std::mutex ServerLock;
+bool ServerConfigured = false;
+std::string ServerPath;
+int ServerTimeout = 30000;
+
+std::string GetServerPath() {
+    std::lock_guard<std::mutex> Guard(ServerLock);
+    if (!ServerConfigured) {
+        const char *Env = getenv("FFMS2_INDEX_SERVER");
+        ServerPath = Env ? Env : "";
+        ServerConfigured = true;
+    }
+    return ServerPath;
+}
+
+#ifndef _WIN32
+// Anything larger is certainly not a response from the index server
+const uint64_t MaxIndexSize = uint64_t(1) << 32;
+
+class Socket {
+    int FD;
+public:
+    Socket() : FD(socket(AF_UNIX, SOCK_STREAM, 0)) {}
+    ~Socket() {
+        if (FD >= 0)
+            close(FD);
+    }
+    // Makes connecting, sending and every read give up after Milliseconds
+    bool SetTimeout(int Milliseconds) {
+        timeval Timeout = {};
+        Timeout.tv_sec = Milliseconds / 1000;
+        Timeout.tv_usec = (Milliseconds % 1000) * 1000;
+        return FD >= 0 &&
+            !setsockopt(FD, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) &&
+            !setsockopt(FD, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+    }
+    bool Connect(std::string const& Path) {
+        sockaddr_un Address = {};
+        if (FD < 0 || Path.size() >= sizeof(Address.sun_path))
+            return false;
+        Address.sun_family = AF_UNIX;
+        memcpy(Address.sun_path, Path.c_str(), Path.size() + 1);
+        return connect(FD, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) == 0;
+    }
+    bool WriteAll(const char *Data, size_t Size) {
+#ifdef MSG_NOSIGNAL
+        const int SendFlags = MSG_NOSIGNAL;
+#else
+        const int SendFlags = 0;
+#endif
+        while (Size > 0) {
+            ssize_t Count = send(FD, Data, Size, SendFlags);
+            if (Count < 0 && errno == EINTR)
+                continue;
+            if (Count <= 0)
+                return false;
+            Data += Count;
+            Size -= static_cast<size_t>(Count);
+        }
+        return true;
+    }
+    bool ReadAll(uint8_t *Data, size_t Size) {
+        while (Size > 0) {
+            ssize_t Count = read(FD, Data, Size);
+            if (Count < 0 && errno == EINTR)
+                continue;
+            if (Count <= 0)
+                return false;
+            Data += Count;
+            Size -= static_cast<size_t>(Count);
+        }
+        return true;
+    }
+    bool ReadLine(std::string &Line) {
+        Line.clear();
+        char c;
+        while (Line.size() < 4096) {
+            if (!ReadAll(reinterpret_cast<uint8_t *>(&c), 1))
+                return false;
+            if (c == '\n')
+                return true;
+            Line.push_back(c);
+        }
+        return false;
+    }
+};
+#endif
+}
+
+void SetIndexServer(const char *SocketPath) {
+    std::lock_guard<std::mutex> Guard(ServerLock);
+    ServerPath = SocketPath ? SocketPath : "";
+    ServerConfigured = true;
+}
+
+void SetIndexServerTimeout(int Milliseconds) {
+    std::lock_guard<std::mutex> Guard(ServerLock);
+    ServerTimeout = std::max(Milliseconds, 1);
+}
+
+std::unique_ptr<FFMS_Index> FetchIndexFromServer(const char *SourceFile, IndexServerRequest const& Request,
+    int64_t Filesize, const uint8_t Digest[20], std::function<bool(int64_t, int64_t)> const& Progress) {
+#ifdef _WIN32
+    return nullptr;
+#else
+    std::string Path = GetServerPath();
+    if (Path.empty())
+        return nullptr;
+    int Timeout;
+    {
+        std::lock_guard<std::mutex> Guard(ServerLock);
+        Timeout = ServerTimeout;
+    }
+    auto Start = std::chrono::steady_clock::now();
+
+    // The server runs in another directory, and can't read paths which don't
+    // fit on the request line
+    char AbsolutePath[PATH_MAX];
+    if (!realpath(SourceFile, AbsolutePath) || strchr(AbsolutePath, '\n'))
+        return nullptr;
+
+    // A server which stops answering is treated like one which isn't there
+    Socket Server;
+    if (!Server.SetTimeout(Timeout) || !Server.Connect(Path))
+        return nullptr;
+
+    std::stringstream RequestLine;
+    RequestLine << "FFMS2 INDEX " << Request.ErrorHandling << " " << Request.Flags << " "
+        << Request.Threads << " " << Request.ReadAheadSize << " " << Request.Tracks.size();
+    for (int Track : Request.Tracks)
+        RequestLine << " " << Track;
+    RequestLine << " " << AbsolutePath << "\n";
+    std::string RequestString = RequestLine.str();
+    if (!Server.WriteAll(RequestString.data(), RequestString.size()))
+        return nullptr;
+
+    std::string Response;
+    for (;;) {
+        if (!Server.ReadLine(Response))
+            return nullptr;
+        if (Response.compare(0, 9, "PROGRESS ") != 0)
+            break;
+        long long Current = 0, Total = 0;
+        std::istringstream(Response.substr(9)) >> Current >> Total;
+        if (Total > 0 && Progress(Current, Total))
+            throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER,
+                "Cancelled by user");
+    }
+    if (Response.compare(0, 3, "OK ") != 0)
+        return nullptr;
+    uint64_t Size = strtoull(Response.c_str() + 3, nullptr, 10);
+    if (Size == 0 || Size > MaxIndexSize)
+        return nullptr;
+
+    std::vector<uint8_t> Buffer(static_cast<size_t>(Size));
+    if (!Server.ReadAll(Buffer.data(), Buffer.size()))
+        return nullptr;
+
+    std::unique_ptr<FFMS_Index> Index;
+    try {
+        Index.reset(new FFMS_Index(Buffer.data(), Buffer.size()));
+    } catch (...) {
+        return nullptr;
+    }
+
+    // The file may have changed since the server indexed it
+    if (Index->Filesize != Filesize || memcmp(Index->Digest, Digest, sizeof(Index->Digest)))
+        return nullptr;
+    Index->Stats.TotalTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    Index->Stats.BytesRead = static_cast<int64_t>(Buffer.size());
+    return Index;
+#endif
+}
@@ -0,0 +1,64 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+
+struct FFMS_Index;
+
+// Client side of the index server run by `ffmsindex -S`.
+//
+// The protocol is a single request and response per connection on a Unix
+// domain socket. The request is one line:
+//
+//     FFMS2 INDEX <errorhandling> <flags> <threads> <readahead> <ntracks> <track>... <path>\n
+//
+// where path is absolute and runs to the end of the line. The server answers
+// with any number of "PROGRESS <current> <total>\n" lines while it waits for
+// or makes the index, at least once a second, and then either "OK <size>\n"
+// followed by size bytes of an index in the format written by
+// FFMS_WriteIndex, or "ERR <message>\n".
+
+struct IndexServerRequest {
+    std::set<int> Tracks;
+    int ErrorHandling;
+    int Flags;
+    int Threads;
+    int64_t ReadAheadSize;
+};
+
+// Overrides the FFMS2_INDEX_SERVER environment variable; null or an empty
+// string disables fetching indexes from a server
+void SetIndexServer(const char *SocketPath);
+
+// How long the server may stay silent before the client gives up on it. Only
+// meant for the tests, which don't want to wait for the default of 30 seconds.
+void SetIndexServerTimeout(int Milliseconds);
+
+// Returns null if no server is configured or anything at all goes wrong,
+// including the server going quiet for longer than the timeout, in which
+// case the caller indexes the file itself. Progress gets what the server
+// reports and returns true to cancel, which throws.
+std::unique_ptr<FFMS_Index> FetchIndexFromServer(const char *SourceFile, IndexServerRequest const& Request,
+    int64_t Filesize, const uint8_t Digest[20], std::function<bool(int64_t, int64_t)> const& Progress);
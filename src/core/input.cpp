@@ -0,0 +1,335 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "input.h"
+
+#include "filehandle.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+namespace {
+#ifndef _WIN32
+class PosixFileInput : public InputSource {
+    std::string Filename;
+    int FD;
+    int ErrorSource;
+    int64_t FileSize;
+
+public:
+    PosixFileInput(const char *Filename, int ErrorSource)
+        : Filename(Filename)
+        , FD(open(Filename, O_RDONLY))
+        , ErrorSource(ErrorSource) {
+        if (FD < 0)
+            throw FFMS_Exception(ErrorSource, FFMS_ERROR_NO_FILE,
+                "Failed to open '" + this->Filename + "'");
+
+        struct stat st;
+        if (fstat(FD, &st) != 0) {
+            close(FD);
+            throw FFMS_Exception(ErrorSource, FFMS_ERROR_FILE_READ,
+                "Failed to get file size for '" + this->Filename + "'");
+        }
+        FileSize = st.st_size;
+    }
+
+    ~PosixFileInput() {
+        close(FD);
+    }
+
+    size_t Read(int64_t Offset, uint8_t *Buffer, size_t Size) override {
+        size_t Total = 0;
+        while (Total < Size) {
+            ssize_t Count = pread(FD, Buffer + Total, Size - Total, static_cast<off_t>(Offset + Total));
+            if (Count < 0 && errno == EINTR)
+                continue;
+            if (Count < 0)
+                throw FFMS_Exception(ErrorSource, FFMS_ERROR_FILE_READ,
+                    "Failed to read from '" + Filename + "'");
+            if (Count == 0)
+                break;
+            Total += static_cast<size_t>(Count);
+        }
+        return Total;
+    }
+
+    int64_t Size() override {
+        return FileSize;
+    }
+
+    void HintSequential() override {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(FD, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+};
+#endif
+
+// Everything that isn't a local file on a POSIX system goes through avio
+class AVIOInput : public InputSource {
+    FileHandle File;
+    std::mutex Lock;
+
+public:
+    AVIOInput(const char *Filename, int ErrorSource)
+        : File(Filename, "rb", ErrorSource, FFMS_ERROR_FILE_READ) {
+    }
+
+    size_t Read(int64_t Offset, uint8_t *Buffer, size_t Size) override {
+        std::lock_guard<std::mutex> Guard(Lock);
+        File.Seek(Offset, SEEK_SET);
+        size_t Total = 0;
+        while (Total < Size) {
+            size_t Count = File.Read(reinterpret_cast<char *>(Buffer) + Total, Size - Total);
+            if (Count == 0)
+                break;
+            Total += Count;
+        }
+        return Total;
+    }
+
+    int64_t Size() override {
+        std::lock_guard<std::mutex> Guard(Lock);
+        return File.Size();
+    }
+};
+
+class CallbackInput : public InputSource {
+    FFMS_IOCallbacks Callbacks;
+
+public:
+    CallbackInput(FFMS_IOCallbacks const& Callbacks)
+        : Callbacks(Callbacks) {
+    }
+
+    ~CallbackInput() {
+        if (Callbacks.Close)
+            Callbacks.Close(Callbacks.Private);
+    }
+
+    size_t Read(int64_t Offset, uint8_t *Buffer, size_t Size) override {
+        size_t Total = 0;
+        while (Total < Size) {
+            int64_t Count = Callbacks.Read(Callbacks.Private, Offset + Total, Buffer + Total, Size - Total);
+            if (Count < 0)
+                throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+                    "Read callback failed");
+            if (Count == 0)
+                break;
+            Total += static_cast<size_t>(Count);
+        }
+        return Total;
+    }
+
+    int64_t Size() override {
+        int64_t Size = Callbacks.Size(Callbacks.Private);
+        if (Size < 0)
+            throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+                "Size callback failed");
+        return Size;
+    }
+};
+
+class MemoryInput : public InputSource {
+    const uint8_t *Buffer;
+    int64_t BufferSize;
+
+public:
+    MemoryInput(const uint8_t *Buffer, int64_t Size)
+        : Buffer(Buffer)
+        , BufferSize(Size) {
+    }
+
+    size_t Read(int64_t Offset, uint8_t *Dest, size_t Size) override {
+        if (Offset >= BufferSize)
+            return 0;
+        size_t Count = static_cast<size_t>(std::min<int64_t>(Size, BufferSize - Offset));
+        memcpy(Dest, Buffer + Offset, Count);
+        return Count;
+    }
+
+    int64_t Size() override {
+        return BufferSize;
+    }
+};
+
+std::mutex RegistryLock;
+std::map<std::string, std::shared_ptr<InputSource>> Registry;
+
+struct InputIOState {
+    std::shared_ptr<InputSource> Input;
+    int64_t Position = 0;
+    int64_t Size = 0;
+};
+
+int ReadInput(void *Opaque, uint8_t *Buffer, int Size) {
+    InputIOState *State = static_cast<InputIOState *>(Opaque);
+    try {
+        size_t Count = State->Input->Read(State->Position, Buffer, Size);
+        if (Count == 0)
+            return AVERROR_EOF;
+        State->Position += Count;
+        return static_cast<int>(Count);
+    } catch (FFMS_Exception &) {
+        return AVERROR(EIO);
+    }
+}
+
+int64_t SeekInput(void *Opaque, int64_t Offset, int Whence) {
+    InputIOState *State = static_cast<InputIOState *>(Opaque);
+    switch (Whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return State->Size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        Offset += State->Position;
+        break;
+    case SEEK_END:
+        Offset += State->Size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (Offset < 0)
+        return AVERROR(EINVAL);
+    State->Position = Offset;
+    return Offset;
+}
+
+const int IOBufferSize = 64 * 1024;
+}
+
+bool IsRegularFile(const char *Filename) {
+#ifdef _WIN32
+    int Length = MultiByteToWideChar(CP_UTF8, 0, Filename, -1, nullptr, 0);
+    if (Length <= 0)
+        return false;
+    std::wstring WideFilename(Length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, Filename, -1, &WideFilename[0], Length);
+    DWORD Attributes = GetFileAttributesW(WideFilename.c_str());
+    return Attributes != INVALID_FILE_ATTRIBUTES && !(Attributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE));
+#else
+    struct stat st;
+    return stat(Filename, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+std::shared_ptr<InputSource> OpenFileInput(const char *Filename, int ErrorSource) {
+#ifndef _WIN32
+    if (IsRegularFile(Filename))
+        return std::make_shared<PosixFileInput>(Filename, ErrorSource);
+#endif
+    return std::make_shared<AVIOInput>(Filename, ErrorSource);
+}
+
+// The input is only made once the name is known to be free, since destroying
+// a callback input calls back into the application
+template<typename T, typename... Args>
+static void AddRegistryEntry(const char *Name, Args&&... args) {
+    std::lock_guard<std::mutex> Guard(RegistryLock);
+    std::shared_ptr<InputSource> &Entry = Registry[Name];
+    if (Entry)
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_INVALID_ARGUMENT,
+            std::string("An input named '") + Name + "' is already registered");
+    try {
+        Entry = std::make_shared<T>(std::forward<Args>(args)...);
+    } catch (...) {
+        Registry.erase(Name);
+        throw;
+    }
+}
+
+void RegisterCallbackInput(const char *Name, FFMS_IOCallbacks const& Callbacks) {
+    AddRegistryEntry<CallbackInput>(Name, Callbacks);
+}
+
+void RegisterMemoryInput(const char *Name, const uint8_t *Buffer, int64_t Size) {
+    AddRegistryEntry<MemoryInput>(Name, Buffer, Size);
+}
+
+void UnregisterInput(const char *Name) {
+    std::shared_ptr<InputSource> Input;
+    {
+        std::lock_guard<std::mutex> Guard(RegistryLock);
+        auto it = Registry.find(Name);
+        if (it == Registry.end())
+            return;
+        Input = std::move(it->second);
+        Registry.erase(it);
+    }
+    // Input is released here, outside of the lock, as it may call back
+    // into the application
+}
+
+std::shared_ptr<InputSource> FindRegisteredInput(const char *Name) {
+    std::lock_guard<std::mutex> Guard(RegistryLock);
+    if (Registry.empty())
+        return nullptr;
+    auto it = Registry.find(Name);
+    return it == Registry.end() ? nullptr : it->second;
+}
+
+AVIOContext *CreateInputIOContext(std::shared_ptr<InputSource> Input) {
+    std::unique_ptr<InputIOState> State = make_unique<InputIOState>();
+    State->Size = Input->Size();
+    State->Input = std::move(Input);
+
+    unsigned char *IOBuffer = static_cast<unsigned char *>(av_malloc(IOBufferSize));
+    AVIOContext *IOContext = nullptr;
+    if (IOBuffer)
+        IOContext = avio_alloc_context(IOBuffer, IOBufferSize, 0, State.get(), ReadInput, nullptr, SeekInput);
+    if (!IOContext) {
+        av_free(IOBuffer);
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+            "Could not allocate I/O context");
+    }
+    State.release();
+    return IOContext;
+}
+
+void FreeInputIOContext(AVIOContext **IOContext) {
+    if (!*IOContext)
+        return;
+    delete static_cast<InputIOState *>((*IOContext)->opaque);
+    av_freep(&(*IOContext)->buffer);
+    avio_context_free(IOContext);
+}
@@ -0,0 +1,59 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#pragma once
+
+#include "ffms.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct AVIOContext;
+
+// Random access to the bytes of a source file or of an input registered
+// through FFMS_RegisterInput. Read() may be called from several threads at
+// once, so nothing in here has a current position.
+class InputSource {
+public:
+    virtual ~InputSource() {}
+    // Returns less than Size only at the end of the input
+    virtual size_t Read(int64_t Offset, uint8_t *Buffer, size_t Size) = 0;
+    virtual int64_t Size() = 0;
+    // Tells the OS the input is about to be read from start to end
+    virtual void HintSequential() {}
+};
+
+bool IsRegularFile(const char *Filename);
+
+// Opens a file, or anything else avio can open
+std::shared_ptr<InputSource> OpenFileInput(const char *Filename, int ErrorSource);
+
+// Nothing is called back if registration fails because the name is taken
+void RegisterCallbackInput(const char *Name, FFMS_IOCallbacks const& Callbacks);
+void RegisterMemoryInput(const char *Name, const uint8_t *Buffer, int64_t Size);
+void UnregisterInput(const char *Name);
+// Returns null if nothing is registered under the name
+std::shared_ptr<InputSource> FindRegisteredInput(const char *Name);
+
+// A seekable AVIOContext with its own position which keeps Input alive until
+// it is freed with FreeInputIOContext
+AVIOContext *CreateInputIOContext(std::shared_ptr<InputSource> Input);
+void FreeInputIOContext(AVIOContext **IOContext);
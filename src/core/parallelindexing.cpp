@@ -0,0 +1,395 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// Parallel indexing of formats which can be split into byte ranges.
+//
+// Every range is indexed by its own demuxer, parser and decoders, starting
+// with a byte seek to the start of the range and reading on past its end.
+// Right after the seek the parser and decoder state is unknown, so the
+// beginning of a range can't be trusted on its own. Instead the previous
+// range, which has been running continuously since a point that was already
+// verified, is read far enough past the boundary to find a keyframe from
+// which both agree on every indexed field for the rest of the overlap. The
+// ranges are spliced at that point, which makes the result identical to what
+// a single serial pass produces. If no such point is found, or anything else
+// unusual happens, the caller falls back to a serial pass.
+
+#include "indexing.h"
+
+#include "track.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+// How far a range may be read past its end while looking for a splice point
+const int64_t MaxOverlap = 256 * 1024 * 1024;
+// How much of every track has to be read past the end of a range
+const int OverlapKeyFrames = 2;
+const int OverlapAudioPackets = 64;
+// Audio packets which have to match before the ranges are considered to agree
+const size_t MinAudioMatch = 8;
+
+bool SameFrame(FrameInfo const& a, FrameInfo const& b) {
+    return a.PTS == b.PTS && a.FilePos == b.FilePos && a.SampleCount == b.SampleCount &&
+        a.FrameType == b.FrameType && a.RepeatPict == b.RepeatPict &&
+        a.KeyFrame == b.KeyFrame && a.Hidden == b.Hidden;
+}
+
+// Splices Next onto the end of Track at the first point after Boundary from
+// which both contain exactly the same frames, trying at most MaxCandidates
+// points
+bool StitchTrack(FFMS_Track &Track, FFMS_Track const& Next, int64_t Boundary, int MaxCandidates) {
+    size_t TailStart = 0;
+    while (TailStart < Track.size() && Track[TailStart].FilePos < Boundary)
+        ++TailStart;
+
+    if (TailStart == Track.size())
+        return Next.empty();
+    if (Next.empty())
+        return false;
+
+    int Tried = 0;
+    size_t j = 0;
+    for (size_t i = TailStart; i < Track.size() && Tried < MaxCandidates; ++i) {
+        if (Track.TT == FFMS_TYPE_VIDEO && !Track[i].KeyFrame)
+            continue;
+        // Packets split from one PES share a position, so only the first of
+        // them can be matched up unambiguously
+        if (i > TailStart && Track[i - 1].FilePos == Track[i].FilePos)
+            continue;
+        ++Tried;
+
+        while (j < Next.size() && Next[j].FilePos < Track[i].FilePos)
+            ++j;
+        if (j == Next.size())
+            break;
+        if (Next[j].FilePos != Track[i].FilePos)
+            continue;
+
+        size_t Count = Track.size() - i;
+        if (Track.TT == FFMS_TYPE_AUDIO && Count < MinAudioMatch)
+            break;
+        if (Count > Next.size() - j)
+            continue;
+
+        bool Match = true;
+        for (size_t m = 0; m < Count && Match; ++m)
+            Match = SameFrame(Track[i + m], Next[j + m]);
+        if (Match) {
+            Track.SpliceFrames(i, Next, j);
+            return true;
+        }
+    }
+    return false;
+}
+
+// libavformat unwraps 33 bit timestamps relative to the first timestamp it
+// sees, which differs between the ranges. Only accept the result if no
+// unwrapping can have happened in any of them.
+bool TimestampsUnwrapped(std::vector<const FFMS_Track *> const& Fragments, AVStream *Stream) {
+    if (Stream->pts_wrap_bits >= 63)
+        return true;
+
+    const int64_t WrapPoint = 1LL << Stream->pts_wrap_bits;
+    const int64_t Slack = av_rescale(60, Stream->time_base.den, Stream->time_base.num);
+    int64_t FirstTS = AV_NOPTS_VALUE;
+    for (size_t k = 0; k < Fragments.size(); ++k) {
+        for (auto const& Frame : *Fragments[k]) {
+            if (Frame.PTS == AV_NOPTS_VALUE)
+                continue;
+            if (Frame.PTS < 0 || Frame.PTS >= WrapPoint)
+                return false;
+            if (FirstTS == AV_NOPTS_VALUE) {
+                if (k > 0 || Frame.PTS >= WrapPoint - (WrapPoint >> 3))
+                    return false;
+                FirstTS = Frame.PTS;
+            } else if (Frame.PTS < FirstTS - Slack) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+}
+
+void FFMS_Indexer::OpenCodecs(IndexingPass &Pass) {
+    for (unsigned int i = 0; i < Pass.FormatContext->nb_streams; i++) {
+        if (!IndexMask.count(i)) {
+            Pass.FormatContext->streams[i]->discard = AVDISCARD_ALL;
+            continue;
+        }
+
+        AVCodecParameters *Params = FormatContext->streams[i]->codecpar;
+        AVCodec *Codec = avcodec_find_decoder(Params->codec_id);
+        if (!Codec)
+            throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_UNSUPPORTED,
+                "Codec not found");
+
+        SharedAVContext &Context = Pass.AVContexts[i];
+        Context.CodecContext = avcodec_alloc_context3(Codec);
+        if (Context.CodecContext == nullptr)
+            throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_ALLOCATION_FAILED,
+                "Could not allocate codec context");
+
+        if (avcodec_parameters_to_context(Context.CodecContext, Params) < 0)
+            throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
+                "Could not copy codec parameters");
+
+        if (avcodec_open2(Context.CodecContext, Codec, nullptr) < 0)
+            throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
+                "Could not open codec");
+
+        if (Params->codec_type == AVMEDIA_TYPE_VIDEO) {
+            Context.Parser = av_parser_init(Params->codec_id);
+            if (Context.Parser)
+                Context.Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
+        }
+    }
+}
+
+bool FFMS_Indexer::CanIndexInParallel() {
+    // Only formats which resynchronize after a byte seek and store real
+    // timestamps can be split. Raw elementary streams get timestamps made up
+    // from where reading started, so a range could never match a serial pass.
+    const char *Name = FormatContext->iformat->name;
+    if (strcmp(Name, "mpegts") && strcmp(Name, "mpeg"))
+        return false;
+    if (!FormatContext->pb || (FormatContext->iformat->flags & AVFMT_NO_BYTE_SEEK))
+        return false;
+    // Keyframe-only tracks number their frames while reading, which a range
+    // starting in the middle of the file can't do
+    if (Flags & FFMS_INDEX_FLAG_KEYFRAMES_ONLY)
+        return false;
+    // Waveform summaries have to be made from the audio in order
+    if (Flags & FFMS_INDEX_FLAG_WAVEFORM)
+        return false;
+    return Filesize >= 2 * MinRangeSize;
+}
+
+bool FFMS_Indexer::DoParallelIndexing(FFMS_Index &TrackIndices, std::vector<SharedAVContext> &AVContexts) {
+    const int NumRanges = static_cast<int>(std::min<int64_t>(Threads, Filesize / MinRangeSize));
+    if (NumRanges < 2)
+        return false;
+
+    struct Range {
+        int64_t Start = 0;
+        int64_t End = 0;
+        std::atomic<int64_t> Position{ 0 };
+        std::unique_ptr<FFMS_Index> Fragment;
+        std::vector<int> HasBFrames;
+        IndexingStats Stats;
+        bool Failed = false;
+        std::thread Thread;
+    };
+
+    std::vector<Range> Ranges(NumRanges);
+    for (int k = 0; k < NumRanges; ++k) {
+        Ranges[k].Start = Filesize * k / NumRanges;
+        Ranges[k].End = Filesize * (k + 1) / NumRanges;
+        Ranges[k].Position = Ranges[k].Start;
+    }
+
+    std::atomic<bool> Stop{ false };
+    std::mutex Lock;
+    std::condition_variable Finished;
+    int Running = 0;
+
+    auto IndexRange = [&](Range &R) {
+        AVFormatContext *Context = nullptr;
+        AVPacket Packet;
+        InitNullPacket(Packet);
+        try {
+            LAVFOpenInput(SourceFile.c_str(), Context, FormatContext->iformat);
+
+            if (avformat_find_stream_info(Context, nullptr) < 0)
+                throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+                    "Couldn't find stream information");
+
+            if (Context->nb_streams != FormatContext->nb_streams)
+                throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_MISMATCH,
+                    "Stream layout differs between ranges");
+            for (int Track : IndexMask) {
+                if (Context->streams[Track]->codecpar->codec_id != FormatContext->streams[Track]->codecpar->codec_id)
+                    throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_MISMATCH,
+                        "Stream layout differs between ranges");
+            }
+
+            IndexingPass Pass(Context, true);
+            OpenCodecs(Pass);
+
+            if (R.Start > 0 && av_seek_frame(Context, -1, R.Start, AVSEEK_FLAG_BYTE) < 0)
+                throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_UNKNOWN,
+                    "Byte seeking failed");
+
+            R.Fragment = make_unique<FFMS_Index>(Filesize, Digest, ErrorHandling);
+            for (auto const& Track : TrackIndices)
+                R.Fragment->emplace_back(Track.TB.Num, Track.TB.Den, Track.TT, Track.HasDiscontTS, Track.UseDTS, Track.HasTS);
+
+            std::map<int, int> Overlap;
+            for (int Track : IndexMask)
+                Overlap[Track] = Context->streams[Track]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO ? OverlapKeyFrames : OverlapAudioPackets;
+            size_t Pending = Overlap.size();
+            const bool IsLast = R.End == Filesize;
+
+            while (!Stop && Pass.ReadPacket(Packet)) {
+                int Track = Packet.stream_index;
+                if (!IndexMask.count(Track) || (Packet.pos >= 0 && Packet.pos < R.Start)) {
+                    av_packet_unref(&Packet);
+                    continue;
+                }
+                if (Packet.pos < 0)
+                    throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+                        "Packet without a file position");
+
+                bool PastEnd = !IsLast && Packet.pos >= R.End;
+                if (PastEnd && Packet.pos >= R.End + MaxOverlap)
+                    break;
+                if (PastEnd) {
+                    int &Left = Overlap[Track];
+                    bool Counts = Context->streams[Track]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO || (Packet.flags & AV_PKT_FLAG_KEY);
+                    if (Left > 0 && Counts && --Left == 0)
+                        --Pending;
+                }
+
+                R.Position = Packet.pos;
+                IndexPacket(Pass, Packet, *R.Fragment);
+                av_packet_unref(&Packet);
+
+                if (PastEnd && Pending == 0)
+                    break;
+            }
+
+            R.HasBFrames.resize(Context->nb_streams);
+            for (int Track : IndexMask)
+                R.HasBFrames[Track] = Pass.AVContexts[Track].CodecContext->has_b_frames;
+            R.Stats.Add(Pass);
+        } catch (...) {
+            av_packet_unref(&Packet);
+            R.Failed = true;
+            Stop = true;
+        }
+        LAVFCloseFile(Context);
+        R.Position = R.End;
+
+        std::lock_guard<std::mutex> Guard(Lock);
+        --Running;
+        Finished.notify_one();
+    };
+
+    bool Cancelled = false;
+    try {
+        for (auto &R : Ranges) {
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                ++Running;
+            }
+            try {
+                R.Thread = std::thread(IndexRange, std::ref(R));
+            } catch (...) {
+                std::lock_guard<std::mutex> Guard(Lock);
+                --Running;
+                throw;
+            }
+        }
+
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (Running > 0) {
+            Finished.wait_for(Guard, std::chrono::milliseconds(100));
+            if ((IC || IC2) && !Cancelled) {
+                int64_t Current = 0;
+                for (auto const& R : Ranges)
+                    Current += std::min<int64_t>(std::max<int64_t>(R.Position - R.Start, 0), R.End - R.Start);
+
+                Guard.unlock();
+                if (ReportProgress(Current, Filesize, Current, -1)) {
+                    Cancelled = true;
+                    Stop = true;
+                }
+                Guard.lock();
+            }
+        }
+    } catch (...) {
+        Stop = true;
+        for (auto &R : Ranges)
+            if (R.Thread.joinable())
+                R.Thread.join();
+        throw;
+    }
+
+    for (auto &R : Ranges)
+        R.Thread.join();
+
+    if (Cancelled)
+        throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER,
+            "Cancelled by user");
+
+    for (auto const& R : Ranges)
+        if (R.Failed)
+            return false;
+
+    std::vector<FFMS_Track> Stitched(TrackIndices.size());
+    for (int Track : IndexMask) {
+        std::vector<const FFMS_Track *> Fragments;
+        for (auto const& R : Ranges)
+            Fragments.push_back(&(*R.Fragment)[Track]);
+
+        if (!TimestampsUnwrapped(Fragments, FormatContext->streams[Track]))
+            return false;
+
+        FFMS_Track Result = *Fragments[0];
+        for (int k = 1; k < NumRanges; ++k) {
+            FFMS_Track const& Next = *Fragments[k];
+            if (Next.UseDTS != Result.UseDTS)
+                return false;
+            // Missing video timestamps are made up from the previous frame,
+            // which a range doesn't have at its start
+            if (Result.TT == FFMS_TYPE_VIDEO && !Next.HasTS)
+                return false;
+
+            if (!StitchTrack(Result, Next, Ranges[k].Start, MaxSpliceCandidates))
+                return false;
+
+            if (!Next.empty())
+                Result.LastDuration = Next.LastDuration;
+            Result.HasTS = Result.TT == FFMS_TYPE_VIDEO ? (Result.HasTS && Next.HasTS) : (Result.HasTS || Next.HasTS);
+            Result.SampleRate = std::max(Result.SampleRate, Next.SampleRate);
+        }
+        Stitched[Track] = Result;
+    }
+
+    for (int Track : IndexMask) {
+        TrackIndices[Track] = Stitched[Track];
+        if (AVContexts[Track].CodecContext) {
+            for (auto const& R : Ranges)
+                AVContexts[Track].CodecContext->has_b_frames = std::max(AVContexts[Track].CodecContext->has_b_frames, R.HasBFrames[Track]);
+        }
+    }
+
+    for (auto const& R : Ranges)
+        TrackIndices.Stats.Add(R.Stats);
+    TrackIndices.Stats.ParallelRanges = NumRanges;
+
+    return true;
+}
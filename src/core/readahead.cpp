@@ -0,0 +1,255 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "readahead.h"
+
+#include "input.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+namespace {
+const size_t MinBlockSize = 64 * 1024;
+const int IOBufferSize = 64 * 1024;
+// Refills start on a page boundary, and go to buffers which do too, so
+// that the kernel copies whole pages
+const int64_t ReadAlignment = 4096;
+
+// Whole pages, so that refills which follow each other stay aligned
+size_t UsableBlockSize(size_t Size) {
+    Size = std::max(Size, MinBlockSize);
+    return Size + (ReadAlignment - Size % ReadAlignment) % ReadAlignment;
+}
+}
+
+ReadAheadReader::ReadAheadReader(std::shared_ptr<InputSource> Input, size_t BlockSize)
+    : Input(Input)
+    , FileSize(Input->Size())
+    , BlockSize(UsableBlockSize(BlockSize)) {
+    Input->HintSequential();
+
+    unsigned char *IOBuffer = static_cast<unsigned char *>(av_malloc(IOBufferSize));
+    if (IOBuffer)
+        IOContext = avio_alloc_context(IOBuffer, IOBufferSize, 0, this, ReadCallback, nullptr, SeekCallback);
+    if (!IOContext) {
+        av_free(IOBuffer);
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+            "Could not allocate I/O context");
+    }
+
+    StatsStart = std::chrono::steady_clock::now();
+    Worker = std::thread(&ReadAheadReader::WorkerLoop, this);
+}
+
+ReadAheadReader::~ReadAheadReader() {
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Stop = true;
+    }
+    WorkerCond.notify_all();
+    Worker.join();
+
+    av_freep(&IOContext->buffer);
+    avio_context_free(&IOContext);
+}
+
+void ReadAheadReader::WorkerLoop() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (true) {
+        Block *Target = nullptr;
+        WorkerCond.wait(Guard, [&] {
+            if (Stop)
+                return true;
+            if (FillOffset >= FileSize)
+                return false;
+            for (auto &B : Blocks) {
+                if (!B.Ready && !B.Filling) {
+                    Target = &B;
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (Stop)
+            return;
+
+        const int64_t Offset = FillOffset;
+        const size_t Size = static_cast<size_t>(std::min<int64_t>(BlockSize, FileSize - Offset));
+        const unsigned ReadGeneration = Generation;
+        Target->Filling = true;
+        PendingOffset = Offset;
+        PendingSize = Size;
+        FillOffset += Size;
+        Guard.unlock();
+
+        size_t Count = 0;
+        bool Error = false;
+        if (Target->Capacity < Size) {
+            // av_malloc only aligns to what SIMD needs
+            Target->Memory.reset(new (std::nothrow) uint8_t[Size + ReadAlignment - 1]);
+            Target->Data = Target->Memory.get();
+            if (Target->Data)
+                Target->Data += (ReadAlignment - reinterpret_cast<uintptr_t>(Target->Data) % ReadAlignment) % ReadAlignment;
+            Target->Capacity = Target->Data ? Size : 0;
+        }
+        if (Target->Data) {
+            try {
+                Count = Input->Read(Offset, Target->Data, Size);
+            } catch (FFMS_Exception &) {
+                Error = true;
+            }
+        } else {
+            Error = true;
+        }
+
+        Guard.lock();
+        Target->Filling = false;
+        BytesRead += Count;
+        if (ReadGeneration != Generation)
+            continue;
+
+        PendingOffset = -1;
+        Target->Offset = Offset;
+        Target->Size = Count;
+        Target->Error = Error;
+        Target->Ready = true;
+        // The file got shorter while we were reading it
+        if (Count < Size && !Error)
+            FileSize = Offset + Count;
+        ConsumerCond.notify_all();
+    }
+}
+
+bool ReadAheadReader::Covers(int64_t Offset, size_t Size) const {
+    return Offset <= Position && Position < Offset + static_cast<int64_t>(Size);
+}
+
+int ReadAheadReader::Read(uint8_t *Buffer, int Size) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (true) {
+        if (Position >= FileSize)
+            return AVERROR_EOF;
+
+        for (auto &B : Blocks) {
+            if (!B.Ready)
+                continue;
+            if (B.Error && B.Offset <= Position) {
+                B.Ready = false;
+                WorkerCond.notify_one();
+                return AVERROR(EIO);
+            }
+            if (!Covers(B.Offset, B.Size))
+                continue;
+
+            size_t Count = static_cast<size_t>(std::min<int64_t>(Size, B.Offset + B.Size - Position));
+            memcpy(Buffer, B.Data + (Position - B.Offset), Count);
+            Position += Count;
+            if (Position == B.Offset + static_cast<int64_t>(B.Size)) {
+                B.Ready = false;
+                WorkerCond.notify_one();
+            }
+            return static_cast<int>(Count);
+        }
+
+        // Data we have skipped past is never needed again, and the worker
+        // may be waiting for room to read what comes next
+        bool HasFree = false;
+        for (auto &B : Blocks) {
+            if (B.Ready && B.Offset + static_cast<int64_t>(B.Size) <= Position) {
+                B.Ready = false;
+                WorkerCond.notify_one();
+            }
+            HasFree = HasFree || !B.Ready;
+        }
+
+        // Wait if the data is already being read or is next in line,
+        // otherwise throw away everything buffered and start over here
+        bool Pending = PendingOffset >= 0 ? Covers(PendingOffset, PendingSize) : (HasFree && Covers(FillOffset, BlockSize));
+        if (!Pending) {
+            ++Generation;
+            for (auto &B : Blocks)
+                B.Ready = false;
+            PendingOffset = -1;
+            FillOffset = Position - Position % ReadAlignment;
+            WorkerCond.notify_one();
+        }
+        ConsumerCond.wait(Guard);
+    }
+}
+
+int64_t ReadAheadReader::Seek(int64_t Offset, int Whence) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    switch (Whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return FileSize;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        Offset += Position;
+        break;
+    case SEEK_END:
+        Offset += FileSize;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (Offset < 0)
+        return AVERROR(EINVAL);
+    Position = Offset;
+    return Position;
+}
+
+int ReadAheadReader::ReadCallback(void *Opaque, uint8_t *Buffer, int Size) {
+    return static_cast<ReadAheadReader *>(Opaque)->Read(Buffer, Size);
+}
+
+int64_t ReadAheadReader::SeekCallback(void *Opaque, int64_t Offset, int Whence) {
+    return static_cast<ReadAheadReader *>(Opaque)->Seek(Offset, Whence);
+}
+
+void ReadAheadReader::SetBlockSize(size_t Size) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    BlockSize = UsableBlockSize(Size);
+}
+
+void ReadAheadReader::ResetStats() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    BytesRead = 0;
+    StatsStart = std::chrono::steady_clock::now();
+}
+
+int64_t ReadAheadReader::GetBytesRead() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return BytesRead;
+}
+
+double ReadAheadReader::GetBandwidth() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StatsStart;
+    return Elapsed.count() > 0 ? BytesRead / Elapsed.count() : 0;
+}
@@ -0,0 +1,97 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct AVIOContext;
+class InputSource;
+
+// An AVIOContext which reads an input on a background thread into two large
+// buffers, one being filled while the other one is consumed, so that the
+// thread doing the demuxing never has to wait for the disk as long as the
+// disk keeps up. Seeking outside of the buffered data discards it and
+// restarts reading at the new position.
+class ReadAheadReader {
+    struct Block {
+        std::unique_ptr<uint8_t[]> Memory;
+        // Starts on a page boundary within Memory
+        uint8_t *Data = nullptr;
+        size_t Capacity = 0;
+        int64_t Offset = 0;
+        size_t Size = 0;
+        bool Ready = false;
+        bool Filling = false;
+        bool Error = false;
+    };
+
+    std::shared_ptr<InputSource> Input;
+    int64_t FileSize = 0;
+    AVIOContext *IOContext = nullptr;
+
+    std::mutex Lock;
+    std::condition_variable WorkerCond;
+    std::condition_variable ConsumerCond;
+    std::thread Worker;
+    bool Stop = false;
+
+    Block Blocks[2];
+    size_t BlockSize;
+    // Read position of the consumer
+    int64_t Position = 0;
+    // Where the worker will read next, and what it is currently reading
+    int64_t FillOffset = 0;
+    int64_t PendingOffset = -1;
+    size_t PendingSize = 0;
+    // Incremented whenever buffered data is thrown away after a seek
+    unsigned Generation = 0;
+
+    int64_t BytesRead = 0;
+    std::chrono::steady_clock::time_point StatsStart;
+
+    void WorkerLoop();
+    bool Covers(int64_t Offset, size_t Size) const;
+    int Read(uint8_t *Buffer, int Size);
+    int64_t Seek(int64_t Offset, int Whence);
+
+    static int ReadCallback(void *Opaque, uint8_t *Buffer, int Size);
+    static int64_t SeekCallback(void *Opaque, int64_t Offset, int Whence);
+
+public:
+    static const size_t DefaultBlockSize = 4 * 1024 * 1024;
+
+    ReadAheadReader(std::shared_ptr<InputSource> Input, size_t BlockSize);
+    ~ReadAheadReader();
+
+    AVIOContext *GetAVIOContext() { return IOContext; }
+    int64_t GetFileSize() const { return FileSize; }
+    void SetBlockSize(size_t Size);
+
+    void ResetStats();
+    int64_t GetBytesRead();
+    // In bytes per second since the last ResetStats()
+    double GetBandwidth();
+};
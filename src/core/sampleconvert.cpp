@@ -0,0 +1,300 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "sampleconvert.h"
+
+#include "ffms.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FFMS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+int16_t ClipS16(long Value) {
+    return static_cast<int16_t>(Value < -32768 ? -32768 : Value > 32767 ? 32767 : Value);
+}
+
+// Both take one sample, or eight of them at a time, and the noise for each
+// if dithering. Without noise the results are the same as swresample's.
+struct FloatToS16 {
+    typedef float In;
+
+    // Values too large for an integer convert to its most negative value,
+    // so they're clipped while still floats, which rounds the same as
+    // clipping afterwards. NaNs end up as the lowest value either way.
+    static int16_t Scalar(const float *Src, const float *Noise) {
+        float Value = *Src * 32768.f + (Noise ? *Noise : 0.f);
+        return static_cast<int16_t>(lrintf(Value > 32767.f ? 32767.f : Value > -32768.f ? Value : -32768.f));
+    }
+
+#ifdef FFMS_SSE2
+    static __m128i Vector(const float *Src, const float *Noise) {
+        const __m128 Scale = _mm_set1_ps(32768.f);
+        const __m128 Min = _mm_set1_ps(-32768.f);
+        const __m128 Max = _mm_set1_ps(32767.f);
+        __m128 A = _mm_mul_ps(_mm_loadu_ps(Src), Scale);
+        __m128 B = _mm_mul_ps(_mm_loadu_ps(Src + 4), Scale);
+        if (Noise) {
+            A = _mm_add_ps(A, _mm_loadu_ps(Noise));
+            B = _mm_add_ps(B, _mm_loadu_ps(Noise + 4));
+        }
+        A = _mm_max_ps(_mm_min_ps(Max, A), Min);
+        B = _mm_max_ps(_mm_min_ps(Max, B), Min);
+        // Rounds to nearest, just like lrintf
+        return _mm_packs_epi32(_mm_cvtps_epi32(A), _mm_cvtps_epi32(B));
+    }
+#endif
+};
+
+struct S32ToS16 {
+    typedef int32_t In;
+
+    static int16_t Scalar(const int32_t *Src, const float *Noise) {
+        if (!Noise)
+            return static_cast<int16_t>(*Src >> 16);
+        return ClipS16(lrintf(static_cast<float>(*Src) * (1.f / 65536.f) + *Noise));
+    }
+
+#ifdef FFMS_SSE2
+    static __m128i Vector(const int32_t *Src, const float *Noise) {
+        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Src));
+        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Src + 4));
+        if (!Noise)
+            return _mm_packs_epi32(_mm_srai_epi32(A, 16), _mm_srai_epi32(B, 16));
+
+        const __m128 Scale = _mm_set1_ps(1.f / 65536.f);
+        __m128 FA = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(A), Scale), _mm_loadu_ps(Noise));
+        __m128 FB = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(B), Scale), _mm_loadu_ps(Noise + 4));
+        return _mm_packs_epi32(_mm_cvtps_epi32(FA), _mm_cvtps_epi32(FB));
+    }
+#endif
+};
+
+template<typename Conv>
+void ConvertPlane(uint8_t *Dst, const uint8_t *Src, size_t Count, const float *Noise) {
+    int16_t *Out = reinterpret_cast<int16_t *>(Dst);
+    const typename Conv::In *In = reinterpret_cast<const typename Conv::In *>(Src);
+    size_t i = 0;
+#ifdef FFMS_SSE2
+    for (; i + 8 <= Count; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + i), Conv::Vector(In + i, Noise ? Noise + i : nullptr));
+#endif
+    for (; i < Count; i++)
+        Out[i] = Conv::Scalar(In + i, Noise ? Noise + i : nullptr);
+}
+
+template<typename Conv>
+void ConvertToStereo(uint8_t *Dst, const uint8_t *Left, const uint8_t *Right, size_t Count, const float *NoiseLeft, const float *NoiseRight) {
+    int16_t *Out = reinterpret_cast<int16_t *>(Dst);
+    const typename Conv::In *L = reinterpret_cast<const typename Conv::In *>(Left);
+    const typename Conv::In *R = reinterpret_cast<const typename Conv::In *>(Right);
+    size_t i = 0;
+#ifdef FFMS_SSE2
+    for (; i + 8 <= Count; i += 8) {
+        __m128i A = Conv::Vector(L + i, NoiseLeft ? NoiseLeft + i : nullptr);
+        __m128i B = Conv::Vector(R + i, NoiseRight ? NoiseRight + i : nullptr);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + 2 * i), _mm_unpacklo_epi16(A, B));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + 2 * i + 8), _mm_unpackhi_epi16(A, B));
+    }
+#endif
+    for (; i < Count; i++) {
+        Out[2 * i] = Conv::Scalar(L + i, NoiseLeft ? NoiseLeft + i : nullptr);
+        Out[2 * i + 1] = Conv::Scalar(R + i, NoiseRight ? NoiseRight + i : nullptr);
+    }
+}
+
+template<size_t Bytes>
+void CopyPlane(uint8_t *Dst, const uint8_t *Src, size_t Count, const float *) {
+    memcpy(Dst, Src, Count * Bytes);
+}
+
+void InterleaveFloatStereo(uint8_t *Dst, const uint8_t *Left, const uint8_t *Right, size_t Count, const float *, const float *) {
+    float *Out = reinterpret_cast<float *>(Dst);
+    const float *L = reinterpret_cast<const float *>(Left);
+    const float *R = reinterpret_cast<const float *>(Right);
+    size_t i = 0;
+#ifdef FFMS_SSE2
+    for (; i + 4 <= Count; i += 4) {
+        __m128 A = _mm_loadu_ps(L + i);
+        __m128 B = _mm_loadu_ps(R + i);
+        _mm_storeu_ps(Out + 2 * i, _mm_unpacklo_ps(A, B));
+        _mm_storeu_ps(Out + 2 * i + 4, _mm_unpackhi_ps(A, B));
+    }
+#endif
+    for (; i < Count; i++) {
+        Out[2 * i] = L[i];
+        Out[2 * i + 1] = R[i];
+    }
+}
+
+template<typename T>
+void Interleave(uint8_t *Dst, const uint8_t *const *Src, int Channels, size_t Count) {
+    T *Out = reinterpret_cast<T *>(Dst);
+    for (int c = 0; c < Channels; c++) {
+        const T *In = reinterpret_cast<const T *>(Src[c]);
+        for (size_t i = 0; i < Count; i++)
+            Out[i * Channels + c] = In[i];
+    }
+}
+
+template<typename T>
+void Deinterleave(uint8_t *const *Dst, const uint8_t *Src, int Channels, size_t Count) {
+    const T *In = reinterpret_cast<const T *>(Src);
+    for (int c = 0; c < Channels; c++) {
+        T *Out = reinterpret_cast<T *>(Dst[c]);
+        for (size_t i = 0; i < Count; i++)
+            Out[i] = In[i * Channels + c];
+    }
+}
+
+void InterleaveAny(uint8_t *Dst, const uint8_t *const *Src, int Channels, size_t Count, size_t Bytes) {
+    switch (Bytes) {
+    case 1: Interleave<uint8_t>(Dst, Src, Channels, Count); break;
+    case 2: Interleave<int16_t>(Dst, Src, Channels, Count); break;
+    case 4: Interleave<int32_t>(Dst, Src, Channels, Count); break;
+    default: Interleave<int64_t>(Dst, Src, Channels, Count); break;
+    }
+}
+
+void DeinterleaveAny(uint8_t *const *Dst, const uint8_t *Src, int Channels, size_t Count, size_t Bytes) {
+    switch (Bytes) {
+    case 1: Deinterleave<uint8_t>(Dst, Src, Channels, Count); break;
+    case 2: Deinterleave<int16_t>(Dst, Src, Channels, Count); break;
+    case 4: Deinterleave<int32_t>(Dst, Src, Channels, Count); break;
+    default: Deinterleave<int64_t>(Dst, Src, Channels, Count); break;
+    }
+}
+
+// The generator and the distributions of swresample's dither noise
+float NextNoise(uint32_t &Seed, int Method) {
+    Seed = Seed * 1664525 + 1013904223;
+    double Value = Seed / static_cast<double>(UINT32_MAX);
+    if (Method == FFMS_RESAMPLE_DITHER_RECTANGULAR)
+        return static_cast<float>(Value - 0.5);
+    Seed = Seed * 1664525 + 1013904223;
+    return static_cast<float>(Value - Seed / static_cast<double>(UINT32_MAX));
+}
+}
+
+SampleConverter::SampleConverter(int Channels, bool FromPlanar, bool ToPlanar, size_t OutSampleBytes, Kernel Convert1, StereoKernel ConvertStereo, int DitherMethod)
+    : Channels(Channels)
+    , FromPlanar(FromPlanar)
+    , ToPlanar(ToPlanar)
+    , OutSampleBytes(OutSampleBytes)
+    , Convert1(Convert1)
+    , ConvertStereo(ConvertStereo)
+    , DitherMethod(DitherMethod)
+    , ScratchPlanes(Channels) {
+    for (int c = 0; c < Channels; c++)
+        Dither.push_back({ static_cast<uint32_t>(c + 1) * 2654435761u, { 0.f, 0.f } });
+}
+
+std::unique_ptr<SampleConverter> SampleConverter::Create(AVSampleFormat From, AVSampleFormat To, int Channels, int DitherMethod) {
+    if (From == To || Channels <= 0)
+        return nullptr;
+
+    const AVSampleFormat PackedFrom = av_get_packed_sample_fmt(From);
+    const AVSampleFormat PackedTo = av_get_packed_sample_fmt(To);
+    Kernel Convert1 = nullptr;
+    StereoKernel Stereo = nullptr;
+    bool ReducesBits = false;
+    if (PackedFrom == PackedTo) {
+        switch (av_get_bytes_per_sample(From)) {
+        case 1: Convert1 = CopyPlane<1>; break;
+        case 2: Convert1 = CopyPlane<2>; break;
+        case 4: Convert1 = CopyPlane<4>; break;
+        case 8: Convert1 = CopyPlane<8>; break;
+        }
+        if (PackedFrom == AV_SAMPLE_FMT_FLT)
+            Stereo = InterleaveFloatStereo;
+    } else if (PackedFrom == AV_SAMPLE_FMT_FLT && PackedTo == AV_SAMPLE_FMT_S16) {
+        Convert1 = ConvertPlane<FloatToS16>;
+        Stereo = ConvertToStereo<FloatToS16>;
+        ReducesBits = true;
+    } else if (PackedFrom == AV_SAMPLE_FMT_S32 && PackedTo == AV_SAMPLE_FMT_S16) {
+        Convert1 = ConvertPlane<S32ToS16>;
+        Stereo = ConvertToStereo<S32ToS16>;
+        ReducesBits = true;
+    }
+    if (!Convert1)
+        return nullptr;
+
+    // Like swresample, only conversions which lose bits are dithered, and
+    // noise shaping is left to swresample
+    if (!ReducesBits)
+        DitherMethod = FFMS_RESAMPLE_DITHER_NONE;
+    else if (DitherMethod < FFMS_RESAMPLE_DITHER_NONE || DitherMethod > FFMS_RESAMPLE_DITHER_TRIANGULAR_HIGHPASS)
+        return nullptr;
+
+    return std::unique_ptr<SampleConverter>(new SampleConverter(Channels,
+        !!av_sample_fmt_is_planar(From), !!av_sample_fmt_is_planar(To),
+        av_get_bytes_per_sample(To), Convert1, Stereo, DitherMethod));
+}
+
+void SampleConverter::GenerateNoise(size_t Count) {
+    Noise.resize(Count * Channels);
+    for (int c = 0; c < Channels; c++) {
+        ChannelDither &D = Dither[c];
+        for (size_t i = 0; i < Count; i++) {
+            float Value = NextNoise(D.Seed, DitherMethod);
+            if (DitherMethod == FFMS_RESAMPLE_DITHER_TRIANGULAR_HIGHPASS) {
+                const float Filtered = (-D.History[0] + 2 * D.History[1] - Value) / sqrtf(6.f);
+                D.History[0] = D.History[1];
+                D.History[1] = Value;
+                Value = Filtered;
+            }
+            Noise[FromPlanar ? c * Count + i : i * Channels + c] = Value;
+        }
+    }
+}
+
+void SampleConverter::Convert(uint8_t *const *Dst, const uint8_t *const *Src, int Count) {
+    const size_t N = static_cast<size_t>(Count);
+    if (DitherMethod != FFMS_RESAMPLE_DITHER_NONE)
+        GenerateNoise(N);
+    const float *AllNoise = DitherMethod != FFMS_RESAMPLE_DITHER_NONE ? Noise.data() : nullptr;
+    auto PlaneNoise = [&](int c) { return AllNoise ? AllNoise + c * N : nullptr; };
+
+    if (FromPlanar == ToPlanar && FromPlanar) {
+        for (int c = 0; c < Channels; c++)
+            Convert1(Dst[c], Src[c], N, PlaneNoise(c));
+    } else if (FromPlanar == ToPlanar || Channels == 1) {
+        Convert1(Dst[0], Src[0], N * Channels, AllNoise);
+    } else if (FromPlanar && Channels == 2 && ConvertStereo) {
+        ConvertStereo(Dst[0], Src[0], Src[1], N, PlaneNoise(0), PlaneNoise(1));
+    } else if (FromPlanar) {
+        Scratch.resize(N * Channels * OutSampleBytes);
+        for (int c = 0; c < Channels; c++) {
+            uint8_t *Plane = Scratch.data() + c * N * OutSampleBytes;
+            Convert1(Plane, Src[c], N, PlaneNoise(c));
+            ScratchPlanes[c] = Plane;
+        }
+        InterleaveAny(Dst[0], ScratchPlanes.data(), Channels, N, OutSampleBytes);
+    } else {
+        Scratch.resize(N * Channels * OutSampleBytes);
+        Convert1(Scratch.data(), Src[0], N * Channels, AllNoise);
+        DeinterleaveAny(Dst, Scratch.data(), Channels, N, OutSampleBytes);
+    }
+}
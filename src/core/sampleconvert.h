@@ -0,0 +1,79 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#pragma once
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Sample format conversions which keep the channel layout and the sample
+// rate, done without swresample for the cases which audio requests mostly
+// are: float and 32 bit audio to 16 bit, and planar audio to interleaved
+// audio of the same format or back. Conversions to 16 bit round and clip
+// like swresample, and support its rectangular and triangular dither.
+class SampleConverter {
+public:
+    typedef void (*Kernel)(uint8_t *Dst, const uint8_t *Src, size_t Count, const float *Noise);
+    typedef void (*StereoKernel)(uint8_t *Dst, const uint8_t *Left, const uint8_t *Right, size_t Count, const float *NoiseLeft, const float *NoiseRight);
+
+private:
+    int Channels;
+    bool FromPlanar;
+    bool ToPlanar;
+    size_t OutSampleBytes;
+    // Converts Count samples of a single plane, or of interleaved audio
+    Kernel Convert1;
+    // Converts two planes to interleaved stereo, if there's a faster way
+    // than converting and interleaving one after another
+    StereoKernel ConvertStereo;
+
+    // Dither noise, in units of the least significant output bit, for each
+    // input sample and in the same order
+    int DitherMethod;
+    std::vector<float> Noise;
+    struct ChannelDither {
+        uint32_t Seed;
+        // The last two values of the noise before highpass filtering
+        float History[2];
+    };
+    std::vector<ChannelDither> Dither;
+    void GenerateNoise(size_t Count);
+
+    // Output converted one plane at a time before changing its packing
+    std::vector<uint8_t> Scratch;
+    std::vector<const uint8_t *> ScratchPlanes;
+
+    SampleConverter(int Channels, bool FromPlanar, bool ToPlanar, size_t OutSampleBytes, Kernel Convert1, StereoKernel ConvertStereo, int DitherMethod);
+
+public:
+    // Returns null if the conversion from From to To isn't one of those
+    // handled here. DitherMethod is an FFMS_AudioDitherMethod.
+    static std::unique_ptr<SampleConverter> Create(AVSampleFormat From, AVSampleFormat To, int Channels, int DitherMethod);
+
+    // Converts Count samples from the planes in Src to the planes in Dst,
+    // like swr_convert
+    void Convert(uint8_t *const *Dst, const uint8_t *const *Src, int Count);
+};
@@ -0,0 +1,323 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "segments.h"
+
+#include "audiosource.h"
+#include "indexing.h"
+#include "utils.h"
+#include "videosource.h"
+
+#include <algorithm>
+
+FFMS_SegmentedIndex::FFMS_SegmentedIndex(const char **SourceFiles, FFMS_Index **Indexes, int NumSegments) {
+    if (NumSegments < 1)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "At least one segment is required");
+
+    for (int i = 0; i < NumSegments; i++) {
+        Segment S;
+        S.SourceFile = SourceFiles[i];
+        if (Indexes && Indexes[i]) {
+            S.Index = Indexes[i]->Snapshot();
+        } else {
+            FFMS_Indexer Indexer(SourceFiles[i]);
+            Indexer.SetIndexTrackType(FFMS_TYPE_AUDIO, true);
+            S.Index.reset(Indexer.DoIndexing());
+        }
+        Segments.push_back(std::move(S));
+    }
+
+    FFMS_Index const& First = *Segments.front().Index;
+    for (size_t i = 1; i < Segments.size(); i++) {
+        FFMS_Index const& Other = *Segments[i].Index;
+        bool Match = Other.size() == First.size();
+        for (size_t t = 0; Match && t < First.size(); t++)
+            Match = Other[t].TT == First[t].TT;
+        if (!Match)
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "'" + Segments[i].SourceFile + "' does not have the same tracks as '" + Segments.front().SourceFile + "'");
+    }
+
+    for (size_t t = 0; t < First.size(); t++) {
+        FFMS_Track Joined = First[t];
+        // A track can only be played across the segments if all of them have it
+        bool Usable = true;
+        for (auto const& S : Segments) {
+            FFMS_Track const& Track = (*S.Index)[t];
+            if (Track.empty() || Track.KeyFramesOnly)
+                Usable = false;
+            else if (Track.TB.Num != Joined.TB.Num || Track.TB.Den != Joined.TB.Den)
+                throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_UNSUPPORTED,
+                    "Track " + std::to_string(t) + " of '" + S.SourceFile + "' has a different time base than in the other segments");
+        }
+
+        if (!Usable) {
+            Joined.clear();
+        } else {
+            std::vector<FFMS_Track const *> Rest;
+            for (size_t i = 1; i < Segments.size(); i++)
+                Rest.push_back(&(*Segments[i].Index)[t]);
+            Joined.AppendTracks(Rest);
+        }
+        Tracks.push_back(std::move(Joined));
+    }
+}
+
+FFMS_Track &FFMS_SegmentedIndex::GetTrack(int Track) {
+    if (Track < 0 || Track >= static_cast<int>(Tracks.size()))
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Out of bounds track index selected");
+    return Tracks[Track];
+}
+
+SegmentedVideo::SegmentedVideo(FFMS_SegmentedIndex &Index, int Track, int Threads, int SeekMode, int MaxOpenSegments)
+    : Segments(Index.Segments)
+    , Track(Track)
+    , Threads(Threads)
+    , SeekMode(SeekMode)
+    , Sources(MaxOpenSegments)
+    , Frames(Index.GetTrack(Track)) {
+    if (Frames.TT != FFMS_TYPE_VIDEO)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Not a video track");
+    if (Frames.empty())
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Video track is missing or not fully indexed in some segments");
+
+    FirstFrame.push_back(0);
+    for (auto const& S : Segments)
+        FirstFrame.push_back(FirstFrame.back() + (*S.Index)[Track].VisibleFrameCount());
+
+    // Everything that doesn't depend on the length comes from the first
+    // segment, as with any other source
+    VP = Get(0).GetVideoProperties();
+    VP.NumFrames = Frames.VisibleFrameCount();
+    if (VP.NumFrames >= 2) {
+        double PTSDiff = (double)(Frames.back().PTS - Frames.front().PTS);
+        double TD = (double)(Frames.TB.Den);
+        double TN = (double)(Frames.TB.Num);
+        VP.FPSDenominator = (unsigned int)(PTSDiff * TN / TD * 1000.0 / (VP.NumFrames - 1));
+        VP.FPSNumerator = 1000000;
+    }
+    VP.FirstTime = ((Frames[Frames.RealFrameNumber(0)].PTS * Frames.TB.Num) / (double)Frames.TB.Den) / 1000;
+    VP.LastTime = ((Frames[Frames.RealFrameNumber(VP.NumFrames - 1)].PTS * Frames.TB.Num) / (double)Frames.TB.Den) / 1000;
+    VP.LastEndTime = (((Frames[Frames.RealFrameNumber(VP.NumFrames - 1)].PTS + Frames.LastDuration) * Frames.TB.Num) / (double)Frames.TB.Den) / 1000;
+}
+
+SegmentedVideo::~SegmentedVideo() {
+}
+
+FFMS_VideoSource &SegmentedVideo::Get(size_t Segment) {
+    if (FFMS_VideoSource *Source = Sources.Find(Segment))
+        return *Source;
+
+    auto const& S = Segments[Segment];
+    auto Source = make_unique<FFMS_VideoSource>(S.SourceFile.c_str(), *S.Index, Track, Threads, SeekMode);
+    if (InputSet)
+        Source->SetInputFormat(InputColorSpace, InputColorRange, InputFormat);
+    if (OutputSet)
+        Source->SetOutputFormat(TargetFormats.data(), TargetWidth, TargetHeight, TargetResizer);
+    return Sources.Add(Segment, std::move(Source));
+}
+
+FFMS_Frame *SegmentedVideo::GetFrame(int n) {
+    if (n < 0 || n >= VP.NumFrames)
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
+            "Out of bounds frame requested");
+    size_t Segment = std::upper_bound(FirstFrame.begin(), FirstFrame.end(), n) - FirstFrame.begin() - 1;
+    return Get(Segment).GetFrame(n - FirstFrame[Segment]);
+}
+
+void SegmentedVideo::SetOutputFormat(const AVPixelFormat *Formats, int Width, int Height, int Resizer) {
+    Sources.ForEach([&](FFMS_VideoSource &Source) {
+        Source.SetOutputFormat(Formats, Width, Height, Resizer);
+    });
+    TargetFormats.clear();
+    while (*Formats != AV_PIX_FMT_NONE)
+        TargetFormats.push_back(*Formats++);
+    TargetFormats.push_back(AV_PIX_FMT_NONE);
+    TargetWidth = Width;
+    TargetHeight = Height;
+    TargetResizer = Resizer;
+    OutputSet = true;
+}
+
+void SegmentedVideo::ResetOutputFormat() {
+    OutputSet = false;
+    Sources.ForEach([](FFMS_VideoSource &Source) {
+        Source.ResetOutputFormat();
+    });
+}
+
+void SegmentedVideo::SetInputFormat(int ColorSpace, int ColorRange, AVPixelFormat Format) {
+    Sources.ForEach([&](FFMS_VideoSource &Source) {
+        Source.SetInputFormat(ColorSpace, ColorRange, Format);
+    });
+    // Like the sources, only overrides what is specified
+    if (!InputSet) {
+        InputColorSpace = AVCOL_SPC_UNSPECIFIED;
+        InputColorRange = AVCOL_RANGE_UNSPECIFIED;
+        InputFormat = AV_PIX_FMT_NONE;
+    }
+    if (Format != AV_PIX_FMT_NONE)
+        InputFormat = Format;
+    if (ColorRange != AVCOL_RANGE_UNSPECIFIED)
+        InputColorRange = ColorRange;
+    if (ColorSpace != AVCOL_SPC_UNSPECIFIED)
+        InputColorSpace = ColorSpace;
+    InputSet = true;
+}
+
+void SegmentedVideo::ResetInputFormat() {
+    InputSet = false;
+    Sources.ForEach([](FFMS_VideoSource &Source) {
+        Source.ResetInputFormat();
+    });
+}
+
+SegmentedAudio::SegmentedAudio(FFMS_SegmentedIndex &Index, int Track, int DelayMode, int MaxOpenSegments)
+    : Segments(Index.Segments)
+    , Track(Track)
+    , DelayMode(DelayMode)
+    , Sources(MaxOpenSegments)
+    , Frames(Index.GetTrack(Track)) {
+    if (Frames.TT != FFMS_TYPE_AUDIO)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Not an audio track");
+    if (Frames.empty())
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Audio track is missing in some segments");
+
+    // The delay only applies to the start of the first segment, after which
+    // every segment follows the previous one without a gap
+    FFMS_AudioSource &First = Get(0);
+    AP = First.GetAudioProperties();
+    Output = *First.CreateResampleOptions();
+    BytesPerSample = First.BytesPerSample;
+
+    // The segments are placed by their sample counts in the index, which only
+    // line up when every segment has the same sample rate
+    FirstSample.push_back(0);
+    FirstSample.push_back(AP.NumSamples);
+    for (size_t i = 1; i < Segments.size(); i++) {
+        FFMS_Track const& SegmentFrames = (*Segments[i].Index)[Track];
+        if (SegmentFrames.CodecSampleRate != (*Segments[0].Index)[Track].CodecSampleRate)
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_UNSUPPORTED,
+                "Audio segments with different sample rates are unsupported");
+        FirstSample.push_back(FirstSample.back() + SegmentFrames.back().SampleStart + SegmentFrames.back().SampleCount);
+    }
+
+    AP.NumSamples = FirstSample.back();
+    AP.LastTime = ((Frames.back().PTS * Frames.TB.Num) / (double)Frames.TB.Den) / 1000;
+    AP.LastEndTime = (((Frames.back().PTS + Frames.LastDuration) * Frames.TB.Num) / (double)Frames.TB.Den) / 1000;
+}
+
+SegmentedAudio::~SegmentedAudio() {
+}
+
+FFMS_AudioSource &SegmentedAudio::Get(size_t Segment) {
+    if (FFMS_AudioSource *Source = Sources.Find(Segment))
+        return *Source;
+
+    auto const& S = Segments[Segment];
+    auto Source = make_unique<FFMS_AudioSource>(S.SourceFile.c_str(), *S.Index, Track,
+        Segment == 0 ? DelayMode : FFMS_DELAY_NO_SHIFT);
+    FFMS_AudioProperties const& SourceAP = Source->GetAudioProperties();
+    // The index can't always tell, as the decoder may not output the rate
+    // the demuxer reported
+    if (Segment > 0 && SourceAP.SampleRate != AP.SampleRate)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_UNSUPPORTED,
+            "Audio segments with different sample rates are unsupported");
+    if (OutputSet || SourceAP.SampleFormat != Output.SampleFormat ||
+        SourceAP.ChannelLayout != Output.ChannelLayout || SourceAP.SampleRate != Output.SampleRate)
+        Source->SetOutputFormat(Output);
+    Source->SetCacheSize(CacheSize);
+    if (PrefetchSize)
+        Source->SetPrefetch(PrefetchSize);
+    return Sources.Add(Segment, std::move(Source));
+}
+
+void SegmentedAudio::GetAudio(void *Buf, int64_t Start, int64_t Count) {
+    if (Start < 0 || Start + Count > AP.NumSamples || Count < 0)
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
+            "Out of bounds audio samples requested");
+
+    uint8_t *Dst = static_cast<uint8_t *>(Buf);
+    while (Count > 0) {
+        size_t Segment = std::upper_bound(FirstSample.begin(), FirstSample.end(), Start) - FirstSample.begin() - 1;
+        int64_t SegmentCount = std::min(Count, FirstSample[Segment + 1] - Start);
+        Get(Segment).GetAudio(Dst, Start - FirstSample[Segment], SegmentCount);
+        Dst += SegmentCount * BytesPerSample;
+        Start += SegmentCount;
+        Count -= SegmentCount;
+    }
+}
+
+void SegmentedAudio::GetAudioPlanar(void **Planes, int64_t Start, int64_t Count) {
+    if (Start < 0 || Start + Count > AP.NumSamples || Count < 0)
+        throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
+            "Out of bounds audio samples requested");
+
+    const int Channels = av_get_channel_layout_nb_channels(Output.ChannelLayout);
+    const size_t SampleBytes = BytesPerSample / Channels;
+    std::vector<void *> Dst(Planes, Planes + Channels);
+    while (Count > 0) {
+        size_t Segment = std::upper_bound(FirstSample.begin(), FirstSample.end(), Start) - FirstSample.begin() - 1;
+        int64_t SegmentCount = std::min(Count, FirstSample[Segment + 1] - Start);
+        Get(Segment).GetAudioPlanar(Dst.data(), Start - FirstSample[Segment], SegmentCount);
+        for (auto &Plane : Dst)
+            Plane = static_cast<uint8_t *>(Plane) + SegmentCount * SampleBytes;
+        Start += SegmentCount;
+        Count -= SegmentCount;
+    }
+}
+
+std::unique_ptr<FFMS_ResampleOptions> SegmentedAudio::CreateResampleOptions() {
+    return Get(0).CreateResampleOptions();
+}
+
+void SegmentedAudio::SetOutputFormat(FFMS_ResampleOptions const& opt) {
+    // Converting every segment on its own wouldn't line the segments up
+    if (opt.SampleRate != AP.SampleRate)
+        throw FFMS_Exception(FFMS_ERROR_RESAMPLING, FFMS_ERROR_UNSUPPORTED,
+            "Sample rate changes are unsupported for segmented audio sources");
+    Sources.ForEach([&](FFMS_AudioSource &Source) {
+        Source.SetOutputFormat(opt);
+    });
+    Output = opt;
+    OutputSet = true;
+    BytesPerSample = av_get_bytes_per_sample(static_cast<AVSampleFormat>(opt.SampleFormat)) * av_get_channel_layout_nb_channels(opt.ChannelLayout);
+}
+
+void SegmentedAudio::SetCacheSize(size_t Bytes) {
+    Sources.ForEach([&](FFMS_AudioSource &Source) {
+        Source.SetCacheSize(Bytes);
+    });
+    CacheSize = Bytes;
+}
+
+void SegmentedAudio::SetPrefetch(size_t Bytes) {
+    Sources.ForEach([&](FFMS_AudioSource &Source) {
+        Source.SetPrefetch(Bytes);
+    });
+    PrefetchSize = Bytes;
+}
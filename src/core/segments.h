@@ -0,0 +1,169 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#pragma once
+
+#include "audiocache.h"
+#include "ffms.h"
+#include "track.h"
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+struct FFMS_Index;
+struct FFMS_VideoSource;
+struct FFMS_AudioSource;
+
+// A recording split over several files (camera chunks, DVD VOBs, broadcast
+// segments) which is played back as if it were one file. The segments must
+// all have the same track layout; each track of the segmented index is the
+// tracks of the segments joined end to end, with the timestamps of every
+// segment moved to start where the previous one ended.
+struct FFMS_SegmentedIndex {
+    struct Segment {
+        std::string SourceFile;
+        std::shared_ptr<FFMS_Index> Index;
+    };
+
+    std::vector<Segment> Segments;
+    std::vector<FFMS_Track> Tracks;
+
+    // Segments without an index are indexed with all video and audio tracks
+    FFMS_SegmentedIndex(const char **SourceFiles, FFMS_Index **Indexes, int NumSegments);
+
+    FFMS_Track &GetTrack(int Track);
+};
+
+// The sources of the most recently used segments. Decoders hold on to a lot
+// of memory and file handles, so only a few of them are kept open at once.
+template<typename Source>
+class SegmentSources {
+    size_t MaxOpen;
+    // Most recently used first
+    std::list<std::pair<size_t, std::unique_ptr<Source>>> Open;
+
+public:
+    explicit SegmentSources(int MaxOpen)
+        : MaxOpen(MaxOpen < 1 ? 1 : static_cast<size_t>(MaxOpen)) {
+    }
+
+    Source *Find(size_t Segment) {
+        for (auto it = Open.begin(); it != Open.end(); ++it) {
+            if (it->first == Segment) {
+                Open.splice(Open.begin(), Open, it);
+                return Open.front().second.get();
+            }
+        }
+        return nullptr;
+    }
+
+    Source &Add(size_t Segment, std::unique_ptr<Source> New) {
+        while (Open.size() >= MaxOpen)
+            Open.pop_back();
+        Open.emplace_front(Segment, std::move(New));
+        return *Open.front().second;
+    }
+
+    template<typename Func>
+    void ForEach(Func f) {
+        for (auto &Entry : Open)
+            f(*Entry.second);
+    }
+};
+
+// The segment decoding behind a video source created from a segmented index
+class SegmentedVideo {
+    std::vector<FFMS_SegmentedIndex::Segment> Segments;
+    int Track;
+    int Threads;
+    int SeekMode;
+    SegmentSources<FFMS_VideoSource> Sources;
+    // First public frame number of each segment, followed by the total
+    std::vector<int> FirstFrame;
+
+    // The latest output and input formats, which every segment opened later
+    // has to get as well
+    bool OutputSet = false;
+    std::vector<AVPixelFormat> TargetFormats;
+    int TargetWidth = 0;
+    int TargetHeight = 0;
+    int TargetResizer = 0;
+    bool InputSet = false;
+    int InputColorSpace = 0;
+    int InputColorRange = 0;
+    AVPixelFormat InputFormat = AV_PIX_FMT_NONE;
+
+    FFMS_VideoSource &Get(size_t Segment);
+
+public:
+    FFMS_Track Frames;
+    FFMS_VideoProperties VP = {};
+
+    SegmentedVideo(FFMS_SegmentedIndex &Index, int Track, int Threads, int SeekMode, int MaxOpenSegments);
+    ~SegmentedVideo();
+
+    FFMS_Frame *GetFrame(int n);
+    void SetOutputFormat(const AVPixelFormat *TargetFormats, int Width, int Height, int Resizer);
+    void ResetOutputFormat();
+    void SetInputFormat(int ColorSpace, int ColorRange, AVPixelFormat Format);
+    void ResetInputFormat();
+};
+
+// The segment decoding behind an audio source created from a segmented index
+class SegmentedAudio {
+    std::vector<FFMS_SegmentedIndex::Segment> Segments;
+    int Track;
+    int DelayMode;
+    SegmentSources<FFMS_AudioSource> Sources;
+    // First sample of each segment, followed by the total
+    std::vector<int64_t> FirstSample;
+
+    // All segments are converted to the output format of the first one so
+    // that the samples can be put next to each other
+    FFMS_ResampleOptions Output = {};
+    bool OutputSet = false;
+    size_t BytesPerSample = 0;
+    size_t CacheSize = DefaultAudioCacheBytes;
+    size_t PrefetchSize = 0;
+
+    FFMS_AudioSource &Get(size_t Segment);
+
+public:
+    FFMS_Track Frames;
+    FFMS_AudioProperties AP = {};
+
+    SegmentedAudio(FFMS_SegmentedIndex &Index, int Track, int DelayMode, int MaxOpenSegments);
+    ~SegmentedAudio();
+
+    void GetAudio(void *Buf, int64_t Start, int64_t Count);
+    void GetAudioPlanar(void **Planes, int64_t Start, int64_t Count);
+    std::unique_ptr<FFMS_ResampleOptions> CreateResampleOptions();
+    void SetOutputFormat(FFMS_ResampleOptions const& opt);
+    void SetCacheSize(size_t Bytes);
+    void SetPrefetch(size_t Bytes);
+};
@@ -20,12 +20,16 @@
 
 #include "track.h"
 
+#include "trackexport.h"
 #include "utils.h"
+#include "waveform.h"
 #include "zipfile.h"
 #include "indexing.h"
 
 #include <algorithm>
 #include <cmath>
+#include <system_error>
+#include <thread>
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -34,7 +38,103 @@ extern "C" {
 }
 
 namespace {
-FrameInfo ReadFrame(ZipFile &stream, FrameInfo const& prev, const FFMS_TrackType TT) {
+// Tracks with fewer frames than this are sorted on a single thread
+const size_t ParallelSortFrames = 1 << 20;
+
+// Sorting moves these around instead of the frames, and ties are broken by
+// position so that the result is always the same
+struct SortKey {
+    int64_t PTS;
+    size_t Pos;
+
+    bool operator<(SortKey const& Other) const {
+        return PTS < Other.PTS || (PTS == Other.PTS && Pos < Other.Pos);
+    }
+};
+
+// Runs Job(0) to Job(Count - 1) on threads of their own, or on this one if
+// no more threads can be started
+template<typename Func>
+void RunInParallel(size_t Count, Func Job) {
+    std::vector<std::thread> Threads;
+    Threads.reserve(Count);
+    for (size_t i = 0; i < Count; i++) {
+        try {
+            Threads.emplace_back(Job, i);
+        } catch (std::system_error const&) {
+            Job(i);
+        }
+    }
+    for (auto &Thread : Threads)
+        Thread.join();
+}
+
+void SortKeys(std::vector<SortKey> &Keys) {
+    const size_t Slices = std::min<size_t>(std::thread::hardware_concurrency(), 16);
+    if (Keys.size() < ParallelSortFrames || Slices < 2) {
+        std::sort(Keys.begin(), Keys.end());
+        return;
+    }
+
+    // Sort equal slices in parallel, and then merge neighbouring slices
+    // until there is only one left
+    std::vector<size_t> Bounds;
+    for (size_t i = 0; i <= Slices; i++)
+        Bounds.push_back(Keys.size() * i / Slices);
+
+    RunInParallel(Slices, [&](size_t i) {
+        std::sort(Keys.begin() + Bounds[i], Keys.begin() + Bounds[i + 1]);
+    });
+
+    while (Bounds.size() > 2) {
+        const size_t Pairs = (Bounds.size() - 1) / 2;
+        RunInParallel(Pairs, [&](size_t i) {
+            std::inplace_merge(Keys.begin() + Bounds[2 * i], Keys.begin() + Bounds[2 * i + 1], Keys.begin() + Bounds[2 * i + 2]);
+        });
+
+        std::vector<size_t> Merged;
+        for (size_t i = 0; i < Bounds.size(); i += 2)
+            Merged.push_back(Bounds[i]);
+        // An odd slice out is merged in the next round
+        if (Bounds.size() % 2 == 0)
+            Merged.push_back(Bounds.back());
+        Bounds.swap(Merged);
+    }
+}
+
+// Sorts the frames from First up to Last by PTS, and stores where each of
+// them went in SortedPos. Only the keys are sorted, after which the frames
+// are put in place one column at a time.
+void SortFramesByPTS(FrameColumns &Frames, size_t First, size_t Last, std::vector<size_t> &SortedPos) {
+    bool Sorted = true;
+    for (size_t i = First + 1; Sorted && i < Last; i++)
+        Sorted = Frames.PTS(i - 1) <= Frames.PTS(i);
+    if (Sorted) {
+        for (size_t i = First; i < Last; i++)
+            SortedPos[i] = i;
+        return;
+    }
+
+    std::vector<size_t> Order;
+    {
+        std::vector<SortKey> Keys;
+        Keys.reserve(Last - First);
+        for (size_t i = First; i < Last; i++)
+            Keys.push_back({ Frames.PTS(i), i - First });
+
+        SortKeys(Keys);
+
+        Order.reserve(Keys.size());
+        for (size_t i = 0; i < Keys.size(); i++) {
+            SortedPos[First + Keys[i].Pos] = First + i;
+            Order.push_back(Keys[i].Pos);
+        }
+    }
+
+    Frames.Permute(First, Order);
+}
+
+FrameInfo ReadFrame(ZipFile &stream, FrameInfo const& prev, const FFMS_TrackType TT, bool KeyFramesOnly) {
     FrameInfo f{};
     f.PTS = stream.Read<int64_t>() + prev.PTS;
     f.OriginalPTS = stream.Read<int64_t>() + prev.OriginalPTS;
@@ -48,11 +148,13 @@ FrameInfo ReadFrame(ZipFile &stream, FrameInfo const& prev, const FFMS_TrackType
     } else if (TT == FFMS_TYPE_VIDEO) {
         f.OriginalPos = static_cast<size_t>(stream.Read<uint64_t>() + prev.OriginalPos + 1);
         f.RepeatPict = stream.Read<int32_t>();
+        if (KeyFramesOnly)
+            f.FrameNumber = stream.Read<int64_t>() + prev.FrameNumber;
     }
     return f;
 }
 
-static void WriteFrame(ZipFile &stream, FrameInfo const& f, FrameInfo const& prev, const FFMS_TrackType TT) {
+static void WriteFrame(ZipFile &stream, FrameInfo const& f, FrameInfo const& prev, const FFMS_TrackType TT, bool KeyFramesOnly) {
     stream.Write(f.PTS - prev.PTS);
     stream.Write(f.OriginalPTS - prev.OriginalPTS);
     stream.Write<int8_t>(f.KeyFrame);
@@ -64,6 +166,8 @@ static void WriteFrame(ZipFile &stream, FrameInfo const& f, FrameInfo const& pre
     else if (TT == FFMS_TYPE_VIDEO) {
         stream.Write(static_cast<uint64_t>(f.OriginalPos) - prev.OriginalPos - 1);
         stream.Write<int32_t>(f.RepeatPict);
+        if (KeyFramesOnly)
+            stream.Write(f.FrameNumber - prev.FrameNumber);
     }
 }
 }
@@ -85,7 +189,7 @@ FFMS_Track::FFMS_Track(int64_t Num, int64_t Den, FFMS_TrackType TT, bool HasDisc
 
 FFMS_Track::FFMS_Track(ZipFile &stream)
     : Data(std::make_shared<TrackData>()) {
-    frame_vec &Frames = Data->Frames;
+    FrameColumns &Frames = Data->Frames;
     TT = static_cast<FFMS_TrackType>(stream.Read<uint8_t>());
     TB.Num = stream.Read<int64_t>();
     TB.Den = stream.Read<int64_t>();
@@ -93,21 +197,34 @@ FFMS_Track::FFMS_Track(ZipFile &stream)
     MaxBFrames = stream.Read<int32_t>();
     UseDTS = !!stream.Read<uint8_t>();
     HasTS = !!stream.Read<uint8_t>();
-    size_t FrameCount = static_cast<size_t>(stream.Read<uint64_t>());
-
-    if (!FrameCount) return;
-
-    FrameInfo temp{};
-    Frames.reserve(FrameCount);
-    for (size_t i = 0; i < FrameCount; ++i)
-        Frames.push_back(ReadFrame(stream, i == 0 ? temp : Frames.back(), TT));
+    KeyFramesOnly = !!stream.Read<uint8_t>();
+    if (KeyFramesOnly) {
+        FrameCount = stream.Read<int64_t>();
+        LastPTS = stream.Read<int64_t>();
+    }
+    CodecName = stream.ReadString();
+    CodecWidth = stream.Read<int32_t>();
+    CodecHeight = stream.Read<int32_t>();
+    CodecSampleRate = stream.Read<int32_t>();
+    CodecChannels = stream.Read<int32_t>();
+    if (stream.Read<uint8_t>())
+        Waveform = std::make_shared<AudioWaveform>(stream);
+    size_t NumFrames = static_cast<size_t>(stream.Read<uint64_t>());
+
+    if (!NumFrames) return;
+
+    FrameInfo prev{};
+    Frames.Reserve(NumFrames);
+    for (size_t i = 0; i < NumFrames; ++i) {
+        prev = ReadFrame(stream, prev, TT, KeyFramesOnly);
+        Frames.PushBack(prev);
+    }
 
     if (TT == FFMS_TYPE_VIDEO)
-        GeneratePublicInfo();
+        UpdateFrameNumbers();
 }
 
 void FFMS_Track::Write(ZipFile &stream) const {
-    frame_vec &Frames = Data->Frames;
     stream.Write<uint8_t>(TT);
     stream.Write(TB.Num);
     stream.Write(TB.Den);
@@ -115,109 +232,207 @@ void FFMS_Track::Write(ZipFile &stream) const {
     stream.Write<int32_t>(MaxBFrames);
     stream.Write<uint8_t>(UseDTS);
     stream.Write<uint8_t>(HasTS);
+    stream.Write<uint8_t>(KeyFramesOnly);
+    if (KeyFramesOnly) {
+        stream.Write<int64_t>(FrameCount);
+        stream.Write<int64_t>(LastPTS);
+    }
+    stream.WriteString(CodecName);
+    stream.Write<int32_t>(CodecWidth);
+    stream.Write<int32_t>(CodecHeight);
+    stream.Write<int32_t>(CodecSampleRate);
+    stream.Write<int32_t>(CodecChannels);
+    stream.Write<uint8_t>(!!Waveform);
+    if (Waveform)
+        Waveform->Write(stream);
     stream.Write<uint64_t>(size());
 
     if (empty()) return;
 
-    FrameInfo temp{};
-    for (size_t i = 0; i < size(); ++i)
-        WriteFrame(stream, Frames[i], i == 0 ? temp : Frames[i - 1], TT);
+    FrameInfo prev{};
+    for (size_t i = 0; i < size(); ++i) {
+        FrameInfo cur = (*this)[i];
+        WriteFrame(stream, cur, prev, TT, KeyFramesOnly);
+        prev = cur;
+    }
 }
 
 void FFMS_Track::AddVideoFrame(int64_t PTS, int RepeatPict, bool KeyFrame, int FrameType, int64_t FilePos, bool Hidden) {
-    Data->Frames.push_back({ PTS, 0, FilePos, 0, 0, 0, FrameType, RepeatPict, KeyFrame, Hidden });
+    Data->Frames.PushBack({ PTS, 0, FilePos, 0, 0, 0, 0, FrameType, RepeatPict, KeyFrame, Hidden });
 }
 
 void FFMS_Track::AddAudioFrame(int64_t PTS, int64_t SampleStart, uint32_t SampleCount, bool KeyFrame, int64_t FilePos, bool Hidden) {
     if (SampleCount > 0) {
-        Data->Frames.push_back({ PTS, 0, FilePos, SampleStart, SampleCount,
-            0, 0, 0, KeyFrame, Hidden });
+        Data->Frames.PushBack({ PTS, 0, FilePos, SampleStart, SampleCount,
+            0, 0, 0, 0, KeyFrame, Hidden });
     }
 }
 
-void FFMS_Track::WriteTimecodes(const char *TimecodeFile) const {
-    frame_vec &Frames = Data->Frames;
-    FileHandle file(TimecodeFile, "w", FFMS_ERROR_TRACK, FFMS_ERROR_FILE_WRITE);
+void FFMS_Track::CountVideoFrame(int64_t PTS, bool KeyFrame, int64_t FilePos) {
+    if (KeyFrame)
+        Data->Frames.PushBack({ PTS, 0, FilePos, 0, 0, FrameCount, 0, AV_PICTURE_TYPE_I, -1, true, false });
+    if (!FrameCount || PTS > LastPTS)
+        LastPTS = PTS;
+    ++FrameCount;
+}
 
-    file.Printf("# timecode format v2\n");
-    for (size_t i = 0; i < size(); ++i) {
-        if (!Frames[i].Hidden)
-            file.Printf("%.02f\n", (Frames[i].PTS * TB.Num) / (double)TB.Den);
+void FFMS_Track::SpliceFrames(size_t Keep, FFMS_Track const& Other, size_t From) {
+    FrameColumns &Frames = Data->Frames;
+    Frames.Resize(Keep);
+
+    int64_t SampleOffset = 0;
+    if (From < Other.size())
+        SampleOffset = (Keep ? back().SampleStart + back().SampleCount : 0) - Other.Columns().SampleStart(From);
+
+    Frames.Reserve(Keep + Other.size() - std::min(From, Other.size()));
+    for (size_t i = From; i < Other.size(); ++i) {
+        FrameInfo Frame = Other[i];
+        Frame.SampleStart += SampleOffset;
+        Frames.PushBack(Frame);
+    }
+}
+
+void FFMS_Track::AppendTracks(std::vector<FFMS_Track const *> const& Others) {
+    // The frame data may be shared with other copies of the track, and is
+    // otherwise appended to in place
+    if (Data.use_count() > 1) {
+        Data = std::make_shared<TrackData>(*Data);
+    } else {
+        Data->PublicFrameInfo.clear();
+        Data->PublicInfoReady = false;
+    }
+    FrameColumns &Frames = Data->Frames;
+
+    size_t Total = Frames.size();
+    for (FFMS_Track const *Other : Others)
+        Total += Other->size();
+    Frames.Reserve(Total);
+
+    for (FFMS_Track const *Other : Others) {
+        if (Other->empty())
+            continue;
+        const size_t FrameOffset = Frames.size();
+        const int64_t SampleOffset = empty() ? 0 : back().SampleStart + back().SampleCount;
+        const int64_t PTSOffset = Other->front().PTS == AV_NOPTS_VALUE ? 0 : EndPTS() - Other->front().PTS;
+        for (FrameInfo Frame : *Other) {
+            if (Frame.PTS != AV_NOPTS_VALUE)
+                Frame.PTS += PTSOffset;
+            if (Frame.OriginalPTS != AV_NOPTS_VALUE)
+                Frame.OriginalPTS += PTSOffset;
+            if (TT == FFMS_TYPE_VIDEO)
+                Frame.OriginalPos += FrameOffset;
+            else
+                Frame.SampleStart += SampleOffset;
+            Frames.PushBack(Frame);
+        }
+
+        LastDuration = Other->LastDuration;
+        MaxBFrames = std::max(MaxBFrames, Other->MaxBFrames);
+        HasTS = HasTS && Other->HasTS;
     }
+    // The summaries of the parts don't line up with the joined samples
+    Waveform.reset();
+
+    if (TT == FFMS_TYPE_VIDEO)
+        UpdateFrameNumbers();
 }
 
-static bool PTSComparison(FrameInfo FI1, FrameInfo FI2) {
-    return FI1.PTS < FI2.PTS;
+int64_t FFMS_Track::EndPTS() const {
+    if (empty() || back().PTS == AV_NOPTS_VALUE)
+        return 0;
+    // Video frames are sorted by timestamp and audio frames come in order
+    int64_t Duration = LastDuration;
+    if (Duration <= 0 && size() > 1)
+        Duration = (back().PTS - front().PTS) / static_cast<int64_t>(size() - 1);
+    return back().PTS + Duration;
 }
 
-int FFMS_Track::FrameFromPTS(int64_t PTS) const {
-    FrameInfo F;
-    F.PTS = PTS;
+void FFMS_Track::WriteTimecodes(const char *TimecodeFile) const {
+    ExportTrack(*this, TimecodeFile, FFMS_EXPORT_TIMECODES_V2);
+}
 
-    auto Pos = std::lower_bound(begin(), end(), F, PTSComparison);
-    while (Pos != end() && Pos->Hidden && Pos->PTS == PTS)
+// The first frame with a PTS of at least PTS
+static size_t LowerBoundPTS(FrameColumns const& Frames, int64_t PTS) {
+    size_t First = 0;
+    size_t Count = Frames.size();
+    while (Count > 0) {
+        size_t Step = Count / 2;
+        if (Frames.PTS(First + Step) < PTS) {
+            First += Step + 1;
+            Count -= Step + 1;
+        } else {
+            Count = Step;
+        }
+    }
+    return First;
+}
+
+int FFMS_Track::FrameFromPTS(int64_t PTS) const {
+    FrameColumns const& Frames = Data->Frames;
+    size_t Pos = LowerBoundPTS(Frames, PTS);
+    while (Pos != size() && Frames.Hidden(Pos) && Frames.PTS(Pos) == PTS)
         Pos++;
 
-    if (Pos == end() || Pos->PTS != PTS)
+    if (Pos == size() || Frames.PTS(Pos) != PTS)
         return -1;
-    return std::distance(begin(), Pos);
+    return static_cast<int>(Pos);
 }
 
 int FFMS_Track::FrameFromPos(int64_t Pos) const {
+    FrameColumns const& Frames = Data->Frames;
     for (size_t i = 0; i < size(); i++)
-        if (Data->Frames[i].FilePos == Pos && !Data->Frames[i].Hidden)
+        if (Frames.FilePos(i) == Pos && !Frames.Hidden(i))
             return static_cast<int>(i);
     return -1;
 }
 
 int FFMS_Track::ClosestFrameFromPTS(int64_t PTS) const {
-    FrameInfo F;
-    F.PTS = PTS;
-
-    auto Pos = std::lower_bound(begin(), end(), F, PTSComparison);
-    while (Pos != end() && Pos->Hidden && Pos->PTS == PTS)
+    FrameColumns const& Frames = Data->Frames;
+    size_t Pos = LowerBoundPTS(Frames, PTS);
+    while (Pos != size() && Frames.Hidden(Pos) && Frames.PTS(Pos) == PTS)
         Pos++;
 
-    if (Pos == end())
+    if (Pos == size())
         return static_cast<int>(size() - 1);
-    size_t Frame = std::distance(begin(), Pos);
-    if (Pos == begin() || FFABS(Pos->PTS - PTS) <= FFABS((Pos - 1)->PTS - PTS))
-        return static_cast<int>(Frame);
-    return static_cast<int>(Frame - 1);
+    if (Pos == 0 || FFABS(Frames.PTS(Pos) - PTS) <= FFABS(Frames.PTS(Pos - 1) - PTS))
+        return static_cast<int>(Pos);
+    return static_cast<int>(Pos - 1);
 }
 
 int FFMS_Track::FindClosestVideoKeyFrame(int Frame) const {
-    frame_vec &Frames = Data->Frames;
+    FrameColumns const& Frames = Data->Frames;
     Frame = std::min(std::max(Frame, 0), static_cast<int>(size()) - 1);
-    for (; Frame > 0 && !Frames[Frame].KeyFrame; Frame--);
-    for (; Frame > 0 && !Frames[Frames[Frame].OriginalPos].KeyFrame; Frame--);
+    for (; Frame > 0 && !Frames.KeyFrame(Frame); Frame--);
+    for (; Frame > 0 && !Frames.KeyFrame(Frames.OriginalPos(Frame)); Frame--);
     return Frame;
 }
 
 int FFMS_Track::RealFrameNumber(int Frame) const {
-    return Data->RealFrameNumbers[Frame];
+    return Data->RealFrameNumbers.empty() ? Frame : Data->RealFrameNumbers[Frame];
 }
 
 int FFMS_Track::VisibleFrameCount() const {
-    return TT == FFMS_TYPE_AUDIO ? static_cast<int>(Data->Frames.size()) : static_cast<int>(Data->RealFrameNumbers.size());
+    if (KeyFramesOnly)
+        return empty() ? 0 : static_cast<int>(FrameCount);
+    return TT == FFMS_TYPE_AUDIO ? static_cast<int>(size()) : Data->VisibleFrames;
 }
 
 void FFMS_Track::MaybeReorderFrames() {
-    frame_vec &Frames = Data->Frames;
+    FrameColumns &Frames = Data->Frames;
     // First check if we need to do anything
     bool has_b_frames = false;
     for (size_t i = 1; i < size(); ++i) {
         // If the timestamps are already out of order, then they actually are
         // presentation timestamps and we don't need to do anything
-        if (Frames[i].PTS < Frames[i - 1].PTS)
+        if (Frames.PTS(i) < Frames.PTS(i - 1))
             return;
 
-        if (Frames[i].FrameType == AV_PICTURE_TYPE_B) {
+        if (Frames.FrameType(i) == AV_PICTURE_TYPE_B) {
             has_b_frames = true;
 
             // Reordering files with multiple b-frames is currently not
             // supported
-            if (Frames[i - 1].FrameType == AV_PICTURE_TYPE_B)
+            if (Frames.FrameType(i - 1) == AV_PICTURE_TYPE_B)
                 return;
         }
     }
@@ -235,27 +450,32 @@ void FFMS_Track::MaybeReorderFrames() {
     // them temporally, but that happens to cover the only files I've seen
     // with b-frames and no presentation timestamps.
     for (size_t i = 1; i < size(); ++i) {
-        if (Frames[i].FrameType == AV_PICTURE_TYPE_B)
-            std::swap(Frames[i].PTS, Frames[i - 1].PTS);
+        if (Frames.FrameType(i) == AV_PICTURE_TYPE_B) {
+            int64_t PTS = Frames.PTS(i);
+            Frames.SetPTS(i, Frames.PTS(i - 1));
+            Frames.SetPTS(i - 1, PTS);
+        }
     }
 }
 
 void FFMS_Track::MaybeHideFrames() {
-    frame_vec &Frames = Data->Frames;
+    if (KeyFramesOnly)
+        return;
+    FrameColumns &Frames = Data->Frames;
     // Awful handling for interlaced H.264: each frame is output twice, so hide
     // frames with an invalid file position. The PTS will not match sometimes,
     // since libavformat makes up timestamps... but only sometimes.
     for (size_t i = 1; i < size(); ++i) {
-        FrameInfo const& prev = Frames[i - 1];
-        FrameInfo& cur = Frames[i];
+        int64_t PrevPos = Frames.FilePos(i - 1);
+        int64_t CurPos = Frames.FilePos(i);
 
-        if (prev.FilePos >= 0 && (cur.FilePos == -1 || cur.FilePos == prev.FilePos) && !prev.Hidden)
-            cur.Hidden = true;
+        if (PrevPos >= 0 && (CurPos == -1 || CurPos == PrevPos) && !Frames.Hidden(i - 1))
+            Frames.SetHidden(i, true);
     }
 }
 
 void FFMS_Track::FillAudioGaps() {
-    frame_vec &Frames = Data->Frames;
+    FrameColumns &Frames = Data->Frames;
     // There may not be audio data for the entire duration of the audio track,
     // as some formats support gaps between the end time of one packet and the
     // PTS of the next audio packet, and we should zero-fill those gaps.
@@ -280,12 +500,12 @@ void FFMS_Track::FillAudioGaps() {
 
     if (HasDiscontTS) {
         int64_t shift = 0;
-        Frames[0].OriginalPTS = Frames[0].PTS;
+        Frames.SetOriginalPTS(0, Frames.PTS(0));
         for (size_t i = 1; i < size(); i++) {
-            Frames[i].OriginalPTS = Frames[i].PTS;
-            if (Frames[i].PTS != AV_NOPTS_VALUE && Frames[i].OriginalPTS <= Frames[i-1].OriginalPTS)
-                shift = -(Frames[i].PTS) + Frames[i-1].PTS + SamplesToDuration(Frames[i-1].SampleCount);
-            Frames[i].PTS += shift;
+            Frames.SetOriginalPTS(i, Frames.PTS(i));
+            if (Frames.PTS(i) != AV_NOPTS_VALUE && Frames.OriginalPTS(i) <= Frames.OriginalPTS(i - 1))
+                shift = -(Frames.PTS(i)) + Frames.PTS(i - 1) + SamplesToDuration(Frames.SampleCount(i - 1));
+            Frames.SetPTS(i, Frames.PTS(i) + shift);
         }
     }
 
@@ -297,38 +517,37 @@ void FFMS_Track::FillAudioGaps() {
     // Verify that every frame has a timestamp and that they monotonically
     // increase, as otherwise we can't trust them
     auto PrevPTS = front().PTS - 1;
-    for (auto const& frame : *this) {
-        if (frame.PTS == AV_NOPTS_VALUE || frame.PTS <= PrevPTS)
+    for (size_t i = 0; i < size(); i++) {
+        if (Frames.PTS(i) == AV_NOPTS_VALUE || Frames.PTS(i) <= PrevPTS)
             return;
-        PrevPTS = frame.PTS;
+        PrevPTS = Frames.PTS(i);
     }
 
     // There are some missing samples and the timestamps appear to all be valid,
     // so go ahead and extend the frames to cover the gaps
     const auto FirstPTS = front().PTS;
-    auto PrevFrame = &Frames.front();
     int32_t Shift = 0;
-    for (auto& Frame : Frames) {
+    for (size_t i = 0; i < size(); i++) {
         if (Shift > 0)
-            Frame.SampleStart += Shift;
+            Frames.SetSampleStart(i, Frames.SampleStart(i) + Shift);
 
-        const auto ExpectedStartSample = DurationToSamples(Frame.PTS - FirstPTS);
-        const auto Gap = static_cast<int32_t>(ExpectedStartSample - Frame.SampleStart);
+        const auto ExpectedStartSample = DurationToSamples(Frames.PTS(i) - FirstPTS);
+        const auto Gap = static_cast<int32_t>(ExpectedStartSample - Frames.SampleStart(i));
         if (Gap > 0) {
-            PrevFrame->SampleCount += Gap;
-            Frame.SampleStart = ExpectedStartSample;
+            if (i > 0)
+                Frames.SetSampleCount(i - 1, Frames.SampleCount(i - 1) + Gap);
+            Frames.SetSampleStart(i, ExpectedStartSample);
         }
         Shift += Gap;
-        PrevFrame = &Frame;
     }
 }
 
 void FFMS_Track::FinalizeTrack() {
-    frame_vec &Frames = Data->Frames;
+    FrameColumns &Frames = Data->Frames;
     // With some formats (such as Vorbis) a bad final packet results in a
     // frame with PTS 0, which we don't want to sort to the beginning
     if (size() > 2 && front().PTS >= back().PTS)
-        Frames.pop_back();
+        Frames.Resize(size() - 1);
 
     if (TT == FFMS_TYPE_AUDIO) {
         FillAudioGaps();
@@ -339,76 +558,240 @@ void FFMS_Track::FinalizeTrack() {
         return;
 
     for (size_t i = 0; i < size(); i++) {
-        Frames[i].OriginalPos = i;
-        Frames[i].OriginalPTS = Frames[i].PTS;
+        Frames.SetOriginalPos(i, i);
+        Frames.SetOriginalPTS(i, Frames.PTS(i));
+    }
+
+    // Keyframes don't get reordered, so there's nothing to fix up
+    if (KeyFramesOnly) {
+        UpdateFrameNumbers();
+        return;
     }
 
     MaybeReorderFrames();
 
+    std::vector<size_t> SortedPos(size());
     if (size() > 2 && HasDiscontTS) {
         std::vector<size_t> secs = { 0 };
 
-        auto lastPTS = Frames[0].PTS;
-        const auto thresh = std::abs(Frames[1].PTS - Frames[0].PTS) * 16; // A bad approximation of 16 frames, the max reorder buffer size.
+        auto lastPTS = Frames.PTS(0);
+        const auto thresh = std::abs(Frames.PTS(1) - Frames.PTS(0)) * 16; // A bad approximation of 16 frames, the max reorder buffer size.
         for (size_t i = 0; i < size(); i++) {
-            if (Frames[i].PTS < lastPTS && (lastPTS - Frames[i].PTS) > thresh && i + 1 < size()) {
+            if (Frames.PTS(i) < lastPTS && (lastPTS - Frames.PTS(i)) > thresh && i + 1 < size()) {
                 secs.push_back(i);
                 i++; // Sections must be at least 2 frames long.
             }
-            lastPTS = Frames[i].PTS;
+            lastPTS = Frames.PTS(i);
         }
 
         // We need to sort each distinct sections by PTS to account for any reordering.
         for (size_t i = 0; i < secs.size() - 1; i++)
-            sort(Frames.begin() + secs[i], Frames.begin() + secs[i + 1], PTSComparison);
-        sort(Frames.begin() + secs.back(), Frames.end(), PTSComparison);
+            SortFramesByPTS(Frames, secs[i], secs[i + 1], SortedPos);
+        SortFramesByPTS(Frames, secs.back(), Frames.size(), SortedPos);
 
         // Try and make up some sane timestamps based on previous sections, while
         // keeping the same frame durations.
         for (size_t i = 1; i < secs.size(); i++) {
-            const auto shift = -(Frames[secs[i]].PTS) + (Frames[secs[i] + 1].PTS - Frames[secs[i]].PTS) + Frames[secs[i] - 1].PTS;
+            const auto shift = -(Frames.PTS(secs[i])) + (Frames.PTS(secs[i] + 1) - Frames.PTS(secs[i])) + Frames.PTS(secs[i] - 1);
             size_t end;
             if (i == secs.size() - 1)
                 end = Frames.size();
             else
                 end = secs[i + 1];
             for (size_t j = secs[i]; j < end; j++)
-                Frames[j].PTS += shift;
+                Frames.SetPTS(j, Frames.PTS(j) + shift);
         }
     } else {
-        sort(Frames.begin(), Frames.end(), PTSComparison);
+        SortFramesByPTS(Frames, 0, Frames.size(), SortedPos);
     }
 
-    std::vector<size_t> ReorderTemp;
-    ReorderTemp.reserve(size());
+    // OriginalPos of the nth frame is where the nth frame in decoding order is
+    for (size_t i = 0; i < Frames.size(); i++)
+        Frames.SetOriginalPos(i, SortedPos[i]);
 
-    for (size_t i = 0; i < size(); i++)
-        ReorderTemp.push_back(Frames[i].OriginalPos);
+    UpdateFrameNumbers();
+}
 
-    for (size_t i = 0; i < size(); i++)
-        Frames[ReorderTemp[i]].OriginalPos = i;
+void FFMS_Track::UpdateFrameNumbers() {
+    FrameColumns const& Frames = Data->Frames;
+    std::vector<int> &RealFrameNumbers = Data->RealFrameNumbers;
 
-    GeneratePublicInfo();
+    RealFrameNumbers.clear();
+    Data->VisibleFrames = static_cast<int>(size());
+    for (size_t i = 0; i < size(); ++i) {
+        if (!Frames.Hidden(i))
+            continue;
+
+        RealFrameNumbers.reserve(size());
+        for (size_t j = 0; j < size(); ++j) {
+            if (!Frames.Hidden(j))
+                RealFrameNumbers.push_back(static_cast<int>(j));
+        }
+        RealFrameNumbers.shrink_to_fit();
+        Data->VisibleFrames = static_cast<int>(RealFrameNumbers.size());
+        break;
+    }
+
+    Data->PublicFrameInfo.clear();
+    Data->PublicInfoReady = false;
 }
 
-void FFMS_Track::GeneratePublicInfo() {
-    frame_vec &Frames = Data->Frames;
-    std::vector<int> &RealFrameNumbers = Data->RealFrameNumbers;
+void FFMS_Track::GeneratePublicInfo() const {
+    FrameColumns const& Frames = Data->Frames;
     std::vector<FFMS_FrameInfo> &PublicFrameInfo = Data->PublicFrameInfo;
-    RealFrameNumbers.reserve(size());
-    PublicFrameInfo.reserve(size());
+
+    if (KeyFramesOnly) {
+        // Make up the frames between the keyframes, spacing their timestamps
+        // evenly up to the next keyframe or the end of the track. Frames
+        // before the first keyframe are spaced like the rest of the track.
+        PublicFrameInfo.reserve(static_cast<size_t>(FrameCount));
+        if (empty())
+            return;
+        const auto AddFrames = [&](int64_t Start, int64_t End, int64_t StartPTS, int64_t Num, int64_t Den, bool KeyFrame) {
+            for (int64_t n = Start; n < End; ++n) {
+                int64_t PTS = StartPTS + (Den ? Num * (n - Start) / Den : 0);
+                FFMS_FrameInfo info = { PTS, -1, KeyFrame && n == Start, PTS };
+                PublicFrameInfo.push_back(info);
+            }
+        };
+
+        const int64_t FirstStart = Frames.FrameNumber(0);
+        const int64_t LastStart = Frames.FrameNumber(size() - 1);
+        if (FirstStart > 0) {
+            const int64_t Span = FrameCount - 1 - FirstStart;
+            const int64_t Duration = Span > 0 ? (LastPTS - Frames.PTS(0)) / Span : LastDuration;
+            AddFrames(0, FirstStart, Frames.PTS(0) - Duration * FirstStart, Duration, 1, false);
+        }
+        for (size_t i = 0; i + 1 < size(); ++i)
+            AddFrames(Frames.FrameNumber(i), Frames.FrameNumber(i + 1), Frames.PTS(i),
+                Frames.PTS(i + 1) - Frames.PTS(i), Frames.FrameNumber(i + 1) - Frames.FrameNumber(i), true);
+        AddFrames(LastStart, FrameCount, Frames.PTS(size() - 1),
+            LastPTS - Frames.PTS(size() - 1), FrameCount - 1 - LastStart, true);
+        return;
+    }
+
+    PublicFrameInfo.reserve(static_cast<size_t>(Data->VisibleFrames));
     for (size_t i = 0; i < size(); ++i) {
-        if (Frames[i].Hidden)
+        if (Frames.Hidden(i))
             continue;
-        RealFrameNumbers.push_back(static_cast<int>(i));
 
-        FFMS_FrameInfo info = { Frames[i].PTS, Frames[i].RepeatPict, Frames[Frames[i].OriginalPos].KeyFrame, Frames[i].OriginalPTS };
+        FFMS_FrameInfo info = { Frames.PTS(i), Frames.RepeatPict(i), Frames.KeyFrame(Frames.OriginalPos(i)), Frames.OriginalPTS(i) };
         PublicFrameInfo.push_back(info);
     }
 }
 
+std::vector<FFMS_FrameInfo> const& FFMS_Track::PublicInfo() const {
+    if (!Data->PublicInfoReady) {
+        std::lock_guard<std::mutex> Guard(Data->PublicInfoLock);
+        if (!Data->PublicInfoReady) {
+            GeneratePublicInfo();
+            Data->PublicInfoReady = true;
+        }
+    }
+    return Data->PublicFrameInfo;
+}
+
 const FFMS_FrameInfo *FFMS_Track::GetFrameInfo(size_t N) const {
-    std::vector<FFMS_FrameInfo> &PublicFrameInfo = Data->PublicFrameInfo;
+    if (TT != FFMS_TYPE_VIDEO)
+        return nullptr;
+    std::vector<FFMS_FrameInfo> const& PublicFrameInfo = PublicInfo();
     if (N >= PublicFrameInfo.size()) return nullptr;
     return &PublicFrameInfo[N];
 }
+
+size_t FFMS_Track::MemoryUsage() const {
+    return Data->Frames.MemoryUsage()
+        + Data->RealFrameNumbers.capacity() * sizeof(int)
+        + Data->PublicFrameInfo.capacity() * sizeof(FFMS_FrameInfo);
+}
+
+FrameInfo FrameColumns::Get(size_t i) const {
+    return { PTSs.Get(i), OriginalPTSs.Get(i), FilePositions.Get(i), SampleStarts.Get(i),
+        SampleCounts.Get(i), FrameNumbers.Get(i), OriginalPositions.Get(i), FrameTypes.Get(i), RepeatPicts.Get(i),
+        KeyFrames.Get(i), HiddenFrames.Get(i) };
+}
+
+void FrameColumns::Set(size_t i, FrameInfo const& Frame) {
+    PTSs.Set(i, Frame.PTS, Count);
+    OriginalPTSs.Set(i, Frame.OriginalPTS, Count);
+    FilePositions.Set(i, Frame.FilePos, Count);
+    SampleStarts.Set(i, Frame.SampleStart, Count);
+    SampleCounts.Set(i, Frame.SampleCount, Count);
+    FrameNumbers.Set(i, Frame.FrameNumber, Count);
+    OriginalPositions.Set(i, static_cast<uint32_t>(Frame.OriginalPos), Count);
+    FrameTypes.Set(i, static_cast<int8_t>(Frame.FrameType), Count);
+    RepeatPicts.Set(i, static_cast<int8_t>(Frame.RepeatPict), Count);
+    KeyFrames.Set(i, Frame.KeyFrame, Count);
+    HiddenFrames.Set(i, Frame.Hidden, Count);
+}
+
+void FrameColumns::PushBack(FrameInfo const& Frame) {
+    if (Count == Capacity)
+        Capacity = std::max<size_t>(Capacity * 2, 16);
+    PTSs.PushBack(Frame.PTS, Count, Capacity);
+    OriginalPTSs.PushBack(Frame.OriginalPTS, Count, Capacity);
+    FilePositions.PushBack(Frame.FilePos, Count, Capacity);
+    SampleStarts.PushBack(Frame.SampleStart, Count, Capacity);
+    SampleCounts.PushBack(Frame.SampleCount, Count, Capacity);
+    FrameNumbers.PushBack(Frame.FrameNumber, Count, Capacity);
+    OriginalPositions.PushBack(static_cast<uint32_t>(Frame.OriginalPos), Count, Capacity);
+    FrameTypes.PushBack(static_cast<int8_t>(Frame.FrameType), Count, Capacity);
+    RepeatPicts.PushBack(static_cast<int8_t>(Frame.RepeatPict), Count, Capacity);
+    KeyFrames.PushBack(Frame.KeyFrame, Count, Capacity);
+    HiddenFrames.PushBack(Frame.Hidden, Count, Capacity);
+    ++Count;
+}
+
+void FrameColumns::Resize(size_t Size) {
+    PTSs.Resize(Size);
+    OriginalPTSs.Resize(Size);
+    FilePositions.Resize(Size);
+    SampleStarts.Resize(Size);
+    SampleCounts.Resize(Size);
+    FrameNumbers.Resize(Size);
+    OriginalPositions.Resize(Size);
+    FrameTypes.Resize(Size);
+    RepeatPicts.Resize(Size);
+    KeyFrames.Resize(Size);
+    HiddenFrames.Resize(Size);
+    Count = Size;
+}
+
+void FrameColumns::Reserve(size_t NewCapacity) {
+    if (NewCapacity <= Capacity)
+        return;
+    Capacity = NewCapacity;
+    PTSs.Reserve(Capacity);
+    OriginalPTSs.Reserve(Capacity);
+    FilePositions.Reserve(Capacity);
+    SampleStarts.Reserve(Capacity);
+    SampleCounts.Reserve(Capacity);
+    FrameNumbers.Reserve(Capacity);
+    OriginalPositions.Reserve(Capacity);
+    FrameTypes.Reserve(Capacity);
+    RepeatPicts.Reserve(Capacity);
+    KeyFrames.Reserve(Capacity);
+    HiddenFrames.Reserve(Capacity);
+}
+
+void FrameColumns::Permute(size_t First, std::vector<size_t> const& Order) {
+    std::vector<bool> Visited;
+    PTSs.Permute(First, Order, Visited);
+    OriginalPTSs.Permute(First, Order, Visited);
+    FilePositions.Permute(First, Order, Visited);
+    SampleStarts.Permute(First, Order, Visited);
+    SampleCounts.Permute(First, Order, Visited);
+    FrameNumbers.Permute(First, Order, Visited);
+    OriginalPositions.Permute(First, Order, Visited);
+    FrameTypes.Permute(First, Order, Visited);
+    RepeatPicts.Permute(First, Order, Visited);
+    KeyFrames.Permute(First, Order, Visited);
+    HiddenFrames.Permute(First, Order, Visited);
+}
+
+size_t FrameColumns::MemoryUsage() const {
+    return PTSs.MemoryUsage() + OriginalPTSs.MemoryUsage() + FilePositions.MemoryUsage()
+        + SampleStarts.MemoryUsage() + SampleCounts.MemoryUsage() + FrameNumbers.MemoryUsage()
+        + OriginalPositions.MemoryUsage() + FrameTypes.MemoryUsage() + RepeatPicts.MemoryUsage()
+        + KeyFrames.MemoryUsage() + HiddenFrames.MemoryUsage();
+}
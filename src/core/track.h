@@ -23,10 +23,16 @@
 
 #include "ffms.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <mutex>
+#include <string>
+#include <type_traits>
 #include <vector>
 #include <memory>
 
+class AudioWaveform;
 class ZipFile;
 
 struct FrameInfo {
@@ -35,6 +41,9 @@ struct FrameInfo {
     int64_t FilePos;
     int64_t SampleStart;
     uint32_t SampleCount;
+    // For the video frames of a keyframe-only track, the frame's number in
+    // decoding order
+    int64_t FrameNumber;
     size_t OriginalPos;
     int FrameType;
     int RepeatPict;
@@ -42,20 +51,159 @@ struct FrameInfo {
     bool Hidden;
 };
 
+// The frames of a track, stored column by column instead of as FrameInfos.
+// A column which has only ever held zeros, such as the sample counts of
+// video frames or the frame types of audio frames, takes no memory, and the
+// flags take a bit each.
+class FrameColumns {
+    template<typename T>
+    class Column {
+        std::vector<T> Values;
+
+        void Materialize(size_t Size, size_t Capacity) {
+            Values.reserve(std::max(Size, Capacity));
+            Values.resize(Size);
+        }
+
+    public:
+        T Get(size_t i) const {
+            return Values.empty() ? T() : static_cast<T>(Values[i]);
+        }
+
+        void Set(size_t i, T Value, size_t Size) {
+            if (Values.empty()) {
+                if (Value == T())
+                    return;
+                Materialize(Size, 0);
+            }
+            Values[i] = Value;
+        }
+
+        void PushBack(T Value, size_t Size, size_t Capacity) {
+            if (Values.empty()) {
+                if (Value == T())
+                    return;
+                Materialize(Size, Capacity);
+            }
+            Values.push_back(Value);
+        }
+
+        void Resize(size_t Size) {
+            if (!Values.empty())
+                Values.resize(Size);
+        }
+
+        void Reserve(size_t Capacity) {
+            if (!Values.empty())
+                Values.reserve(Capacity);
+        }
+
+        // Puts the values from First + Order[0], First + Order[1] and so on
+        // at First, First + 1, ..., moving them in place along the cycles of
+        // Order. Visited is scratch space shared by all columns.
+        void Permute(size_t First, std::vector<size_t> const& Order, std::vector<bool> &Visited) {
+            if (Values.empty())
+                return;
+            Visited.assign(Order.size(), false);
+            for (size_t Start = 0; Start < Order.size(); Start++) {
+                if (Visited[Start])
+                    continue;
+                T Saved = Values[First + Start];
+                size_t To = Start;
+                for (;;) {
+                    Visited[To] = true;
+                    size_t From = Order[To];
+                    if (From == Start)
+                        break;
+                    Values[First + To] = Values[First + From];
+                    To = From;
+                }
+                Values[First + To] = Saved;
+            }
+        }
+
+        size_t MemoryUsage() const {
+            return std::is_same<T, bool>::value ? Values.capacity() / 8 : Values.capacity() * sizeof(T);
+        }
+    };
+
+    size_t Count = 0;
+    size_t Capacity = 0;
+    Column<int64_t> PTSs;
+    Column<int64_t> OriginalPTSs;
+    Column<int64_t> FilePositions;
+    Column<int64_t> SampleStarts;
+    Column<uint32_t> SampleCounts;
+    Column<int64_t> FrameNumbers;
+    Column<uint32_t> OriginalPositions;
+    Column<int8_t> FrameTypes;
+    Column<int8_t> RepeatPicts;
+    Column<bool> KeyFrames;
+    Column<bool> HiddenFrames;
+
+public:
+    size_t size() const { return Count; }
+    bool empty() const { return Count == 0; }
+
+    FrameInfo Get(size_t i) const;
+    void Set(size_t i, FrameInfo const& Frame);
+    void PushBack(FrameInfo const& Frame);
+    void Resize(size_t Size);
+    void Reserve(size_t Capacity);
+    // Reorders the frames from First on as in Column::Permute
+    void Permute(size_t First, std::vector<size_t> const& Order);
+
+    int64_t PTS(size_t i) const { return PTSs.Get(i); }
+    int64_t OriginalPTS(size_t i) const { return OriginalPTSs.Get(i); }
+    int64_t FilePos(size_t i) const { return FilePositions.Get(i); }
+    int64_t SampleStart(size_t i) const { return SampleStarts.Get(i); }
+    uint32_t SampleCount(size_t i) const { return SampleCounts.Get(i); }
+    int64_t FrameNumber(size_t i) const { return FrameNumbers.Get(i); }
+    size_t OriginalPos(size_t i) const { return OriginalPositions.Get(i); }
+    int FrameType(size_t i) const { return FrameTypes.Get(i); }
+    int RepeatPict(size_t i) const { return RepeatPicts.Get(i); }
+    bool KeyFrame(size_t i) const { return KeyFrames.Get(i); }
+    bool Hidden(size_t i) const { return HiddenFrames.Get(i); }
+
+    void SetPTS(size_t i, int64_t Value) { PTSs.Set(i, Value, Count); }
+    void SetOriginalPTS(size_t i, int64_t Value) { OriginalPTSs.Set(i, Value, Count); }
+    void SetSampleStart(size_t i, int64_t Value) { SampleStarts.Set(i, Value, Count); }
+    void SetSampleCount(size_t i, uint32_t Value) { SampleCounts.Set(i, Value, Count); }
+    void SetOriginalPos(size_t i, size_t Value) { OriginalPositions.Set(i, static_cast<uint32_t>(Value), Count); }
+    void SetHidden(size_t i, bool Value) { HiddenFrames.Set(i, Value, Count); }
+
+    size_t MemoryUsage() const;
+};
+
 struct FFMS_Track {
 private:
-    typedef std::vector<FrameInfo> frame_vec;
     struct TrackData {
-        frame_vec Frames;
+        FrameColumns Frames;
+        // The frame numbers of the visible frames, left empty if no frames
+        // are hidden
         std::vector<int> RealFrameNumbers;
+        int VisibleFrames = 0;
+        // Mostly repeats what's in the frames, so it's only generated once
+        // something asks for it
         std::vector<FFMS_FrameInfo> PublicFrameInfo;
+        std::atomic<bool> PublicInfoReady{ false };
+        std::mutex PublicInfoLock;
+
+        TrackData() {}
+        TrackData(TrackData const& Other)
+            : Frames(Other.Frames)
+            , RealFrameNumbers(Other.RealFrameNumbers)
+            , VisibleFrames(Other.VisibleFrames) {
+        }
     };
 
     std::shared_ptr<TrackData> Data;
 
     void MaybeReorderFrames();
     void FillAudioGaps();
-    void GeneratePublicInfo();
+    void UpdateFrameNumbers();
+    void GeneratePublicInfo() const;
+    std::vector<FFMS_FrameInfo> const& PublicInfo() const;
 
 public:
     FFMS_TrackType TT = FFMS_TYPE_UNKNOWN;
@@ -66,9 +214,33 @@ public:
     bool HasDiscontTS = false;
     int64_t LastDuration = 0;
     int SampleRate = 0; // not persisted
+    // The stream as described by the demuxer when the track was indexed
+    std::string CodecName;
+    int CodecWidth = 0;
+    int CodecHeight = 0;
+    int CodecSampleRate = 0;
+    int CodecChannels = 0;
+    // Only the keyframes of this video track were indexed; the other frames
+    // are described by the frame count and the last timestamp
+    bool KeyFramesOnly = false;
+    int64_t FrameCount = 0;
+    int64_t LastPTS = 0;
+    // Summary of the audio for drawing waveforms, only made if asked for
+    // when indexing
+    std::shared_ptr<AudioWaveform> Waveform;
 
     void AddVideoFrame(int64_t PTS, int RepeatPict, bool KeyFrame, int FrameType, int64_t FilePos = 0, bool Invisible = false);
     void AddAudioFrame(int64_t PTS, int64_t SampleStart, uint32_t SampleCount, bool KeyFrame, int64_t FilePos = 0, bool Invisible = false);
+    // Counts a frame of a keyframe-only track, adding it only if it's a keyframe
+    void CountVideoFrame(int64_t PTS, bool KeyFrame, int64_t FilePos);
+    // Replaces everything from frame Keep onwards with the frames of Other starting at From
+    void SpliceFrames(size_t Keep, FFMS_Track const& Other, size_t From);
+    // Appends the frames of other finalized tracks, with the timestamps of
+    // each shifted to start where the frames before it end, so that they
+    // all play back to back
+    void AppendTracks(std::vector<FFMS_Track const *> const& Others);
+    // Where the last frame ends
+    int64_t EndPTS() const;
 
     void MaybeHideFrames();
     void FinalizeTrack();
@@ -85,26 +257,70 @@ public:
     void WriteTimecodes(const char *TimecodeFile) const;
     void Write(ZipFile &Stream) const;
 
-    typedef frame_vec::allocator_type allocator_type;
-    typedef frame_vec::size_type size_type;
-    typedef frame_vec::difference_type difference_type;
-    typedef frame_vec::const_pointer pointer;
-    typedef frame_vec::const_reference reference;
-    typedef frame_vec::value_type value_type;
-    typedef frame_vec::const_iterator iterator;
-    typedef frame_vec::const_reverse_iterator reverse_iterator;
+    // Iterates over copies of the frames, since they aren't stored as
+    // FrameInfos
+    class iterator {
+        FrameColumns const *Frames = nullptr;
+        size_t Pos = 0;
+
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef FrameInfo value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef FrameInfo reference;
+        struct pointer {
+            FrameInfo Frame;
+            FrameInfo const *operator->() const { return &Frame; }
+        };
+
+        iterator() {}
+        iterator(FrameColumns const *Frames, size_t Pos) : Frames(Frames), Pos(Pos) {}
+
+        FrameInfo operator*() const { return Frames->Get(Pos); }
+        pointer operator->() const { return { Frames->Get(Pos) }; }
+        FrameInfo operator[](difference_type n) const { return Frames->Get(Pos + n); }
+
+        iterator &operator++() { ++Pos; return *this; }
+        iterator &operator--() { --Pos; return *this; }
+        iterator operator++(int) { iterator Old = *this; ++Pos; return Old; }
+        iterator operator--(int) { iterator Old = *this; --Pos; return Old; }
+        iterator &operator+=(difference_type n) { Pos += n; return *this; }
+        iterator &operator-=(difference_type n) { Pos -= n; return *this; }
+        iterator operator+(difference_type n) const { return iterator(Frames, Pos + n); }
+        iterator operator-(difference_type n) const { return iterator(Frames, Pos - n); }
+        difference_type operator-(iterator const& Other) const { return static_cast<difference_type>(Pos) - static_cast<difference_type>(Other.Pos); }
+
+        bool operator==(iterator const& Other) const { return Pos == Other.Pos; }
+        bool operator!=(iterator const& Other) const { return Pos != Other.Pos; }
+        bool operator<(iterator const& Other) const { return Pos < Other.Pos; }
+        bool operator>(iterator const& Other) const { return Pos > Other.Pos; }
+        bool operator<=(iterator const& Other) const { return Pos <= Other.Pos; }
+        bool operator>=(iterator const& Other) const { return Pos >= Other.Pos; }
+    };
+
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef FrameInfo value_type;
+    typedef FrameInfo reference;
 
     void clear() {
         Data = std::make_shared<TrackData>();
+        Waveform.reset();
     }
 
     bool empty() const { return Data->Frames.empty(); }
     size_type size() const { return Data->Frames.size(); }
-    reference operator[](size_type pos) const { return Data->Frames[pos]; }
-    reference front() const { return Data->Frames.front(); }
-    reference back() const { return Data->Frames.back(); }
-    iterator begin() const { return Data->Frames.begin(); }
-    iterator end() const { return Data->Frames.end(); }
+    FrameInfo operator[](size_type pos) const { return Data->Frames.Get(pos); }
+    FrameInfo front() const { return Data->Frames.Get(0); }
+    FrameInfo back() const { return Data->Frames.Get(size() - 1); }
+    iterator begin() const { return iterator(&Data->Frames, 0); }
+    iterator end() const { return iterator(&Data->Frames, size()); }
+    // Direct access to single fields, which is much cheaper than copying out
+    // whole frames
+    FrameColumns const& Columns() const { return Data->Frames; }
+
+    // Bytes used by the frames of the track
+    size_t MemoryUsage() const;
 
     FFMS_Track();
     FFMS_Track(ZipFile &Stream);
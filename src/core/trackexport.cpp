@@ -0,0 +1,220 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "trackexport.h"
+
+#include "filehandle.h"
+#include "track.h"
+#include "utils.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+// Output is handed to the file in blocks of this size
+const size_t ExportBufferSize = 1024 * 1024;
+
+class BufferedWriter {
+    FileHandle File;
+    std::vector<char> Buffer;
+    size_t Used = 0;
+
+    void WriteBuffer() {
+        if (Used)
+            File.Write(Buffer.data(), Used);
+        Used = 0;
+    }
+
+public:
+    explicit BufferedWriter(const char *Filename)
+        : File(Filename, "w", FFMS_ERROR_TRACK, FFMS_ERROR_FILE_WRITE)
+        , Buffer(ExportBufferSize) {
+    }
+
+    void Printf(const char *Format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    {
+        for (;;) {
+            va_list Args;
+            va_start(Args, Format);
+            int Length = vsnprintf(Buffer.data() + Used, Buffer.size() - Used, Format, Args);
+            va_end(Args);
+            if (Length < 0)
+                throw FFMS_Exception(FFMS_ERROR_TRACK, FFMS_ERROR_FILE_WRITE,
+                    "Failed to format output");
+            if (Used + Length < Buffer.size()) {
+                Used += Length;
+                return;
+            }
+            if (Used == 0)
+                Buffer.resize(Length + 1);
+            WriteBuffer();
+        }
+    }
+
+    void Finish() {
+        WriteBuffer();
+        File.Flush();
+    }
+};
+
+// The frames as seen through the API: the visible frames of video tracks in
+// presentation order, and every packet of other tracks
+class ExportedFrames {
+    FFMS_Track const& Track;
+    FrameColumns const& Frames;
+    bool Video;
+    int Count;
+
+    // Where frame n is stored in the track
+    int StoredFrame(int n) const {
+        return Video ? Track.RealFrameNumber(n) : n;
+    }
+
+public:
+    explicit ExportedFrames(FFMS_Track const& Track)
+        : Track(Track)
+        , Frames(Track.Columns())
+        , Video(Track.TT == FFMS_TYPE_VIDEO)
+        , Count(Video ? Track.VisibleFrameCount() : static_cast<int>(Track.size())) {
+    }
+
+    int size() const { return Count; }
+
+    int64_t PTS(int n) const {
+        return Video ? Track.GetFrameInfo(n)->PTS : Frames.PTS(n);
+    }
+
+    int64_t Duration(int n) const {
+        return n + 1 < Count ? PTS(n + 1) - PTS(n) : Track.LastDuration;
+    }
+
+    bool KeyFrame(int n) const {
+        return Video ? !!Track.GetFrameInfo(n)->KeyFrame : Frames.KeyFrame(n);
+    }
+
+    // The same letters as av_get_picture_type_char
+    char Type(int n) const {
+        int FrameType = Frames.FrameType(StoredFrame(n));
+        return FrameType >= 0 && FrameType < 8 ? "?IPBSipb"[FrameType] : '?';
+    }
+
+    int64_t FilePos(int n) const {
+        return Frames.FilePos(StoredFrame(n));
+    }
+
+    double Milliseconds(int64_t TS) const {
+        return (TS * Track.TB.Num) / (double)Track.TB.Den;
+    }
+};
+
+void WriteTimecodesV2(BufferedWriter &Out, ExportedFrames const& Frames) {
+    Out.Printf("# timecode format v2\n");
+    for (int n = 0; n < Frames.size(); n++)
+        Out.Printf("%.02f\n", Frames.Milliseconds(Frames.PTS(n)));
+}
+
+// Runs of frames with the same duration become a single line, and the
+// duration most frames have is the assumed one which needs no lines at all
+void WriteTimecodesV1(BufferedWriter &Out, ExportedFrames const& Frames) {
+    // Frames without a usable duration of their own last as long as the
+    // previous one
+    std::vector<int64_t> Durations(Frames.size());
+    int64_t Previous = 1;
+    for (int n = 0; n < Frames.size(); n++) {
+        int64_t Duration = Frames.Duration(n);
+        Durations[n] = Previous = Duration > 0 ? Duration : Previous;
+    }
+
+    std::unordered_map<int64_t, int> Counts;
+    int64_t Assumed = Durations.empty() ? 1 : Durations[0];
+    for (int64_t Duration : Durations) {
+        int Count = ++Counts[Duration];
+        if (Count > Counts[Assumed])
+            Assumed = Duration;
+    }
+
+    auto FPS = [&](int64_t Duration) { return 1000 / Frames.Milliseconds(Duration); };
+    Out.Printf("# timecode format v1\nAssume %.6f\n", FPS(Assumed));
+    for (int Start = 0, End; Start < Frames.size(); Start = End) {
+        for (End = Start + 1; End < Frames.size() && Durations[End] == Durations[Start]; End++);
+        if (Durations[Start] != Assumed)
+            Out.Printf("%d,%d,%.6f\n", Start, End - 1, FPS(Durations[Start]));
+    }
+}
+
+void WriteKeyFrames(BufferedWriter &Out, ExportedFrames const& Frames) {
+    Out.Printf("# keyframe format v1\nfps 0\n");
+    for (int n = 0; n < Frames.size(); n++) {
+        if (Frames.KeyFrame(n))
+            Out.Printf("%d\n", n);
+    }
+}
+
+void WriteFramesCSV(BufferedWriter &Out, ExportedFrames const& Frames) {
+    Out.Printf("frame,pts,time,duration,keyframe,type,pos\n");
+    for (int n = 0; n < Frames.size(); n++) {
+        int64_t PTS = Frames.PTS(n);
+        Out.Printf("%d,%lld,%.3f,%lld,%d,%c,%lld\n", n, static_cast<long long>(PTS),
+            Frames.Milliseconds(PTS), static_cast<long long>(Frames.Duration(n)),
+            Frames.KeyFrame(n) ? 1 : 0, Frames.Type(n), static_cast<long long>(Frames.FilePos(n)));
+    }
+}
+
+void WriteFramesJSON(BufferedWriter &Out, ExportedFrames const& Frames, FFMS_TrackTimeBase const& TB) {
+    Out.Printf("{\n  \"timebase\": [%lld, %lld],\n  \"frames\": [",
+        static_cast<long long>(TB.Num), static_cast<long long>(TB.Den));
+    for (int n = 0; n < Frames.size(); n++) {
+        int64_t PTS = Frames.PTS(n);
+        Out.Printf("%s\n    {\"frame\": %d, \"pts\": %lld, \"time\": %.3f, \"duration\": %lld, \"keyframe\": %s, \"type\": \"%c\", \"pos\": %lld}",
+            n ? "," : "", n, static_cast<long long>(PTS), Frames.Milliseconds(PTS),
+            static_cast<long long>(Frames.Duration(n)), Frames.KeyFrame(n) ? "true" : "false",
+            Frames.Type(n), static_cast<long long>(Frames.FilePos(n)));
+    }
+    Out.Printf("\n  ]\n}\n");
+}
+}
+
+void ExportTrack(FFMS_Track const& Track, const char *Filename, int Format) {
+    if (Format < FFMS_EXPORT_TIMECODES_V2 || Format > FFMS_EXPORT_FRAMES_JSON)
+        throw FFMS_Exception(FFMS_ERROR_TRACK, FFMS_ERROR_INVALID_ARGUMENT,
+            "Invalid export format");
+    // Everything but the keyframe list would be made up from the evenly
+    // spaced timestamps GetFrameInfo reports for the frames in between
+    if (Track.KeyFramesOnly && Format != FFMS_EXPORT_KEYFRAMES)
+        throw FFMS_Exception(FFMS_ERROR_TRACK, FFMS_ERROR_UNSUPPORTED,
+            "Only the keyframes of a keyframe-only track can be exported");
+
+    ExportedFrames Frames(Track);
+    BufferedWriter Out(Filename);
+    switch (Format) {
+    case FFMS_EXPORT_TIMECODES_V2: WriteTimecodesV2(Out, Frames); break;
+    case FFMS_EXPORT_TIMECODES_V1: WriteTimecodesV1(Out, Frames); break;
+    case FFMS_EXPORT_KEYFRAMES: WriteKeyFrames(Out, Frames); break;
+    case FFMS_EXPORT_FRAMES_CSV: WriteFramesCSV(Out, Frames); break;
+    case FFMS_EXPORT_FRAMES_JSON: WriteFramesJSON(Out, Frames, Track.TB); break;
+    }
+    Out.Finish();
+}
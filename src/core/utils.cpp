@@ -25,14 +25,19 @@ extern "C" {
 #include "utils.h"
 
 #include "indexing.h"
+#include "input.h"
 #include "track.h"
 
 #ifdef _WIN32
 #	define WIN32_LEAN_AND_MEAN
 #	include <windows.h>
+#else
+#	include <unistd.h>
 #endif // _WIN32
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <sstream>
 
 FFMS_Exception::FFMS_Exception(int ErrorType, int SubType, const char *Message) : _Message(Message), _ErrorType(ErrorType), _SubType(SubType) {}
@@ -85,14 +90,35 @@ void FillAP(FFMS_AudioProperties &AP, AVCodecContext *CTX, FFMS_Track &Frames) {
         AP.ChannelLayout = av_get_default_channel_layout(AP.Channels);
 }
 
-void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, int Track) {
-    if (avformat_open_input(&FormatContext, SourceFile, nullptr, nullptr) != 0)
+void LAVFOpenInput(const char *SourceFile, AVFormatContext *&FormatContext, AVInputFormat *Format) {
+    if (std::shared_ptr<InputSource> Input = FindRegisteredInput(SourceFile)) {
+        FormatContext = avformat_alloc_context();
+        if (!FormatContext)
+            throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+                "Could not allocate format context");
+        try {
+            FormatContext->pb = CreateInputIOContext(Input);
+        } catch (...) {
+            avformat_free_context(FormatContext);
+            FormatContext = nullptr;
+            throw;
+        }
+        FormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    AVIOContext *IOContext = FormatContext ? FormatContext->pb : nullptr;
+    if (avformat_open_input(&FormatContext, SourceFile, Format, nullptr) != 0) {
+        FreeInputIOContext(&IOContext);
         throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
             std::string("Couldn't open '") + SourceFile + "'");
+    }
+}
+
+void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, int Track) {
+    LAVFOpenInput(SourceFile, FormatContext, nullptr);
 
     if (avformat_find_stream_info(FormatContext, nullptr) < 0) {
-        avformat_close_input(&FormatContext);
-        FormatContext = nullptr;
+        LAVFCloseFile(FormatContext);
         throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
             "Couldn't find stream information");
     }
@@ -102,6 +128,14 @@ void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, int T
             FormatContext->streams[i]->discard = AVDISCARD_ALL;
 }
 
+void LAVFCloseFile(AVFormatContext *&FormatContext) {
+    if (!FormatContext)
+        return;
+    AVIOContext *IOContext = (FormatContext->flags & AVFMT_FLAG_CUSTOM_IO) ? FormatContext->pb : nullptr;
+    avformat_close_input(&FormatContext);
+    FreeInputIOContext(&IOContext);
+}
+
 int ResizerNameToSWSResizer(const char *ResizerName) {
     if (!ResizerName)
         return 0;
@@ -140,3 +174,45 @@ bool IsSamePath(const char *p1, const char *p2) {
     return !_stricmp(p1, p2);
 #endif
 }
+
+#ifdef _WIN32
+static std::wstring WidenPath(const char *Filename) {
+    int Length = MultiByteToWideChar(CP_UTF8, 0, Filename, -1, nullptr, 0);
+    if (Length <= 0)
+        return std::wstring();
+    std::wstring WideFilename(Length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, Filename, -1, &WideFilename[0], Length);
+    return WideFilename;
+}
+#endif
+
+std::string TemporaryFileName(const char *Filename) {
+    static std::atomic<unsigned> Counter(0);
+#ifdef _WIN32
+    unsigned long Process = GetCurrentProcessId();
+#else
+    unsigned long Process = static_cast<unsigned long>(getpid());
+#endif
+    std::stringstream Name;
+    Name << Filename << ".tmp" << Process << "_" << Counter++;
+    return Name.str();
+}
+
+void RenameOver(const char *From, const char *To) {
+#ifdef _WIN32
+    bool Success = !!MoveFileExW(WidenPath(From).c_str(), WidenPath(To).c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    bool Success = rename(From, To) == 0;
+#endif
+    if (!Success)
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_WRITE,
+            std::string("Failed to replace '") + To + "'");
+}
+
+void RemoveFile(const char *Filename) {
+#ifdef _WIN32
+    _wremove(WidenPath(Filename).c_str());
+#else
+    remove(Filename);
+#endif
+}
@@ -61,7 +61,9 @@ void ClearErrorInfo(FFMS_ErrorInfo *ErrorInfo);
 void InitNullPacket(AVPacket &pkt);
 void FillAP(FFMS_AudioProperties &AP, AVCodecContext *CTX, FFMS_Track &Frames);
 
+void LAVFOpenInput(const char *SourceFile, AVFormatContext *&FormatContext, AVInputFormat *Format);
 void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, int Track);
+void LAVFCloseFile(AVFormatContext *&FormatContext);
 
 namespace optdetail {
     template<typename T>
@@ -135,4 +137,11 @@ void SetOptions(T const& src, void *opt, OptionMapper<T>(&options)[N]) {
 int ResizerNameToSWSResizer(const char *ResizerName);
 bool IsSamePath(const char *p1, const char *p2);
 
+// A name for a temporary file next to Filename which no other thread or
+// process will pick
+std::string TemporaryFileName(const char *Filename);
+// Atomically replaces To with From
+void RenameOver(const char *From, const char *To);
+void RemoveFile(const char *Filename);
+
 #endif
@@ -20,6 +20,7 @@
 
 #include "videosource.h"
 #include "indexing.h"
+#include "segments.h"
 #include "videoutils.h"
 #include <algorithm>
 #include <thread>
@@ -130,7 +131,7 @@ FFMS_Frame *FFMS_VideoSource::OutputFrame(AVFrame *Frame) {
 }
 
 FFMS_VideoSource::FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, int Track, int Threads, int SeekMode)
-    : Index(Index), SeekMode(SeekMode) {
+    : SeekMode(SeekMode) {
 
     try {
         if (Track < 0 || Track >= static_cast<int>(Index.size()))
@@ -145,6 +146,10 @@ FFMS_VideoSource::FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, in
             throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
                 "Video track contains no frames");
 
+        if (Index[Track].KeyFramesOnly)
+            throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+                "Only the keyframes of the video track are indexed; upgrade the index first");
+
         if (!Index.CompareFileSignature(SourceFile))
             throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
                 "The index does not match the source file");
@@ -299,6 +304,13 @@ FFMS_VideoSource::FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, in
     }
 }
 
+FFMS_VideoSource::FFMS_VideoSource(FFMS_SegmentedIndex &Index, int Track, int Threads, int SeekMode, int MaxOpenSegments)
+    : SeekMode(SeekMode)
+    , Segments(make_unique<SegmentedVideo>(Index, Track, Threads, SeekMode, MaxOpenSegments)) {
+    VP = Segments->VP;
+    Frames = Segments->Frames;
+}
+
 FFMS_VideoSource::~FFMS_VideoSource() {
     Free();
 }
@@ -319,6 +331,11 @@ static AVColorRange handle_jpeg(AVPixelFormat *format) {
 }
 
 void FFMS_VideoSource::SetOutputFormat(const AVPixelFormat *TargetFormats, int Width, int Height, int Resizer) {
+    if (Segments) {
+        Segments->SetOutputFormat(TargetFormats, Width, Height, Resizer);
+        return;
+    }
+
     TargetWidth = Width;
     TargetHeight = Height;
     TargetResizer = Resizer;
@@ -334,6 +351,11 @@ void FFMS_VideoSource::SetOutputFormat(const AVPixelFormat *TargetFormats, int W
 }
 
 void FFMS_VideoSource::SetInputFormat(int ColorSpace, int ColorRange, AVPixelFormat Format) {
+    if (Segments) {
+        Segments->SetInputFormat(ColorSpace, ColorRange, Format);
+        return;
+    }
+
     InputFormatOverridden = true;
 
     if (Format != AV_PIX_FMT_NONE)
@@ -442,6 +464,11 @@ void FFMS_VideoSource::ReAdjustOutputFormat(AVFrame *Frame) {
 }
 
 void FFMS_VideoSource::ResetOutputFormat() {
+    if (Segments) {
+        Segments->ResetOutputFormat();
+        return;
+    }
+
     if (SWS) {
         sws_freeContext(SWS);
         SWS = nullptr;
@@ -461,6 +488,11 @@ void FFMS_VideoSource::ResetOutputFormat() {
 }
 
 void FFMS_VideoSource::ResetInputFormat() {
+    if (Segments) {
+        Segments->ResetInputFormat();
+        return;
+    }
+
     InputFormatOverridden = false;
     InputFormat = AV_PIX_FMT_NONE;
     InputColorSpace = AVCOL_SPC_UNSPECIFIED;
@@ -598,7 +630,7 @@ int FFMS_VideoSource::ReadFrame(AVPacket *pkt) {
 
 void FFMS_VideoSource::Free() {
     avcodec_free_context(&CodecContext);
-    avformat_close_input(&FormatContext);
+    LAVFCloseFile(FormatContext);
     if (SWS)
         sws_freeContext(SWS);
     av_freep(&SWSFrameData[0]);
@@ -670,6 +702,9 @@ bool FFMS_VideoSource::SeekTo(int n, int SeekOffset) {
 }
 
 FFMS_Frame *FFMS_VideoSource::GetFrame(int n) {
+    if (Segments)
+        return Segments->GetFrame(n);
+
     GetFrameCheck(n);
     n = Frames.RealFrameNumber(n);
 
@@ -31,11 +31,15 @@ extern "C" {
 #include <libavutil/mastering_display_metadata.h>
 }
 
+#include <memory>
 #include <vector>
 
 #include "track.h"
 #include "utils.h"
 
+struct FFMS_SegmentedIndex;
+class SegmentedVideo;
+
 struct FFMS_VideoSource {
 private:
     SwsContext *SWS = nullptr;
@@ -80,7 +84,6 @@ private:
     AVFrame *DecodeFrame = nullptr;
     AVFrame *LastDecodedFrame = nullptr;
     int LastFrameNum = 0;
-    FFMS_Index &Index;
     FFMS_Track Frames;
     int VideoTrack;
     int CurrentFrame = 1;
@@ -90,6 +93,8 @@ private:
     int SeekMode;
     bool SeekByPos = false;
     int PosOffset = 0;
+    // Set if the frames come from the sources of a segmented index instead
+    std::unique_ptr<SegmentedVideo> Segments;
 
     void ReAdjustOutputFormat(AVFrame *Frame);
     FFMS_Frame *OutputFrame(AVFrame *Frame);
@@ -103,6 +108,7 @@ private:
     static void SanityCheckFrameForData(AVFrame *Frame);
 public:
     FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, int Track, int Threads, int SeekMode);
+    FFMS_VideoSource(FFMS_SegmentedIndex &Index, int Track, int Threads, int SeekMode, int MaxOpenSegments);
     ~FFMS_VideoSource();
     const FFMS_VideoProperties& GetVideoProperties() { return VP; }
     FFMS_Track *GetTrack() { return &Frames; }
@@ -0,0 +1,270 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "waveform.h"
+
+#include "utils.h"
+#include "zipfile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+namespace {
+// More channels than any real track has, which only a damaged index claims
+const int MaxChannels = 1024;
+// Points read from an index at once
+const int64_t ReadChunkPoints = 64 * 1024;
+
+int16_t QuantizeLevel(double Value) {
+    return static_cast<int16_t>(std::lrint(std::max(-1.0, std::min(1.0, Value)) * 32767));
+}
+
+uint16_t QuantizeRMS(double Value) {
+    return static_cast<uint16_t>(std::lrint(std::min(1.0, Value) * 65535));
+}
+}
+
+// Combines points, weighting their RMS by the number of samples they cover
+struct AudioWaveform::Accumulator {
+    int Min = std::numeric_limits<int16_t>::max();
+    int Max = std::numeric_limits<int16_t>::min();
+    double Squares = 0;
+    int64_t Samples = 0;
+
+    void Add(Point const& P, int64_t Count) {
+        Min = std::min<int>(Min, P.Min);
+        Max = std::max<int>(Max, P.Max);
+        double RMS = P.RMS / 65535.0;
+        Squares += RMS * RMS * Count;
+        Samples += Count;
+    }
+
+    double RMS() const {
+        return Samples ? std::sqrt(Squares / Samples) : 0;
+    }
+
+    Point ToPoint() const {
+        return { static_cast<int16_t>(Min), static_cast<int16_t>(Max), QuantizeRMS(RMS()) };
+    }
+
+    FFMS_WaveformPoint ToPublic() const {
+        return { Min / 32767.f, Max / 32767.f, static_cast<float>(RMS()) };
+    }
+};
+
+AudioWaveform::AudioWaveform(ZipFile &Stream) {
+    WP.Channels = Stream.Read<int32_t>();
+    WP.SampleRate = Stream.Read<int32_t>();
+    WP.NumSamples = Stream.Read<int64_t>();
+    WP.PointSamples = PointSamples;
+    const int64_t Points = WP.NumSamples / PointSamples + (WP.NumSamples % PointSamples != 0);
+    if (WP.Channels < 0 || WP.Channels > MaxChannels || WP.NumSamples < 0 ||
+        (WP.Channels && Points > std::numeric_limits<int64_t>::max() / WP.Channels))
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+            "Invalid waveform summary in the index");
+
+    // The points are read a chunk at a time, so a damaged count runs out of
+    // data before it can make this allocate much more than the index holds
+    const int64_t Total = Points * WP.Channels;
+    Levels.resize(1);
+    std::vector<Point> &Base = Levels[0];
+    while (static_cast<int64_t>(Base.size()) < Total) {
+        const size_t Done = Base.size();
+        const size_t Count = static_cast<size_t>(std::min<int64_t>(ReadChunkPoints, Total - Done));
+        Base.resize(Done + Count);
+        Stream.Read(&Base[Done], Count * sizeof(Point));
+    }
+    BuildLevels();
+}
+
+void AudioWaveform::Write(ZipFile &Stream) const {
+    static_assert(sizeof(Point) == 6, "waveform points are written to the index as is");
+    Stream.Write<int32_t>(WP.Channels);
+    Stream.Write<int32_t>(WP.SampleRate);
+    Stream.Write<int64_t>(WP.NumSamples);
+    if (!Levels.empty() && !Levels[0].empty())
+        Stream.Write(Levels[0].data(), Levels[0].size() * sizeof(Point));
+}
+
+void AudioWaveform::AddFrame(const AVFrame *Frame) {
+    if (Levels.empty()) {
+        WP.Channels = std::max(Frame->channels, 0);
+        WP.SampleRate = Frame->sample_rate;
+        WP.PointSamples = PointSamples;
+        Levels.resize(1);
+        PendingMin.assign(WP.Channels, std::numeric_limits<float>::max());
+        PendingMax.assign(WP.Channels, std::numeric_limits<float>::lowest());
+        PendingSquares.assign(WP.Channels, 0);
+    }
+
+    const uint8_t *const *Data = Frame->extended_data;
+    const AVSampleFormat Format = static_cast<AVSampleFormat>(Frame->format);
+    const bool Planar = !!av_sample_fmt_is_planar(Format);
+    const int Count = Frame->nb_samples;
+    switch (av_get_packed_sample_fmt(Format)) {
+    case AV_SAMPLE_FMT_U8:
+        AddSamples<uint8_t>(Data, Planar, Count, 1.0 / 128, 128);
+        break;
+    case AV_SAMPLE_FMT_S16:
+        AddSamples<int16_t>(Data, Planar, Count, 1.0 / 32768, 0);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        AddSamples<int32_t>(Data, Planar, Count, 1.0 / 2147483648.0, 0);
+        break;
+    case AV_SAMPLE_FMT_S64:
+        AddSamples<int64_t>(Data, Planar, Count, 1.0 / 9223372036854775808.0, 0);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        AddSamples<float>(Data, Planar, Count, 1, 0);
+        break;
+    case AV_SAMPLE_FMT_DBL:
+        AddSamples<double>(Data, Planar, Count, 1, 0);
+        break;
+    default:
+        throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+            "Unsupported sample format for waveform summaries");
+    }
+}
+
+template<typename T>
+void AudioWaveform::AddSamples(const uint8_t *const *Data, bool Planar, int Count, double Scale, double Offset) {
+    const int Channels = WP.Channels;
+    const size_t Step = Planar ? 1 : Channels;
+    int Done = 0;
+    while (Done < Count) {
+        const int Samples = std::min(Count - Done, PointSamples - PendingSamples);
+        for (int c = 0; c < Channels; c++) {
+            const T *Src = Planar
+                ? reinterpret_cast<const T *>(Data[c]) + Done
+                : reinterpret_cast<const T *>(Data[0]) + static_cast<size_t>(Done) * Channels + c;
+            double Min = PendingMin[c];
+            double Max = PendingMax[c];
+            double Squares = 0;
+            for (int i = 0; i < Samples; i++) {
+                double Value = (static_cast<double>(Src[i * Step]) - Offset) * Scale;
+                Min = std::min(Min, Value);
+                Max = std::max(Max, Value);
+                Squares += Value * Value;
+            }
+            PendingMin[c] = static_cast<float>(Min);
+            PendingMax[c] = static_cast<float>(Max);
+            PendingSquares[c] += Squares;
+        }
+        PendingSamples += Samples;
+        Done += Samples;
+        if (PendingSamples == PointSamples)
+            AddPoint();
+    }
+    WP.NumSamples += Count;
+}
+
+void AudioWaveform::AddPoint() {
+    for (int c = 0; c < WP.Channels; c++) {
+        Levels[0].push_back({
+            QuantizeLevel(PendingMin[c]),
+            QuantizeLevel(PendingMax[c]),
+            QuantizeRMS(std::sqrt(PendingSquares[c] / PendingSamples)) });
+        PendingMin[c] = std::numeric_limits<float>::max();
+        PendingMax[c] = std::numeric_limits<float>::lowest();
+        PendingSquares[c] = 0;
+    }
+    PendingSamples = 0;
+}
+
+void AudioWaveform::Finish() {
+    if (PendingSamples > 0)
+        AddPoint();
+    PendingMin = std::vector<float>();
+    PendingMax = std::vector<float>();
+    PendingSquares = std::vector<double>();
+    BuildLevels();
+}
+
+int64_t AudioWaveform::PointLength(int64_t Index, int64_t Length) const {
+    return std::min(Length, WP.NumSamples - Index * Length);
+}
+
+void AudioWaveform::BuildLevels() {
+    Levels.resize(1);
+    const size_t Channels = WP.Channels;
+    if (!Channels)
+        return;
+
+    int64_t Length = PointSamples;
+    while (Levels.back().size() > Channels) {
+        const std::vector<Point> &Fine = Levels.back();
+        const size_t FinePoints = Fine.size() / Channels;
+        const size_t CoarsePoints = (FinePoints + LevelFactor - 1) / LevelFactor;
+        std::vector<Point> Coarse(CoarsePoints * Channels);
+        for (size_t p = 0; p < CoarsePoints; p++) {
+            const size_t First = p * LevelFactor;
+            const size_t End = std::min(First + LevelFactor, FinePoints);
+            for (size_t c = 0; c < Channels; c++) {
+                Accumulator A;
+                for (size_t j = First; j < End; j++)
+                    A.Add(Fine[j * Channels + c], PointLength(j, Length));
+                Coarse[p * Channels + c] = A.ToPoint();
+            }
+        }
+        Levels.push_back(std::move(Coarse));
+        Length *= LevelFactor;
+    }
+}
+
+void AudioWaveform::GetWaveform(int64_t Start, int64_t Count, int Points, FFMS_WaveformPoint *Dst) const {
+    if (Start < 0 || Count <= 0 || Start + Count > WP.NumSamples)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Out of bounds waveform samples requested");
+    if (Points <= 0)
+        throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+            "Invalid number of waveform points requested");
+
+    // The coarsest level which still has at least one point for every
+    // output point
+    size_t Level = 0;
+    int64_t Length = PointSamples;
+    while (Level + 1 < Levels.size() && Length * LevelFactor <= Count / Points) {
+        ++Level;
+        Length *= LevelFactor;
+    }
+
+    const std::vector<Point> &Source = Levels[Level];
+    const int Channels = WP.Channels;
+    const int64_t Whole = Count / Points;
+    const int64_t Rest = Count % Points;
+    for (int i = 0; i < Points; i++) {
+        int64_t First = Start + Whole * i + Rest * i / Points;
+        int64_t End = Start + Whole * (i + 1) + Rest * (i + 1) / Points;
+        // More points than samples repeat the samples
+        End = std::max(End, First + 1);
+        for (int c = 0; c < Channels; c++) {
+            Accumulator A;
+            for (int64_t j = First / Length; j <= (End - 1) / Length; j++)
+                A.Add(Source[static_cast<size_t>(j * Channels + c)], PointLength(j, Length));
+            Dst[static_cast<size_t>(i) * Channels + c] = A.ToPublic();
+        }
+    }
+}
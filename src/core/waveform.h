@@ -0,0 +1,87 @@
+//  Copyright (c) 2007-2017 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#pragma once
+
+#include "ffms.h"
+
+#include <cstdint>
+#include <vector>
+
+struct AVFrame;
+class ZipFile;
+
+// Min/max/RMS summaries of an audio track, made from the decoded audio while
+// indexing so that drawing a waveform doesn't have to decode anything.
+//
+// Each channel is summarized every PointSamples samples, and every coarser
+// level combines LevelFactor points of the one before it, so that a query
+// covers any range with a bounded number of points. Only the finest level is
+// stored in the index, the others are made again when reading it.
+class AudioWaveform {
+public:
+    static const int PointSamples = 1024;
+    static const int LevelFactor = 4;
+
+private:
+    // Min and max are scaled to the range of int16_t and RMS to that of
+    // uint16_t, which is plenty for drawing
+    struct Point {
+        int16_t Min;
+        int16_t Max;
+        uint16_t RMS;
+    };
+    struct Accumulator;
+
+    FFMS_WaveformProperties WP = {};
+    // The points of each level, with the channels of a point next to each other
+    std::vector<std::vector<Point>> Levels;
+
+    // The point being summarized while indexing
+    int PendingSamples = 0;
+    std::vector<float> PendingMin;
+    std::vector<float> PendingMax;
+    std::vector<double> PendingSquares;
+
+    template<typename T>
+    void AddSamples(const uint8_t *const *Data, bool Planar, int Count, double Scale, double Offset);
+    void AddPoint();
+    void BuildLevels();
+    // Number of samples covered by point Index of a level with points of
+    // Length samples
+    int64_t PointLength(int64_t Index, int64_t Length) const;
+
+public:
+    AudioWaveform() {}
+    explicit AudioWaveform(ZipFile &Stream);
+
+    // Called with every decoded frame of the track, in order
+    void AddFrame(const AVFrame *Frame);
+    // Called once the whole track has been decoded
+    void Finish();
+    void Write(ZipFile &Stream) const;
+
+    FFMS_WaveformProperties const& GetProperties() const { return WP; }
+    // Summarizes samples Start to Start + Count - 1 in Points evenly sized
+    // points per channel, written to Dst with the channels of a point next
+    // to each other
+    void GetWaveform(int64_t Start, int64_t Count, int Points, FFMS_WaveformPoint *Dst) const;
+};
@@ -118,6 +118,7 @@ int ZipFile::Write(const void *data, size_t size) {
         ret = deflate(&z, size > 0 ? Z_NO_FLUSH : Z_FINISH);
         uInt written = buffer.size() - z.avail_out;
         if (written) {
+            bytes_written += written;
             if (is_file)
                 file.Write(&buffer[0], written);
             else
@@ -127,6 +128,26 @@ int ZipFile::Write(const void *data, size_t size) {
     return ret;
 }
 
+std::string ZipFile::ReadString() {
+    // Only names are stored as strings, so anything longer than this means
+    // the file is damaged rather than that much memory should be allocated
+    const uint32_t MaxLength = 64 * 1024;
+    uint32_t Length = Read<uint32_t>();
+    if (Length > MaxLength)
+        throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Failed to read data: String too long.");
+    std::string ret(Length, '\0');
+    if (!ret.empty())
+        Read(&ret[0], ret.size());
+    return ret;
+}
+
+void ZipFile::WriteString(std::string const& str) {
+    Write<uint32_t>(str.size());
+    // A zero-sized write would finish the stream
+    if (!str.empty())
+        Write(str.data(), str.size());
+}
+
 void ZipFile::Finish() {
     while (Write(nullptr, 0) != Z_STREAM_END);
     deflateEnd(&z);
@@ -23,6 +23,7 @@
 
 #include "filehandle.h"
 
+#include <string>
 #include <vector>
 #include <zlib.h>
 
@@ -37,6 +38,7 @@ class ZipFile {
         Inflate,
         Deflate
     } state;
+    int64_t bytes_written = 0;
 
 public:
     ZipFile(const char *filename, const char *mode);
@@ -48,6 +50,7 @@ public:
     int Write(const void *buffer, size_t size);
     void Finish();
     uint8_t *GetBuffer(size_t *size);
+    int64_t GetBytesWritten() const { return bytes_written; }
 
     template<typename T>
     T Read() {
@@ -60,6 +63,9 @@ public:
     void Write(T const& value) {
         Write(&value, sizeof value);
     }
+
+    std::string ReadString();
+    void WriteString(std::string const& str);
 };
 
 #endif
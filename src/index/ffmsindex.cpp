@@ -24,17 +24,43 @@
 #include "vsutf16.h"
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <string>
 #include <stdexcept>
 
+#ifndef _WIN32
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <functional>
+#include <set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
 namespace {
 
 long long IndexMask = 0;
@@ -44,8 +70,21 @@ bool Overwrite = false;
 bool PrintProgress = true;
 bool WriteTC = false;
 bool WriteKF = false;
+bool Waveform = false;
+std::string FrameTableFormat;
+std::string AudioFileFormat;
+int AudioDecoders = 0;
 std::string InputFile;
 std::string CacheFile;
+std::string ServerSocket;
+std::string ServerCacheDir;
+long long ServerMaxBytes = 4LL * 1024 * 1024 * 1024;
+bool Batch = false;
+int Jobs = 0;
+std::vector<std::string> InputFiles;
+std::string ListFile;
+std::string ReportFile;
+std::string StatsFormat;
 
 struct Error {
     std::string msg;
@@ -59,6 +98,7 @@ void PrintUsage() {
     std::cout <<
         "FFmpegSource2 indexing app\n"
         "Usage: ffmsindex [options] inputfile [outputfile]\n"
+        "       ffmsindex -b [options] inputfile|directory...\n"
         "If no output filename is specified, inputfile.ffindex will be used.\n"
         "\n"
         "Options:\n"
@@ -67,8 +107,25 @@ void PrintUsage() {
         "-p        Disable progress reporting. (default: progress reporting on)\n"
         "-c        Write timecodes for all video tracks to outputfile_track00.tc.txt (default: no)\n"
         "-k        Write keyframes for all video tracks to outputfile_track00.kf.txt (default: no)\n"
+        "-w        Store waveform summaries of the indexed audio tracks in the index (default: no)\n"
+        "-F fmt    Write a table of all frames of all video tracks as csv or json to outputfile_track00.frames.fmt (default: no)\n"
+        "-a fmt    Decode all indexed audio tracks as wav or w64 to outputfile_track00.fmt (default: no)\n"
+        "-d N      Decode the audio for -a with N decoders at once (default: number of CPUs)\n"
         "-t N      Set the audio indexing mask to N (-1 means index all tracks, 0 means index none, default: 0)\n"
         "-s N      Set audio decoding error handling. See the documentation for details. (default: 0)\n"
+        "-T fmt    Print where the indexing time went as a table or as json (in batch mode it's added to the -r summary)\n"
+        "\n"
+        "Batch mode: every input is written to inputfile.ffindex, and directories are indexed file by file\n"
+        "-b        Index all the given inputs instead of one inputfile\n"
+        "-l file   Also index the files listed one per line in file (implies -b)\n"
+        "-j N      Index N files at a time (default: number of CPUs)\n"
+        "-r file   Write a JSON summary of the results to file, or to stdout if file is - (implies -b)\n"
+        "\n"
+        "Server mode: ffmsindex -S socket -C cachedir [-M bytes]\n"
+        "-S path   Serve indexes to other processes on the Unix socket at path instead of indexing a file\n"
+        "-C dir    Keep the indexes made by the server in dir (required with -S)\n"
+        "-M N      Remove the least recently used indexes when dir grows past N bytes (default: 4 GiB)\n"
+        "-j N      Handle N requests at a time (default: number of CPUs)\n"
         << std::endl;
 }
 
@@ -87,21 +144,77 @@ void ParseCMDLine(int argc, const char *argv[]) {
             WriteTC = true;
         } else if (!strcmp(Option, "-k")) {
             WriteKF = true;
+        } else if (!strcmp(Option, "-w")) {
+            Waveform = true;
+        } else if (!strcmp(Option, "-F")) {
+            OPTION_ARG(FrameTableFormat, "F", std::string);
+        } else if (!strcmp(Option, "-a")) {
+            OPTION_ARG(AudioFileFormat, "a", std::string);
+        } else if (!strcmp(Option, "-d")) {
+            OPTION_ARG(AudioDecoders, "d", std::stoi);
         } else if (!strcmp(Option, "-t")) {
             OPTION_ARG(IndexMask, "t", std::stoll);
         } else if (!strcmp(Option, "-s")) {
             OPTION_ARG(IgnoreErrors, "s", std::stoi);
-        } else if (InputFile.empty()) {
-            InputFile = Option;
-        } else if (CacheFile.empty()) {
-            CacheFile = Option;
+        } else if (!strcmp(Option, "-S")) {
+            OPTION_ARG(ServerSocket, "S", std::string);
+        } else if (!strcmp(Option, "-C")) {
+            OPTION_ARG(ServerCacheDir, "C", std::string);
+        } else if (!strcmp(Option, "-M")) {
+            OPTION_ARG(ServerMaxBytes, "M", std::stoll);
+        } else if (!strcmp(Option, "-T")) {
+            OPTION_ARG(StatsFormat, "T", std::string);
+        } else if (!strcmp(Option, "-b")) {
+            Batch = true;
+        } else if (!strcmp(Option, "-l")) {
+            OPTION_ARG(ListFile, "l", std::string);
+            Batch = true;
+        } else if (!strcmp(Option, "-j")) {
+            OPTION_ARG(Jobs, "j", std::stoi);
+        } else if (!strcmp(Option, "-r")) {
+            OPTION_ARG(ReportFile, "r", std::string);
+            Batch = true;
         } else {
-            std::cout << "Warning: ignoring unknown option " << Option << std::endl;
+            InputFiles.push_back(Option);
         }
     }
 
+    if (Jobs < 0)
+        throw Error("Error: invalid number of jobs");
+    if (!StatsFormat.empty() && StatsFormat != "table" && StatsFormat != "json")
+        throw Error("Error: invalid argument specified for -T");
+    if (!FrameTableFormat.empty() && FrameTableFormat != "csv" && FrameTableFormat != "json")
+        throw Error("Error: invalid argument specified for -F");
+    if (!AudioFileFormat.empty() && AudioFileFormat != "wav" && AudioFileFormat != "w64")
+        throw Error("Error: invalid argument specified for -a");
+    if (AudioDecoders < 0)
+        throw Error("Error: invalid number of decoders");
     if (IgnoreErrors < 0 || IgnoreErrors > 3)
         throw Error("Error: invalid error handling mode");
+    if (Batch) {
+        if (!ServerSocket.empty())
+            throw Error("Error: -S can't be combined with batch mode");
+        if (InputFiles.empty() && ListFile.empty())
+            throw Error("Error: no input files specified");
+        return;
+    }
+
+    for (size_t i = 0; i < InputFiles.size(); i++) {
+        if (i == 0)
+            InputFile = InputFiles[i];
+        else if (i == 1)
+            CacheFile = InputFiles[i];
+        else
+            std::cout << "Warning: ignoring unknown option " << InputFiles[i] << std::endl;
+    }
+
+    if (!ServerSocket.empty()) {
+        if (ServerCacheDir.empty())
+            throw Error("Error: no cache directory specified for the server");
+        if (ServerMaxBytes <= 0)
+            throw Error("Error: invalid cache size");
+        return;
+    }
     if (InputFile.empty())
         throw Error("Error: no input file specified");
 
@@ -111,6 +224,12 @@ void ParseCMDLine(int argc, const char *argv[]) {
     }
 }
 
+// Where progress and status messages go, which is stderr when stdout is
+// taken by the batch summary
+std::ostream &StatusOut() {
+    return ReportFile == "-" ? std::cerr : std::cout;
+}
+
 int FFMS_CC UpdateProgress(int64_t Current, int64_t Total, void *Private) {
     if (!PrintProgress)
         return 0;
@@ -129,7 +248,7 @@ int FFMS_CC UpdateProgress(int64_t Current, int64_t Total, void *Private) {
     return 0;
 }
 
-std::string DumpFilename(FFMS_Track *Track, int TrackNum, const char *Suffix) {
+std::string DumpFilename(FFMS_Track *Track, int TrackNum, std::string const& CacheFile, const char *Suffix) {
     if (FFMS_GetTrackType(Track) != FFMS_TYPE_VIDEO || !FFMS_GetNumFrames(Track))
         return "";
 
@@ -138,27 +257,129 @@ std::string DumpFilename(FFMS_Track *Track, int TrackNum, const char *Suffix) {
     return CacheFile + "_track" + tn + Suffix;
 }
 
-void DoIndexing() {
+std::string JSONString(std::string const& Str) {
+    std::stringstream Out;
+    Out << '"';
+    for (unsigned char c : Str) {
+        if (c == '"' || c == '\\')
+            Out << '\\' << c;
+        else if (c < 0x20)
+            Out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<unsigned>(c) << std::dec;
+        else
+            Out << c;
+    }
+    Out << '"';
+    return Out.str();
+}
+
+struct FileStats {
+    FFMS_IndexingStats Total = {};
+    // Only the tracks which were indexed
+    std::vector<std::pair<int, FFMS_IndexingStats>> Tracks;
+};
+
+FileStats GetFileStats(FFMS_Index *Index) {
+    FileStats Result;
+    FFMS_GetIndexingStats(Index, -1, &Result.Total, nullptr);
+    int NumTracks = FFMS_GetNumTracks(Index);
+    for (int t = 0; t < NumTracks; t++) {
+        FFMS_IndexingStats Track;
+        if (!FFMS_GetIndexingStats(Index, t, &Track, nullptr) && Track.Packets > 0)
+            Result.Tracks.emplace_back(t, Track);
+    }
+    return Result;
+}
+
+void PrintStatsTable(FileStats const& Stats) {
+    FFMS_IndexingStats const& T = Stats.Total;
+    std::cout << std::fixed << std::setprecision(3)
+        << "Phase         Seconds\n"
+        << "total      " << std::setw(10) << T.TotalTime << "\n"
+        << "demux      " << std::setw(10) << T.DemuxTime << "\n"
+        << "parse      " << std::setw(10) << T.ParseTime << "\n"
+        << "decode     " << std::setw(10) << T.DecodeTime << "\n"
+        << "finalize   " << std::setw(10) << T.FinalizeTime << "\n"
+        << "write      " << std::setw(10) << T.WriteTime << "\n"
+        << "\n"
+        << "Bytes read:    " << T.BytesRead << "\n"
+        << "Bytes written: " << T.BytesWritten << "\n"
+        << "\n"
+        << "Track    Packets  Parser calls  Decode calls  Parse (s)  Decode (s)\n";
+    for (auto const& Track : Stats.Tracks) {
+        std::cout << std::setw(5) << Track.first
+            << std::setw(11) << Track.second.Packets
+            << std::setw(14) << Track.second.ParserCalls
+            << std::setw(14) << Track.second.DecodeCalls
+            << std::setw(11) << Track.second.ParseTime
+            << std::setw(12) << Track.second.DecodeTime << "\n";
+    }
+    std::cout << std::flush;
+}
+
+std::string StatsJSON(FileStats const& Stats, const char *Indent) {
+    auto Fields = [](std::stringstream &Out, FFMS_IndexingStats const& S, bool Total) {
+        if (Total) {
+            Out << "\"total_time\": " << S.TotalTime
+                << ", \"demux_time\": " << S.DemuxTime
+                << ", \"finalize_time\": " << S.FinalizeTime
+                << ", \"write_time\": " << S.WriteTime
+                << ", \"bytes_read\": " << S.BytesRead
+                << ", \"bytes_written\": " << S.BytesWritten << ", ";
+        }
+        Out << "\"parse_time\": " << S.ParseTime
+            << ", \"decode_time\": " << S.DecodeTime
+            << ", \"packets\": " << S.Packets
+            << ", \"parser_calls\": " << S.ParserCalls
+            << ", \"decode_calls\": " << S.DecodeCalls;
+    };
+
+    std::stringstream Out;
+    Out << std::fixed << std::setprecision(6) << "{";
+    Fields(Out, Stats.Total, true);
+    Out << ", \"tracks\": [";
+    for (size_t i = 0; i < Stats.Tracks.size(); i++) {
+        Out << (i ? ",\n" : "\n") << Indent << "  {\"track\": " << Stats.Tracks[i].first << ", ";
+        Fields(Out, Stats.Tracks[i].second, false);
+        Out << "}";
+    }
+    Out << (Stats.Tracks.empty() ? "" : "\n") << (Stats.Tracks.empty() ? "" : Indent) << "]}";
+    return Out.str();
+}
+
+// Returns false without doing anything if the index exists and may not be
+// overwritten. Report enables the messages about each step, which would
+// only get mixed up when several files are indexed at once. Failures to
+// write the extra files are collected in Warnings when given rather than
+// printed, for the same reason.
+bool IndexFile(std::string const& InputFile, std::string const& CacheFile, TIndexCallback IC, void *ICPrivate, bool Report, FileStats *Stats = nullptr, std::string *Warnings = nullptr) {
     char ErrorMsg[1024];
     FFMS_ErrorInfo E;
     E.Buffer = ErrorMsg;
     E.BufferSize = sizeof(ErrorMsg);
 
-    int Progress = 0;
+    auto Warn = [&](const char *What, std::string const& Filename) {
+        std::string Message = std::string("Failed to write ") + What + " " + Filename + ": " + E.Buffer;
+        if (!Warnings)
+            std::cout << std::endl << Message << std::endl;
+        else
+            *Warnings += (Warnings->empty() ? "" : "; ") + Message;
+    };
 
     FFMS_Index *Index = FFMS_ReadIndex(CacheFile.c_str(), &E);
     if (Index) {
         FFMS_DestroyIndex(Index);
         if (!Overwrite)
-            throw Error("Error: index file already exists, use -f if you are sure you want to overwrite it.");
+            return false;
     }
 
-    UpdateProgress(0, 100, nullptr);
+    IC(0, 100, ICPrivate);
     FFMS_Indexer *Indexer = FFMS_CreateIndexer(InputFile.c_str(), &E);
     if (Indexer == nullptr)
         throw Error("\nFailed to initialize indexing: ", E);
 
-    FFMS_SetProgressCallback(Indexer, UpdateProgress, &Progress);
+    FFMS_SetProgressCallback(Indexer, IC, ICPrivate);
+    if (Waveform)
+        FFMS_SetIndexingFlags(Indexer, FFMS_INDEX_FLAG_WAVEFORM);
 
     // Treat -1 as meaning track numbers above sizeof(long long) * 8 too, dumping implies indexing
     if (IndexMask == -1)
@@ -178,62 +399,727 @@ void DoIndexing() {
     if (Index == nullptr)
         throw Error("\nIndexing error: ", E);
 
-    UpdateProgress(100, 100, nullptr);
+    IC(100, 100, ICPrivate);
 
-    std::cout << std::endl;
+    if (Report)
+        std::cout << std::endl;
 
     if (WriteTC) {
-        if (PrintProgress)
+        if (Report)
             std::cout << "Writing timecodes... ";
         int NumTracks = FFMS_GetNumTracks(Index);
         for (int t = 0; t < NumTracks; t++) {
             FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
-            std::string Filename = DumpFilename(Track, t, ".tc.txt");
+            std::string Filename = DumpFilename(Track, t, CacheFile, ".tc.txt");
             if (!Filename.empty()) {
                 if (FFMS_WriteTimecodes(Track, Filename.c_str(), &E))
-                    std::cout << std::endl << "Failed to write timecodes file "
-                    << Filename << ": " << E.Buffer << std::endl;
+                    Warn("timecodes file", Filename);
             }
         }
-        if (PrintProgress)
+        if (Report)
             std::cout << "done." << std::endl;
     }
 
     if (WriteKF) {
-        if (PrintProgress)
+        if (Report)
             std::cout << "Writing keyframes... ";
         int NumTracks = FFMS_GetNumTracks(Index);
         for (int t = 0; t < NumTracks; t++) {
             FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
-            std::string Filename = DumpFilename(Track, t, ".kf.txt");
+            std::string Filename = DumpFilename(Track, t, CacheFile, ".kf.txt");
             if (!Filename.empty()) {
-                std::ofstream kf(Filename.c_str());
-                kf << "# keyframe format v1\n"
-                    "fps 0\n";
-
-                int FrameCount = FFMS_GetNumFrames(Track);
-                for (int CurFrameNum = 0; CurFrameNum < FrameCount; CurFrameNum++) {
-                    if (FFMS_GetFrameInfo(Track, CurFrameNum)->KeyFrame)
-                        kf << CurFrameNum << "\n";
-                }
+                if (FFMS_ExportTrack(Track, Filename.c_str(), FFMS_EXPORT_KEYFRAMES, &E))
+                    Warn("keyframes file", Filename);
             }
         }
-        if (PrintProgress)
+        if (Report)
             std::cout << "done.    " << std::endl;
     }
 
-    if (PrintProgress)
+    if (!FrameTableFormat.empty()) {
+        if (Report)
+            std::cout << "Writing frame tables... ";
+        const bool CSV = FrameTableFormat == "csv";
+        int NumTracks = FFMS_GetNumTracks(Index);
+        for (int t = 0; t < NumTracks; t++) {
+            FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
+            std::string Filename = DumpFilename(Track, t, CacheFile, CSV ? ".frames.csv" : ".frames.json");
+            if (!Filename.empty()) {
+                if (FFMS_ExportTrack(Track, Filename.c_str(), CSV ? FFMS_EXPORT_FRAMES_CSV : FFMS_EXPORT_FRAMES_JSON, &E))
+                    Warn("frame table", Filename);
+            }
+        }
+        if (Report)
+            std::cout << "done." << std::endl;
+    }
+
+    if (!AudioFileFormat.empty()) {
+        if (Report)
+            std::cout << "Decoding audio... ";
+        const bool W64 = AudioFileFormat == "w64";
+        int NumTracks = FFMS_GetNumTracks(Index);
+        for (int t = 0; t < NumTracks; t++) {
+            FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
+            if (FFMS_GetTrackType(Track) != FFMS_TYPE_AUDIO || !FFMS_GetNumFrames(Track))
+                continue;
+            char tn[11];
+            snprintf(tn, 11, "%02" PRIu32"", (uint32_t) t);
+            std::string Filename = CacheFile + "_track" + tn + (W64 ? ".w64" : ".wav");
+            if (FFMS_ExtractAudioToFile(InputFile.c_str(), t, Index, FFMS_DELAY_NO_SHIFT, AudioDecoders, Filename.c_str(),
+                W64 ? FFMS_AUDIO_FILE_W64 : FFMS_AUDIO_FILE_WAV, &E))
+                Warn("audio file", Filename);
+        }
+        if (Report)
+            std::cout << "done." << std::endl;
+    }
+
+    if (Report)
         std::cout << "Writing index... ";
 
     int error = FFMS_WriteIndex(CacheFile.c_str(), Index, &E);
+    if (Stats)
+        *Stats = GetFileStats(Index);
     FFMS_DestroyIndex(Index);
     if (error)
         throw Error("Error writing index: ", E);
 
-    if (PrintProgress)
+    if (Report)
         std::cout << "done." << std::endl;
+    return true;
+}
+
+void DoIndexing() {
+    int Progress = -1;
+    FileStats Stats;
+    if (!IndexFile(InputFile, CacheFile, UpdateProgress, &Progress, PrintProgress, &Stats))
+        throw Error("Error: index file already exists, use -f if you are sure you want to overwrite it.");
+
+    if (StatsFormat == "table")
+        PrintStatsTable(Stats);
+    else if (StatsFormat == "json")
+        std::cout << StatsJSON(Stats, "") << std::endl;
+}
+
+struct BatchJob {
+    std::string InputFile;
+    std::string CacheFile;
+    const char *Status = "pending";
+    std::string Message;
+    double Seconds = 0;
+    FileStats Stats;
+};
+
+// Progress of all the files indexed at once, shown as a single line
+class BatchProgress {
+    std::mutex Lock;
+    std::vector<double> Fraction;
+    size_t Finished = 0;
+    int LastPercentage = -1;
+
+    void PrintLine() {
+        double Total = std::accumulate(Fraction.begin(), Fraction.end(), 0.0);
+        int Percentage = int(Total / Fraction.size() * 100);
+        if (Percentage == LastPercentage)
+            return;
+        LastPercentage = Percentage;
+        StatusOut() << "Indexing " << Finished << "/" << Fraction.size() << " files, please wait... " << Percentage << "% \r" << std::flush;
+    }
+
+public:
+    explicit BatchProgress(size_t Jobs) : Fraction(Jobs) {}
+
+    void Update(size_t Job, int64_t Current, int64_t Total) {
+        if (!PrintProgress || Total <= 0)
+            return;
+        std::lock_guard<std::mutex> Guard(Lock);
+        Fraction[Job] = std::min(1.0, double(Current) / double(Total));
+        PrintLine();
+    }
+
+    void Finish(size_t Job, BatchJob const& Result) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Fraction[Job] = 1;
+        Finished++;
+        // Overwrite what's left of the progress line
+        std::ostream &Out = StatusOut();
+        Out << "\r" << std::left << std::setw(8) << Result.Status << Result.InputFile;
+        if (!Result.Message.empty())
+            Out << ": " << Result.Message;
+        Out << " (" << std::fixed << std::setprecision(1) << Result.Seconds << " s)" << std::endl;
+        LastPercentage = -1;
+        if (PrintProgress)
+            PrintLine();
+    }
+};
+
+struct BatchCallbackState {
+    BatchProgress *Progress;
+    size_t Job;
+};
+
+int FFMS_CC UpdateBatchProgress(int64_t Current, int64_t Total, void *Private) {
+    BatchCallbackState *State = static_cast<BatchCallbackState *>(Private);
+    State->Progress->Update(State->Job, Current, Total);
+    return 0;
+}
+
+bool IsIndexerOutput(std::string const& Filename) {
+    const std::string Index = ".ffindex";
+    if (Filename.size() >= Index.size() && !Filename.compare(Filename.size() - Index.size(), Index.size(), Index))
+        return true;
+
+    // Everything else written next to the index is named
+    // inputfile.ffindex_trackNN followed by what it is
+    const std::string Track = ".ffindex_track";
+    size_t Start = Filename.rfind(Track);
+    if (Start == std::string::npos)
+        return false;
+    size_t Digits = Start + Track.size();
+    size_t End = Filename.find_first_not_of("0123456789", Digits);
+    if (End == std::string::npos || End == Digits)
+        return false;
+    for (const char *Suffix : { ".tc.txt", ".kf.txt", ".frames.csv", ".frames.json", ".wav", ".w64" }) {
+        if (!Filename.compare(End, std::string::npos, Suffix))
+            return true;
+    }
+    return false;
+}
+
+// Appends the files in Directory, or returns false if it isn't one
+bool ListDirectory(std::string const& Directory, std::vector<std::string> &Files) {
+    std::vector<std::string> Found;
+#ifdef _WIN32
+    WIN32_FIND_DATAW Data;
+    HANDLE Find = FindFirstFileW(utf16_from_utf8(Directory + "\\*").c_str(), &Data);
+    if (Find == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        if (!(Data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE)))
+            Found.push_back(Directory + "\\" + utf16_to_utf8(Data.cFileName));
+    } while (FindNextFileW(Find, &Data));
+    FindClose(Find);
+#else
+    DIR *Dir = opendir(Directory.c_str());
+    if (!Dir)
+        return false;
+    while (dirent *Entry = readdir(Dir)) {
+        std::string Name = Directory + "/" + Entry->d_name;
+        struct stat st;
+        if (stat(Name.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            Found.push_back(Name);
+    }
+    closedir(Dir);
+#endif
+    std::sort(Found.begin(), Found.end());
+    for (auto &Name : Found) {
+        // Don't index the results of a previous run
+        if (!IsIndexerOutput(Name))
+            Files.push_back(std::move(Name));
+    }
+    return true;
+}
+
+std::vector<BatchJob> CollectBatchJobs() {
+    std::vector<std::string> Files;
+    for (auto const& Input : InputFiles) {
+        if (!ListDirectory(Input, Files))
+            Files.push_back(Input);
+    }
+
+    if (!ListFile.empty()) {
+        std::ifstream List(ListFile.c_str());
+        if (!List)
+            throw Error("Error: failed to open list file");
+        std::string Line;
+        while (std::getline(List, Line)) {
+            if (!Line.empty() && Line.back() == '\r')
+                Line.pop_back();
+            if (!Line.empty())
+                Files.push_back(Line);
+        }
+    }
+
+    std::vector<BatchJob> Result(Files.size());
+    for (size_t i = 0; i < Files.size(); i++) {
+        Result[i].InputFile = Files[i];
+        Result[i].CacheFile = Files[i] + ".ffindex";
+    }
+    return Result;
+}
+
+void WriteBatchReport(std::vector<BatchJob> const& Results, double Seconds) {
+    std::map<std::string, int> Counts;
+    for (auto const& Result : Results)
+        Counts[Result.Status]++;
+
+    std::stringstream Out;
+    Out << std::fixed << std::setprecision(3);
+    Out << "{\n"
+        << "  \"files\": " << Results.size() << ",\n"
+        << "  \"ok\": " << Counts["ok"] << ",\n"
+        << "  \"skipped\": " << Counts["skipped"] << ",\n"
+        << "  \"failed\": " << Counts["failed"] << ",\n"
+        << "  \"seconds\": " << Seconds << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < Results.size(); i++) {
+        auto const& Result = Results[i];
+        Out << (i ? ",\n" : "\n")
+            << "    {\"input\": " << JSONString(Result.InputFile)
+            << ", \"output\": " << JSONString(Result.CacheFile)
+            << ", \"status\": " << JSONString(Result.Status)
+            << ", \"seconds\": " << Result.Seconds;
+        // Indexed files can still have failed to write their extra outputs
+        if (!Result.Message.empty())
+            Out << (strcmp(Result.Status, "failed") ? ", \"warning\": " : ", \"error\": ") << JSONString(Result.Message);
+        if (!StatsFormat.empty() && !strcmp(Result.Status, "ok"))
+            Out << ", \"stats\": " << StatsJSON(Result.Stats, "    ");
+        Out << "}";
+    }
+    Out << "\n  ]\n}\n";
+
+    if (ReportFile == "-") {
+        std::cout << Out.str() << std::flush;
+    } else {
+        std::ofstream Report(ReportFile.c_str());
+        if (!(Report << Out.str()))
+            throw Error("Error: failed to write the summary");
+    }
 }
 
+// Indexes every file on its own thread from a pool of Jobs threads. Each
+// indexer only has a single thread of its own, so this is what keeps all
+// the cores busy when there are many files.
+void DoBatchIndexing() {
+    std::vector<BatchJob> Results = CollectBatchJobs();
+    if (Results.empty())
+        throw Error("Error: no input files found");
+
+    size_t Threads = Jobs ? Jobs : std::max(1u, std::thread::hardware_concurrency());
+    Threads = std::min(Threads, Results.size());
+
+    BatchProgress Progress(Results.size());
+    std::atomic<size_t> NextJob(0);
+    auto Start = std::chrono::steady_clock::now();
+
+    auto Worker = [&] {
+        for (size_t Job; (Job = NextJob++) < Results.size();) {
+            BatchJob &Result = Results[Job];
+            BatchCallbackState State = { &Progress, Job };
+            auto JobStart = std::chrono::steady_clock::now();
+            try {
+                Result.Status = IndexFile(Result.InputFile, Result.CacheFile, UpdateBatchProgress, &State, false, &Result.Stats, &Result.Message) ? "ok" : "skipped";
+            } catch (Error const& e) {
+                Result.Status = "failed";
+                // Drop the line break meant for the single file progress line
+                Result.Message = e.msg;
+                Result.Message.erase(0, std::min(Result.Message.find_first_not_of('\n'), Result.Message.size()));
+            } catch (std::exception const& e) {
+                // Such as running out of memory, which only fails this file
+                Result.Status = "failed";
+                Result.Message = e.what();
+            }
+            Result.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - JobStart).count();
+            Progress.Finish(Job, Result);
+        }
+    };
+
+    std::vector<std::thread> Pool;
+    for (size_t i = 1; i < Threads; i++)
+        Pool.emplace_back(Worker);
+    Worker();
+    for (auto &Thread : Pool)
+        Thread.join();
+
+    double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    if (!ReportFile.empty())
+        WriteBatchReport(Results, Seconds);
+
+    size_t Failed = std::count_if(Results.begin(), Results.end(), [](BatchJob const& Result) {
+        return !strcmp(Result.Status, "failed");
+    });
+    if (Failed)
+        throw Error((std::to_string(Failed) + " of " + std::to_string(Results.size()) + " files failed to index").c_str());
+}
+
+
+#ifndef _WIN32
+// Serves indexes over the protocol described in src/core/indexserver.h.
+// Every source file is indexed at most once at a time no matter how many
+// processes ask for it, and the results are kept in the cache directory,
+// named after the file signature and the indexing settings, so that later
+// requests for the same file are answered without indexing it again.
+//
+// Only processes of the user running the server are served, since the server
+// reads any file it's asked to. Requests are handled by a fixed number of
+// threads, and connections beyond what they have queued up are turned away,
+// which makes the clients index the files themselves.
+// Most read-ahead a client can ask for
+const long long ServerMaxReadAhead = 256LL * 1024 * 1024;
+// Connections waiting for a free thread
+const size_t ServerMaxQueuedClients = 64;
+// How long a client may take to send its request or read what it's sent
+const int ServerClientTimeout = 30;
+// How often clients waiting for an index are told that it's still coming
+const int ServerProgressIntervalMs = 1000;
+
+class IndexServer {
+    std::mutex Lock;
+    std::condition_variable IndexDone;
+    // Cache files currently being made
+    std::set<std::string> Pending;
+
+    std::mutex QueueLock;
+    std::condition_variable QueueReady;
+    std::deque<int> Queue;
+
+    static bool SendAll(int FD, const char *Data, size_t Size) {
+        while (Size > 0) {
+            ssize_t Count = send(FD, Data, Size, 0);
+            if (Count < 0 && errno == EINTR)
+                continue;
+            if (Count <= 0)
+                return false;
+            Data += Count;
+            Size -= static_cast<size_t>(Count);
+        }
+        return true;
+    }
+
+    static bool SendProgress(int FD, int64_t Current, int64_t Total) {
+        std::string Line = "PROGRESS " + std::to_string(static_cast<long long>(Current)) + " " + std::to_string(static_cast<long long>(Total)) + "\n";
+        return SendAll(FD, Line.data(), Line.size());
+    }
+
+    static bool ReadLine(int FD, std::string &Line) {
+        char c;
+        while (Line.size() < 4096) {
+            ssize_t Count = read(FD, &c, 1);
+            if (Count < 0 && errno == EINTR)
+                continue;
+            if (Count <= 0)
+                return false;
+            if (c == '\n')
+                return true;
+            Line.push_back(c);
+        }
+        return false;
+    }
+
+    static bool SetTimeout(int FD, int Seconds) {
+        timeval Timeout = {};
+        Timeout.tv_sec = Seconds;
+        return !setsockopt(FD, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) &&
+            !setsockopt(FD, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+    }
+
+    static bool IsOwnUser(int FD) {
+#ifdef SO_PEERCRED
+        ucred Credentials;
+        socklen_t Size = sizeof(Credentials);
+        if (getsockopt(FD, SOL_SOCKET, SO_PEERCRED, &Credentials, &Size))
+            return false;
+        return Credentials.uid == geteuid();
+#else
+        uid_t UID;
+        gid_t GID;
+        return !getpeereid(FD, &UID, &GID) && UID == geteuid();
+#endif
+    }
+
+    static std::string CacheName(std::string const& Path, int ErrorHandling, int Flags, std::vector<int> const& Tracks, int64_t &Filesize, FFMS_ErrorInfo &E) {
+        uint8_t Digest[20];
+        if (FFMS_GetFileSignature(Path.c_str(), &Filesize, Digest, &E))
+            throw Error("", E);
+
+        std::stringstream TrackList;
+        for (int Track : Tracks)
+            TrackList << Track << ",";
+
+        std::stringstream Name;
+        Name << ServerCacheDir << "/" << std::hex << std::setfill('0');
+        for (uint8_t Byte : Digest)
+            Name << std::setw(2) << static_cast<unsigned>(Byte);
+        Name << std::dec << "-" << Filesize << "-" << ErrorHandling << "-" << Flags << "-"
+            << std::hex << std::hash<std::string>()(TrackList.str()) << ".ffindex";
+        return Name.str();
+    }
+
+    struct ProgressState {
+        int Client;
+        std::chrono::steady_clock::time_point LastSent;
+    };
+
+    // Keeps the client from timing out, but never cancels: the index is
+    // cached for later requests even if this client has gone away
+    static int FFMS_CC ReportProgress(int64_t Current, int64_t Total, void *Private) {
+        ProgressState *State = static_cast<ProgressState *>(Private);
+        auto Now = std::chrono::steady_clock::now();
+        if (Now - State->LastSent >= std::chrono::milliseconds(ServerProgressIntervalMs)) {
+            SendProgress(State->Client, Current, Total);
+            State->LastSent = Now;
+        }
+        return 0;
+    }
+
+    static void MakeIndex(std::string const& Path, std::string const& CacheName, int ErrorHandling, int Flags, int Threads, long long ReadAhead, std::vector<int> const& Tracks, int Client, FFMS_ErrorInfo &E) {
+        FFMS_Indexer *Indexer = FFMS_CreateIndexer(Path.c_str(), &E);
+        if (!Indexer)
+            throw Error("", E);
+
+        for (int Type = FFMS_TYPE_VIDEO; Type <= FFMS_TYPE_ATTACHMENT; Type++)
+            FFMS_TrackTypeIndexSettings(Indexer, Type, 0, 0);
+        for (int Track : Tracks)
+            FFMS_TrackIndexSettings(Indexer, Track, 1, 0);
+        FFMS_SetIndexingFlags(Indexer, Flags);
+        FFMS_SetIndexingThreads(Indexer, Threads);
+        FFMS_SetIndexingReadAhead(Indexer, ReadAhead);
+        ProgressState State = { Client, std::chrono::steady_clock::now() };
+        FFMS_SetProgressCallback(Indexer, ReportProgress, &State);
+
+        FFMS_Index *Index = FFMS_DoIndexing2(Indexer, ErrorHandling, &E);
+        if (!Index)
+            throw Error("", E);
+        int Result = FFMS_WriteIndex(CacheName.c_str(), Index, &E);
+        FFMS_DestroyIndex(Index);
+        if (Result)
+            throw Error("", E);
+    }
+
+    // Must be called with Lock held
+    void EvictOldIndexes(std::string const& Keep) {
+        DIR *Dir = opendir(ServerCacheDir.c_str());
+        if (!Dir)
+            return;
+
+        struct CacheEntry {
+            std::string Name;
+            time_t LastUse;
+            long long Size;
+        };
+        std::vector<CacheEntry> Entries;
+        long long Total = 0;
+        while (dirent *Entry = readdir(Dir)) {
+            std::string Name = ServerCacheDir + "/" + Entry->d_name;
+            struct stat st;
+            if (Name.size() < 8 || Name.compare(Name.size() - 8, 8, ".ffindex") || stat(Name.c_str(), &st) || !S_ISREG(st.st_mode))
+                continue;
+            Entries.push_back({ Name, st.st_mtime, static_cast<long long>(st.st_size) });
+            Total += st.st_size;
+        }
+        closedir(Dir);
+
+        std::sort(Entries.begin(), Entries.end(), [](CacheEntry const& a, CacheEntry const& b) {
+            return a.LastUse < b.LastUse;
+        });
+        for (auto const& Entry : Entries) {
+            if (Total <= ServerMaxBytes)
+                break;
+            if (Entry.Name == Keep)
+                continue;
+            // Indexes which are being sent right now stay readable until
+            // they're closed
+            if (unlink(Entry.Name.c_str()) == 0)
+                Total -= Entry.Size;
+        }
+    }
+
+    // Returns an open file descriptor for the index
+    int FindOrMakeIndex(std::string const& Request, int Client) {
+        std::istringstream Parser(Request);
+        std::string Magic, Command, Path;
+        int ErrorHandling, Flags, Threads, NumTracks;
+        long long ReadAhead;
+        Parser >> Magic >> Command >> ErrorHandling >> Flags >> Threads >> ReadAhead >> NumTracks;
+        if (!Parser || Magic != "FFMS2" || Command != "INDEX" || NumTracks < 0 || NumTracks > 4096)
+            throw Error("malformed request");
+        if (ErrorHandling < 0 || ErrorHandling > 3)
+            throw Error("invalid error handling mode");
+        std::vector<int> Tracks(NumTracks);
+        for (int &Track : Tracks)
+            Parser >> Track;
+        Parser.get();
+        std::getline(Parser, Path);
+        if (!Parser || Path.empty() || Path[0] != '/')
+            throw Error("malformed request");
+        struct stat st;
+        if (stat(Path.c_str(), &st) || !S_ISREG(st.st_mode))
+            throw Error("not a regular file");
+        Threads = std::max(1, std::min<int>(Threads, std::max(1u, std::thread::hardware_concurrency())));
+        ReadAhead = std::max(0LL, std::min(ReadAhead, ServerMaxReadAhead));
+
+        char ErrorMsg[1024];
+        FFMS_ErrorInfo E;
+        E.Buffer = ErrorMsg;
+        E.BufferSize = sizeof(ErrorMsg);
+
+        int64_t Filesize;
+        std::string Name = CacheName(Path, ErrorHandling, Flags, Tracks, Filesize, E);
+
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (Pending.count(Name)) {
+            if (!IndexDone.wait_for(Guard, std::chrono::milliseconds(ServerProgressIntervalMs), [&] { return !Pending.count(Name); }))
+                SendProgress(Client, 0, Filesize);
+        }
+
+        int FD = open(Name.c_str(), O_RDONLY);
+        if (FD >= 0) {
+            // The modification time doubles as the time of last use
+            utime(Name.c_str(), nullptr);
+            return FD;
+        }
+
+        Pending.insert(Name);
+        Guard.unlock();
+        try {
+            MakeIndex(Path, Name, ErrorHandling, Flags, Threads, ReadAhead, Tracks, Client, E);
+        } catch (...) {
+            Guard.lock();
+            Pending.erase(Name);
+            IndexDone.notify_all();
+            throw;
+        }
+        Guard.lock();
+        Pending.erase(Name);
+        IndexDone.notify_all();
+
+        FD = open(Name.c_str(), O_RDONLY);
+        if (FD < 0)
+            throw Error("failed to open the written index");
+        EvictOldIndexes(Name);
+
+        if (PrintProgress)
+            std::cout << "Indexed " << Path << std::endl;
+        return FD;
+    }
+
+    void HandleConnection(int Client) {
+        std::string Request;
+        if (SetTimeout(Client, ServerClientTimeout) && ReadLine(Client, Request)) {
+            int FD = -1;
+            std::string Response;
+            try {
+                FD = FindOrMakeIndex(Request, Client);
+            } catch (Error const& e) {
+                Response = "ERR " + e.msg;
+            } catch (std::exception const& e) {
+                Response = std::string("ERR ") + e.what();
+            }
+            std::replace(Response.begin(), Response.end(), '\n', ' ');
+
+            struct stat st;
+            if (FD >= 0 && fstat(FD, &st) == 0) {
+                Response = "OK " + std::to_string(static_cast<long long>(st.st_size)) + "\n";
+                if (SendAll(Client, Response.data(), Response.size())) {
+                    std::vector<char> Buffer(1024 * 1024);
+                    ssize_t Count;
+                    while ((Count = read(FD, Buffer.data(), Buffer.size())) > 0 && SendAll(Client, Buffer.data(), static_cast<size_t>(Count)));
+                }
+            } else {
+                if (Response.empty())
+                    Response = "ERR failed to read the index";
+                Response += "\n";
+                SendAll(Client, Response.data(), Response.size());
+            }
+            if (FD >= 0)
+                close(FD);
+        }
+        close(Client);
+    }
+
+    void Worker() {
+        for (;;) {
+            int Client;
+            {
+                std::unique_lock<std::mutex> Guard(QueueLock);
+                QueueReady.wait(Guard, [&] { return !Queue.empty(); });
+                Client = Queue.front();
+                Queue.pop_front();
+            }
+            HandleConnection(Client);
+        }
+    }
+
+    // Turns the client away if the workers already have enough to do
+    void Enqueue(int Client) {
+        {
+            std::lock_guard<std::mutex> Guard(QueueLock);
+            if (Queue.size() < ServerMaxQueuedClients) {
+                Queue.push_back(Client);
+                QueueReady.notify_one();
+                return;
+            }
+        }
+        static const char Busy[] = "ERR server busy\n";
+        send(Client, Busy, sizeof(Busy) - 1, MSG_DONTWAIT);
+        close(Client);
+    }
+
+public:
+    void Run() {
+        sockaddr_un Address = {};
+        if (ServerSocket.size() >= sizeof(Address.sun_path))
+            throw Error("Error: socket path is too long");
+        Address.sun_family = AF_UNIX;
+        memcpy(Address.sun_path, ServerSocket.c_str(), ServerSocket.size() + 1);
+
+        int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (Listener < 0)
+            throw Error("Error: failed to create socket");
+        // A server which exited without cleaning up leaves the socket behind
+        unlink(ServerSocket.c_str());
+        if (bind(Listener, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) ||
+            chmod(ServerSocket.c_str(), S_IRUSR | S_IWUSR) || listen(Listener, 64)) {
+            close(Listener);
+            throw Error("Error: failed to listen on socket");
+        }
+
+        size_t Threads = Jobs ? Jobs : std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < Threads; i++)
+            std::thread(&IndexServer::Worker, this).detach();
+
+        if (PrintProgress)
+            std::cout << "Serving indexes on " << ServerSocket << std::endl;
+
+        for (;;) {
+            int Client = accept(Listener, nullptr, nullptr);
+            if (Client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                close(Listener);
+                throw Error("Error: failed to accept connection");
+            }
+            if (!IsOwnUser(Client)) {
+                close(Client);
+                continue;
+            }
+            Enqueue(Client);
+        }
+    }
+};
+
+void RunServer() {
+    // Clients disconnecting early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // The server must index files itself rather than asking itself
+    FFMS_SetIndexServer(nullptr);
+    // Nothing the server makes is for other users, since the indexes tell
+    // what the files it can read contain
+    umask(S_IRWXG | S_IRWXO);
+    struct stat st;
+    if (mkdir(ServerCacheDir.c_str(), S_IRWXU) && errno != EEXIST)
+        throw Error("Error: failed to create the cache directory");
+    if (stat(ServerCacheDir.c_str(), &st) || !S_ISDIR(st.st_mode) || st.st_uid != geteuid())
+        throw Error("Error: the cache directory must be a directory owned by the user running the server");
+    if ((st.st_mode & (S_IRWXG | S_IRWXO)) && chmod(ServerCacheDir.c_str(), S_IRWXU))
+        throw Error("Error: failed to restrict access to the cache directory");
+    IndexServer().Run();
+}
+#else
+void RunServer() {
+    throw Error("Error: server mode is not supported on Windows");
+}
+#endif
+
 } // namespace {
 
 #ifdef _WIN32
@@ -258,7 +1144,7 @@ int main(int argc, const char *argv[]) {
 
         ParseCMDLine(argc, argv);
     } catch (Error const& e) {
-        std::cout << e.msg << std::endl;
+        StatusOut() << e.msg << std::endl;
         return 1;
     }
 
@@ -273,9 +1159,14 @@ int main(int argc, const char *argv[]) {
     }
 
     try {
-        DoIndexing();
+        if (!ServerSocket.empty())
+            RunServer();
+        else if (Batch)
+            DoBatchIndexing();
+        else
+            DoIndexing();
     } catch (Error const& e) {
-        std::cout << e.msg << std::endl;
+        StatusOut() << e.msg << std::endl;
         FFMS_Deinit();
         return 1;
     }
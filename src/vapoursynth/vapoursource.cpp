@@ -215,9 +215,23 @@ const VSFrameRef *VS_CC VSVideoSource::GetFrame(int n, int activationReason, voi
     return nullptr;
 }
 
-void VS_CC VSVideoSource::Free(void *instanceData, VSCore *, const VSAPI *) {
+void FinishIndexWrite(FFMS_IndexWriter *Writer, const VSAPI *vsapi) {
+    if (!Writer)
+        return;
+    char ErrorMsg[1024];
+    FFMS_ErrorInfo E;
+    E.Buffer = ErrorMsg;
+    E.BufferSize = sizeof(ErrorMsg);
+    if (FFMS_FinishIndexWrite(Writer, &E))
+        vsapi->logMessage(mtWarning, (std::string("Source: ") + E.Buffer).c_str());
+}
+
+void VS_CC VSVideoSource::Free(void *instanceData, VSCore *, const VSAPI *vsapi) {
+    VSVideoSource *vs = static_cast<VSVideoSource *>(instanceData);
+    FinishIndexWrite(vs->IndexWriter, vsapi);
+    vs->IndexWriter = nullptr;
     FFMS_Deinit();
-    delete static_cast<VSVideoSource *>(instanceData);
+    delete vs;
 }
 
 VSVideoSource::VSVideoSource(const char *SourceFile, int Track, FFMS_Index *Index,
@@ -34,6 +34,10 @@ extern "C" {
 #include "ffms.h"
 #include "ffmscompat.h"
 
+// Waits for an index being written in the background and logs a warning if
+// writing it failed
+void FinishIndexWrite(FFMS_IndexWriter *Writer, const VSAPI *vsapi);
+
 struct VSVideoSource {
 private:
     VSVideoInfo VI[2];
@@ -43,6 +47,7 @@ private:
     int SARNum;
     int SARDen;
     bool OutputAlpha;
+    FFMS_IndexWriter *IndexWriter = nullptr;
 
     void InitOutputFormat(int ResizeToWidth, int ResizeToHeight,
         const char *ResizerName, int ConvertToFormat, const VSAPI *vsapi, VSCore *core);
@@ -54,6 +59,8 @@ public:
         int ResizeToWidth, int ResizeToHeight, const char *ResizerName,
         int Format, bool OutputAlpha, const VSAPI *vsapi, VSCore *core);
     ~VSVideoSource();
+    // Waits for the index to be written when the filter is freed
+    void SetIndexWriter(FFMS_IndexWriter *Writer) { IndexWriter = Writer; }
 
     static void VS_CC Init(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi);
     static const VSFrameRef *VS_CC GetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi);
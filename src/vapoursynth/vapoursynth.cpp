@@ -149,6 +149,7 @@ static void VS_CC CreateSource(const VSMap *in, VSMap *out, void *, VSCore *core
     if (Timecodes && IsSamePath(Source, Timecodes))
         return vsapi->setError(out, "Source: Timecodes will overwrite the source");
 
+    FFMS_IndexWriter *Writer = nullptr;
     FFMS_Index *Index = nullptr;
     std::string DefaultCache;
     if (Cache) {
@@ -179,23 +180,29 @@ static void VS_CC CreateSource(const VSMap *in, VSMap *out, void *, VSCore *core
         if (!Index)
             return vsapi->setError(out, (std::string("Index: ") + E.Buffer).c_str());
 
-        if (Cache)
-            if (FFMS_WriteIndex(CacheFile, Index, &E)) {
+        // The index is written in the background while frames are already
+        // being served from the copy in memory
+        if (Cache) {
+            Writer = FFMS_WriteIndexAsync(CacheFile, Index, &E);
+            if (!Writer) {
                 FFMS_DestroyIndex(Index);
                 return vsapi->setError(out, (std::string("Index: ") + E.Buffer).c_str());
             }
+        }
     }
 
     if (Track == -1)
         Track = FFMS_GetFirstIndexedTrackOfType(Index, FFMS_TYPE_VIDEO, &E);
     if (Track < 0) {
         FFMS_DestroyIndex(Index);
+        FinishIndexWrite(Writer, vsapi);
         return vsapi->setError(out, "Source: No video track found");
     }
 
     if (Timecodes && strcmp(Timecodes, "")) {
         if (FFMS_WriteTimecodes(FFMS_GetTrackFromIndex(Index, Track), Timecodes, &E)) {
             FFMS_DestroyIndex(Index);
+            FinishIndexWrite(Writer, vsapi);
             return vsapi->setError(out, (std::string("Index: ") + E.Buffer).c_str());
         }
     }
@@ -205,8 +212,10 @@ static void VS_CC CreateSource(const VSMap *in, VSMap *out, void *, VSCore *core
         vs = new VSVideoSource(Source, Track, Index, FPSNum, FPSDen, Threads, SeekMode, RFFMode, Width, Height, Resizer, Format, OutputAlpha, vsapi, core);
     } catch (std::exception const& e) {
         FFMS_DestroyIndex(Index);
+        FinishIndexWrite(Writer, vsapi);
         return vsapi->setError(out, e.what());
     }
+    vs->SetIndexWriter(Writer);
 
     vsapi->createFilter(in, out, "Source", VSVideoSource::Init, VSVideoSource::GetFrame, VSVideoSource::Free, fmUnordered, nfMakeLinear, vs, core);
 
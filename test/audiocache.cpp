@@ -0,0 +1,113 @@
+// Checks that the audio cache stays within its memory budget. Uses the
+// library internals, so it links against the static library.
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "audiocache.h"
+
+namespace {
+
+const size_t MiB = 1024 * 1024;
+
+// Caches blocks of Count samples of random sizes one after another, filling
+// each with a byte derived from where it starts, and occasionally looks up
+// an earlier block to shuffle the order they're evicted in
+class AudioCacheTest : public ::testing::Test {
+protected:
+    std::mt19937 Random{ 1 };
+    int64_t End = 0;
+
+    static uint8_t Fill(int64_t Start) {
+        return static_cast<uint8_t>(Start % 251);
+    }
+
+    void ExpectIntact(AudioCache::Block *B) {
+        for (size_t i = 0; i < B->DataSize; i++) {
+            if (B->Data[i] != Fill(B->Start)) {
+                ADD_FAILURE() << "Block at " << B->Start << " was overwritten at byte " << i;
+                return;
+            }
+        }
+    }
+
+    void Add(AudioCache &Cache, size_t MaxSize) {
+        size_t Size = std::uniform_int_distribution<size_t>(1000, MaxSize)(Random);
+        // Sometimes more than expected, to go through Grow's reallocation
+        size_t Expected = Random() % 8 ? Size : Size / 2;
+        AudioCache::Block *B = Cache.Insert(End, Expected);
+        ASSERT_NE(nullptr, B);
+        memset(Cache.Grow(B, Size), Fill(End), Size);
+        B->Samples = Size;
+        End += Size;
+
+        if (Random() % 4 == 0) {
+            int64_t Sample = std::uniform_int_distribution<int64_t>(0, End - 1)(Random);
+            if (AudioCache::Block *Found = Cache.Find(Sample))
+                ExpectIntact(Found);
+        }
+    }
+};
+
+TEST_F(AudioCacheTest, EvictionKeepsMemoryInBudget) {
+    const size_t Budget = 4 * MiB;
+    AudioCache Cache(Budget);
+    for (int i = 0; i < 5000; i++) {
+        // Mostly small blocks, with runs of large ones now and then so that
+        // the freed chunks are the wrong size for what comes next
+        Add(Cache, (i / 500) % 2 ? 300 * 1024 : 20 * 1024);
+        ASSERT_LE(Cache.MemoryUsage(), Budget) << "After block " << i << " with " << Cache.size() << " cached";
+    }
+    EXPECT_GT(Cache.size(), 1u);
+}
+
+TEST_F(AudioCacheTest, PinnedBlocksDontCountTowardBudget) {
+    AudioCache Cache;
+    for (int i = 0; i < 100; i++)
+        Add(Cache, 20 * 1024);
+    ASSERT_EQ(100u, Cache.size());
+    Cache.PinAll();
+    int64_t PinnedEnd = End;
+    size_t PinnedUsage = Cache.MemoryUsage();
+    Cache.SetMaxBytes(2 * MiB);
+
+    for (int i = 0; i < 1000; i++)
+        Add(Cache, 20 * 1024);
+    EXPECT_LE(Cache.MemoryUsage(), PinnedUsage + 2 * MiB);
+
+    int64_t Sample = 0;
+    while (AudioCache::Block *B = Cache.Find(Sample)) {
+        ExpectIntact(B);
+        Sample = B->Start + B->Samples;
+    }
+    EXPECT_GE(Sample, PinnedEnd);
+}
+
+TEST_F(AudioCacheTest, ShrinkingBudgetFreesMemory) {
+    AudioCache Cache;
+    for (int i = 0; i < 3000; i++)
+        Add(Cache, 20 * 1024);
+    EXPECT_GT(Cache.MemoryUsage(), 8 * MiB);
+
+    Cache.SetMaxBytes(MiB);
+    EXPECT_LE(Cache.MemoryUsage(), MiB);
+    EXPECT_GT(Cache.size(), 1u);
+    EXPECT_LE(Cache.SpareNodes(), 2 * Cache.size());
+
+    // Only the block written to last is left, in a slab of its own size
+    Cache.SetMaxBytes(0);
+    EXPECT_EQ(1u, Cache.size());
+    EXPECT_LE(Cache.MemoryUsage(), 16 * SampleArena::ClassSize(SampleArena::SizeClass(20 * 1024)));
+    EXPECT_LE(Cache.SpareNodes(), 2u);
+
+    // And the cache still works
+    for (int i = 0; i < 100; i++)
+        Add(Cache, 20 * 1024);
+    EXPECT_EQ(1u, Cache.size());
+}
+
+} // namespace
@@ -0,0 +1,92 @@
+// Checks the parallel audio extraction against a serial read. The samples
+// are too short to be split into more than one part of the usual size, so
+// this shrinks the parts through the extraction internals and links against
+// the static library.
+
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+#include "audioextract.h"
+#include "tests.h"
+
+namespace {
+
+typedef std::unique_ptr<FFMS_Index, decltype(&FFMS_DestroyIndex)> IndexPtr;
+typedef std::unique_ptr<FFMS_AudioSource, decltype(&FFMS_DestroyAudioSource)> AudioPtr;
+
+// Bytes per sample of all channels together
+size_t SampleBytes(const FFMS_AudioProperties *AP) {
+    static const size_t Sizes[] = { 1, 2, 4, 4, 8 };
+    return Sizes[AP->SampleFormat] * AP->Channels;
+}
+
+class AudioExtractTest : public ::testing::Test {
+protected:
+    std::string FilePath;
+    FFMS_ErrorInfo E;
+    char ErrorMsg[1024];
+
+    void SetUp() override {
+        FFMS_Init(0, 0);
+        FilePath = std::string(STRINGIFY(SAMPLES_DIR)) + "/test.mp4";
+        E.Buffer = ErrorMsg;
+        E.BufferSize = sizeof(ErrorMsg);
+        // A few thousand samples per part
+        SetAudioExtractPartBytes(64 * 1024);
+    }
+
+    void TearDown() override {
+        SetAudioExtractPartBytes(4 * 1024 * 1024);
+        SetAudioExtractDistrustOverlaps(false);
+        FFMS_Deinit();
+    }
+};
+
+TEST_F(AudioExtractTest, ManyPartsMatchSerialRead) {
+    FFMS_Indexer *Indexer = FFMS_CreateIndexer(FilePath.c_str(), &E);
+    ASSERT_NE(nullptr, Indexer) << E.Buffer;
+    FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_AUDIO, 1, 0);
+    IndexPtr Index(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, &E), FFMS_DestroyIndex);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track = FFMS_GetFirstIndexedTrackOfType(Index.get(), FFMS_TYPE_AUDIO, &E);
+    ASSERT_GE(Track, 0) << E.Buffer;
+
+    AudioPtr Source(FFMS_CreateAudioSource(FilePath.c_str(), Track, Index.get(), FFMS_DELAY_NO_SHIFT, &E), FFMS_DestroyAudioSource);
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source.get());
+    std::vector<uint8_t> Expected(static_cast<size_t>(AP->NumSamples) * SampleBytes(AP));
+    ASSERT_EQ(0, FFMS_GetAudio(Source.get(), Expected.data(), 0, AP->NumSamples, &E)) << E.Buffer;
+
+    // Distrusting the overlaps sends every part which doesn't start a batch
+    // through the serial decode that parts whose start differs get
+    for (bool Distrust : { false, true }) {
+        SetAudioExtractDistrustOverlaps(Distrust);
+        for (int Decoders : { 1, 3, 4 }) {
+            std::stringstream ss;
+            ss << "Decoders: " << Decoders << ", distrusting overlaps: " << Distrust;
+            SCOPED_TRACE(ss.str());
+
+            std::vector<uint8_t> Extracted(Expected.size());
+            AudioExtractStats Stats;
+            ExtractAudio(FilePath.c_str(), *Index, Track, FFMS_DELAY_NO_SHIFT, Decoders, Extracted.data(), &Stats);
+            EXPECT_TRUE(Expected == Extracted);
+
+            // Several batches of parts, all but the first part of each
+            // compared with the part before
+            ASSERT_GT(Stats.Parts, 2u * Decoders);
+            EXPECT_EQ(Decoders, Stats.Decoders);
+            const size_t Batches = (Stats.Parts + Decoders - 1) / Decoders;
+            EXPECT_EQ(Stats.Parts - Batches, Stats.Compared);
+            if (Distrust)
+                EXPECT_EQ(Stats.Compared, Stats.Redecoded);
+        }
+    }
+}
+
+} // namespace
@@ -0,0 +1,86 @@
+// Runs the ffmsindex program, which is built along with the library, on
+// copies of the samples in a scratch directory
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tests.h"
+
+namespace {
+
+const std::string WorkDir = "commandline-test";
+
+// Returns the exit code of ffmsindex and what it wrote to stdout, dropping
+// what it wrote to stderr
+int RunFFMSIndex(std::string const& Arguments, std::string *Output) {
+    std::string Command = std::string(STRINGIFY(FFMSINDEX)) + " " + Arguments + " 2>/dev/null";
+    FILE *Pipe = popen(Command.c_str(), "r");
+    if (!Pipe)
+        return -1;
+    char Buffer[4096];
+    size_t Count;
+    while ((Count = fread(Buffer, 1, sizeof(Buffer), Pipe)) > 0)
+        Output->append(Buffer, Count);
+    int Status = pclose(Pipe);
+    return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+}
+
+bool FileExists(std::string const& Path) {
+    struct stat st;
+    return stat(Path.c_str(), &st) == 0;
+}
+
+class CommandLineTest : public ::testing::Test {
+protected:
+    std::string Sample;
+
+    void SetUp() override {
+        ASSERT_EQ(0, system(("rm -rf " + WorkDir).c_str()));
+        ASSERT_EQ(0, mkdir(WorkDir.c_str(), 0700));
+        Sample = WorkDir + "/test.mp4";
+        std::ifstream In(std::string(STRINGIFY(SAMPLES_DIR)) + "/test.mp4", std::ios::binary);
+        std::ofstream Out(Sample, std::ios::binary);
+        Out << In.rdbuf();
+        ASSERT_TRUE(!!Out);
+    }
+
+    void TearDown() override {
+        system(("rm -rf " + WorkDir).c_str());
+    }
+};
+
+TEST_F(CommandLineTest, BatchReportOnStdoutIsValidJSON) {
+    // What -c, -k, -F and -a leave behind must not be indexed by a later run
+    for (const char *Suffix : { ".ffindex_track00.tc.txt", ".ffindex_track00.kf.txt", ".ffindex_track00.frames.csv",
+        ".ffindex_track00.frames.json", ".ffindex_track01.wav", ".ffindex_track01.w64" }) {
+        std::ofstream(Sample + Suffix) << "not media";
+    }
+    // Fails to index, so there are a status line and a failure count which
+    // must stay out of the summary
+    std::ofstream(WorkDir + "/broken.mp4") << "not media";
+
+    std::string Output;
+    EXPECT_EQ(1, RunFFMSIndex("-b -r - " + WorkDir, &Output));
+    EXPECT_TRUE(IsValidJSON(Output)) << Output;
+    EXPECT_NE(std::string::npos, Output.find("\"files\": 2,")) << Output;
+    EXPECT_NE(std::string::npos, Output.find("\"ok\": 1,")) << Output;
+    EXPECT_NE(std::string::npos, Output.find("\"failed\": 1,")) << Output;
+    EXPECT_TRUE(FileExists(Sample + ".ffindex"));
+}
+
+TEST_F(CommandLineTest, BatchRejectsServerMode) {
+    std::string Output;
+    EXPECT_EQ(1, RunFFMSIndex("-b -S " + WorkDir + "/socket -C " + WorkDir + "/cache " + Sample, &Output));
+    EXPECT_FALSE(FileExists(Sample + ".ffindex"));
+    EXPECT_FALSE(FileExists(WorkDir + "/cache"));
+}
+
+} // namespace
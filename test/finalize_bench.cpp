@@ -0,0 +1,99 @@
+// Times FFMS_Track::FinalizeTrack on large made-up tracks and checks the
+// result. Links against the static library, since the track internals
+// aren't exported.
+//
+// Usage: finalize_bench [frames]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "track.h"
+
+namespace {
+
+// Decoding order of a stream with two b-frames between references: each
+// reference is stored before the b-frames which are shown before it
+int64_t DecodeOrderPTS(int64_t n) {
+    if (n == 0)
+        return 0;
+    int64_t Group = (n - 1) / 3;
+    switch ((n - 1) % 3) {
+    case 0: return (Group * 3 + 3) * 1001;
+    case 1: return (Group * 3 + 1) * 1001;
+    default: return (Group * 3 + 2) * 1001;
+    }
+}
+
+bool CheckVideo(FFMS_Track const& Track, std::vector<int64_t> const& PTS) {
+    if (Track.size() != PTS.size())
+        return false;
+    for (size_t i = 1; i < Track.size(); i++) {
+        if (Track[i].PTS < Track[i - 1].PTS)
+            return false;
+    }
+    // OriginalPos leads back to the frames in decoding order
+    for (size_t i = 0; i < Track.size(); i++) {
+        if (Track[Track[i].OriginalPos].OriginalPTS != PTS[i])
+            return false;
+    }
+    return true;
+}
+
+template<typename Func>
+double Time(Func f) {
+    auto Start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+bool BenchVideo(int64_t Frames, bool Shuffled) {
+    std::vector<int64_t> PTS(static_cast<size_t>(Frames));
+    for (int64_t n = 0; n < Frames; n++)
+        PTS[n] = DecodeOrderPTS(n);
+    // The worst case for sorting, rather than the nearly sorted timestamps
+    // of real files
+    if (Shuffled)
+        std::shuffle(PTS.begin() + 1, PTS.end(), std::mt19937_64(Frames));
+
+    FFMS_Track Track(1, 24000, FFMS_TYPE_VIDEO, false, false);
+    for (int64_t n = 0; n < Frames; n++)
+        Track.AddVideoFrame(PTS[n], 0, (n % 250) == 0, n % 3 == 0 ? 1 : 3, n * 4096);
+
+    double Seconds = Time([&] { Track.FinalizeTrack(); });
+    bool OK = CheckVideo(Track, PTS);
+    printf("video %s: %lld frames in %.3f s, %.1f bytes per frame%s\n", Shuffled ? "(shuffled)" : "(b-frames)",
+        static_cast<long long>(Frames), Seconds, Track.MemoryUsage() / static_cast<double>(Frames), OK ? "" : " - WRONG RESULT");
+    return OK;
+}
+
+bool BenchAudio(int64_t Frames) {
+    FFMS_Track Track(1, 48000, FFMS_TYPE_AUDIO, false, false);
+    Track.SampleRate = 48000;
+    for (int64_t n = 0; n < Frames; n++)
+        Track.AddAudioFrame(n * 1024, n * 1024, 1024, true, n * 512);
+
+    double Seconds = Time([&] { Track.FinalizeTrack(); });
+    bool OK = static_cast<int64_t>(Track.size()) == Frames;
+    printf("audio: %lld frames in %.3f s, %.1f bytes per frame%s\n", static_cast<long long>(Frames), Seconds,
+        Track.MemoryUsage() / static_cast<double>(Frames), OK ? "" : " - WRONG RESULT");
+    return OK;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    int64_t Frames = argc > 1 ? strtoll(argv[1], nullptr, 10) : 20000000;
+    if (Frames < 1) {
+        fprintf(stderr, "Usage: finalize_bench [frames]\n");
+        return 1;
+    }
+
+    bool OK = BenchVideo(Frames, false);
+    OK = BenchVideo(Frames, true) && OK;
+    OK = BenchAudio(Frames) && OK;
+    return OK ? 0 : 1;
+}
@@ -1,15 +1,31 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <string>
 #include <random>
+#include <sstream>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <ffms.h>
 #include <gtest/gtest.h>
+#include <zlib.h>
 
 #include "data/test.mp4.cpp"
 #include "tests.h"
 
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
 
 namespace {
 
@@ -17,6 +33,307 @@ const TestDataMap TestFiles[] = {
     TEST_ENTRY("test.mp4", testmp4data)
 };
 
+typedef std::unique_ptr<FFMS_Index, decltype(&FFMS_DestroyIndex)> IndexPtr;
+
+// Indexes all video tracks, and the audio tracks too if Audio is set
+IndexPtr MakeIndex(std::string const& FilePath, int Flags, bool Audio, FFMS_ErrorInfo *E) {
+    FFMS_Indexer *Indexer = FFMS_CreateIndexer(FilePath.c_str(), E);
+    if (!Indexer)
+        return IndexPtr(nullptr, FFMS_DestroyIndex);
+    FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_VIDEO, 1, 0);
+    FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_AUDIO, Audio, 0);
+    FFMS_SetIndexingFlags(Indexer, Flags);
+    return IndexPtr(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, E), FFMS_DestroyIndex);
+}
+
+// Checks that two indexes of the same file describe the same frames
+void ExpectSameIndex(FFMS_Index *Expected, FFMS_Index *Actual) {
+    ASSERT_EQ(FFMS_GetNumTracks(Expected), FFMS_GetNumTracks(Actual));
+    for (int t = 0; t < FFMS_GetNumTracks(Expected); t++) {
+        std::stringstream ss;
+        ss << "Track: " << t;
+        SCOPED_TRACE(ss.str());
+
+        FFMS_Track *ExpectedTrack = FFMS_GetTrackFromIndex(Expected, t);
+        FFMS_Track *ActualTrack = FFMS_GetTrackFromIndex(Actual, t);
+        ASSERT_EQ(FFMS_GetTrackType(ExpectedTrack), FFMS_GetTrackType(ActualTrack));
+        ASSERT_EQ(FFMS_GetNumFrames(ExpectedTrack), FFMS_GetNumFrames(ActualTrack));
+        EXPECT_EQ(FFMS_GetTimeBase(ExpectedTrack)->Num, FFMS_GetTimeBase(ActualTrack)->Num);
+        EXPECT_EQ(FFMS_GetTimeBase(ExpectedTrack)->Den, FFMS_GetTimeBase(ActualTrack)->Den);
+        if (FFMS_GetTrackType(ExpectedTrack) != FFMS_TYPE_VIDEO)
+            continue;
+        for (int i = 0; i < FFMS_GetNumFrames(ExpectedTrack); i++) {
+            const FFMS_FrameInfo *ExpectedInfo = FFMS_GetFrameInfo(ExpectedTrack, i);
+            const FFMS_FrameInfo *ActualInfo = FFMS_GetFrameInfo(ActualTrack, i);
+            ASSERT_NE(nullptr, ExpectedInfo);
+            ASSERT_NE(nullptr, ActualInfo);
+            EXPECT_EQ(ExpectedInfo->PTS, ActualInfo->PTS) << "Frame: " << i;
+            EXPECT_EQ(ExpectedInfo->RepeatPict, ActualInfo->RepeatPict) << "Frame: " << i;
+            EXPECT_EQ(ExpectedInfo->KeyFrame, ActualInfo->KeyFrame) << "Frame: " << i;
+        }
+    }
+}
+
+// Checks what the sources opened from two indexes of the same file report,
+// which covers what the frames don't, such as the duration of the last frame
+void ExpectSameSources(std::string const& FilePath, FFMS_Index *Expected, FFMS_Index *Actual, FFMS_ErrorInfo *E) {
+    for (int t = 0; t < FFMS_GetNumTracks(Expected); t++) {
+        std::stringstream ss;
+        ss << "Track: " << t;
+        SCOPED_TRACE(ss.str());
+
+        if (FFMS_GetNumFrames(FFMS_GetTrackFromIndex(Expected, t)) == 0)
+            continue;
+        int Type = FFMS_GetTrackType(FFMS_GetTrackFromIndex(Expected, t));
+        if (Type == FFMS_TYPE_VIDEO) {
+            FFMS_VideoSource *ExpectedSource = FFMS_CreateVideoSource(FilePath.c_str(), t, Expected, 1, FFMS_SEEK_NORMAL, E);
+            FFMS_VideoSource *ActualSource = FFMS_CreateVideoSource(FilePath.c_str(), t, Actual, 1, FFMS_SEEK_NORMAL, E);
+            EXPECT_NE(nullptr, ExpectedSource);
+            EXPECT_NE(nullptr, ActualSource);
+            if (ExpectedSource && ActualSource) {
+                const FFMS_VideoProperties *ExpectedVP = FFMS_GetVideoProperties(ExpectedSource);
+                const FFMS_VideoProperties *ActualVP = FFMS_GetVideoProperties(ActualSource);
+                EXPECT_EQ(ExpectedVP->NumFrames, ActualVP->NumFrames);
+                EXPECT_EQ(ExpectedVP->FirstTime, ActualVP->FirstTime);
+                EXPECT_EQ(ExpectedVP->LastTime, ActualVP->LastTime);
+                EXPECT_EQ(ExpectedVP->LastEndTime, ActualVP->LastEndTime);
+            }
+            FFMS_DestroyVideoSource(ExpectedSource);
+            FFMS_DestroyVideoSource(ActualSource);
+        } else if (Type == FFMS_TYPE_AUDIO) {
+            FFMS_AudioSource *ExpectedSource = FFMS_CreateAudioSource(FilePath.c_str(), t, Expected, FFMS_DELAY_FIRST_VIDEO_TRACK, E);
+            FFMS_AudioSource *ActualSource = FFMS_CreateAudioSource(FilePath.c_str(), t, Actual, FFMS_DELAY_FIRST_VIDEO_TRACK, E);
+            EXPECT_NE(nullptr, ExpectedSource);
+            EXPECT_NE(nullptr, ActualSource);
+            if (ExpectedSource && ActualSource) {
+                const FFMS_AudioProperties *ExpectedAP = FFMS_GetAudioProperties(ExpectedSource);
+                const FFMS_AudioProperties *ActualAP = FFMS_GetAudioProperties(ActualSource);
+                EXPECT_EQ(ExpectedAP->NumSamples, ActualAP->NumSamples);
+                EXPECT_EQ(ExpectedAP->FirstTime, ActualAP->FirstTime);
+                EXPECT_EQ(ExpectedAP->LastTime, ActualAP->LastTime);
+                EXPECT_EQ(ExpectedAP->LastEndTime, ActualAP->LastEndTime);
+            }
+            FFMS_DestroyAudioSource(ExpectedSource);
+            FFMS_DestroyAudioSource(ActualSource);
+        }
+    }
+}
+
+// Writes Index to memory and reads it back
+IndexPtr RoundTrip(FFMS_Index *Index, FFMS_ErrorInfo *E) {
+    uint8_t *Buffer = nullptr;
+    size_t Size = 0;
+    if (FFMS_WriteIndexToBuffer(&Buffer, &Size, Index, E))
+        return IndexPtr(nullptr, FFMS_DestroyIndex);
+    IndexPtr Result(FFMS_ReadIndexFromBuffer(Buffer, Size, E), FFMS_DestroyIndex);
+    FFMS_FreeIndexBuffer(&Buffer);
+    return Result;
+}
+
+// Where FFMS_Index::WriteIndex puts the library versions and the length of
+// the format name in the uncompressed index, before the tracks
+const size_t IndexVersionsOffset = 18;
+const size_t IndexFormatNameOffset = 62;
+
+// The uncompressed contents of an index, for tests which damage them
+std::vector<uint8_t> InflateIndex(FFMS_Index *Index, FFMS_ErrorInfo *E) {
+    uint8_t *Buffer = nullptr;
+    size_t Size = 0;
+    std::vector<uint8_t> Result;
+    if (FFMS_WriteIndexToBuffer(&Buffer, &Size, Index, E))
+        return Result;
+
+    z_stream z = {};
+    inflateInit(&z);
+    z.next_in = Buffer;
+    z.avail_in = static_cast<uInt>(Size);
+    int Ret = Z_OK;
+    while (Ret == Z_OK) {
+        uint8_t Chunk[65536];
+        z.next_out = Chunk;
+        z.avail_out = sizeof(Chunk);
+        Ret = inflate(&z, Z_NO_FLUSH);
+        Result.insert(Result.end(), Chunk, Chunk + sizeof(Chunk) - z.avail_out);
+    }
+    inflateEnd(&z);
+    FFMS_FreeIndexBuffer(&Buffer);
+    if (Ret != Z_STREAM_END)
+        Result.clear();
+    return Result;
+}
+
+std::vector<uint8_t> DeflateIndex(std::vector<uint8_t> const& Data) {
+    uLongf Size = compressBound(static_cast<uLong>(Data.size()));
+    std::vector<uint8_t> Result(Size);
+    compress(Result.data(), &Size, Data.data(), static_cast<uLong>(Data.size()));
+    Result.resize(Size);
+    return Result;
+}
+
+template<typename T>
+T ReadValue(std::vector<uint8_t> const& Data, size_t Offset) {
+    T Value;
+    memcpy(&Value, &Data[Offset], sizeof(Value));
+    return Value;
+}
+
+template<typename T>
+void WriteValue(std::vector<uint8_t> &Data, size_t Offset, T Value) {
+    memcpy(&Data[Offset], &Value, sizeof(Value));
+}
+
+typedef std::unique_ptr<FFMS_AudioSource, decltype(&FFMS_DestroyAudioSource)> AudioPtr;
+
+AudioPtr OpenAudio(std::string const& FilePath, FFMS_Index *Index, int Track, FFMS_ErrorInfo *E) {
+    return AudioPtr(FFMS_CreateAudioSource(FilePath.c_str(), Track, Index, FFMS_DELAY_NO_SHIFT, E), FFMS_DestroyAudioSource);
+}
+
+// Every sample has audio, so not finding any fails the test rather than
+// leaving it with nothing to check
+void FindAudioTrack(FFMS_Index *Index, int *Track, FFMS_ErrorInfo *E) {
+    *Track = FFMS_GetFirstIndexedTrackOfType(Index, FFMS_TYPE_AUDIO, E);
+    ASSERT_GE(*Track, 0) << E->Buffer;
+}
+
+// Bytes per sample of all channels together
+size_t SampleBytes(const FFMS_AudioProperties *AP) {
+    static const size_t Sizes[] = { 1, 2, 4, 4, 8 };
+    return Sizes[AP->SampleFormat] * AP->Channels;
+}
+
+// Returns Count samples from Start in one request, or nothing on errors
+std::vector<uint8_t> ReadAudio(FFMS_AudioSource *Source, int64_t Start, int64_t Count, FFMS_ErrorInfo *E) {
+    std::vector<uint8_t> Result(static_cast<size_t>(Count) * SampleBytes(FFMS_GetAudioProperties(Source)));
+    if (FFMS_GetAudio(Source, Result.data(), Start, Count, E))
+        Result.clear();
+    return Result;
+}
+
+typedef std::unique_ptr<FFMS_ResampleOptions, decltype(&FFMS_DestroyResampleOptions)> ResampleOptionsPtr;
+
+// Reads Count samples from Start in requests of Chunk samples
+std::vector<uint8_t> ReadAudioInChunks(FFMS_AudioSource *Source, int64_t Start, int64_t Count, int64_t Chunk, FFMS_ErrorInfo *E) {
+    std::vector<uint8_t> Result;
+    for (int64_t Pos = Start; Pos < Start + Count; Pos += Chunk) {
+        std::vector<uint8_t> Part = ReadAudio(Source, Pos, std::min(Chunk, Start + Count - Pos), E);
+        if (Part.empty())
+            return std::vector<uint8_t>();
+        Result.insert(Result.end(), Part.begin(), Part.end());
+    }
+    return Result;
+}
+
+// Reads the whole track from the end in requests of Chunk samples, which
+// aren't sequential and so all go through the cache
+std::vector<uint8_t> ReadAudioBackwards(FFMS_AudioSource *Source, int64_t Chunk, FFMS_ErrorInfo *E) {
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source);
+    const size_t Bytes = SampleBytes(AP);
+    std::vector<uint8_t> Result(static_cast<size_t>(AP->NumSamples) * Bytes);
+    for (int64_t End = AP->NumSamples; End > 0; End -= Chunk) {
+        int64_t Start = std::max<int64_t>(End - Chunk, 0);
+        if (FFMS_GetAudio(Source, &Result[Start * Bytes], Start, End - Start, E))
+            return std::vector<uint8_t>();
+    }
+    return Result;
+}
+
+// Writes a QuickTime file with Frames frames of raw RGB video and PCM audio.
+// Neither needs a parser or decoder to be indexed, so the file's sample
+// tables describe both tracks completely.
+bool WriteRawMovie(std::string const& FilePath, int Frames) {
+    const int Width = 16, Height = 16, SamplesPerFrame = 1920;
+    AVFormatContext *Context = nullptr;
+    if (avformat_alloc_output_context2(&Context, nullptr, "mov", FilePath.c_str()) < 0)
+        return false;
+    std::unique_ptr<AVFormatContext, void (*)(AVFormatContext *)> Guard(Context, [](AVFormatContext *Context) {
+        avio_closep(&Context->pb);
+        avformat_free_context(Context);
+    });
+
+    AVStream *Video = avformat_new_stream(Context, nullptr);
+    AVStream *Audio = avformat_new_stream(Context, nullptr);
+    if (!Video || !Audio)
+        return false;
+    const AVRational TimeBases[] = { { 1, 25 }, { 1, 48000 } };
+    Video->time_base = TimeBases[0];
+    Video->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    Video->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+    Video->codecpar->format = AV_PIX_FMT_RGB24;
+    Video->codecpar->width = Width;
+    Video->codecpar->height = Height;
+    Video->codecpar->bits_per_coded_sample = 24;
+    Audio->time_base = TimeBases[1];
+    Audio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+    Audio->codecpar->codec_id = AV_CODEC_ID_PCM_S16LE;
+    Audio->codecpar->format = AV_SAMPLE_FMT_S16;
+    Audio->codecpar->sample_rate = 48000;
+    Audio->codecpar->channels = 2;
+    Audio->codecpar->channel_layout = AV_CH_LAYOUT_STEREO;
+    Audio->codecpar->bits_per_coded_sample = 16;
+    Audio->codecpar->block_align = 4;
+
+    if (avio_open(&Context->pb, FilePath.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(Context, nullptr) < 0)
+        return false;
+    for (int i = 0; i < Frames; i++) {
+        for (int Stream = 0; Stream < 2; Stream++) {
+            AVPacket *Packet = av_packet_alloc();
+            int Size = Stream == 0 ? Width * Height * 3 : SamplesPerFrame * 4;
+            if (!Packet || av_new_packet(Packet, Size) < 0) {
+                av_packet_free(&Packet);
+                return false;
+            }
+            memset(Packet->data, i * 2 + Stream, Size);
+            Packet->stream_index = Stream;
+            Packet->pts = Packet->dts = Stream == 0 ? i : static_cast<int64_t>(i) * SamplesPerFrame;
+            Packet->duration = Stream == 0 ? 1 : SamplesPerFrame;
+            Packet->flags = AV_PKT_FLAG_KEY;
+            av_packet_rescale_ts(Packet, TimeBases[Stream], Context->streams[Stream]->time_base);
+            int Ret = av_interleaved_write_frame(Context, Packet);
+            av_packet_free(&Packet);
+            if (Ret < 0)
+                return false;
+        }
+    }
+    return av_write_trailer(Context) >= 0;
+}
+
+std::vector<uint8_t> ReadFile(std::string const& FilePath) {
+    std::ifstream File(FilePath, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(File), std::istreambuf_iterator<char>());
+}
+
+// An input read through FFMS_RegisterInput, which counts what is done with it
+struct CountingInput {
+    std::vector<uint8_t> Data;
+    std::atomic<int64_t> BytesRead{0};
+    std::atomic<int> Closed{0};
+
+    static int64_t FFMS_CC Read(void *Private, int64_t Offset, uint8_t *Buffer, int64_t Size) {
+        CountingInput *Input = static_cast<CountingInput *>(Private);
+        if (Offset < 0 || Size < 0)
+            return -1;
+        if (Offset >= static_cast<int64_t>(Input->Data.size()))
+            return 0;
+        int64_t Count = std::min<int64_t>(Size, Input->Data.size() - Offset);
+        memcpy(Buffer, Input->Data.data() + Offset, static_cast<size_t>(Count));
+        Input->BytesRead += Count;
+        return Count;
+    }
+
+    static int64_t FFMS_CC Size(void *Private) {
+        return static_cast<CountingInput *>(Private)->Data.size();
+    }
+
+    static void FFMS_CC Close(void *Private) {
+        static_cast<CountingInput *>(Private)->Closed++;
+    }
+
+    FFMS_IOCallbacks Callbacks() {
+        FFMS_IOCallbacks Result = { Read, Size, Close, this };
+        return Result;
+    }
+};
+
 class IndexerTest : public ::testing::TestWithParam<TestDataMap> {
 protected:
     virtual void SetUp();
@@ -132,6 +449,788 @@ TEST_P(IndexerTest, RandomAccessingFrame) {
     }
 }
 
+TEST_P(IndexerTest, ContainerIndexFallsBackToFullRead) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Serial = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Serial.get()) << E.Buffer;
+    IndexPtr Container = MakeIndex(FilePath, FFMS_INDEX_FLAG_CONTAINER_INDEX, true, &E);
+    ASSERT_NE(nullptr, Container.get()) << E.Buffer;
+
+    // Parsed video and compressed audio have to be read in full
+    FFMS_IndexingStats Stats;
+    ASSERT_EQ(0, FFMS_GetIndexingStats(Container.get(), -1, &Stats, &E)) << E.Buffer;
+    EXPECT_EQ(0, Stats.FromContainer);
+    ExpectSameIndex(Serial.get(), Container.get());
+}
+
+// Indexes a file whose tracks can all be taken from its sample tables
+class ContainerIndexTest : public ::testing::Test {
+protected:
+    const std::string FilePath = "container-index-test.mov";
+    FFMS_ErrorInfo E;
+    char ErrorMsg[1024];
+
+    void SetUp() override {
+        E.Buffer = ErrorMsg;
+        E.BufferSize = sizeof(ErrorMsg);
+        FFMS_Init(0, 0);
+        ASSERT_TRUE(WriteRawMovie(FilePath, 100));
+    }
+
+    void TearDown() override {
+        remove(FilePath.c_str());
+        FFMS_Deinit();
+    }
+
+    void ExpectTakenFromContainer(int Flags, bool Audio) {
+        IndexPtr Serial = MakeIndex(FilePath, Flags, Audio, &E);
+        ASSERT_NE(nullptr, Serial.get()) << E.Buffer;
+        IndexPtr Container = MakeIndex(FilePath, Flags | FFMS_INDEX_FLAG_CONTAINER_INDEX, Audio, &E);
+        ASSERT_NE(nullptr, Container.get()) << E.Buffer;
+
+        FFMS_IndexingStats Stats;
+        ASSERT_EQ(0, FFMS_GetIndexingStats(Serial.get(), -1, &Stats, &E)) << E.Buffer;
+        EXPECT_EQ(0, Stats.FromContainer);
+        ASSERT_EQ(0, FFMS_GetIndexingStats(Container.get(), -1, &Stats, &E)) << E.Buffer;
+        EXPECT_NE(0, Stats.FromContainer);
+        EXPECT_EQ(0, Stats.Packets);
+
+        ExpectSameIndex(Serial.get(), Container.get());
+        if (!(Flags & FFMS_INDEX_FLAG_KEYFRAMES_ONLY))
+            ExpectSameSources(FilePath, Serial.get(), Container.get(), &E);
+    }
+};
+
+TEST_F(ContainerIndexTest, ContainerIndexMatchesFullRead) {
+    ExpectTakenFromContainer(0, true);
+}
+
+TEST_F(ContainerIndexTest, ContainerIndexMatchesKeyFramesOnlyRead) {
+    ExpectTakenFromContainer(FFMS_INDEX_FLAG_KEYFRAMES_ONLY, false);
+}
+
+// Exports a track to a scratch file and returns its lines
+std::vector<std::string> ExportLines(FFMS_Track *Track, int Format, FFMS_ErrorInfo *E) {
+    const char Path[] = "export-test.txt";
+    std::vector<std::string> Lines;
+    if (FFMS_ExportTrack(Track, Path, Format, E))
+        return Lines;
+    std::ifstream File(Path);
+    for (std::string Line; std::getline(File, Line);)
+        Lines.push_back(Line);
+    File.close();
+    remove(Path);
+    return Lines;
+}
+
+TEST_P(IndexerTest, ExportedTrackMatchesFrameInfo) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, false, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int VideoTrack = FFMS_GetFirstTrackOfType(Index.get(), FFMS_TYPE_VIDEO, &E);
+    ASSERT_GE(VideoTrack, 0) << E.Buffer;
+    FFMS_Track *Track = FFMS_GetTrackFromIndex(Index.get(), VideoTrack);
+    const FFMS_TrackTimeBase *TB = FFMS_GetTimeBase(Track);
+    const int Frames = FFMS_GetNumFrames(Track);
+    ASSERT_GT(Frames, 1);
+    auto Milliseconds = [&](int64_t TS) { return (TS * TB->Num) / (double)TB->Den; };
+
+    // V2: a time for every frame, the same as FFMS_WriteTimecodes writes
+    std::vector<std::string> V2 = ExportLines(Track, FFMS_EXPORT_TIMECODES_V2, &E);
+    ASSERT_EQ(static_cast<size_t>(Frames) + 1, V2.size()) << E.Buffer;
+    EXPECT_EQ("# timecode format v2", V2[0]);
+    for (int n = 0; n < Frames; n++)
+        EXPECT_NEAR(Milliseconds(FFMS_GetFrameInfo(Track, n)->PTS), std::stod(V2[n + 1]), 0.01) << "Frame: " << n;
+    ASSERT_EQ(0, FFMS_WriteTimecodes(Track, "export-test-v2.txt", &E)) << E.Buffer;
+    std::vector<uint8_t> Written = ReadFile("export-test-v2.txt");
+    remove("export-test-v2.txt");
+    std::string Joined;
+    for (auto const& Line : V2)
+        Joined += Line + "\n";
+    EXPECT_EQ(Joined, std::string(Written.begin(), Written.end()));
+
+    // V1: the assumed rate, and then ranges of frames with another rate in
+    // order, which together give every frame but the last the rate its
+    // duration works out to
+    std::vector<std::string> V1 = ExportLines(Track, FFMS_EXPORT_TIMECODES_V1, &E);
+    ASSERT_GE(V1.size(), 2u) << E.Buffer;
+    EXPECT_EQ("# timecode format v1", V1[0]);
+    double Assumed = 0;
+    ASSERT_EQ(1, sscanf(V1[1].c_str(), "Assume %lf", &Assumed)) << V1[1];
+    std::vector<double> Rates(Frames, Assumed);
+    int NextFree = 0;
+    for (size_t i = 2; i < V1.size(); i++) {
+        int First, Last;
+        double Rate;
+        ASSERT_EQ(3, sscanf(V1[i].c_str(), "%d,%d,%lf", &First, &Last, &Rate)) << V1[i];
+        EXPECT_GE(First, NextFree) << V1[i];
+        EXPECT_LE(First, Last) << V1[i];
+        ASSERT_LT(Last, Frames) << V1[i];
+        EXPECT_NE(Assumed, Rate) << V1[i];
+        std::fill(Rates.begin() + First, Rates.begin() + Last + 1, Rate);
+        NextFree = Last + 1;
+    }
+    int64_t Previous = 1;
+    for (int n = 0; n + 1 < Frames; n++) {
+        int64_t Duration = FFMS_GetFrameInfo(Track, n + 1)->PTS - FFMS_GetFrameInfo(Track, n)->PTS;
+        Previous = Duration > 0 ? Duration : Previous;
+        double Expected = 1000 / Milliseconds(Previous);
+        EXPECT_NEAR(Expected, Rates[n], Expected * 1e-5) << "Frame: " << n;
+    }
+
+    // Keyframes: exactly the frames FFMS_GetFrameInfo says are keyframes
+    std::vector<std::string> KeyFrames = ExportLines(Track, FFMS_EXPORT_KEYFRAMES, &E);
+    ASSERT_GE(KeyFrames.size(), 2u) << E.Buffer;
+    EXPECT_EQ("# keyframe format v1", KeyFrames[0]);
+    EXPECT_EQ("fps 0", KeyFrames[1]);
+    std::vector<std::string> ExpectedKeyFrames;
+    for (int n = 0; n < Frames; n++) {
+        if (FFMS_GetFrameInfo(Track, n)->KeyFrame)
+            ExpectedKeyFrames.push_back(std::to_string(n));
+    }
+    EXPECT_TRUE(std::equal(ExpectedKeyFrames.begin(), ExpectedKeyFrames.end(), KeyFrames.begin() + 2) &&
+        ExpectedKeyFrames.size() + 2 == KeyFrames.size());
+
+    // CSV: a header and a row of seven fields for every frame
+    std::vector<std::string> CSV = ExportLines(Track, FFMS_EXPORT_FRAMES_CSV, &E);
+    ASSERT_EQ(static_cast<size_t>(Frames) + 1, CSV.size()) << E.Buffer;
+    EXPECT_EQ("frame,pts,time,duration,keyframe,type,pos", CSV[0]);
+    for (int n = 0; n < Frames; n++) {
+        const FFMS_FrameInfo *Info = FFMS_GetFrameInfo(Track, n);
+        int Frame, KeyFrame;
+        long long PTS, Duration, Pos;
+        double Time;
+        char Type;
+        ASSERT_EQ(7, sscanf(CSV[n + 1].c_str(), "%d,%lld,%lf,%lld,%d,%c,%lld", &Frame, &PTS, &Time, &Duration, &KeyFrame, &Type, &Pos)) << CSV[n + 1];
+        EXPECT_EQ(n, Frame);
+        EXPECT_EQ(Info->PTS, PTS);
+        EXPECT_NEAR(Milliseconds(PTS), Time, 0.001);
+        EXPECT_EQ(!!Info->KeyFrame, !!KeyFrame);
+        EXPECT_NE(std::string::npos, std::string("?IPBSipb").find(Type));
+        EXPECT_GE(Pos, 0);
+        if (n + 1 < Frames)
+            EXPECT_EQ(FFMS_GetFrameInfo(Track, n + 1)->PTS - Info->PTS, Duration);
+    }
+
+    // JSON: valid, with an object for every frame
+    std::vector<std::string> JSONLines = ExportLines(Track, FFMS_EXPORT_FRAMES_JSON, &E);
+    std::string JSON;
+    for (auto const& Line : JSONLines)
+        JSON += Line + "\n";
+    EXPECT_TRUE(IsValidJSON(JSON)) << JSON.substr(0, 1000);
+    int Objects = 0;
+    for (size_t Pos = 0; (Pos = JSON.find("{\"frame\": ", Pos)) != std::string::npos; Pos++)
+        Objects++;
+    EXPECT_EQ(Frames, Objects);
+    std::stringstream TimeBase;
+    TimeBase << "\"timebase\": [" << TB->Num << ", " << TB->Den << "]";
+    EXPECT_NE(std::string::npos, JSON.find(TimeBase.str()));
+}
+
+TEST_P(IndexerTest, MemoryInputMatchesFile) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+    std::vector<uint8_t> Data = ReadFile(FilePath);
+    ASSERT_FALSE(Data.empty());
+
+    const char *Name = "memory:indexer-test";
+    ASSERT_EQ(0, FFMS_RegisterMemoryInput(Name, Data.data(), Data.size(), &E)) << E.Buffer;
+    EXPECT_NE(0, FFMS_RegisterMemoryInput(Name, Data.data(), Data.size(), &E));
+
+    IndexPtr FromFile = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, FromFile.get()) << E.Buffer;
+    IndexPtr FromMemory = MakeIndex(Name, 0, true, &E);
+    ASSERT_NE(nullptr, FromMemory.get()) << E.Buffer;
+
+    ExpectSameIndex(FromFile.get(), FromMemory.get());
+    ExpectSameSources(Name, FromFile.get(), FromMemory.get(), &E);
+    EXPECT_EQ(0, FFMS_IndexBelongsToFile(FromFile.get(), Name, &E)) << E.Buffer;
+
+    FFMS_UnregisterInput(Name);
+}
+
+TEST_P(IndexerTest, CallbackInputDecodesFrames) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+    CountingInput Input;
+    Input.Data = ReadFile(FilePath);
+    ASSERT_FALSE(Input.Data.empty());
+
+    const char *Name = "callback:indexer-test";
+    FFMS_IOCallbacks Callbacks = Input.Callbacks();
+    ASSERT_EQ(0, FFMS_RegisterInput(Name, &Callbacks, &E)) << E.Buffer;
+
+    // Nothing is called back for an input rejected because the name is taken
+    CountingInput Duplicate;
+    FFMS_IOCallbacks DuplicateCallbacks = Duplicate.Callbacks();
+    EXPECT_NE(0, FFMS_RegisterInput(Name, &DuplicateCallbacks, &E));
+    EXPECT_EQ(0, Duplicate.Closed);
+    EXPECT_NE(0, FFMS_RegisterMemoryInput(Name, Input.Data.data(), Input.Data.size(), &E));
+    EXPECT_EQ(0, Input.Closed);
+
+    IndexPtr Index = MakeIndex(Name, 0, false, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    EXPECT_GT(Input.BytesRead, 0);
+
+    int Track = FFMS_GetFirstTrackOfType(Index.get(), FFMS_TYPE_VIDEO, &E);
+    ASSERT_GE(Track, 0);
+    FFMS_VideoSource *Source = FFMS_CreateVideoSource(Name, Track, Index.get(), 1, FFMS_SEEK_NORMAL, &E);
+    ASSERT_NE(nullptr, Source) << E.Buffer;
+
+    // The source keeps the input alive after it's unregistered
+    FFMS_UnregisterInput(Name);
+    EXPECT_EQ(0, Input.Closed);
+
+    FFMS_Track *IndexTrack = FFMS_GetTrackFromIndex(Index.get(), Track);
+    for (int i = 0; i < FFMS_GetVideoProperties(Source)->NumFrames; i++) {
+        std::stringstream ss;
+        ss << "Testing Frame: " << i;
+        SCOPED_TRACE(ss.str());
+
+        const FFMS_Frame *Frame = FFMS_GetFrame(Source, i, &E);
+        ASSERT_NE(nullptr, Frame) << E.Buffer;
+        ASSERT_TRUE(CheckFrame(Frame, FFMS_GetFrameInfo(IndexTrack, i), &P.TestData[i]));
+    }
+
+    FFMS_DestroyVideoSource(Source);
+    EXPECT_EQ(1, Input.Closed);
+}
+
+TEST_P(IndexerTest, KeyFramesOnlyIndexRoundTrip) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Full = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Full.get()) << E.Buffer;
+    IndexPtr Written = MakeIndex(FilePath, FFMS_INDEX_FLAG_KEYFRAMES_ONLY, true, &E);
+    ASSERT_NE(nullptr, Written.get()) << E.Buffer;
+    IndexPtr KeyFrames = RoundTrip(Written.get(), &E);
+    ASSERT_NE(nullptr, KeyFrames.get()) << E.Buffer;
+
+    // The frame count and keyframes survive being written, but no source
+    // can be opened until the index is upgraded
+    int Track = FFMS_GetFirstTrackOfType(Full.get(), FFMS_TYPE_VIDEO, &E);
+    ASSERT_GE(Track, 0);
+    FFMS_Track *FullTrack = FFMS_GetTrackFromIndex(Full.get(), Track);
+    FFMS_Track *KeyFramesTrack = FFMS_GetTrackFromIndex(KeyFrames.get(), Track);
+    ASSERT_EQ(FFMS_GetNumFrames(FullTrack), FFMS_GetNumFrames(KeyFramesTrack));
+    for (int i = 0; i < FFMS_GetNumFrames(FullTrack); i++) {
+        const FFMS_FrameInfo *Info = FFMS_GetFrameInfo(KeyFramesTrack, i);
+        ASSERT_NE(nullptr, Info);
+        EXPECT_EQ(FFMS_GetFrameInfo(FullTrack, i)->KeyFrame, Info->KeyFrame) << "Frame: " << i;
+    }
+    EXPECT_EQ(nullptr, FFMS_CreateVideoSource(FilePath.c_str(), Track, KeyFrames.get(), 1, FFMS_SEEK_NORMAL, &E));
+
+    // Only the keyframe list is real, and the formats with timestamps are
+    // refused rather than filled with made up ones
+    EXPECT_EQ(ExportLines(FullTrack, FFMS_EXPORT_KEYFRAMES, &E), ExportLines(KeyFramesTrack, FFMS_EXPORT_KEYFRAMES, &E));
+    for (int Format : { FFMS_EXPORT_TIMECODES_V2, FFMS_EXPORT_TIMECODES_V1, FFMS_EXPORT_FRAMES_CSV, FFMS_EXPORT_FRAMES_JSON }) {
+        EXPECT_NE(0, FFMS_ExportTrack(KeyFramesTrack, "export-test.txt", Format, &E)) << "Format: " << Format;
+        EXPECT_EQ(FFMS_ERROR_UNSUPPORTED, E.SubType);
+    }
+    EXPECT_NE(0, FFMS_WriteTimecodes(KeyFramesTrack, "export-test.txt", &E));
+    remove("export-test.txt");
+
+    ASSERT_EQ(0, FFMS_UpgradeIndex(KeyFrames.get(), FilePath.c_str(), &E)) << E.Buffer;
+    IndexPtr Upgraded = RoundTrip(KeyFrames.get(), &E);
+    ASSERT_NE(nullptr, Upgraded.get()) << E.Buffer;
+    ExpectSameIndex(Full.get(), Upgraded.get());
+    ExpectSameSources(FilePath, Full.get(), Upgraded.get(), &E);
+}
+
+TEST_P(IndexerTest, OtherLibraryVersionsAreRevalidated) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Fresh = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Fresh.get()) << E.Buffer;
+    std::vector<uint8_t> Raw = InflateIndex(Fresh.get(), &E);
+    ASSERT_GT(Raw.size(), IndexFormatNameOffset + 4);
+
+    // Pretend another libavutil wrote the index, and break the description
+    // and last frame duration of the first track so that the check has to
+    // index that track again
+    WriteValue<uint32_t>(Raw, IndexVersionsOffset, ReadValue<uint32_t>(Raw, IndexVersionsOffset) + 1);
+    size_t Track = IndexFormatNameOffset + 4 + ReadValue<uint32_t>(Raw, IndexFormatNameOffset);
+    size_t LastDuration = Track + 1 + 8 + 8;
+    size_t KeyFramesOnly = LastDuration + 8 + 4 + 1 + 1;
+    ASSERT_EQ(0, Raw[KeyFramesOnly]);
+    size_t CodecName = KeyFramesOnly + 1;
+    size_t CodecWidth = CodecName + 4 + ReadValue<uint32_t>(Raw, CodecName);
+    WriteValue<int64_t>(Raw, LastDuration, ReadValue<int64_t>(Raw, LastDuration) + 100000);
+    WriteValue<int32_t>(Raw, CodecWidth, ReadValue<int32_t>(Raw, CodecWidth) + 16);
+
+    std::string IndexFile = "indexer-compat.ffindex";
+    {
+        std::vector<uint8_t> Compressed = DeflateIndex(Raw);
+        std::ofstream Out(IndexFile, std::ios::binary);
+        Out.write(reinterpret_cast<const char *>(Compressed.data()), Compressed.size());
+    }
+
+    IndexPtr Strict(FFMS_ReadIndex(IndexFile.c_str(), &E), FFMS_DestroyIndex);
+    EXPECT_EQ(nullptr, Strict.get());
+    IndexPtr Compat(FFMS_ReadIndexCompat(IndexFile.c_str(), FilePath.c_str(), &E), FFMS_DestroyIndex);
+    std::remove(IndexFile.c_str());
+    ASSERT_NE(nullptr, Compat.get()) << E.Buffer;
+
+    ExpectSameIndex(Fresh.get(), Compat.get());
+    ExpectSameSources(FilePath, Fresh.get(), Compat.get(), &E);
+}
+
+TEST_P(IndexerTest, OverlongIndexStringIsRejected) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, false, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    std::vector<uint8_t> Raw = InflateIndex(Index.get(), &E);
+    ASSERT_GT(Raw.size(), IndexFormatNameOffset + 4);
+
+    WriteValue<uint32_t>(Raw, IndexFormatNameOffset, 0xFFFFFFF0);
+    std::vector<uint8_t> Compressed = DeflateIndex(Raw);
+    IndexPtr Damaged(FFMS_ReadIndexFromBuffer(Compressed.data(), Compressed.size(), &E), FFMS_DestroyIndex);
+    EXPECT_EQ(nullptr, Damaged.get());
+    EXPECT_EQ(FFMS_ERROR_PARSER, E.ErrorType);
+}
+
+TEST_P(IndexerTest, AsyncIndexWriteMatchesIndex) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+
+    std::string IndexFile = "indexer-async.ffindex";
+    FFMS_IndexWriter *Writer = FFMS_WriteIndexAsync(IndexFile.c_str(), Index.get(), &E);
+    ASSERT_NE(nullptr, Writer) << E.Buffer;
+    ASSERT_EQ(0, FFMS_FinishIndexWrite(Writer, &E)) << E.Buffer;
+    IndexPtr Written(FFMS_ReadIndex(IndexFile.c_str(), &E), FFMS_DestroyIndex);
+    std::remove(IndexFile.c_str());
+    ASSERT_NE(nullptr, Written.get()) << E.Buffer;
+    ExpectSameIndex(Index.get(), Written.get());
+
+    // Failing to start a write gives nothing to finish
+    EXPECT_NE(0, FFMS_FinishIndexWrite(nullptr, &E));
+    EXPECT_EQ(FFMS_ERROR_INVALID_ARGUMENT, E.SubType);
+}
+
+TEST_P(IndexerTest, AdditionalTracksMatchFullIndex) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Full = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Full.get()) << E.Buffer;
+    IndexPtr VideoOnly = MakeIndex(FilePath, 0, false, &E);
+    ASSERT_NE(nullptr, VideoOnly.get()) << E.Buffer;
+
+    // Asking for the video track again leaves it alone
+    std::vector<int> Tracks;
+    for (int t = 0; t < FFMS_GetNumTracks(Full.get()); t++) {
+        int Type = FFMS_GetTrackType(FFMS_GetTrackFromIndex(Full.get(), t));
+        if (Type == FFMS_TYPE_AUDIO || Type == FFMS_TYPE_VIDEO)
+            Tracks.push_back(t);
+    }
+    ASSERT_EQ(0, FFMS_IndexAdditionalTracks(VideoOnly.get(), FilePath.c_str(), Tracks.data(), static_cast<int>(Tracks.size()), &E)) << E.Buffer;
+
+    IndexPtr Added = RoundTrip(VideoOnly.get(), &E);
+    ASSERT_NE(nullptr, Added.get()) << E.Buffer;
+    ExpectSameIndex(Full.get(), Added.get());
+    ExpectSameSources(FilePath, Full.get(), Added.get(), &E);
+}
+
+TEST_P(IndexerTest, ExtractAudioMatchesGetAudio) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+
+    AudioPtr Source = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source.get());
+    std::vector<uint8_t> Expected = ReadAudio(Source.get(), 0, AP->NumSamples, &E);
+    ASSERT_EQ(static_cast<size_t>(AP->NumSamples) * SampleBytes(AP), Expected.size()) << E.Buffer;
+
+    for (int Decoders : { 1, 4 }) {
+        std::stringstream ss;
+        ss << "Decoders: " << Decoders;
+        SCOPED_TRACE(ss.str());
+
+        std::vector<uint8_t> Extracted(Expected.size());
+        ASSERT_EQ(0, FFMS_ExtractAudio(FilePath.c_str(), Track, Index.get(), FFMS_DELAY_NO_SHIFT, Decoders, Extracted.data(), &E)) << E.Buffer;
+        EXPECT_TRUE(Expected == Extracted);
+    }
+}
+
+TEST_P(IndexerTest, ExtractAudioToFileWritesReadableHeaders) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+
+    AudioPtr Source = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source.get());
+    std::vector<uint8_t> Expected = ReadAudio(Source.get(), 0, AP->NumSamples, &E);
+    ASSERT_EQ(static_cast<size_t>(AP->NumSamples) * SampleBytes(AP), Expected.size()) << E.Buffer;
+
+    // W64 chunks are only told apart by the first four bytes of their GUIDs
+    for (int Format : { FFMS_AUDIO_FILE_WAV, FFMS_AUDIO_FILE_W64 }) {
+        const bool W64 = Format == FFMS_AUDIO_FILE_W64;
+        const std::string OutputPath = W64 ? "extract-test.w64" : "extract-test.wav";
+        SCOPED_TRACE(OutputPath);
+        ASSERT_EQ(0, FFMS_ExtractAudioToFile(FilePath.c_str(), Track, Index.get(), FFMS_DELAY_NO_SHIFT, 2,
+            OutputPath.c_str(), Format, &E)) << E.Buffer;
+        std::vector<uint8_t> File = ReadFile(OutputPath);
+        remove(OutputPath.c_str());
+
+        size_t FmtOffset, DataOffset;
+        uint64_t DataSize;
+        if (W64) {
+            ASSERT_GE(File.size(), 40u + 24 + 16 + 24u);
+            EXPECT_EQ(0, memcmp(File.data(), "riff", 4));
+            EXPECT_EQ(File.size(), ReadValue<uint64_t>(File, 16));
+            EXPECT_EQ(0, memcmp(&File[24], "wave", 4));
+            EXPECT_EQ(0, memcmp(&File[40], "fmt ", 4));
+            uint64_t FmtSize = ReadValue<uint64_t>(File, 56);
+            FmtOffset = 64;
+            size_t DataChunk = static_cast<size_t>(40 + FmtSize);
+            ASSERT_LE(DataChunk + 24, File.size());
+            EXPECT_EQ(0, memcmp(&File[DataChunk], "data", 4));
+            DataSize = ReadValue<uint64_t>(File, DataChunk + 16) - 24;
+            DataOffset = DataChunk + 24;
+            EXPECT_EQ(0u, File.size() % 8);
+        } else {
+            ASSERT_GE(File.size(), 20u + 16 + 8u);
+            EXPECT_EQ(0, memcmp(File.data(), "RIFF", 4));
+            EXPECT_EQ(File.size() - 8, ReadValue<uint32_t>(File, 4));
+            EXPECT_EQ(0, memcmp(&File[8], "WAVEfmt ", 8));
+            FmtOffset = 20;
+            size_t DataChunk = FmtOffset + ReadValue<uint32_t>(File, 16);
+            ASSERT_LE(DataChunk + 8, File.size());
+            EXPECT_EQ(0, memcmp(&File[DataChunk], "data", 4));
+            DataSize = ReadValue<uint32_t>(File, DataChunk + 4);
+            DataOffset = DataChunk + 8;
+        }
+
+        EXPECT_EQ(AP->Channels, ReadValue<uint16_t>(File, FmtOffset + 2));
+        EXPECT_EQ(static_cast<uint32_t>(AP->SampleRate), ReadValue<uint32_t>(File, FmtOffset + 4));
+        EXPECT_EQ(SampleBytes(AP), ReadValue<uint16_t>(File, FmtOffset + 12));
+        EXPECT_EQ(AP->BitsPerSample, ReadValue<uint16_t>(File, FmtOffset + 14));
+        ASSERT_EQ(Expected.size(), DataSize);
+        ASSERT_LE(DataOffset + Expected.size(), File.size());
+        EXPECT_TRUE(std::equal(Expected.begin(), Expected.end(), File.begin() + DataOffset));
+    }
+}
+
+TEST_P(IndexerTest, ResampledRandomAccessMatchesSequentialRead) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+
+    // To another rate, and forced through the resampler at the same rate
+    for (bool Force : { false, true }) {
+        std::stringstream Mode;
+        Mode << "Forced: " << Force;
+        SCOPED_TRACE(Mode.str());
+
+        // One source is read from start to end and the other in random order
+        AudioPtr Sequential = OpenAudio(FilePath, Index.get(), Track, &E);
+        ASSERT_NE(nullptr, Sequential.get()) << E.Buffer;
+        AudioPtr Random = OpenAudio(FilePath, Index.get(), Track, &E);
+        ASSERT_NE(nullptr, Random.get()) << E.Buffer;
+        const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Sequential.get());
+        const int64_t SourceSamples = AP->NumSamples;
+        const int Rate = Force ? AP->SampleRate : AP->SampleRate == 44100 ? 48000 : 44100;
+        for (FFMS_AudioSource *Source : { Sequential.get(), Random.get() }) {
+            ResampleOptionsPtr Options(FFMS_CreateResampleOptions(Source), FFMS_DestroyResampleOptions);
+            ASSERT_NE(nullptr, Options.get());
+            Options->SampleRate = Rate;
+            Options->ForceResample = Force;
+            ASSERT_EQ(0, FFMS_SetOutputFormatA(Source, Options.get(), &E)) << E.Buffer;
+        }
+
+        AP = FFMS_GetAudioProperties(Sequential.get());
+        ASSERT_EQ(Rate, AP->SampleRate);
+        if (Force)
+            EXPECT_EQ(SourceSamples, AP->NumSamples);
+        const size_t Bytes = SampleBytes(AP);
+        std::vector<uint8_t> Expected = ReadAudioInChunks(Sequential.get(), 0, AP->NumSamples, 1000, &E);
+        ASSERT_EQ(static_cast<size_t>(AP->NumSamples) * Bytes, Expected.size()) << E.Buffer;
+
+        // Requests of any length starting anywhere, which restart the conversion
+        std::mt19937 Gen(1);
+        std::uniform_int_distribution<int64_t> StartDist(0, AP->NumSamples - 1);
+        std::uniform_int_distribution<int64_t> CountDist(1, 5000);
+        for (int i = 0; i < 50; i++) {
+            int64_t Start = StartDist(Gen);
+            int64_t Count = std::min(CountDist(Gen), AP->NumSamples - Start);
+            std::stringstream ss;
+            ss << "Samples: " << Start << "+" << Count;
+            SCOPED_TRACE(ss.str());
+
+            std::vector<uint8_t> Part = ReadAudio(Random.get(), Start, Count, &E);
+            ASSERT_EQ(static_cast<size_t>(Count) * Bytes, Part.size()) << E.Buffer;
+            EXPECT_TRUE(std::equal(Part.begin(), Part.end(), Expected.begin() + Start * Bytes));
+        }
+    }
+}
+
+TEST_P(IndexerTest, OutputFormatChangeKeepsCachedAudio) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+    CountingInput Input;
+    Input.Data = ReadFile(FilePath);
+    ASSERT_FALSE(Input.Data.empty());
+
+    const char *Name = "callback:audio-format-test";
+    FFMS_IOCallbacks Callbacks = Input.Callbacks();
+    ASSERT_EQ(0, FFMS_RegisterInput(Name, &Callbacks, &E)) << E.Buffer;
+    IndexPtr Index = MakeIndex(Name, 0, true, &E);
+    int Track = Index ? FFMS_GetFirstIndexedTrackOfType(Index.get(), FFMS_TYPE_AUDIO, &E) : -1;
+    AudioPtr Source(Track >= 0 ? OpenAudio(Name, Index.get(), Track, &E) : AudioPtr(nullptr, FFMS_DestroyAudioSource));
+    FFMS_UnregisterInput(Name);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    ASSERT_GE(Track, 0) << E.Buffer;
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+
+    FFMS_SetAudioCacheSize(Source.get(), 1 << 30);
+    std::vector<uint8_t> Native = ReadAudioBackwards(Source.get(), 1024, &E);
+    ASSERT_FALSE(Native.empty()) << E.Buffer;
+    int64_t BytesRead = Input.BytesRead;
+
+    ResampleOptionsPtr Options(FFMS_CreateResampleOptions(Source.get()), FFMS_DestroyResampleOptions);
+    ASSERT_NE(nullptr, Options.get());
+    Options->SampleFormat = FFMS_GetAudioProperties(Source.get())->SampleFormat == FFMS_FMT_FLT ? FFMS_FMT_S16 : FFMS_FMT_FLT;
+    ASSERT_EQ(0, FFMS_SetOutputFormatA(Source.get(), Options.get(), &E)) << E.Buffer;
+    std::vector<uint8_t> Converted = ReadAudioBackwards(Source.get(), 1024, &E);
+    ASSERT_FALSE(Converted.empty()) << E.Buffer;
+
+    // Everything came from the cache
+    EXPECT_EQ(BytesRead, Input.BytesRead);
+
+    // and is what converting while decoding gives
+    AudioPtr Fresh = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Fresh.get()) << E.Buffer;
+    ASSERT_EQ(0, FFMS_SetOutputFormatA(Fresh.get(), Options.get(), &E)) << E.Buffer;
+    EXPECT_TRUE(Converted == ReadAudio(Fresh.get(), 0, FFMS_GetAudioProperties(Fresh.get())->NumSamples, &E));
+}
+
+TEST_P(IndexerTest, PlanarAudioMatchesInterleaved) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+
+    AudioPtr Source = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+
+    // Once as the decoder outputs it and once converted to another format
+    for (int Pass = 0; Pass < 2; Pass++) {
+        std::stringstream ss;
+        ss << "Pass: " << Pass;
+        SCOPED_TRACE(ss.str());
+
+        if (Pass == 1) {
+            ResampleOptionsPtr Options(FFMS_CreateResampleOptions(Source.get()), FFMS_DestroyResampleOptions);
+            ASSERT_NE(nullptr, Options.get());
+            Options->SampleFormat = Options->SampleFormat == FFMS_FMT_S16 ? FFMS_FMT_FLT : FFMS_FMT_S16;
+            ASSERT_EQ(0, FFMS_SetOutputFormatA(Source.get(), Options.get(), &E)) << E.Buffer;
+        }
+
+        const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source.get());
+        const size_t Channels = AP->Channels;
+        const size_t Bytes = SampleBytes(AP) / Channels;
+        std::vector<uint8_t> Interleaved = ReadAudioInChunks(Source.get(), 0, AP->NumSamples, 1000, &E);
+        ASSERT_EQ(static_cast<size_t>(AP->NumSamples) * Bytes * Channels, Interleaved.size()) << E.Buffer;
+
+        // Requests which don't line up with the interleaved ones
+        std::vector<std::vector<uint8_t>> Planes(Channels, std::vector<uint8_t>(static_cast<size_t>(AP->NumSamples) * Bytes));
+        const int64_t Chunk = 777;
+        for (int64_t Start = 0; Start < AP->NumSamples; Start += Chunk) {
+            std::vector<void *> Dst;
+            for (auto &Plane : Planes)
+                Dst.push_back(&Plane[Start * Bytes]);
+            ASSERT_EQ(0, FFMS_GetAudioPlanar(Source.get(), Dst.data(), Start, std::min(Chunk, AP->NumSamples - Start), &E)) << E.Buffer;
+        }
+
+        for (size_t c = 0; c < Channels; c++) {
+            for (int64_t i = 0; i < AP->NumSamples; i++) {
+                if (memcmp(&Planes[c][i * Bytes], &Interleaved[(i * Channels + c) * Bytes], Bytes)) {
+                    ADD_FAILURE() << "Channel " << c << " differs at sample " << i;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+TEST_P(IndexerTest, PrefetchedAudioMatchesSerialRead) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, 0, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+
+    AudioPtr Serial = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Serial.get()) << E.Buffer;
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Serial.get());
+    const size_t Bytes = SampleBytes(AP);
+    std::vector<uint8_t> Expected = ReadAudio(Serial.get(), 0, AP->NumSamples, &E);
+    ASSERT_EQ(static_cast<size_t>(AP->NumSamples) * Bytes, Expected.size()) << E.Buffer;
+
+    AudioPtr Prefetched = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Prefetched.get()) << E.Buffer;
+    ASSERT_EQ(0, FFMS_SetAudioPrefetch(Prefetched.get(), 1 << 20, &E)) << E.Buffer;
+
+    // Runs of small reads, which contend with the prefetch thread for the
+    // decoder, starting from places which make it drop what it was doing.
+    // Pausing now and then lets it get ahead so that reads also come from
+    // what it prefetched.
+    std::mt19937 Gen(1);
+    std::uniform_int_distribution<int64_t> StartDist(0, AP->NumSamples - 1);
+    for (int Run = 0; Run < 10; Run++) {
+        int64_t Start = Run == 0 ? 0 : StartDist(Gen);
+        for (int i = 0; i < 50 && Start < AP->NumSamples; i++) {
+            int64_t Count = std::min<int64_t>(700, AP->NumSamples - Start);
+            std::stringstream ss;
+            ss << "Samples: " << Start << "+" << Count;
+            SCOPED_TRACE(ss.str());
+
+            std::vector<uint8_t> Part = ReadAudio(Prefetched.get(), Start, Count, &E);
+            ASSERT_EQ(static_cast<size_t>(Count) * Bytes, Part.size()) << E.Buffer;
+            EXPECT_TRUE(std::equal(Part.begin(), Part.end(), Expected.begin() + Start * Bytes));
+            Start += Count;
+            if (i % 10 == 9)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+TEST_P(IndexerTest, WaveformMatchesDecodedAudio) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Written = MakeIndex(FilePath, FFMS_INDEX_FLAG_WAVEFORM, true, &E);
+    ASSERT_NE(nullptr, Written.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Written.get(), &Track, &E));
+    IndexPtr Index = RoundTrip(Written.get(), &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+
+    FFMS_Track *T = FFMS_GetTrackFromIndex(Index.get(), Track);
+    const FFMS_WaveformProperties *WP = FFMS_GetWaveformProperties(T);
+    ASSERT_NE(nullptr, WP);
+
+    AudioPtr Source = OpenAudio(FilePath, Index.get(), Track, &E);
+    ASSERT_NE(nullptr, Source.get()) << E.Buffer;
+    ResampleOptionsPtr Options(FFMS_CreateResampleOptions(Source.get()), FFMS_DestroyResampleOptions);
+    ASSERT_NE(nullptr, Options.get());
+    Options->SampleFormat = FFMS_FMT_FLT;
+    ASSERT_EQ(0, FFMS_SetOutputFormatA(Source.get(), Options.get(), &E)) << E.Buffer;
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Source.get());
+    ASSERT_EQ(AP->Channels, WP->Channels);
+    EXPECT_EQ(AP->SampleRate, WP->SampleRate);
+    EXPECT_EQ(AP->NumSamples, WP->NumSamples);
+
+    // Parts made of whole stored points, so that no samples outside them
+    // are included
+    int Points = 4;
+    int64_t PartSamples = WP->NumSamples / Points / WP->PointSamples * WP->PointSamples;
+    if (PartSamples == 0) {
+        Points = 1;
+        PartSamples = WP->NumSamples;
+    }
+    const int Channels = WP->Channels;
+    std::vector<FFMS_WaveformPoint> Summary(Points * Channels);
+    ASSERT_EQ(0, FFMS_GetWaveform(T, 0, PartSamples * Points, Points, Summary.data(), &E)) << E.Buffer;
+
+    std::vector<uint8_t> Audio = ReadAudio(Source.get(), 0, PartSamples * Points, &E);
+    ASSERT_FALSE(Audio.empty()) << E.Buffer;
+    const float *Samples = reinterpret_cast<const float *>(Audio.data());
+    for (int p = 0; p < Points; p++) {
+        for (int c = 0; c < Channels; c++) {
+            double Min = 1, Max = -1, Squares = 0;
+            for (int64_t i = p * PartSamples; i < (p + 1) * PartSamples; i++) {
+                double Value = std::max(-1.0, std::min(1.0, static_cast<double>(Samples[i * Channels + c])));
+                Min = std::min(Min, Value);
+                Max = std::max(Max, Value);
+                Squares += Value * Value;
+            }
+            // The index stores 16 bit levels
+            FFMS_WaveformPoint const& Point = Summary[p * Channels + c];
+            EXPECT_NEAR(Min, Point.Min, 1e-4) << "Part: " << p << ", channel: " << c;
+            EXPECT_NEAR(Max, Point.Max, 1e-4) << "Part: " << p << ", channel: " << c;
+            EXPECT_NEAR(std::sqrt(Squares / PartSamples), Point.RMS, 1e-3) << "Part: " << p << ", channel: " << c;
+        }
+    }
+}
+
+TEST_P(IndexerTest, DamagedWaveformIsRejected) {
+    TestDataMap P = GetParam();
+    std::string FilePath = SamplesDir + "/" + P.Filename;
+
+    IndexPtr Index = MakeIndex(FilePath, FFMS_INDEX_FLAG_WAVEFORM, true, &E);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    int Track;
+    ASSERT_NO_FATAL_FAILURE(FindAudioTrack(Index.get(), &Track, &E));
+    const FFMS_WaveformProperties *WP = FFMS_GetWaveformProperties(FFMS_GetTrackFromIndex(Index.get(), Track));
+    ASSERT_NE(nullptr, WP);
+    std::vector<uint8_t> Raw = InflateIndex(Index.get(), &E);
+    ASSERT_FALSE(Raw.empty()) << E.Buffer;
+
+    // The summary starts with a flag, the channel count, the sample rate and
+    // the sample count, which together only show up there
+    std::vector<uint8_t> Header(1 + 4 + 4 + 8);
+    WriteValue<uint8_t>(Header, 0, 1);
+    WriteValue<int32_t>(Header, 1, WP->Channels);
+    WriteValue<int32_t>(Header, 5, WP->SampleRate);
+    WriteValue<int64_t>(Header, 9, WP->NumSamples);
+    auto Found = std::search(Raw.begin(), Raw.end(), Header.begin(), Header.end());
+    ASSERT_NE(Raw.end(), Found);
+    const size_t Channels = Found - Raw.begin() + 1;
+    const size_t NumSamples = Channels + 4 + 4;
+
+    // Too many channels, a point count which overflows once multiplied by
+    // the channel count, and far more points than the index holds
+    const std::pair<int32_t, int64_t> Damage[] = {
+        { 1025, WP->NumSamples },
+        { 1024, std::numeric_limits<int64_t>::max() },
+        { WP->Channels, int64_t(1) << 40 },
+    };
+    for (auto const& D : Damage) {
+        std::stringstream ss;
+        ss << "Channels: " << D.first << ", samples: " << D.second;
+        SCOPED_TRACE(ss.str());
+
+        std::vector<uint8_t> Damaged = Raw;
+        WriteValue<int32_t>(Damaged, Channels, D.first);
+        WriteValue<int64_t>(Damaged, NumSamples, D.second);
+        std::vector<uint8_t> Compressed = DeflateIndex(Damaged);
+        IndexPtr Read(FFMS_ReadIndexFromBuffer(Compressed.data(), Compressed.size(), &E), FFMS_DestroyIndex);
+        EXPECT_EQ(nullptr, Read.get());
+        EXPECT_EQ(FFMS_ERROR_PARSER, E.ErrorType);
+    }
+}
+
 INSTANTIATE_TEST_CASE_P(ValidateIndexer, IndexerTest, ::testing::ValuesIn(TestFiles));
 
 } //namespace
@@ -0,0 +1,261 @@
+// Checks how FFMS_DoIndexing2 deals with index servers, using fake servers
+// which answer in the ways a real one could, or don't answer at all. Uses the
+// client internals to shorten the timeout, so it links against the static
+// library.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "indexserver.h"
+#include "tests.h"
+
+namespace {
+
+typedef std::unique_ptr<FFMS_Index, decltype(&FFMS_DestroyIndex)> IndexPtr;
+
+const char SocketPath[] = "indexserver-test.sock";
+
+// Accepts a single connection and hands the request line to Handler
+class FakeServer {
+    int Listener = -1;
+    std::thread Thread;
+
+    static std::string ReadLine(int FD) {
+        std::string Line;
+        char c;
+        while (read(FD, &c, 1) == 1 && c != '\n')
+            Line.push_back(c);
+        return Line;
+    }
+
+public:
+    explicit FakeServer(std::function<void(int, std::string const&)> Handler) {
+        sockaddr_un Address = {};
+        Address.sun_family = AF_UNIX;
+        memcpy(Address.sun_path, SocketPath, sizeof(SocketPath));
+        unlink(SocketPath);
+        Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (Listener < 0 || bind(Listener, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) || listen(Listener, 1))
+            return;
+        Thread = std::thread([=] {
+            int Client = accept(Listener, nullptr, nullptr);
+            if (Client < 0)
+                return;
+            Handler(Client, ReadLine(Client));
+            close(Client);
+        });
+    }
+
+    ~FakeServer() {
+        // Unblocks accept if the client never connected
+        shutdown(Listener, SHUT_RDWR);
+        Wait();
+        if (Listener >= 0)
+            close(Listener);
+        unlink(SocketPath);
+    }
+
+    bool Listening() const {
+        return Thread.joinable();
+    }
+
+    // Waits for the handler to finish
+    void Wait() {
+        if (Thread.joinable())
+            Thread.join();
+    }
+};
+
+bool SendAll(int FD, const void *Data, size_t Size) {
+    return send(FD, Data, Size, MSG_NOSIGNAL) == static_cast<ssize_t>(Size);
+}
+
+// Waits for the client to hang up
+void WaitForClose(int FD) {
+    char c;
+    while (read(FD, &c, 1) > 0);
+}
+
+class IndexServerTest : public ::testing::Test {
+protected:
+    std::string FilePath;
+    FFMS_ErrorInfo E;
+    char ErrorMsg[1024];
+
+    void SetUp() override {
+        FFMS_Init(0, 0);
+        FilePath = std::string(STRINGIFY(SAMPLES_DIR)) + "/test.mp4";
+        E.Buffer = ErrorMsg;
+        E.BufferSize = sizeof(ErrorMsg);
+        SetIndexServerTimeout(200);
+    }
+
+    void TearDown() override {
+        FFMS_SetIndexServer(nullptr);
+        SetIndexServerTimeout(30000);
+        FFMS_Deinit();
+    }
+
+    FFMS_Indexer *CreateIndexer() {
+        FFMS_Indexer *Indexer = FFMS_CreateIndexer(FilePath.c_str(), &E);
+        if (Indexer) {
+            FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_VIDEO, 1, 0);
+            FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_AUDIO, 1, 0);
+        }
+        return Indexer;
+    }
+
+    IndexPtr MakeIndex() {
+        FFMS_Indexer *Indexer = CreateIndexer();
+        if (!Indexer)
+            return IndexPtr(nullptr, FFMS_DestroyIndex);
+        return IndexPtr(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, &E), FFMS_DestroyIndex);
+    }
+
+    void ExpectSameFrameCounts(FFMS_Index *Expected, FFMS_Index *Actual) {
+        ASSERT_EQ(FFMS_GetNumTracks(Expected), FFMS_GetNumTracks(Actual));
+        for (int t = 0; t < FFMS_GetNumTracks(Expected); t++)
+            EXPECT_EQ(FFMS_GetNumFrames(FFMS_GetTrackFromIndex(Expected, t)), FFMS_GetNumFrames(FFMS_GetTrackFromIndex(Actual, t))) << "Track: " << t;
+    }
+};
+
+TEST_F(IndexServerTest, FallsBackWhenServerHangs) {
+    IndexPtr Expected = MakeIndex();
+    ASSERT_NE(nullptr, Expected.get()) << E.Buffer;
+
+    FakeServer Server([](int Client, std::string const&) {
+        WaitForClose(Client);
+    });
+    ASSERT_TRUE(Server.Listening());
+    FFMS_SetIndexServer(SocketPath);
+
+    auto Start = std::chrono::steady_clock::now();
+    IndexPtr Index = MakeIndex();
+    double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    ExpectSameFrameCounts(Expected.get(), Index.get());
+
+    // Indexed here rather than fetched
+    FFMS_IndexingStats Stats;
+    ASSERT_EQ(0, FFMS_GetIndexingStats(Index.get(), -1, &Stats, &E));
+    EXPECT_GT(Stats.Packets, 0);
+    EXPECT_LT(Seconds, 10);
+}
+
+TEST_F(IndexServerTest, ServerProgressCanCancel) {
+    FakeServer Server([](int Client, std::string const&) {
+        const char Progress[] = "PROGRESS 25 100\n";
+        while (SendAll(Client, Progress, sizeof(Progress) - 1))
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    ASSERT_TRUE(Server.Listening());
+    FFMS_SetIndexServer(SocketPath);
+
+    struct Reported {
+        int64_t Current = -1;
+        int64_t Total = -1;
+    } Last;
+    FFMS_Indexer *Indexer = CreateIndexer();
+    ASSERT_NE(nullptr, Indexer) << E.Buffer;
+    FFMS_SetProgressCallback(Indexer, [](int64_t Current, int64_t Total, void *Private) -> int {
+        Reported *Last = static_cast<Reported *>(Private);
+        Last->Current = Current;
+        Last->Total = Total;
+        return 1;
+    }, &Last);
+
+    IndexPtr Index(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, &E), FFMS_DestroyIndex);
+    EXPECT_EQ(nullptr, Index.get());
+    EXPECT_EQ(FFMS_ERROR_CANCELLED, E.ErrorType);
+    EXPECT_EQ(25, Last.Current);
+    EXPECT_EQ(100, Last.Total);
+}
+
+TEST_F(IndexServerTest, FetchesIndexWithCallerSettings) {
+    IndexPtr Expected = MakeIndex();
+    ASSERT_NE(nullptr, Expected.get()) << E.Buffer;
+    uint8_t *Buffer = nullptr;
+    size_t Size = 0;
+    ASSERT_EQ(0, FFMS_WriteIndexToBuffer(&Buffer, &Size, Expected.get(), &E)) << E.Buffer;
+    std::vector<uint8_t> Data(Buffer, Buffer + Size);
+    FFMS_FreeIndexBuffer(&Buffer);
+
+    std::string Request;
+    FakeServer Server([&](int Client, std::string const& Line) {
+        Request = Line;
+        std::string Header = "PROGRESS 5 10\nOK " + std::to_string(Data.size()) + "\n";
+        SendAll(Client, Header.data(), Header.size());
+        SendAll(Client, Data.data(), Data.size());
+        WaitForClose(Client);
+    });
+    ASSERT_TRUE(Server.Listening());
+    FFMS_SetIndexServer(SocketPath);
+
+    // Every kind of track is asked for, but the server should only be asked
+    // for the ones which can be indexed
+    FFMS_Indexer *Indexer = FFMS_CreateIndexer(FilePath.c_str(), &E);
+    ASSERT_NE(nullptr, Indexer) << E.Buffer;
+    std::set<int> Indexable;
+    for (int t = 0; t < FFMS_GetNumTracksI(Indexer); t++) {
+        int Type = FFMS_GetTrackTypeI(Indexer, t);
+        if (Type == FFMS_TYPE_VIDEO || Type == FFMS_TYPE_AUDIO)
+            Indexable.insert(t);
+    }
+    for (int Type = FFMS_TYPE_VIDEO; Type <= FFMS_TYPE_ATTACHMENT; Type++)
+        FFMS_TrackTypeIndexSettings(Indexer, Type, 1, 0);
+    FFMS_SetIndexingThreads(Indexer, 3);
+    FFMS_SetIndexingReadAhead(Indexer, 1 << 20);
+    int64_t LastTotal = 0;
+    FFMS_SetProgressCallback(Indexer, [](int64_t, int64_t Total, void *Private) -> int {
+        *static_cast<int64_t *>(Private) = Total;
+        return 0;
+    }, &LastTotal);
+
+    IndexPtr Index(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, &E), FFMS_DestroyIndex);
+    ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    ExpectSameFrameCounts(Expected.get(), Index.get());
+    EXPECT_EQ(10, LastTotal);
+
+    FFMS_IndexingStats Stats;
+    ASSERT_EQ(0, FFMS_GetIndexingStats(Index.get(), -1, &Stats, &E));
+    EXPECT_EQ(0, Stats.Packets);
+    EXPECT_EQ(static_cast<int64_t>(Data.size()), Stats.BytesRead);
+    EXPECT_GT(Stats.TotalTime, 0);
+
+    Server.Wait();
+    std::istringstream Parser(Request);
+    std::string Magic, Command;
+    int ErrorHandling, Flags, Threads, NumTracks;
+    long long ReadAhead;
+    Parser >> Magic >> Command >> ErrorHandling >> Flags >> Threads >> ReadAhead >> NumTracks;
+    ASSERT_TRUE(!!Parser) << Request;
+    EXPECT_EQ("FFMS2", Magic);
+    EXPECT_EQ("INDEX", Command);
+    EXPECT_EQ(FFMS_IEH_ABORT, ErrorHandling);
+    EXPECT_EQ(3, Threads);
+    EXPECT_EQ(1 << 20, ReadAhead);
+    std::set<int> Tracks;
+    for (int i = 0; i < NumTracks; i++) {
+        int Track;
+        Parser >> Track;
+        Tracks.insert(Track);
+    }
+    EXPECT_EQ(Indexable, Tracks);
+}
+
+} // namespace
@@ -0,0 +1,245 @@
+// Checks that indexing a file in several byte ranges at once gives the same
+// index as reading it from start to end. Uses the indexer internals to force
+// the split on a small file, so it links against the static library.
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+}
+
+#include "indexing.h"
+#include "track.h"
+
+namespace {
+
+const int VideoFrames = 300;
+const int SampleRate = 48000;
+
+bool WritePackets(AVFormatContext *Output, AVCodecContext *Codec, AVStream *Stream) {
+    AVPacket Packet;
+    av_init_packet(&Packet);
+    Packet.data = nullptr;
+    Packet.size = 0;
+    while (avcodec_receive_packet(Codec, &Packet) == 0) {
+        av_packet_rescale_ts(&Packet, Codec->time_base, Stream->time_base);
+        Packet.stream_index = Stream->index;
+        if (av_interleaved_write_frame(Output, &Packet) < 0)
+            return false;
+    }
+    return true;
+}
+
+AVCodecContext *OpenEncoder(AVFormatContext *Output, AVCodecID ID, void (*Setup)(AVCodecContext *), AVStream **Stream) {
+    AVCodec *Codec = avcodec_find_encoder(ID);
+    if (!Codec)
+        return nullptr;
+    AVCodecContext *Context = avcodec_alloc_context3(Codec);
+    if (!Context)
+        return nullptr;
+    Setup(Context);
+    if (Output->oformat->flags & AVFMT_GLOBALHEADER)
+        Context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    *Stream = avformat_new_stream(Output, nullptr);
+    if (!*Stream || avcodec_open2(Context, Codec, nullptr) < 0 ||
+        avcodec_parameters_from_context((*Stream)->codecpar, Context) < 0) {
+        avcodec_free_context(&Context);
+        return nullptr;
+    }
+    (*Stream)->time_base = Context->time_base;
+    return Context;
+}
+
+// Twelve seconds of MPEG-2 video with a keyframe every twelve frames and
+// b-frames, and MP2 audio, in MPEG-TS: the kind of file parallel indexing is
+// meant for, with plenty of places to splice the ranges together
+bool WriteTestFile(std::string const& Path) {
+    AVFormatContext *Output = nullptr;
+    if (avformat_alloc_output_context2(&Output, nullptr, "mpegts", Path.c_str()) < 0)
+        return false;
+
+    AVStream *VideoStream = nullptr;
+    AVCodecContext *Video = OpenEncoder(Output, AV_CODEC_ID_MPEG2VIDEO, [](AVCodecContext *Context) {
+        Context->width = 320;
+        Context->height = 240;
+        Context->pix_fmt = AV_PIX_FMT_YUV420P;
+        Context->time_base = AVRational{ 1, 25 };
+        Context->gop_size = 12;
+        Context->max_b_frames = 2;
+        Context->bit_rate = 2000000;
+    }, &VideoStream);
+    AVStream *AudioStream = nullptr;
+    AVCodecContext *Audio = OpenEncoder(Output, AV_CODEC_ID_MP2, [](AVCodecContext *Context) {
+        Context->sample_fmt = AV_SAMPLE_FMT_S16;
+        Context->sample_rate = SampleRate;
+        Context->channel_layout = AV_CH_LAYOUT_STEREO;
+        Context->channels = 2;
+        Context->time_base = AVRational{ 1, SampleRate };
+        Context->bit_rate = 192000;
+    }, &AudioStream);
+
+    bool Success = Video && Audio &&
+        avio_open(&Output->pb, Path.c_str(), AVIO_FLAG_WRITE) >= 0 &&
+        avformat_write_header(Output, nullptr) >= 0;
+
+    AVFrame *Picture = av_frame_alloc();
+    AVFrame *Samples = av_frame_alloc();
+    if (Success) {
+        Picture->format = Video->pix_fmt;
+        Picture->width = Video->width;
+        Picture->height = Video->height;
+        Samples->format = Audio->sample_fmt;
+        Samples->channel_layout = Audio->channel_layout;
+        Samples->channels = Audio->channels;
+        Samples->sample_rate = Audio->sample_rate;
+        Samples->nb_samples = Audio->frame_size;
+        Success = av_frame_get_buffer(Picture, 0) >= 0 && av_frame_get_buffer(Samples, 0) >= 0;
+    }
+
+    int64_t SamplePos = 0;
+    uint32_t Noise = 1;
+    for (int n = 0; Success && n < VideoFrames; n++) {
+        // Moving gradients with some noise, so the frames aren't free to code
+        Success = av_frame_make_writable(Picture) >= 0;
+        for (int y = 0; Success && y < Picture->height; y++) {
+            for (int x = 0; x < Picture->width; x++) {
+                Noise = Noise * 1664525 + 1013904223;
+                Picture->data[0][y * Picture->linesize[0] + x] = static_cast<uint8_t>(x + y + n * 3 + (Noise >> 29));
+            }
+        }
+        for (int y = 0; Success && y < Picture->height / 2; y++) {
+            for (int x = 0; x < Picture->width / 2; x++) {
+                Picture->data[1][y * Picture->linesize[1] + x] = static_cast<uint8_t>(128 + y + n * 2);
+                Picture->data[2][y * Picture->linesize[2] + x] = static_cast<uint8_t>(64 + x + n * 5);
+            }
+        }
+        Picture->pts = n;
+        Success = Success && avcodec_send_frame(Video, Picture) >= 0 &&
+            WritePackets(Output, Video, VideoStream);
+
+        while (Success && SamplePos * 25 < (n + 1) * static_cast<int64_t>(SampleRate)) {
+            Success = av_frame_make_writable(Samples) >= 0;
+            int16_t *Data = reinterpret_cast<int16_t *>(Samples->data[0]);
+            for (int i = 0; Success && i < Samples->nb_samples; i++) {
+                int64_t Pos = SamplePos + i;
+                Data[i * 2] = static_cast<int16_t>((Pos % 200) * 100 - 10000);
+                Data[i * 2 + 1] = static_cast<int16_t>((Pos % 73) * 300 - 10000);
+            }
+            Samples->pts = SamplePos;
+            SamplePos += Samples->nb_samples;
+            Success = Success && avcodec_send_frame(Audio, Samples) >= 0 &&
+                WritePackets(Output, Audio, AudioStream);
+        }
+    }
+
+    Success = Success &&
+        avcodec_send_frame(Video, nullptr) >= 0 && WritePackets(Output, Video, VideoStream) &&
+        avcodec_send_frame(Audio, nullptr) >= 0 && WritePackets(Output, Audio, AudioStream) &&
+        av_write_trailer(Output) >= 0;
+
+    av_frame_free(&Picture);
+    av_frame_free(&Samples);
+    avcodec_free_context(&Video);
+    avcodec_free_context(&Audio);
+    if (Output->pb)
+        avio_closep(&Output->pb);
+    avformat_free_context(Output);
+    return Success;
+}
+
+void ExpectSameTrack(FFMS_Track const& Expected, FFMS_Track const& Actual, size_t TrackNumber) {
+    SCOPED_TRACE(TrackNumber);
+    EXPECT_EQ(Expected.TT, Actual.TT);
+    EXPECT_EQ(Expected.TB.Num, Actual.TB.Num);
+    EXPECT_EQ(Expected.TB.Den, Actual.TB.Den);
+    EXPECT_EQ(Expected.MaxBFrames, Actual.MaxBFrames);
+    EXPECT_EQ(Expected.UseDTS, Actual.UseDTS);
+    EXPECT_EQ(Expected.HasTS, Actual.HasTS);
+    EXPECT_EQ(Expected.LastDuration, Actual.LastDuration);
+    ASSERT_EQ(Expected.size(), Actual.size());
+
+    for (size_t i = 0; i < Expected.size(); i++) {
+        SCOPED_TRACE(i);
+        FrameInfo const& E = Expected[i];
+        FrameInfo const& A = Actual[i];
+        EXPECT_EQ(E.PTS, A.PTS);
+        EXPECT_EQ(E.OriginalPTS, A.OriginalPTS);
+        EXPECT_EQ(E.FilePos, A.FilePos);
+        EXPECT_EQ(E.SampleStart, A.SampleStart);
+        EXPECT_EQ(E.SampleCount, A.SampleCount);
+        EXPECT_EQ(E.OriginalPos, A.OriginalPos);
+        EXPECT_EQ(E.FrameType, A.FrameType);
+        EXPECT_EQ(E.RepeatPict, A.RepeatPict);
+        EXPECT_EQ(E.KeyFrame, A.KeyFrame);
+        EXPECT_EQ(E.Hidden, A.Hidden);
+        // Stop at the first mismatch rather than printing the rest of the track
+        if (::testing::Test::HasFailure())
+            return;
+    }
+}
+
+void ExpectSameIndex(FFMS_Index const& Expected, FFMS_Index const& Actual) {
+    ASSERT_EQ(Expected.size(), Actual.size());
+    for (size_t i = 0; i < Expected.size(); i++)
+        ExpectSameTrack(Expected[i], Actual[i], i);
+}
+
+class ParallelIndexingTest : public ::testing::Test {
+protected:
+    std::string FilePath = "parallelindexing.ts";
+    int64_t Filesize = 0;
+
+    void SetUp() override {
+        FFMS_Init(0, 0);
+        ASSERT_TRUE(WriteTestFile(FilePath));
+        std::ifstream File(FilePath, std::ios::binary | std::ios::ate);
+        Filesize = static_cast<int64_t>(File.tellg());
+        ASSERT_GT(Filesize, 0);
+    }
+
+    void TearDown() override {
+        std::remove(FilePath.c_str());
+    }
+
+    std::unique_ptr<FFMS_Index> MakeIndex(int Threads, int64_t MinRangeSize, int MaxSpliceCandidates) {
+        FFMS_Indexer Indexer(FilePath.c_str());
+        Indexer.SetIndexTrackType(FFMS_TYPE_AUDIO, true);
+        Indexer.SetErrorHandling(FFMS_IEH_ABORT);
+        Indexer.SetThreads(Threads);
+        Indexer.SetParallelLimits(MinRangeSize, MaxSpliceCandidates);
+        return std::unique_ptr<FFMS_Index>(Indexer.DoIndexing());
+    }
+};
+
+TEST_F(ParallelIndexingTest, MatchesSerialIndex) {
+    std::unique_ptr<FFMS_Index> Serial = MakeIndex(1, Filesize, 64);
+    ASSERT_TRUE(!!Serial);
+    EXPECT_EQ(0, Serial->Stats.ParallelRanges);
+
+    std::unique_ptr<FFMS_Index> Parallel = MakeIndex(4, Filesize / 4, 64);
+    ASSERT_TRUE(!!Parallel);
+    EXPECT_GT(Parallel->Stats.ParallelRanges, 1);
+    ExpectSameIndex(*Serial, *Parallel);
+}
+
+TEST_F(ParallelIndexingTest, FallsBackWhenRangesDontStitch) {
+    std::unique_ptr<FFMS_Index> Serial = MakeIndex(1, Filesize, 64);
+    ASSERT_TRUE(!!Serial);
+
+    // With no splice points to try no range can be joined to the one before
+    // it, so the file has to be indexed again from the start
+    std::unique_ptr<FFMS_Index> Fallback = MakeIndex(4, Filesize / 4, 0);
+    ASSERT_TRUE(!!Fallback);
+    EXPECT_EQ(0, Fallback->Stats.ParallelRanges);
+    ExpectSameIndex(*Serial, *Fallback);
+}
+
+} // namespace
@@ -0,0 +1,167 @@
+// Reads a made up input through the read-ahead reader and compares what
+// comes out with the input itself, across the boundaries of its buffers and
+// around seeks. The reader is internal, so this links against the static
+// library.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#include "input.h"
+#include "readahead.h"
+#include "utils.h"
+
+namespace {
+
+const size_t BlockSize = 64 * 1024;
+
+// Bytes which don't repeat, so that data from the wrong place doesn't happen
+// to match
+class PatternInput : public InputSource {
+    int64_t Length;
+
+public:
+    // Reading this byte fails
+    int64_t FailAt = -1;
+    // Reads which didn't start on a page boundary or didn't go to a buffer
+    // which does
+    std::atomic<int> Misaligned{ 0 };
+
+    explicit PatternInput(int64_t Length) : Length(Length) {}
+
+    static uint8_t Byte(int64_t Offset) {
+        return static_cast<uint8_t>((static_cast<uint64_t>(Offset) * 0x9E3779B97F4A7C15ULL) >> 56);
+    }
+
+    size_t Read(int64_t Offset, uint8_t *Buffer, size_t Size) override {
+        if (Offset % 4096 || reinterpret_cast<uintptr_t>(Buffer) % 4096)
+            Misaligned++;
+        if (FailAt >= Offset && FailAt < Offset + static_cast<int64_t>(Size))
+            throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Made up read error");
+        size_t Count = static_cast<size_t>(std::max<int64_t>(0, std::min<int64_t>(Size, Length - Offset)));
+        for (size_t i = 0; i < Count; i++)
+            Buffer[i] = Byte(Offset + i);
+        return Count;
+    }
+
+    int64_t Size() override { return Length; }
+};
+
+class ReadAheadTest : public ::testing::Test {
+protected:
+    // A few blocks and a bit, so that the last one is short
+    const int64_t Length = 10 * BlockSize + 12345;
+    std::shared_ptr<PatternInput> Input = std::make_shared<PatternInput>(Length);
+    std::mt19937 Random{ 1 };
+
+    // Reads Size bytes from Offset, or up to the end, and checks them
+    void ExpectRead(ReadAheadReader &Reader, int64_t Offset, int Size) {
+        std::stringstream ss;
+        ss << "Reading " << Size << " bytes at " << Offset;
+        SCOPED_TRACE(ss.str());
+
+        AVIOContext *IO = Reader.GetAVIOContext();
+        ASSERT_EQ(Offset, avio_seek(IO, Offset, SEEK_SET));
+        std::vector<uint8_t> Buffer(Size);
+        int Expected = static_cast<int>(std::min<int64_t>(Size, Length - Offset));
+        int Count = Expected > 0 ? avio_read(IO, Buffer.data(), Size) : 0;
+        ASSERT_EQ(Expected, Count);
+        for (int i = 0; i < Count; i++) {
+            if (Buffer[i] != PatternInput::Byte(Offset + i)) {
+                ADD_FAILURE() << "Wrong byte at " << Offset + i;
+                return;
+            }
+        }
+    }
+};
+
+TEST_F(ReadAheadTest, SequentialReadMatchesInput) {
+    ReadAheadReader Reader(Input, BlockSize);
+    AVIOContext *IO = Reader.GetAVIOContext();
+    EXPECT_EQ(Length, avio_size(IO));
+
+    // Pieces of all sizes, some larger than a block, so that they end at
+    // every position within the blocks
+    std::vector<uint8_t> Buffer(3 * BlockSize);
+    int64_t Offset = 0;
+    while (Offset < Length) {
+        int Size = std::uniform_int_distribution<int>(1, static_cast<int>(Buffer.size()))(Random);
+        int Count = avio_read(IO, Buffer.data(), Size);
+        ASSERT_EQ(std::min<int64_t>(Size, Length - Offset), Count) << "At " << Offset;
+        for (int i = 0; i < Count; i++)
+            ASSERT_EQ(PatternInput::Byte(Offset + i), Buffer[i]) << "At " << Offset + i;
+        Offset += Count;
+    }
+    EXPECT_EQ(AVERROR_EOF, avio_read(IO, Buffer.data(), 1));
+
+    // Every byte was read from the input exactly once
+    EXPECT_EQ(Length, Reader.GetBytesRead());
+    EXPECT_EQ(0, Input->Misaligned);
+}
+
+TEST_F(ReadAheadTest, SeeksMatchInput) {
+    ReadAheadReader Reader(Input, BlockSize);
+    const int64_t Block = BlockSize;
+
+    // Across a block boundary, forward into data which hasn't been read yet,
+    // back into data which has been thrown away, within the current block,
+    // to an odd place for the refill to align, and over the end
+    ExpectRead(Reader, 0, 100);
+    ExpectRead(Reader, Block - 10, 20);
+    ExpectRead(Reader, 7 * Block + 3, 1000);
+    ExpectRead(Reader, 1000, 5000);
+    ExpectRead(Reader, 3000, 100);
+    ExpectRead(Reader, 5 * Block + 4095, 2 * Block);
+    ExpectRead(Reader, Length - 5, 100);
+    ExpectRead(Reader, Length, 100);
+
+    // And everything mixed up, with both small and large reads
+    for (int i = 0; i < 300; i++) {
+        int64_t Offset = std::uniform_int_distribution<int64_t>(0, Length)(Random);
+        int Size = std::uniform_int_distribution<int>(1, i % 2 ? 2 * Block : 200)(Random);
+        ExpectRead(Reader, Offset, Size);
+        if (HasFatalFailure())
+            return;
+    }
+    EXPECT_EQ(0, Input->Misaligned);
+}
+
+TEST_F(ReadAheadTest, BlockSizeChangesStayAligned) {
+    ReadAheadReader Reader(Input, BlockSize + 1000);
+    ExpectRead(Reader, 0, static_cast<int>(Length / 2));
+    Reader.SetBlockSize(BlockSize * 2 + 1);
+    ExpectRead(Reader, Length / 2, static_cast<int>(Length));
+    EXPECT_EQ(0, Input->Misaligned);
+}
+
+TEST_F(ReadAheadTest, ReadErrorsReachTheReader) {
+    Input->FailAt = 4 * BlockSize + 100;
+    ReadAheadReader Reader(Input, BlockSize);
+    AVIOContext *IO = Reader.GetAVIOContext();
+
+    // Everything before the failed block arrives intact, and then the
+    // error does
+    std::vector<uint8_t> Buffer(10000);
+    int64_t Offset = 0;
+    int Count;
+    while ((Count = avio_read(IO, Buffer.data(), static_cast<int>(Buffer.size()))) > 0) {
+        for (int i = 0; i < Count; i++)
+            ASSERT_EQ(PatternInput::Byte(Offset + i), Buffer[i]) << "At " << Offset + i;
+        Offset += Count;
+    }
+    EXPECT_EQ(AVERROR(EIO), Count);
+    EXPECT_LE(Offset, Input->FailAt);
+}
+
+} // namespace
@@ -0,0 +1,202 @@
+// Checks the sample format conversions of SampleConverter against
+// swresample doing the same. The converters aren't exported, so this links
+// against the static library.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+#include "sampleconvert.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+namespace {
+
+// Audio is converted in blocks of about the size of a decoded packet, as it
+// is on the way out of the audio cache, and then an odd sized one so that
+// the vectorized loops leave something over
+const int BlockSamples = 1024;
+const int64_t Samples = 4 * BlockSamples + 13;
+
+struct Planes {
+    std::vector<uint8_t> Data;
+    std::vector<uint8_t *> Pointers;
+    size_t SampleBytes;
+
+    Planes(AVSampleFormat Format, int Channels, int64_t Samples) {
+        const size_t Bytes = static_cast<size_t>(Samples * Channels * av_get_bytes_per_sample(Format));
+        Data.resize(Bytes);
+        const bool Planar = !!av_sample_fmt_is_planar(Format);
+        for (int c = 0; c < (Planar ? Channels : 1); c++)
+            Pointers.push_back(Data.data() + c * (Bytes / Channels));
+        SampleBytes = av_get_bytes_per_sample(Format) * (Planar ? 1 : Channels);
+    }
+
+    // Pointers to sample Offset of each plane
+    std::vector<uint8_t *> At(int64_t Offset) const {
+        std::vector<uint8_t *> Ret = Pointers;
+        for (auto &p : Ret)
+            p += Offset * SampleBytes;
+        return Ret;
+    }
+};
+
+// Random audio, with floats going somewhat past full scale and now and then
+// well past it
+Planes MakeInput(AVSampleFormat Format, int Channels) {
+    Planes In(Format, Channels, Samples);
+    std::mt19937 Random(Channels);
+    if (av_get_packed_sample_fmt(Format) == AV_SAMPLE_FMT_FLT) {
+        std::uniform_real_distribution<float> Dist(-1.1f, 1.1f);
+        float *Values = reinterpret_cast<float *>(In.Data.data());
+        for (size_t i = 0; i < In.Data.size() / sizeof(float); i++)
+            Values[i] = Random() % 64 ? Dist(Random) : Dist(Random) * 10.f;
+    } else {
+        for (size_t i = 0; i < In.Data.size(); i++)
+            In.Data[i] = static_cast<uint8_t>(Random());
+    }
+    return In;
+}
+
+template<typename Func>
+Planes ConvertInBlocks(Planes const& In, AVSampleFormat To, int Channels, Func Convert) {
+    Planes Out(To, Channels, Samples);
+    for (int64_t i = 0; i < Samples; i += BlockSamples) {
+        const int Count = static_cast<int>(std::min<int64_t>(BlockSamples, Samples - i));
+        std::vector<uint8_t *> Src = In.At(i);
+        std::vector<uint8_t *> Dst = Out.At(i);
+        Convert(Dst.data(), const_cast<const uint8_t **>(Src.data()), Count);
+    }
+    return Out;
+}
+
+Planes ConvertWithSwresample(Planes const& In, AVSampleFormat From, AVSampleFormat To, int Channels, int Dither) {
+    SwrContext *Swr = swr_alloc();
+    const int64_t Layout = av_get_default_channel_layout(Channels);
+    av_opt_set_int(Swr, "in_channel_layout", Layout, 0);
+    av_opt_set_int(Swr, "out_channel_layout", Layout, 0);
+    av_opt_set_int(Swr, "in_sample_rate", 48000, 0);
+    av_opt_set_int(Swr, "out_sample_rate", 48000, 0);
+    av_opt_set_sample_fmt(Swr, "in_sample_fmt", From, 0);
+    av_opt_set_sample_fmt(Swr, "out_sample_fmt", To, 0);
+    av_opt_set_int(Swr, "dither_method", Dither, 0);
+    EXPECT_EQ(0, swr_init(Swr));
+    Planes Out = ConvertInBlocks(In, To, Channels, [&](uint8_t **Dst, const uint8_t **Src, int Count) {
+        swr_convert(Swr, Dst, Count, Src, Count);
+    });
+    swr_free(&Swr);
+    return Out;
+}
+
+Planes ConvertWithConverter(Planes const& In, AVSampleFormat From, AVSampleFormat To, int Channels, int Dither) {
+    std::unique_ptr<SampleConverter> Converter = SampleConverter::Create(From, To, Channels, Dither);
+    EXPECT_NE(nullptr, Converter.get());
+    if (!Converter)
+        return Planes(To, Channels, 0);
+    return ConvertInBlocks(In, To, Channels, [&](uint8_t **Dst, const uint8_t **Src, int Count) {
+        Converter->Convert(Dst, Src, Count);
+    });
+}
+
+TEST(SampleConverterTest, UnditheredMatchesSwresample) {
+    const AVSampleFormat Conversions[][2] = {
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16 },
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16P },
+        { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16 },
+        { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16P },
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT },
+        { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP },
+        { AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16 },
+        { AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S16 },
+        { AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16 },
+    };
+    for (auto const& Conversion : Conversions) {
+        for (int Channels : { 1, 2, 6 }) {
+            std::stringstream ss;
+            ss << av_get_sample_fmt_name(Conversion[0]) << " -> " << av_get_sample_fmt_name(Conversion[1]) << ", " << Channels << " channels";
+            SCOPED_TRACE(ss.str());
+
+            Planes In = MakeInput(Conversion[0], Channels);
+            Planes Expected = ConvertWithSwresample(In, Conversion[0], Conversion[1], Channels, FFMS_RESAMPLE_DITHER_NONE);
+            Planes Actual = ConvertWithConverter(In, Conversion[0], Conversion[1], Channels, FFMS_RESAMPLE_DITHER_NONE);
+            EXPECT_TRUE(Expected.Data == Actual.Data);
+        }
+    }
+}
+
+TEST(SampleConverterTest, DitheredStaysNearSwresample) {
+    for (int Channels : { 1, 2, 6 }) {
+        std::stringstream ss;
+        ss << Channels << " channels";
+        SCOPED_TRACE(ss.str());
+
+        Planes In = MakeInput(AV_SAMPLE_FMT_FLTP, Channels);
+        Planes Expected = ConvertWithSwresample(In, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, Channels, FFMS_RESAMPLE_DITHER_TRIANGULAR);
+        Planes Actual = ConvertWithConverter(In, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, Channels, FFMS_RESAMPLE_DITHER_TRIANGULAR);
+        ASSERT_EQ(Expected.Data.size(), Actual.Data.size());
+        const int16_t *A = reinterpret_cast<const int16_t *>(Expected.Data.data());
+        const int16_t *B = reinterpret_cast<const int16_t *>(Actual.Data.data());
+        int Furthest = 0;
+        for (size_t i = 0; i < Expected.Data.size() / sizeof(int16_t); i++)
+            Furthest = std::max(Furthest, std::abs(A[i] - B[i]));
+        EXPECT_LE(Furthest, 3);
+    }
+}
+
+// Floats too large for a 32 bit integer, which swresample doesn't get
+// right either
+TEST(SampleConverterTest, HugeFloatsClip) {
+    const float Huge[] = {
+        1e10f, -1e10f, std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+        std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), 65536.f, -65536.f,
+    };
+    const int Count = 8 * 3 + 5;
+    std::vector<float> Left(Count), Right(Count);
+    for (int i = 0; i < Count; i++) {
+        Left[i] = Huge[i % 8];
+        Right[i] = Huge[(i + 1) % 8];
+    }
+    auto Expected = [](float Value) -> int16_t { return Value > 0 ? 32767 : -32768; };
+
+    for (int Dither : { FFMS_RESAMPLE_DITHER_NONE, FFMS_RESAMPLE_DITHER_TRIANGULAR }) {
+        std::stringstream ss;
+        ss << "Dither: " << Dither;
+        SCOPED_TRACE(ss.str());
+
+        // Through the stereo kernel
+        std::unique_ptr<SampleConverter> Stereo = SampleConverter::Create(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, 2, Dither);
+        ASSERT_NE(nullptr, Stereo.get());
+        std::vector<int16_t> Interleaved(2 * Count);
+        const uint8_t *Src[] = { reinterpret_cast<const uint8_t *>(Left.data()), reinterpret_cast<const uint8_t *>(Right.data()) };
+        uint8_t *Dst[] = { reinterpret_cast<uint8_t *>(Interleaved.data()) };
+        Stereo->Convert(Dst, Src, Count);
+        for (int i = 0; i < Count; i++) {
+            EXPECT_EQ(Expected(Left[i]), Interleaved[2 * i]) << "Sample: " << i;
+            EXPECT_EQ(Expected(Right[i]), Interleaved[2 * i + 1]) << "Sample: " << i;
+        }
+
+        // and through the single plane one
+        std::unique_ptr<SampleConverter> Mono = SampleConverter::Create(AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, 1, Dither);
+        ASSERT_NE(nullptr, Mono.get());
+        std::vector<int16_t> Out(Count);
+        Src[0] = reinterpret_cast<const uint8_t *>(Left.data());
+        Dst[0] = reinterpret_cast<uint8_t *>(Out.data());
+        Mono->Convert(Dst, Src, Count);
+        for (int i = 0; i < Count; i++)
+            EXPECT_EQ(Expected(Left[i]), Out[i]) << "Sample: " << i;
+    }
+}
+
+} // namespace
@@ -0,0 +1,132 @@
+// Times the sample format conversions of SampleConverter against
+// swresample doing the same. That the results match is checked by the
+// sampleconvert test. Links against the static library, since the
+// converters aren't exported.
+//
+// Usage: sampleconvert_bench [samples]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "sampleconvert.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+namespace {
+
+template<typename Func>
+double Time(Func f) {
+    auto Start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+// Audio is converted in blocks of about the size of a decoded packet, as
+// it is on the way out of the audio cache
+const int BlockSamples = 1024;
+
+struct Planes {
+    std::vector<uint8_t> Data;
+    std::vector<uint8_t *> Pointers;
+
+    Planes(AVSampleFormat Format, int Channels, int64_t Samples) {
+        const size_t Bytes = static_cast<size_t>(Samples * Channels * av_get_bytes_per_sample(Format));
+        Data.resize(Bytes);
+        const bool Planar = !!av_sample_fmt_is_planar(Format);
+        for (int c = 0; c < (Planar ? Channels : 1); c++)
+            Pointers.push_back(Data.data() + c * (Bytes / Channels));
+    }
+
+    // Pointers to sample Offset of each plane
+    std::vector<uint8_t *> At(int64_t Offset, size_t SampleBytes) const {
+        std::vector<uint8_t *> Ret = Pointers;
+        for (auto &p : Ret)
+            p += Offset * SampleBytes;
+        return Ret;
+    }
+};
+
+void Bench(AVSampleFormat From, AVSampleFormat To, int Channels, int Dither, int64_t Samples) {
+    Planes In(From, Channels, Samples);
+    std::mt19937 Random(Channels);
+    if (av_get_packed_sample_fmt(From) == AV_SAMPLE_FMT_FLT) {
+        std::uniform_real_distribution<float> Dist(-1.1f, 1.1f);
+        for (size_t i = 0; i < In.Data.size() / sizeof(float); i++)
+            reinterpret_cast<float *>(In.Data.data())[i] = Dist(Random);
+    } else {
+        for (size_t i = 0; i < In.Data.size(); i++)
+            In.Data[i] = static_cast<uint8_t>(Random());
+    }
+
+    const size_t InBytes = av_get_bytes_per_sample(From) * (av_sample_fmt_is_planar(From) ? 1 : Channels);
+    const size_t OutBytes = av_get_bytes_per_sample(To) * (av_sample_fmt_is_planar(To) ? 1 : Channels);
+
+    SwrContext *Swr = swr_alloc();
+    const int64_t Layout = av_get_default_channel_layout(Channels);
+    av_opt_set_int(Swr, "in_channel_layout", Layout, 0);
+    av_opt_set_int(Swr, "out_channel_layout", Layout, 0);
+    av_opt_set_int(Swr, "in_sample_rate", 48000, 0);
+    av_opt_set_int(Swr, "out_sample_rate", 48000, 0);
+    av_opt_set_sample_fmt(Swr, "in_sample_fmt", From, 0);
+    av_opt_set_sample_fmt(Swr, "out_sample_fmt", To, 0);
+    av_opt_set_int(Swr, "dither_method", Dither, 0);
+    av_opt_set_int(Swr, "force_resampling", 0, 0);
+    if (swr_init(Swr)) {
+        fprintf(stderr, "Could not open swresample context\n");
+        return;
+    }
+
+    Planes SwrOut(To, Channels, Samples);
+    double SwrSeconds = Time([&] {
+        for (int64_t i = 0; i < Samples; i += BlockSamples) {
+            const int Count = static_cast<int>(std::min<int64_t>(BlockSamples, Samples - i));
+            std::vector<uint8_t *> Src = In.At(i, InBytes);
+            std::vector<uint8_t *> Dst = SwrOut.At(i, OutBytes);
+            swr_convert(Swr, Dst.data(), Count, const_cast<const uint8_t **>(Src.data()), Count);
+        }
+    });
+    swr_free(&Swr);
+
+    auto Converter = SampleConverter::Create(From, To, Channels, Dither);
+    Planes Out(To, Channels, Samples);
+    double Seconds = Time([&] {
+        for (int64_t i = 0; i < Samples; i += BlockSamples) {
+            const int Count = static_cast<int>(std::min<int64_t>(BlockSamples, Samples - i));
+            std::vector<uint8_t *> Src = In.At(i, InBytes);
+            std::vector<uint8_t *> Dst = Out.At(i, OutBytes);
+            Converter->Convert(Dst.data(), const_cast<const uint8_t **>(Src.data()), Count);
+        }
+    });
+
+    printf("%s -> %s, %d channels, dither %d: %.3f s, swresample %.3f s (%.1fx)\n",
+        av_get_sample_fmt_name(From), av_get_sample_fmt_name(To), Channels, Dither,
+        Seconds, SwrSeconds, SwrSeconds / Seconds);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    int64_t Samples = argc > 1 ? strtoll(argv[1], nullptr, 10) : 48000 * 600;
+    if (Samples < 1) {
+        fprintf(stderr, "Usage: sampleconvert_bench [samples]\n");
+        return 1;
+    }
+
+    for (int Channels : { 2, 6 }) {
+        Bench(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, Channels, 0, Samples);
+        Bench(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, Channels, 2, Samples);
+        Bench(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT, Channels, 0, Samples);
+        Bench(AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16, Channels, 0, Samples);
+        Bench(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16P, Channels, 0, Samples);
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+// Plays test.mp4 back to back with itself as a segmented file and compares
+// it with the single file. Uses the library internals to give segments
+// mismatching properties, so it links against the static library.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ffms.h>
+#include <gtest/gtest.h>
+
+#include "indexing.h"
+#include "segments.h"
+#include "tests.h"
+#include "utils.h"
+
+namespace {
+
+typedef std::unique_ptr<FFMS_Index, decltype(&FFMS_DestroyIndex)> IndexPtr;
+typedef std::unique_ptr<FFMS_SegmentedIndex, decltype(&FFMS_DestroySegmentedIndex)> SegmentedIndexPtr;
+typedef std::unique_ptr<FFMS_VideoSource, decltype(&FFMS_DestroyVideoSource)> VideoPtr;
+typedef std::unique_ptr<FFMS_AudioSource, decltype(&FFMS_DestroyAudioSource)> AudioPtr;
+
+// Bytes per sample of all channels together
+size_t SampleBytes(const FFMS_AudioProperties *AP) {
+    static const size_t Sizes[] = { 1, 2, 4, 4, 8 };
+    return Sizes[AP->SampleFormat] * AP->Channels;
+}
+
+// The visible part of the first plane, which is enough to tell frames apart
+std::vector<uint8_t> FirstPlane(const FFMS_Frame *Frame) {
+    std::vector<uint8_t> Result;
+    if (!Frame)
+        return Result;
+    for (int y = 0; y < Frame->EncodedHeight; y++) {
+        const uint8_t *Row = Frame->Data[0] + y * Frame->Linesize[0];
+        Result.insert(Result.end(), Row, Row + Frame->EncodedWidth);
+    }
+    return Result;
+}
+
+class SegmentsTest : public ::testing::Test {
+protected:
+    std::string FilePath;
+    FFMS_ErrorInfo E;
+    char ErrorMsg[1024];
+    IndexPtr Index{ nullptr, FFMS_DestroyIndex };
+
+    void SetUp() override {
+        FFMS_Init(0, 0);
+        FilePath = std::string(STRINGIFY(SAMPLES_DIR)) + "/test.mp4";
+        E.Buffer = ErrorMsg;
+        E.BufferSize = sizeof(ErrorMsg);
+
+        FFMS_Indexer *Indexer = FFMS_CreateIndexer(FilePath.c_str(), &E);
+        ASSERT_NE(nullptr, Indexer) << E.Buffer;
+        FFMS_TrackTypeIndexSettings(Indexer, FFMS_TYPE_AUDIO, 1, 0);
+        Index.reset(FFMS_DoIndexing2(Indexer, FFMS_IEH_ABORT, &E));
+        ASSERT_NE(nullptr, Index.get()) << E.Buffer;
+    }
+
+    void TearDown() override {
+        Index.reset();
+        FFMS_Deinit();
+    }
+
+    // An independent copy of the index, which can be changed freely
+    IndexPtr CopyIndex() {
+        uint8_t *Buffer = nullptr;
+        size_t Size = 0;
+        if (FFMS_WriteIndexToBuffer(&Buffer, &Size, Index.get(), &E))
+            return IndexPtr(nullptr, FFMS_DestroyIndex);
+        IndexPtr Copy(FFMS_ReadIndexFromBuffer(Buffer, Size, &E), FFMS_DestroyIndex);
+        FFMS_FreeIndexBuffer(&Buffer);
+        return Copy;
+    }
+
+    // The file played twice in a row
+    SegmentedIndexPtr Twice(FFMS_Index *Second) {
+        const char *Files[] = { FilePath.c_str(), FilePath.c_str() };
+        FFMS_Index *Indexes[] = { Index.get(), Second };
+        return SegmentedIndexPtr(FFMS_CreateSegmentedIndex(Files, Indexes, 2, &E), FFMS_DestroySegmentedIndex);
+    }
+};
+
+TEST_F(SegmentsTest, FramesAcrossBoundaryMatchSingleFile) {
+    int Track = FFMS_GetFirstIndexedTrackOfType(Index.get(), FFMS_TYPE_VIDEO, &E);
+    ASSERT_GE(Track, 0) << E.Buffer;
+    SegmentedIndexPtr Segmented = Twice(Index.get());
+    ASSERT_NE(nullptr, Segmented.get()) << E.Buffer;
+
+    VideoPtr Single(FFMS_CreateVideoSource(FilePath.c_str(), Track, Index.get(), 1, FFMS_SEEK_NORMAL, &E), FFMS_DestroyVideoSource);
+    ASSERT_NE(nullptr, Single.get()) << E.Buffer;
+    // Only one segment open at a time, so every switch reopens a segment
+    VideoPtr Joined(FFMS_CreateSegmentedVideoSource(Segmented.get(), Track, 1, FFMS_SEEK_NORMAL, 1, &E), FFMS_DestroyVideoSource);
+    ASSERT_NE(nullptr, Joined.get()) << E.Buffer;
+
+    const int Frames = FFMS_GetVideoProperties(Single.get())->NumFrames;
+    ASSERT_GT(Frames, 2);
+    ASSERT_EQ(2 * Frames, FFMS_GetVideoProperties(Joined.get())->NumFrames);
+
+    // Timestamps go on rising across the boundary
+    FFMS_Track *JoinedTrack = FFMS_GetTrackFromSegmentedIndex(Segmented.get(), Track);
+    EXPECT_LT(FFMS_GetFrameInfo(JoinedTrack, Frames - 1)->PTS, FFMS_GetFrameInfo(JoinedTrack, Frames)->PTS);
+
+    // Back and forth over the boundary
+    for (int n : { Frames - 2, Frames - 1, Frames, Frames + 1, Frames - 1, Frames, 0, 2 * Frames - 1 }) {
+        std::stringstream ss;
+        ss << "Frame: " << n;
+        SCOPED_TRACE(ss.str());
+        std::vector<uint8_t> Expected = FirstPlane(FFMS_GetFrame(Single.get(), n % Frames, &E));
+        ASSERT_FALSE(Expected.empty()) << E.Buffer;
+        std::vector<uint8_t> Actual = FirstPlane(FFMS_GetFrame(Joined.get(), n, &E));
+        ASSERT_FALSE(Actual.empty()) << E.Buffer;
+        EXPECT_TRUE(Expected == Actual);
+    }
+}
+
+TEST_F(SegmentsTest, SamplesAcrossBoundaryMatchSingleFile) {
+    int Track = FFMS_GetFirstIndexedTrackOfType(Index.get(), FFMS_TYPE_AUDIO, &E);
+    ASSERT_GE(Track, 0) << E.Buffer;
+    SegmentedIndexPtr Segmented = Twice(Index.get());
+    ASSERT_NE(nullptr, Segmented.get()) << E.Buffer;
+
+    AudioPtr Single(FFMS_CreateAudioSource(FilePath.c_str(), Track, Index.get(), FFMS_DELAY_NO_SHIFT, &E), FFMS_DestroyAudioSource);
+    ASSERT_NE(nullptr, Single.get()) << E.Buffer;
+    AudioPtr Joined(FFMS_CreateSegmentedAudioSource(Segmented.get(), Track, FFMS_DELAY_NO_SHIFT, 1, &E), FFMS_DestroyAudioSource);
+    ASSERT_NE(nullptr, Joined.get()) << E.Buffer;
+
+    const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(Single.get());
+    const int64_t Samples = AP->NumSamples;
+    const size_t Bytes = SampleBytes(AP);
+    ASSERT_EQ(2 * Samples, FFMS_GetAudioProperties(Joined.get())->NumSamples);
+    std::vector<uint8_t> Expected(static_cast<size_t>(Samples) * Bytes);
+    ASSERT_EQ(0, FFMS_GetAudio(Single.get(), Expected.data(), 0, Samples, &E)) << E.Buffer;
+
+    // Reads which end exactly at the boundary, start exactly at it, span
+    // it, and cover both segments whole
+    const int64_t Span = std::min<int64_t>(Samples, 5000);
+    const int64_t Reads[][2] = {
+        { Samples - Span, Span },
+        { Samples, Span },
+        { Samples - Span / 2, Span },
+        { 0, 2 * Samples },
+    };
+    for (auto const& Read : Reads) {
+        std::stringstream ss;
+        ss << "Samples: " << Read[0] << "+" << Read[1];
+        SCOPED_TRACE(ss.str());
+        std::vector<uint8_t> Actual(static_cast<size_t>(Read[1]) * Bytes);
+        ASSERT_EQ(0, FFMS_GetAudio(Joined.get(), Actual.data(), Read[0], Read[1], &E)) << E.Buffer;
+        int64_t Pos = Read[0];
+        size_t Offset = 0;
+        while (Pos < Read[0] + Read[1]) {
+            int64_t InSegment = Pos % Samples;
+            int64_t Count = std::min(Samples - InSegment, Read[0] + Read[1] - Pos);
+            EXPECT_EQ(0, memcmp(&Actual[Offset], &Expected[InSegment * Bytes], Count * Bytes)) << "From sample: " << Pos;
+            Pos += Count;
+            Offset += Count * Bytes;
+        }
+    }
+}
+
+// Counts how many of it exist
+struct CountedSource {
+    static int Live;
+    CountedSource() { Live++; }
+    ~CountedSource() { Live--; }
+};
+int CountedSource::Live = 0;
+
+TEST(SegmentSourcesTest, KeepsOnlyMostRecentlyUsed) {
+    {
+        SegmentSources<CountedSource> Sources(2);
+        Sources.Add(0, make_unique<CountedSource>());
+        Sources.Add(1, make_unique<CountedSource>());
+        EXPECT_EQ(2, CountedSource::Live);
+
+        // Using 0 makes 1 the one to go when 2 is opened
+        EXPECT_NE(nullptr, Sources.Find(0));
+        Sources.Add(2, make_unique<CountedSource>());
+        EXPECT_EQ(2, CountedSource::Live);
+        EXPECT_NE(nullptr, Sources.Find(0));
+        EXPECT_NE(nullptr, Sources.Find(2));
+        EXPECT_EQ(nullptr, Sources.Find(1));
+
+        int Visited = 0;
+        Sources.ForEach([&](CountedSource &) { Visited++; });
+        EXPECT_EQ(2, Visited);
+    }
+    EXPECT_EQ(0, CountedSource::Live);
+
+    // Limits below one still keep the source in use
+    SegmentSources<CountedSource> Single(0);
+    Single.Add(0, make_unique<CountedSource>());
+    Single.Add(1, make_unique<CountedSource>());
+    EXPECT_EQ(1, CountedSource::Live);
+    EXPECT_NE(nullptr, Single.Find(1));
+}
+
+TEST_F(SegmentsTest, MismatchedSegmentsAreRejected) {
+    int Audio = FFMS_GetFirstIndexedTrackOfType(Index.get(), FFMS_TYPE_AUDIO, &E);
+    ASSERT_GE(Audio, 0) << E.Buffer;
+
+    // Another track layout
+    IndexPtr Other = CopyIndex();
+    ASSERT_NE(nullptr, Other.get()) << E.Buffer;
+    (*Other)[Audio].TT = FFMS_TYPE_DATA;
+    EXPECT_EQ(nullptr, Twice(Other.get()).get());
+    EXPECT_EQ(FFMS_ERROR_INVALID_ARGUMENT, E.SubType);
+
+    // Another time base
+    Other = CopyIndex();
+    ASSERT_NE(nullptr, Other.get()) << E.Buffer;
+    (*Other)[Audio].TB.Den *= 2;
+    EXPECT_EQ(nullptr, Twice(Other.get()).get());
+    EXPECT_EQ(FFMS_ERROR_UNSUPPORTED, E.SubType);
+
+    // Another sample rate, which the index can be joined with but which
+    // can't be played back
+    Other = CopyIndex();
+    ASSERT_NE(nullptr, Other.get()) << E.Buffer;
+    (*Other)[Audio].CodecSampleRate /= 2;
+    SegmentedIndexPtr Segmented = Twice(Other.get());
+    ASSERT_NE(nullptr, Segmented.get()) << E.Buffer;
+    AudioPtr Source(FFMS_CreateSegmentedAudioSource(Segmented.get(), Audio, FFMS_DELAY_NO_SHIFT, 2, &E), FFMS_DestroyAudioSource);
+    EXPECT_EQ(nullptr, Source.get());
+    EXPECT_EQ(FFMS_ERROR_UNSUPPORTED, E.SubType);
+}
+
+} // namespace
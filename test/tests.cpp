@@ -1,3 +1,4 @@
+#include <cctype>
 #include <string>
 #include <cstring>
 
@@ -48,3 +49,142 @@ bool CheckFrame(const FFMS_Frame *Frame, const FFMS_FrameInfo *info, const TestF
 
     return ok;
 }
+
+namespace {
+class JSONChecker {
+    const char *Pos;
+    const char *End;
+
+    bool At(char c) const {
+        return Pos < End && *Pos == c;
+    }
+
+    void SkipSpace() {
+        while (Pos < End && (*Pos == ' ' || *Pos == '\t' || *Pos == '\r' || *Pos == '\n'))
+            Pos++;
+    }
+
+    bool Digits() {
+        const char *Start = Pos;
+        while (Pos < End && *Pos >= '0' && *Pos <= '9')
+            Pos++;
+        return Pos > Start;
+    }
+
+    bool Literal(const char *Word) {
+        size_t Length = strlen(Word);
+        if (static_cast<size_t>(End - Pos) < Length || strncmp(Pos, Word, Length))
+            return false;
+        Pos += Length;
+        return true;
+    }
+
+    bool String() {
+        if (!At('"'))
+            return false;
+        for (Pos++; Pos < End; Pos++) {
+            unsigned char c = *Pos;
+            if (c == '"') {
+                Pos++;
+                return true;
+            }
+            if (c < 0x20)
+                return false;
+            if (c != '\\')
+                continue;
+            if (++Pos == End)
+                return false;
+            if (*Pos == 'u') {
+                for (int i = 0; i < 4; i++) {
+                    if (++Pos == End || !isxdigit(static_cast<unsigned char>(*Pos)))
+                        return false;
+                }
+            } else if (!strchr("\"\\/bfnrt", *Pos)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool Number() {
+        if (At('-'))
+            Pos++;
+        if (At('0'))
+            Pos++;
+        else if (!Digits())
+            return false;
+        if (At('.')) {
+            Pos++;
+            if (!Digits())
+                return false;
+        }
+        if (At('e') || At('E')) {
+            Pos++;
+            if (At('+') || At('-'))
+                Pos++;
+            if (!Digits())
+                return false;
+        }
+        return true;
+    }
+
+    // Members of an object or elements of an array, up to Close
+    bool Items(char Close, bool Members, int Depth) {
+        Pos++;
+        SkipSpace();
+        if (At(Close)) {
+            Pos++;
+            return true;
+        }
+        for (;;) {
+            if (Members) {
+                SkipSpace();
+                if (!String())
+                    return false;
+                SkipSpace();
+                if (!At(':'))
+                    return false;
+                Pos++;
+            }
+            if (!Value(Depth + 1))
+                return false;
+            SkipSpace();
+            if (At(Close)) {
+                Pos++;
+                return true;
+            }
+            if (!At(','))
+                return false;
+            Pos++;
+        }
+    }
+
+public:
+    JSONChecker(std::string const& Text) : Pos(Text.data()), End(Text.data() + Text.size()) {}
+
+    bool Value(int Depth = 0) {
+        SkipSpace();
+        if (Pos == End || Depth > 100)
+            return false;
+        switch (*Pos) {
+        case '{': return Items('}', true, Depth);
+        case '[': return Items(']', false, Depth);
+        case '"': return String();
+        case 't': return Literal("true");
+        case 'f': return Literal("false");
+        case 'n': return Literal("null");
+        default: return Number();
+        }
+    }
+
+    bool AtEnd() {
+        SkipSpace();
+        return Pos == End;
+    }
+};
+}
+
+bool IsValidJSON(std::string const& Text) {
+    JSONChecker Checker(Text);
+    return Checker.Value() && Checker.AtEnd();
+}
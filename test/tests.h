@@ -1,6 +1,8 @@
 #ifndef _FFMS2_TESTS_H
 #define _FFMS2_TESTS_H
 
+#include <string>
+
 #include <ffms.h>
 #include <gtest/gtest.h>
 
@@ -37,4 +39,7 @@ typedef struct TestDataMap {
 
 bool CheckFrame(const FFMS_Frame *Frame, const FFMS_FrameInfo *info, const TestFrameData *Data);
 
+// Checks that Text is a single complete JSON value
+bool IsValidJSON(std::string const& Text);
+
 #endif